@@ -1,6 +1,16 @@
 #ifdef _LINUX_
 
 #include "badblk_intern.h"
+#include "bbmap.h"
+#include "bb_stats.h"
+#include "bb_trace.h"
+#include "dev_stack.h"
+#include "epoch.h"
+#include "sysfs_attr.h"
+#include "work_pool.h"
+
+#include <sched.h>
+#include <time.h>
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -22,32 +32,61 @@ static void set_bit_range(u32 *bitmap, s32 start_bit, s32 end_bit)
 	}
 }
 
+/* copy the blank separated word at p, return the byte after it */
+static const s8 *copy_word(const s8 *p, const s8 *end, s8 *word, s32 size)
+{
+	s32 len = 0;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p ++;
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\n') {
+		if (len < size - 1)
+			word[len++] = *p;
+		p ++;
+	}
+	word[len] = '\0';
+
+	return p;
+}
+
 static s32 get_name_by_devno(struct devinfo *dinfo, char *name)
 {
-	FILE *fp;
-	s8 buf[128];
-	s32 maj, min, ret;
-	u64 size_kb;
+	struct attr_buf *buf = attr_local_buf();
+	const s8 *p, *end, *eol;
+	s8 pathname[256];
+	s64 maj, min, size_kb;
 
-	fp = fopen("/proc/partitions", "r");
-	if (NULL == fp)
+	if (NULL == buf)
 		return -1;
 
-	while (!feof(fp)) {
-		memset(buf, 0, sizeof(buf));
-		if (fgets(buf, sizeof(buf), fp)) {
-			ret = sscanf(buf, "%4d %7d %10llu %s", &maj, &min, &size_kb, name);
-			if (ret != 4)
-				continue;
+	sprintf(pathname, "%s/dev/block/%d:%d/uevent", attr_root(ROOT_SYS),
+		dinfo->major, dinfo->minor);
+	if (!attr_read(pathname, buf) && (p = strstr(buf->data, "DEVNAME=")) != NULL) {
+		copy_word(p + 8, buf->data + buf->len, name, 128);
+		return 0;
+	}
 
-			if (maj == dinfo->major && min == dinfo->minor) {
-				fclose(fp);
-				return 0;
-			}
+	sprintf(pathname, "%s/partitions", attr_root(ROOT_PROC));
+	if (attr_read(pathname, buf))
+		return -1;
+
+	end = buf->data + buf->len;
+	for (p = buf->data; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (NULL == eol)
+			eol = end;
+
+		if ((p = attr_parse_s64(p, eol, &maj)) == NULL ||
+				(p = attr_parse_s64(p, eol, &min)) == NULL ||
+				(p = attr_parse_s64(p, eol, &size_kb)) == NULL)
+			continue;
+
+		if (maj == dinfo->major && min == dinfo->minor) {
+			copy_word(p, eol, name, 128);
+			return 0;
 		}
 	}
 
-	fclose(fp);
 	return -1;
 }
 
@@ -60,45 +99,118 @@ static s32 get_md_status(s32 fd, mdu_array_info_t *info)
 	return 0;
 }
 
-static s32 get_sys_data_offset(const s8 *pathname, s64 *data_offset)
+/* the same fields from sysfs, for arrays without a usable device node */
+static s32 get_sys_md_status(const s8 *name, mdu_array_info_t *info)
 {
-	s32 fd, size;
-	s8 buf[128];
+	s8 pathname[384];
+	s64 level, raid_disks, chunk_size, degraded;
 
-	fd = open(pathname, O_RDONLY);
-	if (fd < 0)
-		return -1;
+	memset(info, 0, sizeof(mdu_array_info_t));
 
-	size = read(fd, buf, sizeof(buf));
-	if (size < 0) {
-		close(fd);
+	sprintf(pathname, "%s/block/%s/md/level", attr_root(ROOT_SYS), name);
+	if (attr_read_s64(pathname, "raid", &level))
+		return -1;
+	sprintf(pathname, "%s/block/%s/md/raid_disks", attr_root(ROOT_SYS), name);
+	if (attr_read_s64(pathname, NULL, &raid_disks))
+		return -1;
+	sprintf(pathname, "%s/block/%s/md/chunk_size", attr_root(ROOT_SYS), name);
+	if (attr_read_s64(pathname, NULL, &chunk_size))
 		return -1;
+	sprintf(pathname, "%s/block/%s/md/degraded", attr_root(ROOT_SYS), name);
+	if (attr_read_s64(pathname, NULL, &degraded))
+		return -1;
+
+	info->level = level;
+	info->raid_disks = raid_disks;
+	info->active_disks = raid_disks - degraded;
+	info->chunk_size = chunk_size;
+
+	return 0;
+}
+
+static s32 get_sys_data_offset(const s8 *pathname, s64 *data_offset)
+{
+	return attr_read_s64(pathname, NULL, data_offset);
+}
+
+/* bad ranges of one member, before they are packed into a snapshot */
+struct rdev_arena {
+	struct md_rdev_bbs rdev;
+	s32 bb_max;
+	u64 bytes;
+};
+
+static s32 add_arena_range(struct rdev_arena *arena, u64 sector, s32 len)
+{
+	struct md_bb_range *range;
+
+	if (arena->rdev.bb_cnt == arena->bb_max) {
+		s32 max = arena->bb_max ? arena->bb_max * 2 : 64;
+
+		range = realloc(arena->rdev.bb_range, sizeof(struct md_bb_range) * max);
+		if (NULL == range)
+			return -1;
+		arena->rdev.bb_range = range;
+		arena->bb_max = max;
 	}
 
-	if (sscanf(buf, "%llu", data_offset) != 1) {
-		close(fd);
+	range = &arena->rdev.bb_range[arena->rdev.bb_cnt++];
+	range->sector = sector;
+	range->len = len;
+
+	return 0;
+}
+
+static s32 sys_load_bb(const s8 *name, struct rdev_arena *arena, s32 idx)
+{
+	s8 buf[384];
+	s32 i, bad_len, ret;
+	struct attr_buf *abuf = attr_local_buf();
+	const s8 *pos, *end;
+	u64 sector;
+
+	if (NULL == abuf)
 		return -1;
+
+	/* a missing rdN, e.g. a faulty member, has no offset either */
+	sprintf(buf, "%s/block/%s/md/rd%d/offset", attr_root(ROOT_SYS), name, idx);
+	if (get_sys_data_offset(buf, &arena->rdev.data_offset))
+		return 0;
+	arena->rdev.present = 1;
+
+	for (i = 0; i < 2; i ++) {
+		if (0 == i)
+			sprintf(buf, "%s/block/%s/md/rd%d/unacknowledged_bad_blocks",
+				     attr_root(ROOT_SYS), name, idx);
+		else
+			sprintf(buf, "%s/block/%s/md/rd%d/bad_blocks",
+				     attr_root(ROOT_SYS), name, idx);
+		if (attr_read(buf, abuf))
+			return 0;
+		arena->bytes += abuf->len;
+
+		pos = abuf->data;
+		end = abuf->data + abuf->len;
+		while ((ret = attr_next_range(&pos, end, &sector, &bad_len)) != 0) {
+			if (ret < 0 || bad_len <= 0)
+				continue;
+			if (add_arena_range(arena, sector, bad_len))
+				return -1;
+		}
 	}
 
-	close(fd);
 	return 0;
 }
 
-static s32 sys_fetch_bb(struct md_devinfo *md_info, u32 *bitmap, s32 idx)
+static s32 fetch_bb(struct md_devinfo *md_info, struct md_rdev_bbs *rdev, u32 *bitmap)
 {
-	s8 buf[256];
 	s64 data_offset, bad_blocks, stripe;
 	s32 i, bad_len, chunk_sector, md_start_bit, md_end_bit;
 	s32 cross = 0, tmp1, chunk_bits;
-	FILE *fp;
-
-	sprintf(buf, "/sys/block/%s/md/rd%d", md_info->name, idx);
-	if (access(buf, R_OK))
-		return 0;
 
-	sprintf(buf, "/sys/block/%s/md/rd%d/offset", md_info->name, idx);
-	if (get_sys_data_offset(buf, &data_offset))
+	if (!rdev->present)
 		return 0;
+	data_offset = rdev->data_offset;
 
 	chunk_sector = md_info->array_info.chunk_size >> 9;
 	chunk_bits = chunk_sector >> 3;
@@ -130,85 +242,57 @@ static s32 sys_fetch_bb(struct md_devinfo *md_info, u32 *bitmap, s32 idx)
 		break;
 	}
 
-	for (i = 0; i < 2; i ++) {
-		if (0 == i)
-			sprintf(buf, "/sys/block/%s/md/rd%d/unacknowledged_bad_blocks",
-				     md_info->name, idx);
+	for (i = 0; i < rdev->bb_cnt; i ++) {
+		s64 failed_stripe;
+		s32 start_bit, end_bit, offset;
+
+		bad_blocks = rdev->bb_range[i].sector;
+		bad_len = rdev->bb_range[i].len;
+
+		if (bad_blocks + bad_len < data_offset)
+			continue;
+
+		if (bad_blocks < data_offset) {
+			bad_blocks = 0;
+			bad_len = bad_blocks + bad_len - data_offset;
+		} else
+			bad_blocks -= data_offset;
+
+		failed_stripe = bad_blocks / chunk_sector;
+		if (stripe != failed_stripe)
+			continue;
+
+		/*
+		fprintf(stderr, "md stripe %llu, cross %d, md_start_bit %d md_end_bit %d ",
+		                stripe, cross, md_start_bit, md_end_bit);
+		*/
+
+		offset = (bad_blocks % chunk_sector);
+		start_bit = offset / 8;
+		if (offset + bad_len >= chunk_sector)
+			end_bit = chunk_bits;
 		else
-			sprintf(buf, "/sys/block/%s/md/rd%d/bad_blocks",
-				     md_info->name, idx);
-		fp = fopen(buf, "r");
-			if (NULL == fp) {
-			return 0;
-		}
+			end_bit = ROUND_UP(offset + bad_len, 8);
 
-		while (!feof(fp)) {
-			s32 invalid = 0;
-			s64 failed_stripe;
-			s32 start_bit, end_bit, offset;
-
-			memset(buf, 0, sizeof(buf));
-			if (fgets(buf, sizeof(buf), fp)) {
-				switch(sscanf(buf, "%llu %d", &bad_blocks, &bad_len)) {
-				case 2:
-					if (bad_len <= 0)
-						invalid = 1;
-					break;
-				default:
-					invalid = 1;
-				}
-
-				if (invalid)
-					continue;
-
-				if (bad_blocks + bad_len < data_offset)
-					continue;
-
-				if (bad_blocks < data_offset) {
-					bad_blocks = 0;
-					bad_len = bad_blocks + bad_len - data_offset;
-				} else
-					bad_blocks -= data_offset;
-
-				failed_stripe = bad_blocks / chunk_sector;
-				if (stripe != failed_stripe)
-					continue;
-
-				/*
-				fprintf(stderr, "md stripe %llu, cross %d, md_start_bit %d md_end_bit %d ",
-				                stripe, cross, md_start_bit, md_end_bit);
-				*/
-
-				offset = (bad_blocks % chunk_sector);
-				start_bit = offset / 8;
-				if (offset + bad_len >= chunk_sector)
-					end_bit = chunk_bits;
-				else
-					end_bit = ROUND_UP(offset + bad_len, 8);
-
-				/*
-				fprintf(stderr, "start_bit %d end_bit %d\n", start_bit, end_bit);
-				*/
-
-				if (cross) {
-					if (md_start_bit >= start_bit && md_end_bit <= end_bit)
-						continue;
-					if (start_bit < md_start_bit)
-						set_bit_range(bitmap, start_bit,
-						             MIN(md_start_bit, end_bit));
-					if (end_bit > md_end_bit)
-						set_bit_range(bitmap, MAX(start_bit, md_end_bit),
-						             end_bit);
-				} else {
-					if (md_start_bit > end_bit || md_end_bit <= start_bit)
-						continue;
-					set_bit_range(bitmap, MAX(start_bit, md_start_bit),
-					             MIN(end_bit, md_end_bit));
-				}
-			}
-		}
+		/*
+		fprintf(stderr, "start_bit %d end_bit %d\n", start_bit, end_bit);
+		*/
 
-		fclose(fp);
+		if (cross) {
+			if (md_start_bit >= start_bit && md_end_bit <= end_bit)
+				continue;
+			if (start_bit < md_start_bit)
+				set_bit_range(bitmap, start_bit,
+				             MIN(md_start_bit, end_bit));
+			if (end_bit > md_end_bit)
+				set_bit_range(bitmap, MAX(start_bit, md_end_bit),
+				             end_bit);
+		} else {
+			if (md_start_bit > end_bit || md_end_bit <= start_bit)
+				continue;
+			set_bit_range(bitmap, MAX(start_bit, md_start_bit),
+			             MIN(end_bit, md_end_bit));
+		}
 	}
 
 	return 0;
@@ -219,12 +303,12 @@ static s32 find_next_bit(s32 start_bit, u32 value)
 	if (start_bit >= 32)
 		return 0;
 
-	value &= ~((1 >> start_bit) - 1);
+	value &= ~((1U << start_bit) - 1);
 
 	return ffs(value);
 }
 
-static s32 is_hit_badblock(struct md_devinfo *md_info)
+static s32 is_hit_badblock(struct md_devinfo *md_info, struct md_snapshot *snap)
 {
 	s32 raid_disks = md_info->array_info.raid_disks;
 	s32 chunk_page = md_info->array_info.chunk_size >> 12;
@@ -236,15 +320,16 @@ static s32 is_hit_badblock(struct md_devinfo *md_info)
 		                    - md_info->array_info.active_disks);
 	memset(bitmap, 0, sizeof(bitmap));
 	for (i = 0; i < raid_disks; i ++) {
-		sys_fetch_bb(md_info, bitmap[i], i);
+		fetch_bb(md_info, &snap->rdev[i], bitmap[i]);
 	}
 
 	for (i = 0; i < capacity; i ++) {
-		tmp = 0, bad_cnt = 0, pos = 0;
+		tmp = 0, pos = 0;
 		for (j = 0; j < raid_disks; j ++) {
 			tmp |= bitmap[j][i];
 		}
 		while ((pos = find_next_bit(pos, tmp)) != 0) {
+			bad_cnt = 0;
 			for (j = 0; j < raid_disks; j ++) {
 				if (bitmap[j][i] & (1 << (pos - 1)))
 					bad_cnt ++;
@@ -258,7 +343,8 @@ static s32 is_hit_badblock(struct md_devinfo *md_info)
 	return 0;
 }
 
-static s32 process_badblock(struct devinfo *dinfo, struct md_devinfo *md_info)
+static s32 process_badblock(struct devinfo *dinfo, struct md_devinfo *md_info,
+			    struct md_snapshot *snap)
 {
 	s32 i, count;
 	s64 start_sect;
@@ -278,31 +364,186 @@ static s32 process_badblock(struct devinfo *dinfo, struct md_devinfo *md_info)
 		else
 			md_info->end_sect = start_sect + (i + 1) * md_info->stripe_sect;
 
-		if (is_hit_badblock(md_info))
+		dinfo->stripes ++;
+		if (is_hit_badblock(md_info, snap))
 			return 1;
 	}
 
 	return 0;
 }
 
-static s32 process_md_badblk(struct devinfo *dinfo)
+/**************************************/
+
+#define MD_SLOTS 256
+#define MD_DEVNO(maj, min) ((((u32)(maj)) << 20) | (u32)(min))
+
+/*
+ * Snapshot table, one slot per array. A slot is claimed once and never
+ * freed; readers find it without locks and load snap inside an epoch.
+ */
+struct md_slot {
+	u32 devno;
+	s32 loading;
+	struct md_snapshot *snap;
+};
+
+static struct md_slot md_slots[MD_SLOTS];
+static s32 load_workers = 1;
+static s32 cache_ttl_ms = 1000;
+/* set by set_badblock_map(), read inside an epoch */
+static struct bbmap *member_map;
+
+static s64 now_ms(void)
 {
-	s32 fd, ret, degraded, max_degraded;
-	struct md_devinfo md_info;
-	s8 devname[64];
+	struct timespec ts;
 
-	ret = get_name_by_devno(dinfo, md_info.name);
-	if (ret)
-		return ret;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	sprintf(devname, "/dev/%s", md_info.name);
-	fd = open(devname, O_RDONLY);
-	if (fd < 0)
+struct md_snapshot *alloc_md_snapshot(s32 nr_rdev, s32 nr_ranges)
+{
+	struct md_snapshot *snap;
+	s8 *p;
+
+	p = calloc(1, sizeof(struct md_snapshot) + sizeof(struct md_rdev_bbs) * nr_rdev
+			+ sizeof(struct md_bb_range) * nr_ranges);
+	if (NULL == p)
+		return NULL;
+
+	snap = (struct md_snapshot *)p;
+	snap->rdev = (struct md_rdev_bbs *)(p + sizeof(struct md_snapshot));
+	if (nr_ranges)
+		snap->rdev[0].bb_range = (struct md_bb_range *)(snap->rdev + nr_rdev);
+	snap->load_ms = now_ms();
+
+	return snap;
+}
+
+void free_md_snapshot(void *snap)
+{
+	free(snap);
+}
+
+struct load_bb_work {
+	const s8 *name;
+	struct rdev_arena *arena;
+	s32 *ret;
+	struct bbmap *map;
+	u8 uuid[16];
+};
+
+/*
+ * Add what fix_sector -m found unreadable on member idx, if the map has
+ * a section for its disk made on this array at this data offset.
+ */
+static s32 map_load_bb(struct load_bb_work *work, struct rdev_arena *arena, s32 idx)
+{
+	const struct bbmap_section *sec;
+	struct bbmap_range *ranges;
+	s8 name[BBMAP_NAME_LEN], serial[BBMAP_NAME_LEN - 16];
+	s32 i, nr;
+
+	if (attr_md_serial(work->name, idx, serial, sizeof(serial)))
+		return 0;
+
+	snprintf(name, sizeof(name), "%s:%d", serial, idx);
+	sec = bbmap_find(work->map, BBMAP_MEMBER, name);
+	if (NULL == sec ||
+	    sec->generation != bbmap_member_generation(work->uuid, arena->rdev.data_offset))
+		return 0;
+
+	ranges = malloc(sizeof(struct bbmap_range) * (sec->nr_ranges + 1));
+	if (NULL == ranges)
 		return -1;
-	ret = get_md_status(fd, &md_info.array_info);
-	close(fd);
+
+	/* a section that doesn't decode is skipped like a missing one */
+	nr = bbmap_decode(work->map, sec, ranges, sec->nr_ranges);
+	for (i = 0; i < nr; i ++) {
+		if (add_arena_range(arena, ranges[i].start, ranges[i].len))
+			break;
+	}
+	free(ranges);
+
+	return i < nr ? -1 : 0;
+}
+
+static void load_bb_work(void *ctx, int job)
+{
+	struct load_bb_work *work = ctx;
+	struct rdev_arena *arena = &work->arena[job];
+
+	work->ret[job] = sys_load_bb(work->name, arena, job);
+	if (0 == work->ret[job] && work->map && arena->rdev.present)
+		work->ret[job] = map_load_bb(work, arena, job);
+}
+
+/* pack the member arenas into one snapshot, in role order */
+static struct md_snapshot *pack_md_snapshot(struct md_devinfo *md_info,
+					    struct rdev_arena *arena)
+{
+	struct md_snapshot *snap;
+	struct md_bb_range *range;
+	s32 i, raid_disks = md_info->array_info.raid_disks, total = 0;
+
+	for (i = 0; i < raid_disks; i ++)
+		total += arena[i].rdev.bb_cnt;
+
+	snap = alloc_md_snapshot(raid_disks, total);
+	if (NULL == snap)
+		return NULL;
+
+	memcpy(&snap->md_info, md_info, sizeof(struct md_devinfo));
+	range = snap->rdev[0].bb_range;
+	for (i = 0; i < raid_disks; i ++) {
+		snap->sysfs_bytes += arena[i].bytes;
+		snap->rdev[i].present = arena[i].rdev.present;
+		snap->rdev[i].data_offset = arena[i].rdev.data_offset;
+		snap->rdev[i].bb_cnt = arena[i].rdev.bb_cnt;
+		snap->rdev[i].bb_range = range;
+		if (arena[i].rdev.bb_cnt)
+			memcpy(range, arena[i].rdev.bb_range,
+			       sizeof(struct md_bb_range) * arena[i].rdev.bb_cnt);
+		range += arena[i].rdev.bb_cnt;
+	}
+
+	return snap;
+}
+
+/*
+ * Read everything about an array into a new snapshot. An array that
+ * can't be checked, for an unsupported level or too many failed
+ * members, still gets one with status -1 so the answer is cached too.
+ * Return NULL if the array can't be found at all.
+ */
+static struct md_snapshot *build_md_snapshot(s32 major, s32 minor)
+{
+	s32 fd, ret, i, degraded, max_degraded, raid_disks;
+	struct md_devinfo md_info;
+	struct devinfo dinfo;
+	struct md_snapshot *snap = NULL;
+	struct rdev_arena *arena;
+	struct load_bb_work work;
+	s32 *rets;
+	s8 devname[384];
+
+	memset(&md_info, 0, sizeof(md_info));
+	memset(&dinfo, 0, sizeof(dinfo));
+	dinfo.major = major;
+	dinfo.minor = minor;
+
+	ret = get_name_by_devno(&dinfo, md_info.name);
 	if (ret)
-		return ret;
+		return NULL;
+
+	sprintf(devname, "%s/%s", attr_root(ROOT_DEV), md_info.name);
+	fd = open(devname, O_RDONLY);
+	if (fd >= 0) {
+		ret = get_md_status(fd, &md_info.array_info);
+		close(fd);
+	}
+	if ((fd < 0 || ret) && get_sys_md_status(md_info.name, &md_info.array_info))
+		return NULL;
 
 	switch (md_info.array_info.level) {
 	case 1:
@@ -318,115 +559,465 @@ static s32 process_md_badblk(struct devinfo *dinfo)
 	/* case 10: */
 	/* case 50: */
 	default:
-		return -1;
+		max_degraded = -1;
 	}
 
-	degraded = md_info.array_info.raid_disks - md_info.array_info.active_disks;
-	if (degraded > max_degraded) {
-		/* raid is failed */
-		return -1;
+	raid_disks = md_info.array_info.raid_disks;
+	degraded = raid_disks - md_info.array_info.active_disks;
+	if (max_degraded < 0 || degraded > max_degraded || raid_disks <= 0) {
+		/* raid is failed or not supported */
+		snap = alloc_md_snapshot(0, 0);
+		if (snap) {
+			memcpy(&snap->md_info, &md_info, sizeof(md_info));
+			snap->major = major;
+			snap->minor = minor;
+			snap->status = -1;
+		}
+		return snap;
 	}
 
 	md_info.max_degraded = max_degraded;
-	md_info.stripe_sect = (md_info.array_info.raid_disks - max_degraded)
+	md_info.stripe_sect = (raid_disks - max_degraded)
 			             * (md_info.array_info.chunk_size >> 9);
 
-	ret = process_badblock(dinfo, &md_info);
+	arena = calloc(raid_disks, sizeof(struct rdev_arena));
+	rets = calloc(raid_disks, sizeof(s32));
+	if (NULL == arena || NULL == rets)
+		goto out;
+
+	work.name = md_info.name;
+	work.arena = arena;
+	work.ret = rets;
+
+	/* the workers use the map under this thread's epoch */
+	epoch_enter();
+	work.map = __atomic_load_n(&member_map, __ATOMIC_ACQUIRE);
+	if (work.map && attr_md_uuid(md_info.name, work.uuid))
+		work.map = NULL;
+
+	if (load_workers > 1) {
+		/* every member fills only its own arena */
+		run_work_pool(load_workers, raid_disks, load_bb_work, &work);
+	} else {
+		for (i = 0; i < raid_disks; i ++)
+			load_bb_work(&work, i);
+	}
+	epoch_exit();
+
+	for (i = 0; i < raid_disks; i ++) {
+		if (rets[i])
+			goto out;
+	}
+
+	snap = pack_md_snapshot(&md_info, arena);
+	if (snap) {
+		snap->major = major;
+		snap->minor = minor;
+	}
+
+out:
+	if (arena) {
+		for (i = 0; i < raid_disks; i ++)
+			free(arena[i].rdev.bb_range);
+	}
+	free(arena);
+	free(rets);
+
+	return snap;
+}
+
+static struct md_slot *find_md_slot(s32 major, s32 minor, s32 create)
+{
+	u32 devno = MD_DEVNO(major, minor);
+	u32 i, cur, hash = (devno * 2654435761u) % MD_SLOTS;
+	struct md_slot *slot;
+
+	for (i = 0; i < MD_SLOTS; i ++) {
+		slot = &md_slots[(hash + i) % MD_SLOTS];
+		cur = __atomic_load_n(&slot->devno, __ATOMIC_ACQUIRE);
+		if (cur == devno)
+			return slot;
+		if (cur)
+			continue;
+		if (!create)
+			return NULL;
+
+		if (__atomic_compare_exchange_n(&slot->devno, &cur, devno, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return slot;
+		if (cur == devno)
+			return slot;
+	}
+
+	return NULL;
+}
+
+static void replace_md_snapshot(struct md_slot *slot, struct md_snapshot *snap)
+{
+	struct md_snapshot *old;
+
+	if (stats_on())
+		stats_add_bytes(slot - md_slots, slot->devno, snap->sysfs_bytes);
+
+	old = __atomic_exchange_n(&slot->snap, snap, __ATOMIC_SEQ_CST);
+	if (old)
+		epoch_retire(old, free_md_snapshot);
+}
+
+/* reload a slot unless somebody else already is, return 0 if done */
+static s32 reload_md_slot(struct md_slot *slot, s32 major, s32 minor)
+{
+	struct md_snapshot *snap;
+
+	if (__atomic_exchange_n(&slot->loading, 1, __ATOMIC_ACQUIRE))
+		return -1;
+
+	snap = build_md_snapshot(major, minor);
+	if (snap)
+		replace_md_snapshot(slot, snap);
+
+	__atomic_store_n(&slot->loading, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * get_md_snapshot:
+ *
+ * Called inside an epoch. A stale snapshot is reloaded by the first
+ * reader that sees it while the others keep using the old one; only a
+ * cold array makes its readers wait for sysfs. *owned is set when the
+ * table is full and the caller has to free the result itself. With
+ * @nowait, NULL is returned wherever sysfs would have to be read.
+ */
+static struct md_snapshot *get_md_snapshot(s32 major, s32 minor, s32 nowait,
+					   s32 *owned, s32 *idx)
+{
+	struct md_slot *slot;
+	struct md_snapshot *snap, *cur = NULL;
+
+	*owned = 0;
+	*idx = STATS_ALL;
+	slot = find_md_slot(major, minor, 1);
+	if (NULL == slot) {
+		if (nowait)
+			return NULL;
+		*owned = 1;
+		return build_md_snapshot(major, minor);
+	}
+	*idx = slot - md_slots;
+
+	snap = __atomic_load_n(&slot->snap, __ATOMIC_ACQUIRE);
+	if (snap) {
+		if (cache_ttl_ms && now_ms() - snap->load_ms > cache_ttl_ms) {
+			if (nowait)
+				return NULL;
+			if (!reload_md_slot(slot, major, minor))
+				snap = __atomic_load_n(&slot->snap, __ATOMIC_ACQUIRE);
+		}
+		return snap;
+	}
+
+	if (nowait)
+		return NULL;
+
+	snap = build_md_snapshot(major, minor);
+	if (NULL == snap)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&slot->snap, &cur, snap, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* lost the race, the winner's copy is as fresh */
+		free_md_snapshot(snap);
+		snap = cur;
+	} else if (stats_on())
+		stats_add_bytes(*idx, slot->devno, snap->sysfs_bytes);
+
+	return snap;
+}
+
+/* used by the benchmark to install a snapshot built in memory */
+s32 publish_md_snapshot(struct md_snapshot *snap)
+{
+	struct md_slot *slot;
+
+	slot = find_md_slot(snap->major, snap->minor, 1);
+	if (NULL == slot)
+		return -1;
+
+	replace_md_snapshot(slot, snap);
+
+	return 0;
+}
+
+static s32 query_md_snapshot(struct devinfo *dinfo, struct md_snapshot *snap)
+{
+	struct md_devinfo md_info;
+
+	if (snap->status)
+		return -1;
+
+	memcpy(&md_info, &snap->md_info, sizeof(md_info));
+
+	return process_badblock(dinfo, &md_info, snap);
+}
+
+static s32 process_md_badblk(struct devinfo *dinfo)
+{
+	struct md_snapshot *snap;
+	s32 ret, owned, idx, stripes = dinfo->stripes;
+	s64 start = stats_on() ? stats_now() : 0;
+
+	epoch_enter();
+
+	snap = get_md_snapshot(dinfo->major, dinfo->minor, dinfo->nowait, &owned, &idx);
+	if (NULL == snap)
+		ret = dinfo->nowait ? BB_WOULDBLOCK : -1;
+	else
+		ret = query_md_snapshot(dinfo, snap);
+
+	epoch_exit();
+
+	if (snap && owned)
+		free_md_snapshot(snap);
+
+	if (start && idx != STATS_ALL && ret != BB_WOULDBLOCK)
+		stats_record(idx, MD_DEVNO(dinfo->major, dinfo->minor), ret,
+			     dinfo->stripes - stripes, stats_now() - start);
 
 	return ret;
 }
 
-static s32 process_dmlinear_badblk(struct devinfo *dinfo)
+/* query an array by device number, in array sectors */
+s32 query_md_badblock(s32 major, s32 minor, s64 start_sect, s64 end_sect, s32 rw)
 {
-	FILE *fp;
-	char buf[256];
-	s32 maj, min, ret;
-	s64 start, end, size, offset, dm_start;
-	struct devinfo md_device;
+	struct devinfo dinfo;
+
+	memset(&dinfo, 0, sizeof(dinfo));
+	dinfo.rw = rw;
+	dinfo.start_sect = start_sect;
+	dinfo.end_sect = end_sect;
+	dinfo.type = TYPE_MD;
+	dinfo.major = major;
+	dinfo.minor = minor;
+
+	return process_md_badblk(&dinfo);
+}
+
+#define STACK_SLOTS 256
+
+/*
+ * Compiled stacks of the devices above the arrays, partitions and dm
+ * devices, kept the same way as the md snapshots.
+ */
+struct stack_slot {
+	u32 devno;
+	s32 loading;
+	struct dev_stack *stack;
+};
+
+static struct stack_slot stack_slots[STACK_SLOTS];
+
+static s32 get_cached_major(s32 *dm_major, s32 *mdp_major, s32 nowait);
+
+static struct stack_slot *find_stack_slot(s32 major, s32 minor, s32 create)
+{
+	u32 devno = MD_DEVNO(major, minor);
+	u32 i, cur, hash = (devno * 2654435761u) % STACK_SLOTS;
+	struct stack_slot *slot;
+
+	for (i = 0; i < STACK_SLOTS; i ++) {
+		slot = &stack_slots[(hash + i) % STACK_SLOTS];
+		cur = __atomic_load_n(&slot->devno, __ATOMIC_ACQUIRE);
+		if (cur == devno)
+			return slot;
+		if (cur)
+			continue;
+		if (!create)
+			return NULL;
+
+		if (__atomic_compare_exchange_n(&slot->devno, &cur, devno, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return slot;
+		if (cur == devno)
+			return slot;
+	}
+
+	return NULL;
+}
+
+static struct dev_stack *load_dev_stack(s32 major, s32 minor)
+{
+	struct stack_resolver r;
+	struct dev_stack *stack;
+
+	memset(&r, 0, sizeof(r));
+	if (get_cached_major(&r.dm_major, &r.mdp_major, 0))
+		return NULL;
+
+	stack = build_dev_stack(&r, major, minor);
+	if (stack)
+		stack->load_ms = now_ms();
+
+	return stack;
+}
 
-	sprintf(buf, "dmsetup table -j %d -m %d", dinfo->major, dinfo->minor);
-	fp = popen(buf, "r");
-	if (NULL == fp)
+static s32 reload_stack_slot(struct stack_slot *slot, s32 major, s32 minor)
+{
+	struct dev_stack *stack, *old;
+
+	if (__atomic_exchange_n(&slot->loading, 1, __ATOMIC_ACQUIRE))
 		return -1;
 
-	dm_start = dinfo->start_sect;
+	stack = load_dev_stack(major, minor);
+	if (stack) {
+		old = __atomic_exchange_n(&slot->stack, stack, __ATOMIC_SEQ_CST);
+		if (old)
+			epoch_retire(old, free_dev_stack);
+	}
 
-	while (!feof(fp)) {
-		memset(buf, 0, sizeof(buf));
-		if (fgets(buf, sizeof(buf), fp)) {
-			if ((strstr(buf, "linear")) == NULL)
-				continue;
+	__atomic_store_n(&slot->loading, 0, __ATOMIC_RELEASE);
 
-			ret = sscanf(buf, "%llu %llu linear %d:%d %llu",
-				          &start, &size, &maj, &min, &offset);
-			if (ret != 5)
-				continue;
+	return 0;
+}
+
+/* get_md_snapshot() for the stack of a device */
+static struct dev_stack *get_dev_stack(s32 major, s32 minor, s32 nowait, s32 *owned)
+{
+	struct stack_slot *slot;
+	struct dev_stack *stack, *cur = NULL;
+
+	*owned = 0;
+	slot = find_stack_slot(major, minor, 1);
+	if (NULL == slot) {
+		if (nowait)
+			return NULL;
+		*owned = 1;
+		return load_dev_stack(major, minor);
+	}
+
+	stack = __atomic_load_n(&slot->stack, __ATOMIC_ACQUIRE);
+	if (stack) {
+		if (cache_ttl_ms && now_ms() - stack->load_ms > cache_ttl_ms) {
+			if (nowait)
+				return NULL;
+			if (!reload_stack_slot(slot, major, minor))
+				stack = __atomic_load_n(&slot->stack, __ATOMIC_ACQUIRE);
+		}
+		return stack;
+	}
+
+	if (nowait)
+		return NULL;
+
+	stack = load_dev_stack(major, minor);
+	if (NULL == stack)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&slot->stack, &cur, stack, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free_dev_stack(stack);
+		stack = cur;
+	}
+
+	return stack;
+}
+
+/*
+ * Query the arrays under a stacked device. The extents the range
+ * touches are found with one search however deep the stack is, and on
+ * a striped extent the part of the range on one leg is still one run
+ * of that leg's sectors.
+ */
+static s32 query_dev_stack(struct devinfo *dinfo, const struct dev_stack *stack)
+{
+	const struct stack_extent *ext;
+	struct devinfo md_device;
+	s32 i, j, ret = 0;
+	u64 a, b, lo, hi;
 
-			end = start + size;
-			if (dm_start >= end || dinfo->end_sect < start)
+	if (stack->status)
+		return -1;
+
+	for (i = dev_stack_find(stack, dinfo->start_sect);
+	     i < stack->nr && stack->ext[i].start < dinfo->end_sect && ret != 1; i ++) {
+		ext = &stack->ext[i];
+		a = MAX(dinfo->start_sect, ext->start) - ext->start;
+		b = MIN(dinfo->end_sect, ext->start + ext->len) - ext->start;
+
+		for (j = 0; j < ext->nr_legs && ret != 1; j ++) {
+			stack_leg_range(stack, ext, j, a, b, &lo, &hi);
+			if (lo >= hi)
 				continue;
 
 			memset(&md_device, 0, sizeof(struct devinfo));
 			md_device.rw = dinfo->rw;
-			md_device.start_sect = dm_start + offset - start;
-			if (dinfo->end_sect > end) {
-				dm_start = end;
-				md_device.end_sect = offset + size;
-			} else
-				md_device.end_sect = dinfo->end_sect + offset - start;
+			md_device.start_sect = lo;
+			md_device.end_sect = hi;
 			md_device.type = TYPE_MD;
-			md_device.major = maj;
-			md_device.minor = min;
-			/*
-			fprintf(stderr, "dm start_sector %llu end_sector %llu\n",
-			       md_device.start_sect, md_device.end_sect);
-			*/
+			md_device.major = stack->legs[ext->leg + j].major;
+			md_device.minor = stack->legs[ext->leg + j].minor;
+			md_device.nowait = dinfo->nowait;
+
 			ret = process_md_badblk(&md_device);
-			if (ret == 1)
+			dinfo->stripes += md_device.stripes;
+			if (BB_WOULDBLOCK == ret)
 				return ret;
 		}
 	}
 
-	pclose(fp);
+	return ret == 1 ? 1 : 0;
+}
 
-	return 0;
+static s32 process_stack_badblk(struct devinfo *dinfo)
+{
+	struct dev_stack *stack;
+	s32 ret, owned;
+
+	epoch_enter();
+
+	stack = get_dev_stack(dinfo->major, dinfo->minor, dinfo->nowait, &owned);
+	if (NULL == stack)
+		ret = dinfo->nowait ? BB_WOULDBLOCK : -1;
+	else
+		ret = query_dev_stack(dinfo, stack);
+
+	epoch_exit();
+
+	if (stack && owned)
+		free_dev_stack(stack);
+
+	return ret;
 }
 
-static s32 get_valid_major(s32 *dm_major, s32 *mdp_major)
+static s32 valid_major_loaded;
+static s32 cached_dm_major = -1, cached_mdp_major = -1;
+
+/* /proc/devices only changes when a driver loads, read it once */
+static s32 get_cached_major(s32 *dm_major, s32 *mdp_major, s32 nowait)
 {
-	char buf[512];
-	char driver_name[64];
-	s32 ret, major;
-	FILE *fp = fopen(PROC_DEVICES, "r");
+	if (!__atomic_load_n(&valid_major_loaded, __ATOMIC_ACQUIRE)) {
+		s32 dm = -1, mdp = -1;
 
-	if (NULL == fp)
-		return -1;
+		if (nowait)
+			return BB_WOULDBLOCK;
 
-	while (!feof(fp)) {
-		major = -1;
-		memset(driver_name, 0, sizeof(driver_name));
-		memset(buf, 0, sizeof(buf));
-		if (fgets(buf, sizeof(buf), fp)) {
-			ret = sscanf(buf, "%d %s", &major, driver_name);
-			if (ret != 2)
-				continue;
-			if (0 == strncmp(driver_name, "device-mapper", sizeof(driver_name))) {
-				*dm_major = major;
-			} else if (0 == strncmp(driver_name, "mdp", sizeof(driver_name))) {
-				*mdp_major = major;
-			}
-		}
+		if (dev_stack_majors(&dm, &mdp))
+			return -1;
+		__atomic_store_n(&cached_dm_major, dm, __ATOMIC_RELAXED);
+		__atomic_store_n(&cached_mdp_major, mdp, __ATOMIC_RELAXED);
+		__atomic_store_n(&valid_major_loaded, 1, __ATOMIC_RELEASE);
 	}
 
-	fclose(fp);
+	*dm_major = __atomic_load_n(&cached_dm_major, __ATOMIC_RELAXED);
+	*mdp_major = __atomic_load_n(&cached_mdp_major, __ATOMIC_RELAXED);
 
 	return 0;
 }
 
-static s32 init_device_info(struct devinfo *dinfo, int fd)
+s32 get_block_dev(s32 fd, dev_t *dev)
 {
 	struct stat sbuf;
-	s32 dm_major = -1, mdp_major = -1;
 
 	memset(&sbuf, 0, sizeof(struct stat));
 	if (fstat(fd, &sbuf) < 0) {
@@ -436,11 +1027,22 @@ static s32 init_device_info(struct devinfo *dinfo, int fd)
 	if (! S_ISBLK(sbuf.st_mode))
 		return -1;
 
-	dinfo->major = major(sbuf.st_rdev);
-	dinfo->minor = minor(sbuf.st_rdev);
+	*dev = sbuf.st_rdev;
 
-	if (get_valid_major(&dm_major, &mdp_major))
-		return -1;
+	return 0;
+}
+
+static s32 init_device_info(struct devinfo *dinfo, dev_t dev)
+{
+	s32 dm_major = -1, mdp_major = -1;
+	s32 ret;
+
+	dinfo->major = major(dev);
+	dinfo->minor = minor(dev);
+
+	ret = get_cached_major(&dm_major, &mdp_major, dinfo->nowait);
+	if (ret)
+		return ret;
 
 	if (dinfo->major == MD_MAJOR)
 		dinfo->type = TYPE_MD;
@@ -454,6 +1056,47 @@ static s32 init_device_info(struct devinfo *dinfo, int fd)
 	return 0;
 }
 
+/*
+ * query_badblock_dev:
+ *
+ * is_badblock() on an already resolved block device. With
+ * dinfo->nowait set only warm state is used, anything that needs
+ * sysfs, an ioctl or dmsetup returns BB_WOULDBLOCK.
+ */
+s32 query_badblock_dev(struct devinfo *dinfo, dev_t dev, s64 offset, s32 len, s32 rw)
+{
+	s32 ret;
+
+	dinfo->rw = rw;
+	if (!rw)
+		dinfo->start_sect = offset / SECTOR_SIZE;
+	else
+		dinfo->start_sect = offset / PAGE_SIZE * (PAGE_SIZE / SECTOR_SIZE);
+	dinfo->end_sect = ROUND_UP((offset + len), SECTOR_SIZE);
+	/*
+	fprintf(stderr, "start sector %llu, end_sector %llu\n",
+	       dinfo->start_sect, dinfo->end_sect);
+	*/
+
+	ret = init_device_info(dinfo, dev);
+	if (ret)
+		return ret;
+
+	switch (dinfo->type) {
+	case TYPE_MD:
+		ret = process_md_badblk(dinfo);
+		break;
+	case TYPE_DM:
+	case TYPE_MDP:
+	default:
+		/* partitions and dm devices, down to the arrays under them */
+		ret = process_stack_badblk(dinfo);
+		break;
+	}
+
+	return ret;
+}
+
 /*
  * is_badblock:
  * @fd: the filedescriptor which need to judge for is hitted a badblock.
@@ -469,41 +1112,153 @@ static s32 init_device_info(struct devinfo *dinfo, int fd)
  * */
 s32 is_badblock(s32 fd, s64 offset, s32 len, s32 rw)
 {
-	s32 ret;
 	struct devinfo dinfo;
+	s64 start = stats_on() ? stats_now() : 0;
+	s64 trace_start = trace_on() ? trace_now() : 0;
+	dev_t dev = 0;
+	s32 ret;
 
 	memset(&dinfo, 0, sizeof(struct devinfo));
-	dinfo.rw = rw;
-	if (!rw)
-		dinfo.start_sect = offset / SECTOR_SIZE;
+	if (get_block_dev(fd, &dev))
+		ret = -1;
 	else
-		dinfo.start_sect = offset / PAGE_SIZE * (PAGE_SIZE / SECTOR_SIZE);
-	dinfo.end_sect = ROUND_UP((offset + len), SECTOR_SIZE);
-	/*
-	fprintf(stderr, "start sector %llu, end_sector %llu\n",
-	       dinfo.start_sect, dinfo.end_sect);
-	*/
+		ret = query_badblock_dev(&dinfo, dev, offset, len, rw);
+
+	if (start)
+		stats_record(STATS_ALL, 0, ret, dinfo.stripes, stats_now() - start);
+	if (trace_start)
+		trace_query(dev, offset, len, rw, ret, trace_start);
+
+	return ret;
+}
 
-	if (init_device_info(&dinfo, fd))
+/*
+ * set_badblock_workers:
+ * @nr: threads used to read the member bad_blocks of one array.
+ *
+ * 1, the default, reads the members serially in the calling thread.
+ */
+s32 set_badblock_workers(s32 nr)
+{
+	if (nr < 1)
 		return -1;
 
-	switch (dinfo.type) {
-	case TYPE_DM:
-		ret = process_dmlinear_badblk(&dinfo);
-		break;
-	case TYPE_MDP:
-		ret = -1;
-		break;
-	case TYPE_MD:
-		ret = process_md_badblk(&dinfo);
-		break;
-	default:
+	load_workers = nr;
+
+	return 0;
+}
+
+/*
+ * set_badblock_cache_ttl:
+ * @msecs: how long an array snapshot is used before a query reloads it.
+ *
+ * 0 keeps snapshots until refresh_badblocks() is called, which is the
+ * mode to use when a dedicated thread refreshes them.
+ */
+s32 set_badblock_cache_ttl(s32 msecs)
+{
+	if (msecs < 0)
 		return -1;
+
+	cache_ttl_ms = msecs;
+
+	return 0;
+}
+
+/*
+ * refresh_badblocks:
+ *
+ * Reload every array and stacked device queried so far and swap the
+ * new snapshots in. Queries running meanwhile keep using the old ones
+ * and never wait.
+ */
+s32 refresh_badblocks(void)
+{
+	struct md_slot *slot;
+	u32 devno;
+	s32 i, dm = -1, mdp = -1;
+
+	if (!dev_stack_majors(&dm, &mdp)) {
+		__atomic_store_n(&cached_dm_major, dm, __ATOMIC_RELAXED);
+		__atomic_store_n(&cached_mdp_major, mdp, __ATOMIC_RELAXED);
+		__atomic_store_n(&valid_major_loaded, 1, __ATOMIC_RELEASE);
 	}
 
+	for (i = 0; i < MD_SLOTS; i ++) {
+		slot = &md_slots[i];
+		devno = __atomic_load_n(&slot->devno, __ATOMIC_ACQUIRE);
+		if (0 == devno)
+			continue;
+
+		while (reload_md_slot(slot, devno >> 20, devno & ((1 << 20) - 1)))
+			sched_yield();
+	}
+
+	for (i = 0; i < STACK_SLOTS; i ++) {
+		devno = __atomic_load_n(&stack_slots[i].devno, __ATOMIC_ACQUIRE);
+		if (0 == devno)
+			continue;
+
+		while (reload_stack_slot(&stack_slots[i], devno >> 20, devno & ((1 << 20) - 1)))
+			sched_yield();
+	}
+
+	return 0;
+}
+
+/*
+ * set_badblock_root:
+ * @dir: tree with sys/, proc/, dev/ and a dmsetup command, as written
+ *       by bb_bench gentree, or NULL for the host paths.
+ *
+ * Call it before querying; snapshots loaded from the previous root stay
+ * until refresh_badblocks().
+ */
+s32 set_badblock_root(const s8 *dir)
+{
+	s32 ret = 0;
+
+	if (dir)
+		ret = attr_set_tree(dir);
+	else if (attr_set_root(ROOT_SYS, "/sys") || attr_set_root(ROOT_PROC, "/proc") ||
+		 attr_set_root(ROOT_DEV, "/dev") || attr_set_root(ROOT_DMSETUP, "dmsetup"))
+		ret = -1;
+
+	__atomic_store_n(&valid_major_loaded, 0, __ATOMIC_RELEASE);
+
 	return ret;
 }
 
+static void close_member_map(void *map)
+{
+	bbmap_close(map);
+}
+
+/*
+ * set_badblock_map:
+ * @pathname: a map written by fix_sector -m, or NULL for none.
+ *
+ * Count what the map's member sections found unreadable as bad, on top
+ * of md's own lists. Arrays loaded before keep their snapshots until
+ * refresh_badblocks(). Return -1 if the map can't be opened.
+ */
+s32 set_badblock_map(const s8 *pathname)
+{
+	struct bbmap *map = NULL, *old;
+
+	if (pathname) {
+		map = bbmap_open(pathname);
+		if (NULL == map)
+			return -1;
+	}
+
+	old = __atomic_exchange_n(&member_map, map, __ATOMIC_ACQ_REL);
+	if (old)
+		epoch_retire(old, close_member_map);
+
+	return 0;
+}
+
 #else
 
 s32 is_badblock(s32 fd, s64 offset, s32 len, s32 rw)
@@ -511,4 +1266,29 @@ s32 is_badblock(s32 fd, s64 offset, s32 len, s32 rw)
 	return 0;
 }
 
+s32 set_badblock_workers(s32 nr)
+{
+	return 0;
+}
+
+s32 set_badblock_cache_ttl(s32 msecs)
+{
+	return 0;
+}
+
+s32 refresh_badblocks(void)
+{
+	return 0;
+}
+
+s32 set_badblock_root(const s8 *dir)
+{
+	return 0;
+}
+
+s32 set_badblock_map(const s8 *pathname)
+{
+	return 0;
+}
+
 #endif
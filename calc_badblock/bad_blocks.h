@@ -3,6 +3,46 @@
 
 #include "vbfscommon.h"
 
+#define BB_LAT_BUCKETS 32
+
+/* entry i of lat_hist counts calls that took [2^i, 2^(i+1)) ns */
+struct badblock_stats {
+	s32 major;
+	s32 minor;
+
+	u64 calls;
+	u64 hits;
+	u64 errors;
+	u64 stripes;
+	u64 sysfs_bytes;
+	u64 lat_hist[BB_LAT_BUCKETS];
+};
+
+/* ret is what is_badblock() would have returned */
+typedef void (*badblock_cb_t)(u64 ticket, s32 ret, void *arg);
+
+struct badblock_completion {
+	u64 ticket;
+	s32 ret;
+	void *arg;
+};
+
 s32 is_badblock(s32 fd, s64 offset, s32 len, s32 rw);
+s64 submit_badblock(s32 fd, s64 offset, s32 len, s32 rw, badblock_cb_t cb, void *arg);
+s32 badblock_eventfd(void);
+s32 reap_badblock(struct badblock_completion *done, s32 max);
+void stop_badblock_async(void);
+s32 set_badblock_workers(s32 nr);
+s32 set_badblock_cache_ttl(s32 msecs);
+s32 refresh_badblocks(void);
+s32 set_badblock_root(const s8 *dir);
+s32 set_badblock_map(const s8 *pathname);
+
+s32 enable_badblock_stats(s32 on);
+s32 get_badblock_stats(struct badblock_stats *stats, s32 max);
+void dump_badblock_stats(FILE *fp);
+
+s32 start_badblock_trace(const s8 *pathname);
+s32 stop_badblock_trace(void);
 
 #endif
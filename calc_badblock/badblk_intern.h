@@ -6,11 +6,10 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
-#define PROC_DEVICES "/proc/devices"
-
 /* copy from md_u.h */
 #define MD_MAJOR 9
 #define GET_ARRAY_INFO _IOR (MD_MAJOR, 0x11, mdu_array_info_t)
@@ -18,6 +17,9 @@
 #define SECTOR_SIZE 512
 #define PAGE_SIZE 4096
 
+/* returned by a nowait query that would have to load state */
+#define BB_WOULDBLOCK -2
+
 typedef struct mdu_array_info_s {
 	/*
 	 * Generic constant information
@@ -66,6 +68,12 @@ struct devinfo {
 	s32 type;
 	s32 major;
 	s32 minor;
+
+	/* stripes evaluated, for the stats */
+	s32 stripes;
+
+	/* fail with BB_WOULDBLOCK instead of reading sysfs or running dmsetup */
+	s32 nowait;
 };
 
 struct md_devinfo {
@@ -79,6 +87,44 @@ struct md_devinfo {
 	s64 end_sect;
 };
 
+/* one bad range of a member, as listed by sysfs */
+struct md_bb_range {
+	u64 sector;
+	s32 len;
+};
+
+struct md_rdev_bbs {
+	s32 present;
+	s64 data_offset;
+
+	/* unacknowledged_bad_blocks first, then bad_blocks */
+	s32 bb_cnt;
+	struct md_bb_range *bb_range;
+};
+
+/*
+ * Everything a query needs to know about one array. Published through
+ * md_slot and never modified afterwards; a refresh builds a new one and
+ * retires the old through epoch_retire().
+ */
+struct md_snapshot {
+	s32 major;
+	s32 minor;
+	s32 status;
+	s64 load_ms;
+	u64 sysfs_bytes;
+
+	struct md_devinfo md_info;
+	struct md_rdev_bbs *rdev;
+};
+
 s32 is_badblock(s32 fd, s64 offset, s32 len, s32 rw);
+s32 get_block_dev(s32 fd, dev_t *dev);
+s32 query_badblock_dev(struct devinfo *dinfo, dev_t dev, s64 offset, s32 len, s32 rw);
+
+struct md_snapshot *alloc_md_snapshot(s32 nr_rdev, s32 nr_ranges);
+void free_md_snapshot(void *snap);
+s32 publish_md_snapshot(struct md_snapshot *snap);
+s32 query_md_badblock(s32 major, s32 minor, s64 start_sect, s64 end_sect, s32 rw);
 
 #endif
@@ -0,0 +1,350 @@
+#include "badblk_intern.h"
+#include "bb_stats.h"
+#include "bb_trace.h"
+
+#ifdef _LINUX_
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+struct bb_request {
+	struct bb_request *next;
+	u64 ticket;
+	s64 offset;
+	s32 len;
+	s32 rw;
+	s32 ret;
+	s64 submit_ns;
+	s64 trace_ns;
+	dev_t dev;
+
+	badblock_cb_t cb;
+	void *arg;
+};
+
+/*
+ * Queries waiting for one device. The group lives until its queue is
+ * empty, so every query for the device that arrives meanwhile joins
+ * it and only one load per device is ever in flight.
+ */
+struct bb_group {
+	struct bb_group *next;
+	dev_t dev;
+
+	struct bb_request *head;
+	struct bb_request **tail;
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct bb_group *group_head;
+static struct bb_group **group_tail = &group_head;
+static struct bb_group *active_group;
+static pthread_t async_worker;
+static s32 worker_running, worker_stop;
+
+/* completions without a callback, counted on the eventfd */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bb_request *done_head;
+static struct bb_request **done_tail = &done_head;
+static s32 done_efd = -1;
+
+static u64 next_ticket;
+
+static void complete_request(struct bb_request *req, s32 ret, s32 stripes)
+{
+	u64 one = 1;
+
+	if (req->submit_ns)
+		stats_record(STATS_ALL, 0, ret, stripes, stats_now() - req->submit_ns);
+	if (req->trace_ns)
+		trace_query(req->dev, req->offset, req->len, req->rw, ret, req->trace_ns);
+
+	if (req->cb) {
+		req->cb(req->ticket, ret, req->arg);
+		free(req);
+		return;
+	}
+
+	req->ret = ret;
+	req->next = NULL;
+
+	pthread_mutex_lock(&done_lock);
+	*done_tail = req;
+	done_tail = &req->next;
+	if (done_efd >= 0 && write(done_efd, &one, sizeof(one)) < 0)
+		perror("eventfd write");
+	pthread_mutex_unlock(&done_lock);
+}
+
+static void run_batch(dev_t dev, struct bb_request *req)
+{
+	struct bb_request *next;
+	struct devinfo dinfo;
+	s32 ret;
+
+	/* the first query loads the array, the rest find it warm */
+	for (; req; req = next) {
+		next = req->next;
+		memset(&dinfo, 0, sizeof(struct devinfo));
+		ret = query_badblock_dev(&dinfo, dev, req->offset, req->len, req->rw);
+		complete_request(req, ret, dinfo.stripes);
+	}
+}
+
+static void *async_worker_fn(void *arg)
+{
+	struct bb_group *group;
+	struct bb_request *batch;
+
+	pthread_mutex_lock(&async_lock);
+	for (;;) {
+		while (NULL == group_head && !worker_stop)
+			pthread_cond_wait(&async_cond, &async_lock);
+		if (NULL == group_head)
+			break;
+
+		group = group_head;
+		group_head = group->next;
+		if (NULL == group_head)
+			group_tail = &group_head;
+		active_group = group;
+
+		batch = group->head;
+		group->head = NULL;
+		group->tail = &group->head;
+
+		pthread_mutex_unlock(&async_lock);
+		run_batch(group->dev, batch);
+		pthread_mutex_lock(&async_lock);
+
+		/* queries that joined during the load go to the back of the line */
+		active_group = NULL;
+		if (group->head) {
+			group->next = NULL;
+			*group_tail = group;
+			group_tail = &group->next;
+		} else
+			free(group);
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return NULL;
+}
+
+static struct bb_group *find_group(dev_t dev)
+{
+	struct bb_group *group;
+
+	if (active_group && active_group->dev == dev)
+		return active_group;
+
+	for (group = group_head; group; group = group->next) {
+		if (group->dev == dev)
+			return group;
+	}
+
+	return NULL;
+}
+
+static s32 queue_request(dev_t dev, struct bb_request *req)
+{
+	struct bb_group *group;
+
+	pthread_mutex_lock(&async_lock);
+
+	if (worker_stop) {
+		pthread_mutex_unlock(&async_lock);
+		errno = ESHUTDOWN;
+		return -1;
+	}
+
+	if (!worker_running) {
+		if (pthread_create(&async_worker, NULL, async_worker_fn, NULL)) {
+			pthread_mutex_unlock(&async_lock);
+			return -1;
+		}
+		worker_running = 1;
+	}
+
+	group = find_group(dev);
+	if (NULL == group) {
+		group = calloc(1, sizeof(struct bb_group));
+		if (NULL == group) {
+			pthread_mutex_unlock(&async_lock);
+			return -1;
+		}
+		group->dev = dev;
+		group->tail = &group->head;
+		*group_tail = group;
+		group_tail = &group->next;
+		pthread_cond_signal(&async_cond);
+	}
+
+	req->next = NULL;
+	*group->tail = req;
+	group->tail = &req->next;
+
+	pthread_mutex_unlock(&async_lock);
+
+	return 0;
+}
+
+/*
+ * submit_badblock:
+ * @cb: called with the result, or NULL to queue it for reap_badblock().
+ * @arg: passed back to @cb or in the completion.
+ *
+ * Non-blocking is_badblock(). A query that only needs warm snapshots
+ * completes before this returns, @cb then runs in the caller's thread.
+ * Anything that would read sysfs, issue an md ioctl or run dmsetup is
+ * handed to an internal worker and @cb runs there. Queries for a device
+ * whose load is already queued wait for that load.
+ *
+ * Return the ticket of the query, or -1 if it could not be queued.
+ */
+s64 submit_badblock(s32 fd, s64 offset, s32 len, s32 rw, badblock_cb_t cb, void *arg)
+{
+	struct bb_request *req;
+	struct devinfo dinfo;
+	dev_t dev;
+	u64 ticket;
+	s32 ret;
+
+	req = calloc(1, sizeof(struct bb_request));
+	if (NULL == req)
+		return -1;
+
+	ticket = __atomic_add_fetch(&next_ticket, 1, __ATOMIC_RELAXED);
+	req->ticket = ticket;
+	req->offset = offset;
+	req->len = len;
+	req->rw = rw;
+	req->cb = cb;
+	req->arg = arg;
+	req->submit_ns = stats_on() ? stats_now() : 0;
+	req->trace_ns = trace_on() ? trace_now() : 0;
+
+	if (get_block_dev(fd, &dev)) {
+		complete_request(req, -1, 0);
+		return ticket;
+	}
+	req->dev = dev;
+
+	memset(&dinfo, 0, sizeof(struct devinfo));
+	dinfo.nowait = 1;
+	ret = query_badblock_dev(&dinfo, dev, offset, len, rw);
+	if (ret != BB_WOULDBLOCK) {
+		complete_request(req, ret, dinfo.stripes);
+		return ticket;
+	}
+
+	if (queue_request(dev, req)) {
+		free(req);
+		return -1;
+	}
+
+	return ticket;
+}
+
+/*
+ * badblock_eventfd:
+ *
+ * Non-blocking eventfd that counts completions queued for
+ * reap_badblock(). Create it before submitting; after it polls
+ * readable, read it and reap until nothing is left.
+ */
+s32 badblock_eventfd(void)
+{
+	pthread_mutex_lock(&done_lock);
+	if (done_efd < 0)
+		done_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_unlock(&done_lock);
+
+	return done_efd;
+}
+
+/*
+ * reap_badblock:
+ *
+ * Take up to @max completions of queries submitted without a callback.
+ * Return the number taken, 0 if none is ready.
+ */
+s32 reap_badblock(struct badblock_completion *done, s32 max)
+{
+	struct bb_request *req;
+	s32 nr = 0;
+
+	pthread_mutex_lock(&done_lock);
+	while (nr < max && (req = done_head) != NULL) {
+		done_head = req->next;
+		if (NULL == done_head)
+			done_tail = &done_head;
+
+		done[nr].ticket = req->ticket;
+		done[nr].ret = req->ret;
+		done[nr].arg = req->arg;
+		nr ++;
+		free(req);
+	}
+	pthread_mutex_unlock(&done_lock);
+
+	return nr;
+}
+
+/*
+ * stop_badblock_async:
+ *
+ * Finish every queued query, stop the worker and close the eventfd.
+ * Completions not reaped yet stay available to reap_badblock().
+ */
+void stop_badblock_async(void)
+{
+	pthread_mutex_lock(&async_lock);
+	if (!worker_running) {
+		pthread_mutex_unlock(&async_lock);
+		goto close_efd;
+	}
+	worker_stop = 1;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+
+	pthread_join(async_worker, NULL);
+
+	pthread_mutex_lock(&async_lock);
+	worker_running = 0;
+	worker_stop = 0;
+	pthread_mutex_unlock(&async_lock);
+
+close_efd:
+	pthread_mutex_lock(&done_lock);
+	if (done_efd >= 0) {
+		close(done_efd);
+		done_efd = -1;
+	}
+	pthread_mutex_unlock(&done_lock);
+}
+
+#else
+
+s64 submit_badblock(s32 fd, s64 offset, s32 len, s32 rw, badblock_cb_t cb, void *arg)
+{
+	return -1;
+}
+
+s32 badblock_eventfd(void)
+{
+	return -1;
+}
+
+s32 reap_badblock(struct badblock_completion *done, s32 max)
+{
+	return 0;
+}
+
+void stop_badblock_async(void)
+{
+}
+
+#endif
@@ -0,0 +1,987 @@
+#define _GNU_SOURCE
+#include "badblk_intern.h"
+#include "bbmap.h"
+#include "dev_stack.h"
+#include "gentree.h"
+#include "sysfs_attr.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#define BENCH_MAJOR 9
+#define BENCH_MINOR 127
+#define BENCH_SECTORS (1ULL << 32)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double secs, s64 lines, s64 bytes)
+{
+	printf("%-24s %10.1f ns/line %10.1f MB/s\n", name,
+	       secs * 1e9 / lines, bytes / secs / 1e6);
+}
+
+/* old path: fopen + fgets + sscanf for every read */
+static s64 parse_stdio(const s8 *pathname)
+{
+	FILE *fp;
+	s8 buf[256];
+	u64 sector;
+	s32 len;
+	s64 sum = 0;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "%llu %d", &sector, &len) == 2)
+			sum += sector + len;
+	}
+
+	fclose(fp);
+
+	return sum;
+}
+
+static s64 parse_attr(const s8 *pathname, struct attr_buf *buf)
+{
+	const s8 *pos, *end;
+	u64 sector;
+	s32 len;
+	s64 sum = 0;
+
+	if (attr_read(pathname, buf))
+		return -1;
+
+	pos = buf->data;
+	end = buf->data + buf->len;
+	while (attr_next_range(&pos, end, &sector, &len) != 0)
+		sum += sector + len;
+
+	return sum;
+}
+
+static s32 bench_parse(s32 lines, s32 loops)
+{
+	s8 pathname[] = "/tmp/bb_bench_XXXXXX";
+	s8 line[64];
+	struct attr_buf *buf = attr_local_buf();
+	s64 bytes = 0, sum1 = 0, sum2 = 0;
+	double start;
+	s32 fd, i;
+
+	fd = mkstemp(pathname);
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+
+	srand(1);
+	for (i = 0; i < lines; i ++) {
+		s32 n = sprintf(line, "%llu %d\n",
+				(u64)rand() * 4096 + i * 8ULL, 8 << (rand() % 4));
+		if (write(fd, line, n) != n) {
+			perror("write");
+			close(fd);
+			unlink(pathname);
+			return -1;
+		}
+		bytes += n;
+	}
+	close(fd);
+
+	printf("%d lines, %lld bytes, %d loops\n", lines, bytes, loops);
+
+	start = now();
+	for (i = 0; i < loops; i ++)
+		sum1 += parse_stdio(pathname);
+	report("fopen+fgets+sscanf", now() - start, (s64)lines * loops, bytes * loops);
+
+	start = now();
+	for (i = 0; i < loops; i ++)
+		sum2 += parse_attr(pathname, buf);
+	report("pread+attr_next_range", now() - start, (s64)lines * loops, bytes * loops);
+
+	attr_close_all();
+	unlink(pathname);
+
+	if (sum1 != sum2) {
+		fprintf(stderr, "parse mismatch %lld != %lld\n", sum1, sum2);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* an in-memory raid6 array with nr_bb random bad ranges per member */
+static struct md_snapshot *make_snapshot(s32 raid_disks, s32 nr_bb, u32 seed)
+{
+	struct md_snapshot *snap;
+	struct md_devinfo *md_info;
+	struct md_bb_range *range;
+	s32 i, j;
+
+	snap = alloc_md_snapshot(raid_disks, raid_disks * nr_bb);
+	if (NULL == snap)
+		return NULL;
+
+	snap->major = BENCH_MAJOR;
+	snap->minor = BENCH_MINOR;
+
+	md_info = &snap->md_info;
+	strcpy(md_info->name, "md_bench");
+	md_info->array_info.level = 6;
+	md_info->array_info.raid_disks = raid_disks;
+	md_info->array_info.active_disks = raid_disks;
+	md_info->array_info.chunk_size = 64 * 1024;
+	md_info->max_degraded = 2;
+	md_info->stripe_sect = (raid_disks - 2) * (64 * 1024 >> 9);
+
+	range = snap->rdev[0].bb_range;
+	for (i = 0; i < raid_disks; i ++) {
+		snap->rdev[i].present = 1;
+		snap->rdev[i].data_offset = 2048;
+		snap->rdev[i].bb_cnt = nr_bb;
+		snap->rdev[i].bb_range = range;
+		for (j = 0; j < nr_bb; j ++, range ++) {
+			range->sector = (u64)rand_r(&seed) % (BENCH_SECTORS / raid_disks) / 8 * 8;
+			range->len = 8;
+		}
+	}
+
+	return snap;
+}
+
+struct stress {
+	s32 stop;
+	s32 raid_disks;
+	s32 nr_bb;
+	u64 refreshes;
+};
+
+struct stress_reader {
+	struct stress *stress;
+	pthread_t tid;
+	u32 seed;
+	u64 queries;
+	u64 hits;
+};
+
+static void *stress_writer(void *arg)
+{
+	struct stress *stress = arg;
+	struct md_snapshot *snap;
+	u32 seed = 1;
+
+	while (!__atomic_load_n(&stress->stop, __ATOMIC_RELAXED)) {
+		snap = make_snapshot(stress->raid_disks, stress->nr_bb, seed++);
+		if (snap && publish_md_snapshot(snap))
+			free_md_snapshot(snap);
+		stress->refreshes ++;
+	}
+
+	return NULL;
+}
+
+static void *stress_reader(void *arg)
+{
+	struct stress_reader *reader = arg;
+	struct stress *stress = reader->stress;
+	u64 queries = 0, hits = 0;
+	s64 start;
+
+	while (!__atomic_load_n(&stress->stop, __ATOMIC_RELAXED)) {
+		start = (s64)(((u64)rand_r(&reader->seed) << 16) % BENCH_SECTORS) / 8 * 8;
+		if (query_md_badblock(BENCH_MAJOR, BENCH_MINOR, start, start + 8, 0) > 0)
+			hits ++;
+		queries ++;
+	}
+
+	reader->queries = queries;
+	reader->hits = hits;
+
+	return NULL;
+}
+
+/* query throughput with 1, 2, 4 .. max_threads readers and one busy writer */
+static s32 bench_stress(s32 max_threads, s32 secs, s32 raid_disks, s32 nr_bb)
+{
+	struct stress stress;
+	struct stress_reader *readers;
+	struct md_snapshot *snap;
+	pthread_t writer;
+	double start, elapsed, base = 0;
+	s32 nr, i;
+
+	readers = calloc(max_threads, sizeof(struct stress_reader));
+	snap = make_snapshot(raid_disks, nr_bb, 0);
+	if (NULL == readers || NULL == snap || publish_md_snapshot(snap)) {
+		fprintf(stderr, "setup error\n");
+		return -1;
+	}
+
+	/* only the writer below replaces the snapshot */
+	set_badblock_cache_ttl(0);
+
+	printf("raid6 %d disks, %d bad ranges per member, %d s per run\n",
+	       raid_disks, nr_bb, secs);
+	printf("%8s %14s %14s %10s %12s\n", "threads", "queries/s", "per thread",
+	       "scaling", "refreshes/s");
+
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		u64 total = 0;
+
+		memset(&stress, 0, sizeof(stress));
+		stress.raid_disks = raid_disks;
+		stress.nr_bb = nr_bb;
+
+		start = now();
+		pthread_create(&writer, NULL, stress_writer, &stress);
+		for (i = 0; i < nr; i ++) {
+			readers[i].stress = &stress;
+			readers[i].seed = i + 1;
+			pthread_create(&readers[i].tid, NULL, stress_reader, &readers[i]);
+		}
+
+		sleep(secs);
+		__atomic_store_n(&stress.stop, 1, __ATOMIC_RELAXED);
+
+		for (i = 0; i < nr; i ++) {
+			pthread_join(readers[i].tid, NULL);
+			total += readers[i].queries;
+		}
+		pthread_join(writer, NULL);
+		elapsed = now() - start;
+
+		if (1 == nr)
+			base = total / elapsed;
+		printf("%8d %14.0f %14.0f %9.2fx %12.0f\n", nr, total / elapsed,
+		       total / elapsed / nr, total / elapsed / base,
+		       stress.refreshes / elapsed);
+	}
+
+	free(readers);
+
+	return 0;
+}
+
+static double query_loop(s32 loops)
+{
+	double start = now();
+	u32 seed = 1;
+	s64 sect;
+	s32 i;
+
+	for (i = 0; i < loops; i ++) {
+		sect = (s64)(((u64)rand_r(&seed) << 16) % BENCH_SECTORS) / 8 * 8;
+		query_md_badblock(BENCH_MAJOR, BENCH_MINOR, sect, sect + 8, 0);
+	}
+
+	return (now() - start) * 1e9 / loops;
+}
+
+/* cost of the query counters, off and on */
+static s32 bench_stats(s32 loops, s32 raid_disks, s32 nr_bb)
+{
+	struct md_snapshot *snap;
+	double off, on;
+
+	snap = make_snapshot(raid_disks, nr_bb, 0);
+	if (NULL == snap || publish_md_snapshot(snap)) {
+		fprintf(stderr, "setup error\n");
+		return -1;
+	}
+	set_badblock_cache_ttl(0);
+
+	enable_badblock_stats(0);
+	query_loop(loops / 10);
+	off = query_loop(loops);
+
+	enable_badblock_stats(1);
+	on = query_loop(loops);
+	enable_badblock_stats(0);
+
+	printf("stats off %8.1f ns/query\n", off);
+	printf("stats on  %8.1f ns/query\n", on);
+	dump_badblock_stats(stdout);
+
+	return 0;
+}
+
+static __thread s32 in_submit;
+static s32 async_done, async_inline;
+
+static void async_cb(u64 ticket, s32 ret, void *arg)
+{
+	__atomic_add_fetch(&async_done, 1, __ATOMIC_RELAXED);
+	if (in_submit)
+		__atomic_add_fetch(&async_inline, 1, __ATOMIC_RELAXED);
+}
+
+static double submit_loop(s32 fd, s32 loops, double *worst)
+{
+	double start = now(), t;
+	u32 seed = 1;
+	s64 sect;
+	s32 i;
+
+	*worst = 0;
+	for (i = 0; i < loops; i ++) {
+		sect = (s64)(((u64)rand_r(&seed) << 16) % BENCH_SECTORS) / 8 * 8;
+		t = now();
+		in_submit = 1;
+		submit_badblock(fd, sect * 512, 4096, 0, async_cb, NULL);
+		in_submit = 0;
+		t = now() - t;
+		if (t > *worst)
+			*worst = t;
+	}
+
+	return (now() - start) * 1e9 / loops;
+}
+
+/*
+ * Submission cost through a device node of the bench array, opened
+ * O_PATH since no md driver backs it. The cold round has no snapshot,
+ * so its queries go to the worker behind a single load.
+ */
+static s32 bench_async(s32 loops)
+{
+	const s8 *pathname = "/tmp/bb_bench.md";
+	struct md_snapshot *snap;
+	double cold, warm, sync, worst;
+	s32 fd, i;
+
+	unlink(pathname);
+	if (mknod(pathname, S_IFBLK | 0600, makedev(BENCH_MAJOR, BENCH_MINOR)) ||
+	    (fd = open(pathname, O_PATH)) < 0) {
+		perror("device node");
+		return -1;
+	}
+	set_badblock_cache_ttl(0);
+
+	cold = submit_loop(fd, loops, &worst);
+	stop_badblock_async();
+	printf("cold submit %8.1f ns/query, worst %.1f us, %d/%d inline\n",
+	       cold, worst * 1e6, async_inline, async_done);
+
+	snap = make_snapshot(12, 16, 0);
+	if (NULL == snap || publish_md_snapshot(snap)) {
+		fprintf(stderr, "setup error\n");
+		close(fd);
+		unlink(pathname);
+		return -1;
+	}
+
+	async_done = async_inline = 0;
+	warm = submit_loop(fd, loops, &worst);
+	printf("warm submit %8.1f ns/query, worst %.1f us, %d/%d inline\n",
+	       warm, worst * 1e6, async_inline, async_done);
+
+	sync = now();
+	for (i = 0; i < loops; i ++)
+		is_badblock(fd, (s64)i * 4096, 4096, 0);
+	sync = (now() - sync) * 1e9 / loops;
+	printf("is_badblock %8.1f ns/query\n", sync);
+
+	stop_badblock_async();
+	close(fd);
+	unlink(pathname);
+
+	return 0;
+}
+
+/* linear reference for the map lookup */
+static s32 scan_ranges(struct bbmap_range *ranges, s32 nr, u64 start, u64 len)
+{
+	s32 i;
+
+	for (i = 0; i < nr; i ++) {
+		if (ranges[i].start < start + len && ranges[i].start + ranges[i].len > start)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* map size and lookup cost against a linear scan of the same ranges */
+static s32 bench_map(s32 nr, s32 loops)
+{
+	const s8 *pathname = "/tmp/bb_bench.map";
+	struct bbmap_writer *writer;
+	struct bbmap_range *ranges;
+	const struct bbmap_section *sec;
+	struct bbmap *map;
+	struct stat st;
+	double start, t_map, t_scan;
+	u64 sect;
+	u32 seed = 1;
+	s32 i, hits = 0, ret = -1;
+
+	ranges = malloc(sizeof(struct bbmap_range) * nr);
+	writer = bbmap_writer_new();
+	if (NULL == ranges || NULL == writer)
+		goto out;
+
+	for (i = 0; i < nr; i ++) {
+		ranges[i].start = ((u64)rand_r(&seed) << 16) % BENCH_SECTORS;
+		ranges[i].len = 8 * (1 + rand_r(&seed) % 16);
+	}
+
+	if (bbmap_add_section(writer, BBMAP_ARRAY, "md127", 1, ranges, nr) ||
+	    bbmap_write(writer, pathname)) {
+		perror("write map");
+		goto out;
+	}
+	nr = bbmap_normalize(ranges, nr);
+
+	map = bbmap_open(pathname);
+	if (NULL == map || stat(pathname, &st) ||
+	    NULL == (sec = bbmap_find(map, BBMAP_ARRAY, "md127"))) {
+		fprintf(stderr, "open map error\n");
+		bbmap_close(map);
+		goto out;
+	}
+
+	/* both paths have to agree before the timings mean anything */
+	seed = 2;
+	for (i = 0; i < loops; i ++) {
+		sect = ((u64)rand_r(&seed) << 16) % BENCH_SECTORS;
+		if (bbmap_lookup(map, sec, sect, 8) != scan_ranges(ranges, nr, sect, 8)) {
+			fprintf(stderr, "lookup mismatch at %llu\n", sect);
+			bbmap_close(map);
+			goto out;
+		}
+	}
+
+	seed = 2;
+	start = now();
+	for (i = 0; i < loops; i ++) {
+		sect = ((u64)rand_r(&seed) << 16) % BENCH_SECTORS;
+		hits += bbmap_lookup(map, sec, sect, 8);
+	}
+	t_map = (now() - start) * 1e9 / loops;
+
+	seed = 2;
+	start = now();
+	for (i = 0; i < loops; i ++) {
+		sect = ((u64)rand_r(&seed) << 16) % BENCH_SECTORS;
+		hits += scan_ranges(ranges, nr, sect, 8);
+	}
+	t_scan = (now() - start) * 1e9 / loops;
+
+	printf("%d ranges, %lld bytes, %.1f bytes/range, %d hits\n", nr,
+	       (s64)st.st_size, (double)st.st_size / nr, hits / 2);
+	printf("map lookup  %10.1f ns/query\n", t_map);
+	printf("linear scan %10.1f ns/query\n", t_scan);
+
+	bbmap_close(map);
+	unlink(pathname);
+	ret = 0;
+out:
+	bbmap_writer_free(writer);
+	free(ranges);
+	return ret;
+}
+
+static s32 cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_lat(const s8 *name, double *lat, s32 nr)
+{
+	qsort(lat, nr, sizeof(double), cmp_double);
+	printf("%-22s p50 %9.2f  p99 %9.2f  max %9.2f us\n", name,
+	       lat[nr / 2] * 1e6, lat[nr * 99 / 100] * 1e6, lat[nr - 1] * 1e6);
+}
+
+/* wall time of "get_bad_block -a" over the tree, best of three runs */
+static double time_get_bad_block(const s8 *prog, const s8 *dir, s32 workers)
+{
+	s8 jobs[16];
+	double best = 0, t;
+	pid_t pid;
+	s32 i, status, fd;
+
+	sprintf(jobs, "%d", workers);
+	for (i = 0; i < 3; i ++) {
+		t = now();
+		pid = fork();
+		if (0 == pid) {
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0)
+				dup2(fd, 1);
+			execl(prog, prog, "-R", dir, "-j", jobs, "-a", (char *)NULL);
+			_exit(127);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			return -1;
+		t = now() - t;
+		if (0 == best || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+/*
+ * Queries inside the chunks gentree failed, on the arrays and through
+ * the devices on top of their LVs: every one of them must hit.
+ */
+static s32 bench_failed(const struct tree_params *params, const s8 *dir, s32 *fds,
+			double *lat, s32 loops)
+{
+	struct tree_chunk *chunks = NULL, *c;
+	s32 nr, i, lv, nr_lvs = params->nr_arrays * params->nr_lvs, hits, ret = -1;
+	s32 *dm_fds = NULL, *lvs = NULL, nr_top = 0;
+	s64 *tops = NULL;
+	s8 path[512];
+	u32 seed = 2;
+	double t;
+
+	nr = tree_failed(dir, &chunks);
+	if (nr <= 0)
+		return nr;
+
+	for (i = 0, hits = 0; i < loops; i ++) {
+		c = &chunks[rand_r(&seed) % nr];
+		t = now();
+		hits += is_badblock(fds[c->array], c->sector * 512, c->len * 512, 0) > 0;
+		lat[i] = now() - t;
+	}
+	print_lat("is_badblock md failed", lat, loops);
+	printf("%-22s %d of %d\n", "failed md hits", hits, loops);
+	if (hits != loops)
+		goto out;
+
+	/* the same chunks where the LVs show them, those in a header excepted */
+	dm_fds = malloc(sizeof(s32) * nr_lvs);
+	lvs = malloc(sizeof(s32) * nr);
+	tops = malloc(sizeof(s64) * nr);
+	if (NULL == dm_fds || NULL == lvs || NULL == tops)
+		goto out;
+	for (i = 0; i < nr_lvs; i ++)
+		dm_fds[i] = -1;
+
+	for (i = 0; i < nr; i ++) {
+		tops[nr_top] = tree_top_sector(params, chunks[i].array, chunks[i].sector, &lv);
+		if (tops[nr_top] < 0)
+			continue;
+		if (dm_fds[lv] < 0) {
+			snprintf(path, sizeof(path), "%s/nodes/dm-%d", dir, tree_top_minor(params, lv));
+			dm_fds[lv] = open(path, O_PATH);
+			if (dm_fds[lv] < 0) {
+				perror("open node");
+				goto out;
+			}
+		}
+		lvs[nr_top ++] = lv;
+	}
+
+	for (i = 0, hits = 0; nr_top && i < loops; i ++) {
+		lv = rand_r(&seed) % nr_top;
+		t = now();
+		hits += is_badblock(dm_fds[lvs[lv]], tops[lv] * 512, 4096, 0) > 0;
+		lat[i] = now() - t;
+	}
+	if (nr_top) {
+		print_lat("is_badblock dm failed", lat, loops);
+		printf("%-22s %d of %d\n", "failed dm hits", hits, loops);
+	}
+	ret = nr_top && hits != loops ? -1 : 0;
+
+out:
+	if (dm_fds) {
+		for (i = 0; i < nr_lvs; i ++) {
+			if (dm_fds[i] >= 0)
+				close(dm_fds[i]);
+		}
+	}
+	free(dm_fds);
+	free(lvs);
+	free(tops);
+	free(chunks);
+
+	return ret;
+}
+
+/*
+ * get_bad_block -a against is_badblock() on the same tree: every 4K of
+ * a range it reports must hit, and the sectors just outside must not.
+ * A range reported over a healthy chunk, or one cut short, fails here.
+ */
+static s32 check_get_bad_block(const struct tree_params *params, const s8 *prog, const s8 *dir)
+{
+	s8 cmd[1024], line[256], name[128], path[512];
+	s32 fd = -1, i, k, l, minor, len, q, ranges = 0, bad = 0;
+	u64 start, end, x, dev_sectors = 0;
+	FILE *out;
+
+	snprintf(cmd, sizeof(cmd), "%s -R %s -a", prog, dir);
+	out = popen(cmd, "r");
+	if (NULL == out)
+		return -1;
+
+	while (fgets(line, sizeof(line), out)) {
+		if (strstr(line, " has ") && 1 == sscanf(line, "%127s", name)) {
+			if (fd >= 0)
+				close(fd);
+			l = 0;
+			if (sscanf(name, "vg%d-lv%d-l%d", &i, &k, &l) < 2) {
+				fd = -1;
+				continue;
+			}
+			minor = (l * params->nr_arrays + i) * params->nr_lvs + k;
+			dev_sectors = tree_top_sectors(params) +
+				(u64)(params->layers - l) * TREE_LAYER_SECTORS;
+			snprintf(path, sizeof(path), "%s/nodes/dm-%d", dir, minor);
+			fd = open(path, O_PATH);
+			continue;
+		}
+		if (fd < 0 || 2 != sscanf(line, "start %llu len %d", &start, &len))
+			continue;
+
+		ranges ++;
+		end = start + len;
+		for (x = start; x < end; x += 8) {
+			q = end - x < 8 ? end - x : 8;
+			if (is_badblock(fd, x * 512, q * 512, 0) <= 0) {
+				printf("%s: %llu+%d reported but is_badblock misses it\n", name, x, q);
+				bad ++;
+			}
+		}
+		if (start && is_badblock(fd, (start - 1) * 512, 512, 0)) {
+			printf("%s: %llu is bad but get_bad_block starts at %llu\n", name, start - 1, start);
+			bad ++;
+		}
+		if (end < dev_sectors && is_badblock(fd, end * 512, 512, 0)) {
+			printf("%s: %llu is bad but get_bad_block ends there\n", name, end);
+			bad ++;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	if (pclose(out))
+		return -1;
+
+	printf("%-22s %d ranges, %d disagree\n", "get_bad_block check", ranges, bad);
+
+	return bad || 0 == ranges ? -1 : 0;
+}
+
+/*
+ * set_badblock_map() over array 0 of the tree: a clean 4K must hit
+ * once a map marks it on max_degraded + 1 members, and miss again when
+ * the map is dropped.
+ */
+static s32 check_member_map(const struct tree_params *params, const s8 *dir, s32 fd)
+{
+	struct bbmap_writer *writer;
+	struct bbmap_range range;
+	s8 pathname[512], name[BBMAP_NAME_LEN], serial[32];
+	s32 chunk = params->chunk_kb * 2, max_degraded = params->level == 6 ? 2 : 1;
+	s32 i, with, after, ret = -1;
+	u64 stripe, off;
+	u8 uuid[16];
+
+	for (stripe = 0; stripe < 1024; stripe ++) {
+		off = stripe * (params->raid_disks - max_degraded) * chunk * 512;
+		if (0 == is_badblock(fd, off, 4096, 0))
+			break;
+	}
+	if (1024 == stripe)
+		return -1;
+
+	writer = bbmap_writer_new();
+	if (NULL == writer)
+		return -1;
+
+	tree_uuid(0, uuid);
+	range.start = params->data_offset + stripe * chunk;
+	range.len = 8;
+	for (i = 0; i <= max_degraded; i ++) {
+		tree_serial(0, i, serial, sizeof(serial));
+		snprintf(name, sizeof(name), "%s:%d", serial, i);
+		if (bbmap_add_section(writer, BBMAP_MEMBER, name,
+				      bbmap_member_generation(uuid, params->data_offset), &range, 1))
+			goto out;
+	}
+	snprintf(pathname, sizeof(pathname), "%s/surface.bbmap", dir);
+	if (bbmap_write(writer, pathname) || set_badblock_map(pathname))
+		goto out;
+
+	refresh_badblocks();
+	with = is_badblock(fd, off, 4096, 0);
+	set_badblock_map(NULL);
+	refresh_badblocks();
+	after = is_badblock(fd, off, 4096, 0);
+
+	ret = 1 == with && 0 == after ? 0 : -1;
+	printf("%-22s %s\n", "is_badblock member map",
+	       ret ? "wrong" : "hits with the map, misses without");
+
+out:
+	bbmap_writer_free(writer);
+
+	return ret;
+}
+
+/*
+ * is_badblock() and get_bad_block over a generated tree: the first
+ * query of every array (snapshot load), warm md and dm queries at
+ * random and inside the failed chunks, checks
+ * of get_bad_block against is_badblock() and of a member map, and a full
+ * get_bad_block -a run with one and four workers.
+ */
+static s32 bench_tree(struct tree_params *params, const s8 *prog)
+{
+	s8 dir[] = "/tmp/bb_tree.XXXXXX", path[512];
+	s32 *fds = NULL, i, fd, loops = 100000, hits = 0, ret = -1;
+	double *lat = NULL, t, cold = 0, cold_max = 0, j1, j4;
+	u64 array_bytes, top_bytes;
+	u32 seed = 1;
+	s64 off;
+
+	if (NULL == mkdtemp(dir) || gen_tree(dir, params)) {
+		perror("generate tree");
+		return -1;
+	}
+
+	printf("%d x raid%d, %d disks, %dK chunk, %d bad ranges per member", params->nr_arrays,
+	       params->level, params->raid_disks, params->chunk_kb, params->nr_bb);
+	if (params->stripes > 1)
+		printf(", LVs striped over %d arrays", params->stripes);
+	if (params->partitioned)
+		printf(", on md partitions");
+	if (params->layers)
+		printf(", %d dm layers on each LV", params->layers);
+	printf("\n");
+
+	set_badblock_root(dir);
+	set_badblock_cache_ttl(0);
+
+	fds = calloc(params->nr_arrays, sizeof(s32));
+	lat = malloc(sizeof(double) * loops);
+	if (NULL == fds || NULL == lat)
+		goto out;
+
+	sprintf(path, "%s/nodes/md%d", dir, TREE_MD_MINOR);
+	if (access(path, F_OK)) {
+		printf("no device nodes (mknod not permitted), skipping is_badblock\n");
+		goto tool;
+	}
+
+	for (i = 0; i < params->nr_arrays; i ++) {
+		sprintf(path, "%s/nodes/md%d", dir, TREE_MD_MINOR + i);
+		fds[i] = open(path, O_PATH);
+		if (fds[i] < 0) {
+			perror("open node");
+			goto out;
+		}
+
+		t = now();
+		is_badblock(fds[i], 0, 4096, 0);
+		t = now() - t;
+		cold += t;
+		if (t > cold_max)
+			cold_max = t;
+	}
+	printf("%-22s avg %9.2f  max %9.2f us\n", "is_badblock cold",
+	       cold / params->nr_arrays * 1e6, cold_max * 1e6);
+
+	array_bytes = params->member_sectors * 512 *
+		(params->level == 1 ? 1 : params->raid_disks - (params->level == 6 ? 2 : 1));
+	for (i = 0; i < loops; i ++) {
+		fd = fds[rand_r(&seed) % params->nr_arrays];
+		off = (((u64)rand_r(&seed) << 31 | rand_r(&seed)) % array_bytes) / 4096 * 4096;
+		t = now();
+		hits += is_badblock(fd, off, 4096, 0) > 0;
+		lat[i] = now() - t;
+	}
+	print_lat("is_badblock md warm", lat, loops);
+	printf("%-22s %d of %d\n", "is_badblock md hits", hits, loops);
+
+	/* the first query compiles the stack, running dmsetup once per dm level */
+	sprintf(path, "%s/nodes/dm-%d", dir, tree_top_minor(params, 0));
+	fd = open(path, O_PATH);
+	if (fd >= 0) {
+		t = now();
+		is_badblock(fd, 0, 4096, 0);
+		printf("%-22s %9.2f us\n", "is_badblock dm cold", (now() - t) * 1e6);
+
+		top_bytes = tree_top_sectors(params) * 512;
+		for (i = 0, hits = 0; i < loops; i ++) {
+			off = (((u64)rand_r(&seed) << 31 | rand_r(&seed)) % top_bytes) / 4096 * 4096;
+			t = now();
+			hits += is_badblock(fd, off, 4096, 0) > 0;
+			lat[i] = now() - t;
+		}
+		print_lat("is_badblock dm warm", lat, loops);
+		printf("%-22s %d of %d\n", "is_badblock dm hits", hits, loops);
+		close(fd);
+	}
+
+	if (bench_failed(params, dir, fds, lat, loops))
+		goto out;
+
+	if (params->level > 1 &&
+	    (check_get_bad_block(params, prog, dir) || check_member_map(params, dir, fds[0])))
+		goto out;
+
+tool:
+	j1 = time_get_bad_block(prog, dir, 1);
+	j4 = time_get_bad_block(prog, dir, 4);
+	if (j1 < 0 || j4 < 0)
+		printf("%s failed\n", prog);
+	else
+		printf("%-22s -j1 %8.2f ms  -j4 %8.2f ms  speedup %.2f\n", "get_bad_block -a",
+		       j1 * 1e3, j4 * 1e3, j1 / j4);
+	ret = 0;
+
+out:
+	if (fds) {
+		for (i = 0; i < params->nr_arrays; i ++) {
+			if (fds[i] > 0)
+				close(fds[i]);
+		}
+	}
+	free(fds);
+	free(lat);
+	set_badblock_root(NULL);
+	remove_tree(dir);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	printf("%s parse [lines] [loops]: bad_blocks parse throughput\n", prog);
+	printf("%s stress [threads] [seconds] [raid_disks] [bad_ranges]: "
+	       "concurrent queries during refresh\n", prog);
+	printf("%s stats [loops]: query cost with counters off and on\n", prog);
+	printf("%s map [ranges] [loops]: bad range map size and lookup cost\n", prog);
+	printf("%s async [loops]: submit_badblock cost, cold and warm\n", prog);
+	printf("%s gentree dir [arrays] [raid_disks] [bad_ranges] [level] [chunk_kb] [data_offset] "
+	       "[stripes] [layers] [partitioned]: write a fake sysfs/procfs tree\n", prog);
+	printf("%s tree [arrays] [raid_disks] [bad_ranges] [level] [chunk_kb] [stripes] [layers] "
+	       "[partitioned]: "
+	       "is_badblock and get_bad_block over a generated tree\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage(argv[0]);
+
+	if (0 == strcmp(argv[1], "parse")) {
+		s32 lines = argc > 2 ? atoi(argv[2]) : 512;
+		s32 loops = argc > 3 ? atoi(argv[3]) : 2000;
+
+		if (lines <= 0 || loops <= 0)
+			usage(argv[0]);
+		return bench_parse(lines, loops) ? 1 : 0;
+	}
+
+	if (0 == strcmp(argv[1], "stress")) {
+		s32 threads = argc > 2 ? atoi(argv[2]) : 8;
+		s32 secs = argc > 3 ? atoi(argv[3]) : 2;
+		s32 raid_disks = argc > 4 ? atoi(argv[4]) : 12;
+		s32 nr_bb = argc > 5 ? atoi(argv[5]) : 16;
+
+		if (threads <= 0 || secs <= 0 || raid_disks < 4 || nr_bb < 0)
+			usage(argv[0]);
+		return bench_stress(threads, secs, raid_disks, nr_bb) ? 1 : 0;
+	}
+
+	if (0 == strcmp(argv[1], "stats")) {
+		s32 loops = argc > 2 ? atoi(argv[2]) : 1000000;
+
+		if (loops <= 0)
+			usage(argv[0]);
+		return bench_stats(loops, 12, 16) ? 1 : 0;
+	}
+
+	if (0 == strcmp(argv[1], "map")) {
+		s32 nr = argc > 2 ? atoi(argv[2]) : 100000;
+		s32 loops = argc > 3 ? atoi(argv[3]) : 100000;
+
+		if (nr <= 0 || loops <= 0)
+			usage(argv[0]);
+		return bench_map(nr, loops) ? 1 : 0;
+	}
+
+	if (0 == strcmp(argv[1], "async")) {
+		s32 loops = argc > 2 ? atoi(argv[2]) : 100000;
+
+		if (loops <= 0)
+			usage(argv[0]);
+		return bench_async(loops) ? 1 : 0;
+	}
+
+	if (0 == strcmp(argv[1], "gentree") || 0 == strcmp(argv[1], "tree")) {
+		struct tree_params params;
+		s32 tree = argv[1][0] == 't', arg = tree ? 2 : 3;
+		s8 self[512], prog[512], *env;
+
+		if (!tree && argc < 3)
+			usage(argv[0]);
+
+		default_tree_params(&params);
+		if (argc > arg)
+			params.nr_arrays = atoi(argv[arg]);
+		if (argc > arg + 1)
+			params.raid_disks = atoi(argv[arg + 1]);
+		if (argc > arg + 2)
+			params.nr_bb = atoi(argv[arg + 2]);
+		if (argc > arg + 3)
+			params.level = atoi(argv[arg + 3]);
+		if (argc > arg + 4)
+			params.chunk_kb = atoi(argv[arg + 4]);
+		if (!tree && argc > arg + 5)
+			params.data_offset = atoll(argv[arg + 5]);
+		if (argc > arg + 5 + !tree)
+			params.stripes = atoi(argv[arg + 5 + !tree]);
+		if (argc > arg + 6 + !tree)
+			params.layers = atoi(argv[arg + 6 + !tree]);
+		if (argc > arg + 7 + !tree)
+			params.partitioned = atoi(argv[arg + 7 + !tree]);
+		if (params.nr_arrays <= 0 || params.nr_bb < 0 || params.stripes <= 0 ||
+		    params.stripes > DM_MAX_LEGS || params.nr_arrays % params.stripes ||
+		    params.layers < 0 || params.layers > STACK_MAX_DEPTH - 3)
+			usage(argv[0]);
+
+		if (!tree) {
+			if (gen_tree(argv[2], &params)) {
+				perror("generate tree");
+				return 1;
+			}
+			return 0;
+		}
+
+		/* get_bad_block is expected next to this binary */
+		env = getenv("BB_GET_BAD_BLOCK");
+		snprintf(self, sizeof(self), "%s", argv[0]);
+		snprintf(prog, sizeof(prog), "%s/get_bad_block", dirname(self));
+		return bench_tree(&params, env ? env : prog) ? 1 : 0;
+	}
+
+	usage(argv[0]);
+
+	return 0;
+}
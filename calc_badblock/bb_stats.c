@@ -0,0 +1,283 @@
+#include "bad_blocks.h"
+#include "bb_stats.h"
+
+#ifdef BB_STATS
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Query counters, sharded per thread so the I/O path only ever writes
+ * memory of its own. Each shard is written by one thread at a time
+ * with relaxed stores; readers sum all shards and may see a count that
+ * is a few calls behind, which is fine for statistics.
+ */
+struct array_shard {
+	u32 devno;
+
+	u64 calls;
+	u64 hits;
+	u64 errors;
+	u64 stripes;
+	u64 sysfs_bytes;
+	u64 lat_hist[BB_LAT_BUCKETS];
+};
+
+struct stats_shard {
+	struct stats_shard *next;
+	u32 in_use;
+
+	struct array_shard *arrays[STATS_MAX_ARRAYS + 1];
+};
+
+s32 stats_enabled;
+
+static struct stats_shard *stats_shards;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static __thread struct stats_shard *local_shard;
+
+static void put_shard(void *arg)
+{
+	struct stats_shard *shard = arg;
+
+	/* keep the counts, the next new thread carries on with them */
+	__atomic_store_n(&shard->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_init(void)
+{
+	pthread_key_create(&stats_key, put_shard);
+}
+
+static struct stats_shard *get_shard(void)
+{
+	struct stats_shard *shard;
+	u32 unused = 0;
+
+	if (local_shard)
+		return local_shard;
+
+	pthread_once(&stats_once, stats_init);
+
+	for (shard = __atomic_load_n(&stats_shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+		if (__atomic_compare_exchange_n(&shard->in_use, &unused, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			goto out;
+		unused = 0;
+	}
+
+	shard = calloc(1, sizeof(struct stats_shard));
+	if (NULL == shard)
+		return NULL;
+	shard->in_use = 1;
+
+	shard->next = __atomic_load_n(&stats_shards, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&stats_shards, &shard->next, shard, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+out:
+	pthread_setspecific(stats_key, shard);
+	local_shard = shard;
+
+	return shard;
+}
+
+static struct array_shard *get_array_shard(s32 idx, u32 devno)
+{
+	struct stats_shard *shard = get_shard();
+	struct array_shard *array;
+
+	if (NULL == shard || idx < 0 || idx > STATS_ALL)
+		return NULL;
+
+	array = shard->arrays[idx];
+	if (array)
+		return array;
+
+	array = calloc(1, sizeof(struct array_shard));
+	if (NULL == array)
+		return NULL;
+	array->devno = devno;
+	__atomic_store_n(&shard->arrays[idx], array, __ATOMIC_RELEASE);
+
+	return array;
+}
+
+static inline void stats_inc(u64 *counter, u64 val)
+{
+	__atomic_store_n(counter, *counter + val, __ATOMIC_RELAXED);
+}
+
+static s32 lat_bucket(s64 lat_ns)
+{
+	s32 bucket;
+
+	if (lat_ns <= 1)
+		return 0;
+
+	bucket = 63 - __builtin_clzll(lat_ns);
+	return bucket < BB_LAT_BUCKETS ? bucket : BB_LAT_BUCKETS - 1;
+}
+
+s64 stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_record(s32 idx, u32 devno, s32 ret, s32 stripes, s64 lat_ns)
+{
+	struct array_shard *array = get_array_shard(idx, devno);
+
+	if (NULL == array)
+		return;
+
+	stats_inc(&array->calls, 1);
+	if (ret > 0)
+		stats_inc(&array->hits, 1);
+	else if (ret < 0)
+		stats_inc(&array->errors, 1);
+	stats_inc(&array->stripes, stripes);
+	stats_inc(&array->lat_hist[lat_bucket(lat_ns)], 1);
+}
+
+void stats_add_bytes(s32 idx, u32 devno, u64 bytes)
+{
+	struct array_shard *array = get_array_shard(idx, devno);
+
+	if (array)
+		stats_inc(&array->sysfs_bytes, bytes);
+}
+
+/*
+ * enable_badblock_stats:
+ * @on: 1 to start counting, 0 to stop.
+ *
+ * Counting is off by default; while off a query pays one branch.
+ */
+s32 enable_badblock_stats(s32 on)
+{
+	__atomic_store_n(&stats_enabled, !!on, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * get_badblock_stats:
+ * @stats: filled with the sum over all threads, entry 0 covers every
+ *         call and the rest one md array each.
+ * @max: number of entries in stats.
+ *
+ * Return the number of entries filled.
+ */
+s32 get_badblock_stats(struct badblock_stats *stats, s32 max)
+{
+	struct badblock_stats sum;
+	struct stats_shard *shard;
+	struct array_shard *array;
+	s32 idx, i, nr = 0;
+
+	for (idx = STATS_ALL; idx >= 0 && nr < max; idx --) {
+		memset(&sum, 0, sizeof(sum));
+
+		for (shard = __atomic_load_n(&stats_shards, __ATOMIC_ACQUIRE); shard;
+					shard = shard->next) {
+			array = __atomic_load_n(&shard->arrays[idx], __ATOMIC_ACQUIRE);
+			if (NULL == array)
+				continue;
+
+			if (idx != STATS_ALL) {
+				sum.major = array->devno >> 20;
+				sum.minor = array->devno & ((1 << 20) - 1);
+			}
+			sum.calls += __atomic_load_n(&array->calls, __ATOMIC_RELAXED);
+			sum.hits += __atomic_load_n(&array->hits, __ATOMIC_RELAXED);
+			sum.errors += __atomic_load_n(&array->errors, __ATOMIC_RELAXED);
+			sum.stripes += __atomic_load_n(&array->stripes, __ATOMIC_RELAXED);
+			sum.sysfs_bytes += __atomic_load_n(&array->sysfs_bytes, __ATOMIC_RELAXED);
+			for (i = 0; i < BB_LAT_BUCKETS; i ++)
+				sum.lat_hist[i] += __atomic_load_n(&array->lat_hist[i],
+								   __ATOMIC_RELAXED);
+		}
+
+		if (idx != STATS_ALL && 0 == sum.calls && 0 == sum.sysfs_bytes)
+			continue;
+
+		memcpy(&stats[nr++], &sum, sizeof(sum));
+	}
+
+	return nr;
+}
+
+/* upper bound of the bucket holding the given fraction of calls */
+static u64 lat_percentile(struct badblock_stats *stats, double frac)
+{
+	u64 seen = 0, total = 0;
+	s32 i;
+
+	for (i = 0; i < BB_LAT_BUCKETS; i ++)
+		total += stats->lat_hist[i];
+
+	for (i = 0; i < BB_LAT_BUCKETS; i ++) {
+		seen += stats->lat_hist[i];
+		if (seen && seen >= total * frac)
+			return 2ULL << i;
+	}
+
+	return 0;
+}
+
+void dump_badblock_stats(FILE *fp)
+{
+	struct badblock_stats stats[STATS_MAX_ARRAYS + 1];
+	s32 i, j, nr;
+	s8 name[32];
+
+	nr = get_badblock_stats(stats, STATS_MAX_ARRAYS + 1);
+
+	fprintf(fp, "%-10s %12s %10s %10s %12s %12s %10s %10s\n", "array", "calls",
+		"hits", "errors", "stripes", "sysfs_bytes", "p50_ns", "p99_ns");
+	for (i = 0; i < nr; i ++) {
+		if (0 == i)
+			strcpy(name, "all");
+		else
+			sprintf(name, "%d:%d", stats[i].major, stats[i].minor);
+
+		fprintf(fp, "%-10s %12llu %10llu %10llu %12llu %12llu %10llu %10llu\n",
+			name, stats[i].calls, stats[i].hits, stats[i].errors,
+			stats[i].stripes, stats[i].sysfs_bytes,
+			lat_percentile(&stats[i], 0.5), lat_percentile(&stats[i], 0.99));
+	}
+
+	if (nr == 0 || 0 == stats[0].calls)
+		return;
+
+	fprintf(fp, "latency of all calls:\n");
+	for (j = 0; j < BB_LAT_BUCKETS; j ++) {
+		if (stats[0].lat_hist[j])
+			fprintf(fp, "  < %12llu ns %12llu\n", 2ULL << j, stats[0].lat_hist[j]);
+	}
+}
+
+#else
+
+s32 enable_badblock_stats(s32 on)
+{
+	return -1;
+}
+
+s32 get_badblock_stats(struct badblock_stats *stats, s32 max)
+{
+	return 0;
+}
+
+void dump_badblock_stats(FILE *fp)
+{
+	fprintf(fp, "bad block stats are not compiled in\n");
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __BB_STATS_H__
+#define __BB_STATS_H__
+
+#include "vbfscommon.h"
+
+/* per-array counters live at the md slot index, this one sums every call */
+#define STATS_MAX_ARRAYS 256
+#define STATS_ALL STATS_MAX_ARRAYS
+
+#ifdef BB_STATS
+
+extern s32 stats_enabled;
+
+#define stats_on() __builtin_expect(stats_enabled, 0)
+
+s64 stats_now(void);
+void stats_record(s32 idx, u32 devno, s32 ret, s32 stripes, s64 lat_ns);
+void stats_add_bytes(s32 idx, u32 devno, u64 bytes);
+
+#else
+
+#define stats_on() 0
+
+static inline s64 stats_now(void)
+{
+	return 0;
+}
+
+static inline void stats_record(s32 idx, u32 devno, s32 ret, s32 stripes, s64 lat_ns)
+{
+}
+
+static inline void stats_add_bytes(s32 idx, u32 devno, u64 bytes)
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,337 @@
+#include "bad_blocks.h"
+#include "bb_trace.h"
+
+#ifdef BB_TRACE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/sysmacros.h>
+
+#define TRACE_RING_SIZE 16384
+#define TRACE_FLUSH_MS 100
+
+/*
+ * One ring per thread. The owning thread only moves head and the
+ * flusher only moves tail, so neither side takes a lock; a full ring
+ * drops the record rather than stall the query.
+ */
+struct trace_ring {
+	struct trace_ring *next;
+	u32 in_use;
+	u32 id;
+
+	u64 head;
+	u64 tail;
+	u64 dropped;
+
+	struct bb_trace_rec recs[TRACE_RING_SIZE];
+};
+
+s32 trace_enabled;
+
+static struct trace_ring *trace_rings;
+static u32 nr_rings;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static __thread struct trace_ring *local_ring;
+
+/* serializes start, stop and the flusher */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flush_thread;
+static s32 trace_fd = -1;
+static s32 trace_stop;
+static s64 trace_start_ns;
+static u64 trace_nr_recs;
+static u64 trace_dropped_base;
+
+static void put_ring(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_init(void)
+{
+	pthread_key_create(&trace_key, put_ring);
+}
+
+static struct trace_ring *get_ring(void)
+{
+	struct trace_ring *ring;
+	u32 unused = 0;
+
+	if (local_ring)
+		return local_ring;
+
+	pthread_once(&trace_once, trace_init);
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		if (__atomic_compare_exchange_n(&ring->in_use, &unused, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			goto out;
+		unused = 0;
+	}
+
+	ring = calloc(1, sizeof(struct trace_ring));
+	if (NULL == ring)
+		return NULL;
+	ring->in_use = 1;
+	ring->id = __atomic_fetch_add(&nr_rings, 1, __ATOMIC_RELAXED);
+
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+out:
+	pthread_setspecific(trace_key, ring);
+	local_ring = ring;
+
+	return ring;
+}
+
+s64 trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_query(dev_t dev, s64 offset, s32 len, s32 rw, s32 ret, s64 start_ns)
+{
+	struct trace_ring *ring = get_ring();
+	struct bb_trace_rec *rec;
+	s64 lat = trace_now() - start_ns;
+	u64 head, tail;
+
+	if (NULL == ring)
+		return;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail == TRACE_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->recs[head % TRACE_RING_SIZE];
+	rec->ts_ns = start_ns > trace_start_ns ? start_ns - trace_start_ns : 0;
+	rec->offset = offset;
+	rec->devno = ((u32)major(dev) << 20) | minor(dev);
+	rec->len = len;
+	rec->lat_ns = lat > 0xffffffffLL ? 0xffffffff : lat;
+	rec->rw = rw;
+	rec->ret = ret;
+	rec->thread = ring->id;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* a burst fills the ring faster than the flush period */
+	if (head + 1 - tail == TRACE_RING_SIZE / 2)
+		pthread_cond_signal(&trace_cond);
+}
+
+static s32 write_all(s32 fd, const void *data, u64 len)
+{
+	const u8 *p = data;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* called with trace_lock held */
+static s32 flush_rings(void)
+{
+	struct trace_ring *ring;
+	u64 head, tail, idx, n;
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		tail = ring->tail;
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		while (tail != head) {
+			idx = tail % TRACE_RING_SIZE;
+			n = head - tail;
+			if (n > TRACE_RING_SIZE - idx)
+				n = TRACE_RING_SIZE - idx;
+
+			if (write_all(trace_fd, &ring->recs[idx], n * sizeof(struct bb_trace_rec)))
+				return -1;
+			tail += n;
+			trace_nr_recs += n;
+		}
+
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+static u64 total_dropped(void)
+{
+	struct trace_ring *ring;
+	u64 dropped = 0;
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	return dropped;
+}
+
+static void *trace_flusher(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&trace_lock);
+	while (!trace_stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TRACE_FLUSH_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec ++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&trace_cond, &trace_lock, &ts);
+
+		if (flush_rings())
+			perror("bad block trace write");
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	return NULL;
+}
+
+/*
+ * start_badblock_trace:
+ * @pathname: trace file, truncated.
+ *
+ * Record every is_badblock() and submit_badblock() query from now on.
+ * Queries append to a per-thread ring and a background thread writes
+ * the rings out every TRACE_FLUSH_MS, or early when a ring is half
+ * full; a query never waits for the file.
+ */
+s32 start_badblock_trace(const s8 *pathname)
+{
+	struct bb_trace_header header;
+	struct trace_ring *ring;
+	s32 fd;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0) {
+		pthread_mutex_unlock(&trace_lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = BB_TRACE_MAGIC;
+	header.version = BB_TRACE_VERSION;
+	header.rec_size = sizeof(struct bb_trace_rec);
+	if (write_all(fd, &header, sizeof(header)))
+		goto err;
+
+	/* whatever an earlier trace left behind belongs to no file */
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+		__atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+
+	trace_fd = fd;
+	trace_stop = 0;
+	trace_nr_recs = 0;
+	trace_dropped_base = total_dropped();
+	trace_start_ns = trace_now();
+
+	if (pthread_create(&flush_thread, NULL, trace_flusher, NULL)) {
+		trace_fd = -1;
+		goto err;
+	}
+
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+
+	return 0;
+
+err:
+	close(fd);
+	pthread_mutex_unlock(&trace_lock);
+	return -1;
+}
+
+/*
+ * stop_badblock_trace:
+ *
+ * Stop recording, write out what the rings hold and finish the header
+ * with the record and drop counts.
+ */
+s32 stop_badblock_trace(void)
+{
+	struct bb_trace_header header;
+	s32 ret;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd < 0) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+	trace_stop = 1;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+
+	pthread_join(flush_thread, NULL);
+
+	pthread_mutex_lock(&trace_lock);
+	ret = flush_rings();
+
+	memset(&header, 0, sizeof(header));
+	header.magic = BB_TRACE_MAGIC;
+	header.version = BB_TRACE_VERSION;
+	header.rec_size = sizeof(struct bb_trace_rec);
+	header.nr_recs = trace_nr_recs;
+	header.dropped = total_dropped() - trace_dropped_base;
+	if (pwrite(trace_fd, &header, sizeof(header), 0) != sizeof(header))
+		ret = -1;
+	if (close(trace_fd))
+		ret = -1;
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+#else
+
+s32 start_badblock_trace(const s8 *pathname)
+{
+	return -1;
+}
+
+s32 stop_badblock_trace(void)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __BB_TRACE_H__
+#define __BB_TRACE_H__
+
+#include "vbfscommon.h"
+
+#include <sys/types.h>
+
+/*
+ * Trace file: one header, then fixed size records in flush order.
+ * Records of one thread are in time order, records of different
+ * threads interleave by flush; sort by ts_ns to get the global order.
+ */
+#define BB_TRACE_MAGIC 0x52544242	/* "BBTR" */
+#define BB_TRACE_VERSION 1
+
+struct bb_trace_header {
+	u32 magic;
+	u32 version;
+	u32 rec_size;
+	u32 reserved;
+	u64 nr_recs;
+	u64 dropped;
+};
+
+/* devno is major << 20 | minor, ts_ns counts from the trace start */
+struct bb_trace_rec {
+	u64 ts_ns;
+	s64 offset;
+	u32 devno;
+	s32 len;
+	u32 lat_ns;
+	u8 rw;
+	s8 ret;
+	u16 thread;
+};
+
+#ifdef BB_TRACE
+
+extern s32 trace_enabled;
+
+#define trace_on() __builtin_expect(trace_enabled, 0)
+
+s64 trace_now(void);
+void trace_query(dev_t dev, s64 offset, s32 len, s32 rw, s32 ret, s64 start_ns);
+
+#else
+
+#define trace_on() 0
+
+static inline s64 trace_now(void)
+{
+	return 0;
+}
+
+static inline void trace_query(dev_t dev, s64 offset, s32 len, s32 rw, s32 ret, s64 start_ns)
+{
+}
+
+#endif
+
+#endif
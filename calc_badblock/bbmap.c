@@ -0,0 +1,604 @@
+#include "bbmap.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct wsection {
+	struct bbmap_section sec;
+	struct bbmap_index *index;
+	u8 *data;
+};
+
+struct bbmap_writer {
+	s32 nr;
+	s32 max;
+	struct wsection *sections;
+};
+
+struct bbmap {
+	u8 *base;
+	u64 size;
+	struct bbmap_header *header;
+	struct bbmap_section *sections;
+};
+
+static u32 crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	u32 i, j, c;
+
+	for (i = 0; i < 256; i ++) {
+		c = i;
+		for (j = 0; j < 8; j ++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static u32 crc32_update(u32 crc, const void *data, u64 len)
+{
+	const u8 *p = data;
+	u64 i;
+
+	pthread_once(&crc_once, crc_init);
+
+	for (i = 0; i < len; i ++)
+		crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/* FNV-1a, used for the generation keys stored with each section */
+u64 bbmap_hash(u64 hash, const void *data, u64 len)
+{
+	const u8 *p = data;
+	u64 i;
+
+	for (i = 0; i < len; i ++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * bbmap_member_generation:
+ * @uuid: the array's 16 byte uuid.
+ * @data_offset: the member's data offset, in sectors.
+ *
+ * The generation of a member section: a map made on another array, or
+ * before a reshape moved the data, is no use.
+ */
+u64 bbmap_member_generation(const u8 *uuid, s64 data_offset)
+{
+	u64 gen = BBMAP_HASH_INIT;
+
+	gen = bbmap_hash(gen, uuid, 16);
+	gen = bbmap_hash(gen, &data_offset, sizeof(data_offset));
+
+	return gen;
+}
+
+static s32 cmp_range(const void *a, const void *b)
+{
+	const struct bbmap_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * bbmap_normalize:
+ * @ranges: sorted and merged in place.
+ *
+ * Sort ranges and merge overlapping or adjacent ones, dropping empty
+ * ones. Return the new number of ranges.
+ */
+s32 bbmap_normalize(struct bbmap_range *ranges, s32 nr)
+{
+	s32 i, n = 0;
+	u64 end;
+
+	qsort(ranges, nr, sizeof(struct bbmap_range), cmp_range);
+
+	for (i = 0; i < nr; i ++) {
+		if (ranges[i].len == 0)
+			continue;
+
+		if (n > 0) {
+			end = ranges[n - 1].start + ranges[n - 1].len;
+			if (ranges[i].start <= end) {
+				if (ranges[i].start + ranges[i].len > end)
+					ranges[n - 1].len = ranges[i].start + ranges[i].len -
+						ranges[n - 1].start;
+				continue;
+			}
+		}
+		ranges[n ++] = ranges[i];
+	}
+
+	return n;
+}
+
+static u8 *put_varint(u8 *p, u64 val)
+{
+	while (val >= 0x80) {
+		*p ++ = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	*p ++ = val;
+
+	return p;
+}
+
+static const u8 *get_varint(const u8 *p, const u8 *end, u64 *val)
+{
+	u64 v = 0;
+	s32 shift = 0;
+
+	while (p < end && shift < 64) {
+		v |= (u64)(*p & 0x7f) << shift;
+		if (!(*p ++ & 0x80)) {
+			*val = v;
+			return p;
+		}
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+static s32 cmp_section(const void *a, const void *b)
+{
+	const struct bbmap_section *sa = a, *sb = b;
+
+	if (sa->type != sb->type)
+		return sa->type < sb->type ? -1 : 1;
+	return strncmp(sa->name, sb->name, BBMAP_NAME_LEN);
+}
+
+struct bbmap_writer *bbmap_writer_new(void)
+{
+	return calloc(1, sizeof(struct bbmap_writer));
+}
+
+void bbmap_writer_free(struct bbmap_writer *writer)
+{
+	s32 i;
+
+	if (NULL == writer)
+		return;
+
+	for (i = 0; i < writer->nr; i ++) {
+		free(writer->sections[i].index);
+		free(writer->sections[i].data);
+	}
+	free(writer->sections);
+	free(writer);
+}
+
+/*
+ * bbmap_add_section:
+ * @generation: key the reader compares against the live source to
+ *		decide whether the section is still valid.
+ *
+ * Add a named list of bad ranges to the map. The ranges are copied,
+ * sorted and coalesced. Return 0 or -1.
+ */
+s32 bbmap_add_section(struct bbmap_writer *writer, u32 type, const s8 *name,
+		      u64 generation, const struct bbmap_range *ranges, s32 nr)
+{
+	struct wsection *ws;
+	struct bbmap_range *sorted;
+	u64 prev_end = 0;
+	u8 *p;
+	s32 i, blk;
+
+	if (strlen(name) >= BBMAP_NAME_LEN) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (writer->nr == writer->max) {
+		s32 max = writer->max ? writer->max * 2 : 16;
+
+		ws = realloc(writer->sections, max * sizeof(struct wsection));
+		if (NULL == ws)
+			return -1;
+		writer->sections = ws;
+		writer->max = max;
+	}
+
+	sorted = malloc((nr ? nr : 1) * sizeof(struct bbmap_range));
+	if (NULL == sorted)
+		return -1;
+	memcpy(sorted, ranges, nr * sizeof(struct bbmap_range));
+	nr = bbmap_normalize(sorted, nr);
+
+	ws = &writer->sections[writer->nr];
+	memset(ws, 0, sizeof(struct wsection));
+	ws->sec.type = type;
+	ws->sec.nr_ranges = nr;
+	ws->sec.nr_blocks = (nr + BBMAP_BLOCK - 1) / BBMAP_BLOCK;
+	ws->sec.generation = generation;
+	strcpy(ws->sec.name, name);
+
+	/* two varints of at most 10 bytes per range */
+	ws->index = calloc(ws->sec.nr_blocks + 1, sizeof(struct bbmap_index));
+	ws->data = malloc(nr * 20 + 1);
+	if (NULL == ws->index || NULL == ws->data) {
+		free(ws->index);
+		free(ws->data);
+		free(sorted);
+		return -1;
+	}
+
+	p = ws->data;
+	for (i = 0; i < nr; i ++) {
+		blk = i / BBMAP_BLOCK;
+		if (i % BBMAP_BLOCK == 0) {
+			ws->index[blk].first_start = sorted[i].start;
+			ws->index[blk].data_off = p - ws->data;
+			prev_end = sorted[i].start;
+		}
+		p = put_varint(p, sorted[i].start - prev_end);
+		p = put_varint(p, sorted[i].len);
+		prev_end = sorted[i].start + sorted[i].len;
+		ws->index[blk].last_end = prev_end;
+	}
+	ws->sec.data_len = p - ws->data;
+
+	free(sorted);
+	writer->nr ++;
+	return 0;
+}
+
+
+/*
+ * bbmap_merge:
+ * @map: the map being rewritten.
+ *
+ * Carry over the sections of map that writer lacks, when a map is
+ * rewritten after refreshing only some of them. The copied ones keep
+ * their generation and are revalidated on use.
+ */
+s32 bbmap_merge(struct bbmap_writer *writer, struct bbmap *map)
+{
+	struct bbmap_section *sec;
+	struct bbmap_range *ranges;
+	s32 i, j, nr, nr_new = writer->nr;
+
+	for (i = 0; i < map->header->nr_sections; i ++) {
+		sec = &map->sections[i];
+
+		for (j = 0; j < nr_new; j ++) {
+			if (!cmp_section(sec, &writer->sections[j].sec))
+				break;
+		}
+		if (j < nr_new)
+			continue;
+
+		ranges = malloc((sec->nr_ranges + 1) * sizeof(struct bbmap_range));
+		if (NULL == ranges)
+			return -1;
+
+		nr = bbmap_decode(map, sec, ranges, sec->nr_ranges);
+		if (nr < 0 || bbmap_add_section(writer, sec->type, sec->name,
+						sec->generation, ranges, nr)) {
+			free(ranges);
+			return -1;
+		}
+		free(ranges);
+	}
+
+	return 0;
+}
+
+#define ALIGN8(x) (((x) + 7) & ~7ULL)
+
+/*
+ * bbmap_write:
+ * @pathname: replaced atomically.
+ *
+ * Lay out the map and write it to a temporary name renamed over
+ * pathname, so readers that mapped the old file keep a consistent view.
+ */
+s32 bbmap_write(struct bbmap_writer *writer, const s8 *pathname)
+{
+	struct bbmap_header *header;
+	struct bbmap_section *secs;
+	s8 tmp[PATH_MAX];
+	u64 size, off;
+	u8 *buf;
+	s32 i, fd, ret = -1;
+
+	qsort(writer->sections, writer->nr, sizeof(struct wsection), cmp_section);
+
+	size = sizeof(struct bbmap_header) + writer->nr * sizeof(struct bbmap_section);
+	for (i = 0; i < writer->nr; i ++) {
+		size = ALIGN8(size);
+		size += writer->sections[i].sec.nr_blocks * sizeof(struct bbmap_index);
+		size += writer->sections[i].sec.data_len;
+	}
+	size = ALIGN8(size);
+
+	buf = calloc(1, size);
+	if (NULL == buf)
+		return -1;
+
+	header = (struct bbmap_header *)buf;
+	header->magic = BBMAP_MAGIC;
+	header->version = BBMAP_VERSION;
+	header->nr_sections = writer->nr;
+	header->file_size = size;
+
+	secs = (struct bbmap_section *)(header + 1);
+	off = sizeof(struct bbmap_header) + writer->nr * sizeof(struct bbmap_section);
+	for (i = 0; i < writer->nr; i ++) {
+		struct wsection *ws = &writer->sections[i];
+
+		secs[i] = ws->sec;
+		off = ALIGN8(off);
+		secs[i].index_off = off;
+		memcpy(buf + off, ws->index, ws->sec.nr_blocks * sizeof(struct bbmap_index));
+		off += ws->sec.nr_blocks * sizeof(struct bbmap_index);
+		secs[i].data_off = off;
+		memcpy(buf + off, ws->data, ws->sec.data_len);
+		off += ws->sec.data_len;
+	}
+
+	header->crc = crc32_update(0xffffffff, buf, size) ^ 0xffffffff;
+
+	if (snprintf(tmp, PATH_MAX, "%s.%d", pathname, getpid()) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		goto out;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+
+	for (off = 0; off < size; ) {
+		ssize_t n = write(fd, buf + off, size - off);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += n;
+	}
+
+	if (off < size || fsync(fd) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+
+	if (rename(tmp, pathname) < 0) {
+		unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+static s32 check_map(struct bbmap *map)
+{
+	struct bbmap_header *header = map->header;
+	struct bbmap_header tmp;
+	struct bbmap_section *sec;
+	u32 crc;
+	u64 table_end;
+	s32 i;
+
+	if (map->size < sizeof(struct bbmap_header) ||
+	    header->magic != BBMAP_MAGIC ||
+	    header->version != BBMAP_VERSION ||
+	    header->file_size != map->size)
+		return -1;
+
+	table_end = sizeof(struct bbmap_header) +
+		(u64)header->nr_sections * sizeof(struct bbmap_section);
+	if (table_end > map->size)
+		return -1;
+
+	/* crc covers the whole file with the crc field zeroed */
+	tmp = *header;
+	tmp.crc = 0;
+	crc = crc32_update(0xffffffff, &tmp, sizeof(tmp));
+	crc = crc32_update(crc, map->base + sizeof(tmp), map->size - sizeof(tmp));
+	if ((crc ^ 0xffffffff) != header->crc)
+		return -1;
+
+	for (i = 0; i < header->nr_sections; i ++) {
+		sec = &map->sections[i];
+		if (sec->nr_blocks != (sec->nr_ranges + BBMAP_BLOCK - 1) / BBMAP_BLOCK ||
+		    sec->index_off < table_end ||
+		    sec->index_off + (u64)sec->nr_blocks * sizeof(struct bbmap_index) > map->size ||
+		    sec->data_off + sec->data_len > map->size ||
+		    sec->data_off < table_end ||
+		    sec->name[BBMAP_NAME_LEN - 1] != '\0')
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * bbmap_open:
+ *
+ * Map a bad range map read-only and validate it. Return NULL if the
+ * file is missing, truncated, of another version or fails the checksum.
+ */
+struct bbmap *bbmap_open(const s8 *pathname)
+{
+	struct bbmap *map;
+	struct stat st;
+	s32 fd;
+
+	fd = open(pathname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct bbmap_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = calloc(1, sizeof(struct bbmap));
+	if (NULL == map) {
+		close(fd);
+		return NULL;
+	}
+
+	map->size = st.st_size;
+	map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map->base == MAP_FAILED) {
+		free(map);
+		return NULL;
+	}
+
+	map->header = (struct bbmap_header *)map->base;
+	map->sections = (struct bbmap_section *)(map->header + 1);
+
+	if (check_map(map) < 0) {
+		bbmap_close(map);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return map;
+}
+
+void bbmap_close(struct bbmap *map)
+{
+	if (NULL == map)
+		return;
+
+	munmap(map->base, map->size);
+	free(map);
+}
+
+const struct bbmap_section *bbmap_find(struct bbmap *map, u32 type, const s8 *name)
+{
+	struct bbmap_section key;
+	s32 lo = 0, hi = map->header->nr_sections - 1, mid, c;
+
+	memset(&key, 0, sizeof(key));
+	key.type = type;
+	strncpy(key.name, name, BBMAP_NAME_LEN - 1);
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = cmp_section(&key, &map->sections[mid]);
+		if (c == 0)
+			return &map->sections[mid];
+		if (c < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * bbmap_lookup:
+ * @sec: a section of map, from bbmap_find().
+ *
+ * Check whether [start, start + len) touches a bad range. Block ends
+ * are increasing, so the first block ending after start is found by
+ * binary search and only that block has to be decoded. Return 1 on
+ * hit, 0 on miss and -1 on corrupt data.
+ */
+s32 bbmap_lookup(struct bbmap *map, const struct bbmap_section *sec, u64 start, u64 len)
+{
+	const struct bbmap_index *index;
+	const u8 *p, *end;
+	u64 gap, rlen, rstart, qend = start + len;
+	s32 lo = 0, hi = sec->nr_blocks, mid, i, n;
+
+	index = (const struct bbmap_index *)(map->base + sec->index_off);
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (index[mid].last_end > start)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (lo == sec->nr_blocks || index[lo].first_start >= qend)
+		return 0;
+
+	p = map->base + sec->data_off + index[lo].data_off;
+	end = map->base + sec->data_off + sec->data_len;
+	n = sec->nr_ranges - lo * BBMAP_BLOCK;
+	if (n > BBMAP_BLOCK)
+		n = BBMAP_BLOCK;
+
+	rstart = index[lo].first_start;
+	for (i = 0; i < n; i ++) {
+		p = get_varint(p, end, &gap);
+		if (NULL == p || NULL == (p = get_varint(p, end, &rlen)))
+			return -1;
+		rstart += gap;
+		if (rstart >= qend)
+			return 0;
+		if (rstart + rlen > start)
+			return 1;
+		rstart += rlen;
+	}
+
+	return 0;
+}
+
+/*
+ * bbmap_decode:
+ * @ranges: room for max ranges.
+ *
+ * Expand a section into at most max ranges. Return the number of
+ * ranges in the section, which may exceed max, or -1 on corrupt data.
+ */
+s32 bbmap_decode(struct bbmap *map, const struct bbmap_section *sec,
+		 struct bbmap_range *ranges, s32 max)
+{
+	const struct bbmap_index *index;
+	const u8 *p = NULL, *end;
+	u64 gap, rlen, rstart = 0;
+	s32 i;
+
+	index = (const struct bbmap_index *)(map->base + sec->index_off);
+	end = map->base + sec->data_off + sec->data_len;
+
+	for (i = 0; i < sec->nr_ranges && i < max; i ++) {
+		if (i % BBMAP_BLOCK == 0) {
+			p = map->base + sec->data_off + index[i / BBMAP_BLOCK].data_off;
+			rstart = index[i / BBMAP_BLOCK].first_start;
+		}
+		p = get_varint(p, end, &gap);
+		if (NULL == p || NULL == (p = get_varint(p, end, &rlen)))
+			return -1;
+		rstart += gap;
+		ranges[i].start = rstart;
+		ranges[i].len = rlen;
+		rstart += rlen;
+	}
+
+	return sec->nr_ranges;
+}
@@ -0,0 +1,90 @@
+#ifndef __BBMAP_H__
+#define __BBMAP_H__
+
+#include "vbfscommon.h"
+
+/*
+ * Binary bad range map, all fields little endian:
+ *
+ *	header | section table | per section: block index, range data
+ *
+ * Sections are sorted by (type, name). The ranges of a section are
+ * sorted and coalesced, then stored in blocks of BBMAP_BLOCK ranges as
+ * LEB128 pairs (gap from the previous end, length). The block index
+ * keeps the first start and the end of the last range of every
+ * block, so a lookup is a binary search plus one block decode. crc is
+ * the CRC-32 of the whole file with the crc field zeroed.
+ */
+#define BBMAP_MAGIC 0x504d4242	/* "BBMP" */
+#define BBMAP_VERSION 1
+#define BBMAP_BLOCK 64
+#define BBMAP_NAME_LEN 64
+#define BBMAP_HASH_INIT 0xcbf29ce484222325ULL
+
+/*
+ * Member sections are named "<serial>:<role>" and hold sectors of the
+ * whole member, data_offset included, as md's bad_blocks does.
+ * fix_sector -m writes them, get_bad_block -m and set_badblock_map()
+ * read them.
+ */
+enum {
+	BBMAP_LV = 1,
+	BBMAP_ARRAY,
+	BBMAP_MEMBER,		/* unreadable */
+	BBMAP_MEMBER_SLOW,	/* read, but slowly */
+};
+
+struct bbmap_range {
+	u64 start;
+	u64 len;
+};
+
+struct bbmap_header {
+	u32 magic;
+	u32 version;
+	u32 nr_sections;
+	u32 crc;
+	u64 file_size;
+};
+
+struct bbmap_section {
+	u32 type;
+	u32 nr_ranges;
+	u32 nr_blocks;
+	u32 reserved;
+	u64 generation;
+	u64 index_off;
+	u64 data_off;
+	u64 data_len;
+	s8 name[BBMAP_NAME_LEN];
+};
+
+struct bbmap_index {
+	u64 first_start;
+	u64 last_end;
+	u64 data_off;
+};
+
+struct bbmap_writer;
+struct bbmap;
+
+s32 bbmap_normalize(struct bbmap_range *ranges, s32 nr);
+
+struct bbmap_writer *bbmap_writer_new(void);
+s32 bbmap_add_section(struct bbmap_writer *writer, u32 type, const s8 *name,
+		      u64 generation, const struct bbmap_range *ranges, s32 nr);
+s32 bbmap_merge(struct bbmap_writer *writer, struct bbmap *map);
+s32 bbmap_write(struct bbmap_writer *writer, const s8 *pathname);
+void bbmap_writer_free(struct bbmap_writer *writer);
+
+struct bbmap *bbmap_open(const s8 *pathname);
+void bbmap_close(struct bbmap *map);
+const struct bbmap_section *bbmap_find(struct bbmap *map, u32 type, const s8 *name);
+s32 bbmap_lookup(struct bbmap *map, const struct bbmap_section *sec, u64 start, u64 len);
+s32 bbmap_decode(struct bbmap *map, const struct bbmap_section *sec,
+		 struct bbmap_range *ranges, s32 max);
+
+u64 bbmap_hash(u64 hash, const void *data, u64 len);
+u64 bbmap_member_generation(const u8 *uuid, s64 data_offset);
+
+#endif
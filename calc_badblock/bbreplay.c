@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include "bad_blocks.h"
+#include "bb_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define MAX_DEVS 256
+#define MAX_DIFFS 10
+
+struct replay_dev {
+	u32 devno;
+	s32 fd;
+};
+
+struct replay {
+	struct bb_trace_rec *recs;
+	s64 nr_recs;
+
+	struct replay_dev devs[MAX_DEVS];
+	s32 nr_devs;
+	s8 dir[64];
+
+	s32 fast;
+	s64 start_ns;
+
+	/* per record, filled by the replay threads */
+	s32 *ret;
+	s64 *lat;
+};
+
+struct replay_thread {
+	struct replay *replay;
+	pthread_t tid;
+	u32 thread;
+};
+
+static s64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static s32 cmp_rec(const void *a, const void *b)
+{
+	const struct bb_trace_rec *ra = a, *rb = b;
+
+	if (ra->ts_ns != rb->ts_ns)
+		return ra->ts_ns < rb->ts_ns ? -1 : 1;
+	return (s32)ra->thread - (s32)rb->thread;
+}
+
+static s32 cmp_s64(const void *a, const void *b)
+{
+	s64 x = *(const s64 *)a, y = *(const s64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static s32 load_trace(struct replay *replay, const s8 *pathname)
+{
+	struct bb_trace_header header;
+	struct stat st;
+	s64 nr;
+	FILE *fp;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+
+	if (fstat(fileno(fp), &st) || fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.magic != BB_TRACE_MAGIC || header.version != BB_TRACE_VERSION ||
+	    header.rec_size != sizeof(struct bb_trace_rec)) {
+		fprintf(stderr, "%s: not a bad block trace\n", pathname);
+		fclose(fp);
+		return -1;
+	}
+
+	/* a trace whose writer died has no count, take what is there */
+	nr = (st.st_size - sizeof(header)) / sizeof(struct bb_trace_rec);
+	if (header.nr_recs && header.nr_recs < nr)
+		nr = header.nr_recs;
+	if (header.dropped)
+		fprintf(stderr, "trace dropped %llu queries\n", header.dropped);
+
+	replay->recs = malloc(sizeof(struct bb_trace_rec) * (nr + 1));
+	replay->ret = malloc(sizeof(s32) * (nr + 1));
+	replay->lat = malloc(sizeof(s64) * (nr + 1));
+	if (NULL == replay->recs || NULL == replay->ret || NULL == replay->lat ||
+	    fread(replay->recs, sizeof(struct bb_trace_rec), nr, fp) != nr) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	replay->nr_recs = nr;
+	qsort(replay->recs, nr, sizeof(struct bb_trace_rec), cmp_rec);
+
+	return 0;
+}
+
+/*
+ * The library only fstat()s the fd and opens the md device by name
+ * itself, so an O_PATH fd on a private node is enough for any devno,
+ * whether or not /dev has a node for it.
+ */
+static s32 open_devs(struct replay *replay)
+{
+	s8 pathname[128];
+	u32 devno;
+	s64 i;
+	s32 j;
+
+	strcpy(replay->dir, "/tmp/bbreplay.XXXXXX");
+	if (NULL == mkdtemp(replay->dir))
+		return -1;
+
+	for (i = 0; i < replay->nr_recs; i ++) {
+		devno = replay->recs[i].devno;
+		for (j = 0; j < replay->nr_devs; j ++) {
+			if (replay->devs[j].devno == devno)
+				break;
+		}
+		if (j < replay->nr_devs)
+			continue;
+
+		if (replay->nr_devs == MAX_DEVS) {
+			fprintf(stderr, "more than %d devices in trace\n", MAX_DEVS);
+			return -1;
+		}
+
+		sprintf(pathname, "%s/%u", replay->dir, devno);
+		if (mknod(pathname, S_IFBLK | 0600, makedev(devno >> 20, devno & ((1 << 20) - 1)))) {
+			perror("mknod");
+			return -1;
+		}
+		replay->devs[j].devno = devno;
+		replay->devs[j].fd = open(pathname, O_PATH);
+		if (replay->devs[j].fd < 0) {
+			perror("open");
+			return -1;
+		}
+		replay->nr_devs ++;
+	}
+
+	return 0;
+}
+
+static void close_devs(struct replay *replay)
+{
+	s8 pathname[128];
+	s32 i;
+
+	for (i = 0; i < replay->nr_devs; i ++) {
+		close(replay->devs[i].fd);
+		sprintf(pathname, "%s/%u", replay->dir, replay->devs[i].devno);
+		unlink(pathname);
+	}
+
+	if (replay->dir[0])
+		rmdir(replay->dir);
+}
+
+static s32 dev_fd(struct replay *replay, u32 devno)
+{
+	s32 i;
+
+	for (i = 0; i < replay->nr_devs; i ++) {
+		if (replay->devs[i].devno == devno)
+			return replay->devs[i].fd;
+	}
+
+	return -1;
+}
+
+/* replays the queries one recorded thread issued, in its order */
+static void *replay_fn(void *arg)
+{
+	struct replay_thread *rt = arg;
+	struct replay *replay = rt->replay;
+	struct bb_trace_rec *rec;
+	struct timespec ts;
+	s64 i, due, t;
+
+	for (i = 0; i < replay->nr_recs; i ++) {
+		rec = &replay->recs[i];
+		if (rec->thread != rt->thread)
+			continue;
+
+		if (!replay->fast) {
+			due = replay->start_ns + rec->ts_ns;
+			t = now_ns();
+			if (due > t) {
+				ts.tv_sec = (due - t) / 1000000000LL;
+				ts.tv_nsec = (due - t) % 1000000000LL;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		t = now_ns();
+		replay->ret[i] = is_badblock(dev_fd(replay, rec->devno), rec->offset,
+					     rec->len, rec->rw);
+		replay->lat[i] = now_ns() - t;
+	}
+
+	return NULL;
+}
+
+static void print_dist(const s8 *name, s64 *lat, s64 nr)
+{
+	qsort(lat, nr, sizeof(s64), cmp_s64);
+
+	printf("%-9s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n", name,
+	       lat[nr * 50 / 100] / 1e3, lat[nr * 90 / 100] / 1e3,
+	       lat[nr * 99 / 100] / 1e3, lat[nr * 999 / 1000] / 1e3,
+	       lat[nr - 1] / 1e3);
+}
+
+static void report(struct replay *replay, s64 elapsed)
+{
+	struct bb_trace_rec *rec;
+	s64 i, nr = replay->nr_recs, diffs = 0;
+	s64 *recorded;
+
+	printf("%lld queries in %.3f s, %.0f queries/s\n", nr, elapsed / 1e9,
+	       nr / (elapsed / 1e9));
+
+	recorded = malloc(sizeof(s64) * nr);
+	if (recorded) {
+		for (i = 0; i < nr; i ++)
+			recorded[i] = replay->recs[i].lat_ns;
+		print_dist("recorded", recorded, nr);
+		free(recorded);
+	}
+
+	for (i = 0; i < nr; i ++) {
+		rec = &replay->recs[i];
+		if (replay->ret[i] == rec->ret)
+			continue;
+
+		if (diffs ++ < MAX_DIFFS)
+			printf("diff: %u:%u offset %lld len %d %s: recorded %d, replay %d\n",
+			       rec->devno >> 20, rec->devno & ((1 << 20) - 1), rec->offset,
+			       rec->len, rec->rw ? "WRITE" : "READ", rec->ret, replay->ret[i]);
+	}
+
+	print_dist("replay", replay->lat, nr);
+	printf("%lld result differences\n", diffs);
+}
+
+static void usage(const char *prog)
+{
+	printf("%s [-f] trace: replay a bad block query trace\n", prog);
+	printf("\t-f: as fast as possible instead of the recorded timing\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay replay;
+	struct replay_thread *threads;
+	u32 nr_threads = 0;
+	s64 i, elapsed;
+	s32 option, ret = 1;
+
+	memset(&replay, 0, sizeof(replay));
+
+	while ((option = getopt(argc, argv, "f")) != EOF) {
+		switch (option) {
+		case 'f':
+			replay.fast = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (load_trace(&replay, argv[optind])) {
+		fprintf(stderr, "load trace error\n");
+		exit(1);
+	}
+
+	if (0 == replay.nr_recs) {
+		printf("empty trace\n");
+		return 0;
+	}
+
+	for (i = 0; i < replay.nr_recs; i ++) {
+		if (replay.recs[i].thread >= nr_threads)
+			nr_threads = replay.recs[i].thread + 1;
+	}
+
+	threads = calloc(nr_threads, sizeof(struct replay_thread));
+	if (NULL == threads || open_devs(&replay))
+		goto out;
+
+	replay.start_ns = now_ns();
+	for (i = 0; i < nr_threads; i ++) {
+		threads[i].replay = &replay;
+		threads[i].thread = i;
+		if (pthread_create(&threads[i].tid, NULL, replay_fn, &threads[i])) {
+			perror("pthread_create");
+			nr_threads = i;
+			break;
+		}
+	}
+	for (i = 0; i < nr_threads; i ++)
+		pthread_join(threads[i].tid, NULL);
+	elapsed = now_ns() - replay.start_ns;
+
+	report(&replay, elapsed);
+	ret = 0;
+out:
+	close_devs(&replay);
+	free(threads);
+	free(replay.recs);
+	free(replay.ret);
+	free(replay.lat);
+
+	return ret;
+}
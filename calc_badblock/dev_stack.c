@@ -0,0 +1,385 @@
+#include "badblk_intern.h"
+#include "dev_stack.h"
+#include "sysfs_attr.h"
+
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/* the length of an array, or a partition whose size can't be read */
+#define STACK_END ((u64)1 << 62)
+
+void free_dev_stack(void *arg)
+{
+	struct dev_stack *stack = arg;
+
+	if (NULL == stack)
+		return;
+	free(stack->ext);
+	free(stack->legs);
+	free(stack);
+}
+
+/* the arrays grow to the next power of two once nr reaches one */
+static s32 grow(void **array, s32 nr, size_t size)
+{
+	void *more;
+
+	if (nr && (nr < 8 || (nr & (nr - 1))))
+		return 0;
+
+	more = realloc(*array, size * MAX(8, nr * 2));
+	if (NULL == more)
+		return -1;
+	*array = more;
+
+	return 0;
+}
+
+/*
+ * Append an extent and its legs, or stretch the last one when both are
+ * linear and the new one carries on where it ends on the same array.
+ */
+static s32 add_extent(struct dev_stack *stack, u64 start, u64 len, u64 phase, u64 chunk,
+		      s32 nr_legs, const struct stack_leg *legs)
+{
+	struct stack_extent *ext, *prev = stack->nr ? &stack->ext[stack->nr - 1] : NULL;
+	struct stack_leg *last;
+	s32 i;
+
+	if (prev && 1 == prev->nr_legs && 1 == nr_legs && prev->start + prev->len == start) {
+		last = &stack->legs[prev->leg];
+		if (last->major == legs[0].major && last->minor == legs[0].minor &&
+		    last->offset + prev->phase + prev->len == legs[0].offset + phase) {
+			prev->len += len;
+			return 0;
+		}
+	}
+
+	if (stack->nr >= STACK_MAX_EXTENTS ||
+	    grow((void **)&stack->ext, stack->nr, sizeof(struct stack_extent)))
+		return -1;
+	for (i = 0; i < nr_legs; i ++) {
+		if (grow((void **)&stack->legs, stack->nr_legs + i, sizeof(struct stack_leg)))
+			return -1;
+		stack->legs[stack->nr_legs + i] = legs[i];
+	}
+
+	ext = &stack->ext[stack->nr ++];
+	ext->start = start;
+	ext->len = len;
+	ext->phase = phase;
+	ext->chunk = chunk;
+	ext->nr_legs = nr_legs;
+	ext->leg = stack->nr_legs;
+	stack->nr_legs += nr_legs;
+
+	return 0;
+}
+
+/*
+ * dev_stack_find:
+ *
+ * The first extent that ends after sector, or stack->nr if none does.
+ */
+s32 dev_stack_find(const struct dev_stack *stack, u64 sector)
+{
+	s32 lo = 0, hi = stack->nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (stack->ext[mid].start + stack->ext[mid].len <= sector)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* map [start, start + len) of a device onto [pos, pos + len) of the one under it */
+static s32 map_range(struct dev_stack *stack, u64 start, u64 len,
+		     const struct dev_stack *lower, u64 pos)
+{
+	const struct stack_extent *ext;
+	u64 end = pos + len, from;
+	s32 i;
+
+	for (i = dev_stack_find(lower, pos); i < lower->nr && lower->ext[i].start < end; i ++) {
+		ext = &lower->ext[i];
+		from = MAX(pos, ext->start);
+		if (add_extent(stack, start + from - pos, MIN(end, ext->start + ext->len) - from,
+			       ext->phase + from - ext->start, ext->chunk, ext->nr_legs,
+			       &lower->legs[ext->leg]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static struct dev_stack *resolve(struct stack_resolver *r, s32 major, s32 minor);
+
+/* the stack of a device under the one being built, kept ones first */
+static struct dev_stack *get_lower(struct stack_resolver *r, s32 major, s32 minor)
+{
+	struct dev_stack *stack, **more;
+	s32 i;
+
+	for (i = 0; i < r->nr_kept; i ++) {
+		if (r->kept[i]->major == major && r->kept[i]->minor == minor)
+			return r->kept[i];
+	}
+
+	stack = resolve(r, major, minor);
+	if (NULL == stack || !r->keep)
+		return stack;
+
+	more = realloc(r->kept, sizeof(struct dev_stack *) * (r->nr_kept + 1));
+	if (NULL == more) {
+		free_dev_stack(stack);
+		return NULL;
+	}
+	r->kept = more;
+	r->kept[r->nr_kept ++] = stack;
+
+	return stack;
+}
+
+static void put_lower(struct stack_resolver *r, struct dev_stack *stack)
+{
+	if (!r->keep)
+		free_dev_stack(stack);
+}
+
+/*
+ * A striped target whose every leg lands on one run of one array stays
+ * one extent; otherwise each chunk is mapped on its own.
+ */
+static s32 map_segment(struct dev_stack *stack, const struct dm_segment *seg,
+		       struct dev_stack **lower)
+{
+	struct stack_leg legs[DM_MAX_LEGS];
+	const struct stack_extent *ext;
+	u64 leg_len = dm_leg_len(seg), off, nr, row;
+	s32 i, idx;
+
+	if (1 == seg->nr_legs)
+		return map_range(stack, seg->start, seg->len, lower[0], seg->legs[0].offset);
+
+	for (i = 0; i < seg->nr_legs; i ++) {
+		off = seg->legs[i].offset;
+		idx = dev_stack_find(lower[i], off);
+		if (idx == lower[i]->nr)
+			break;
+		ext = &lower[i]->ext[idx];
+		if (ext->nr_legs != 1 || ext->start > off || off + leg_len > ext->start + ext->len)
+			break;
+
+		legs[i] = lower[i]->legs[ext->leg];
+		legs[i].offset += ext->phase + off - ext->start;
+	}
+	if (i == seg->nr_legs)
+		return add_extent(stack, seg->start, seg->len, 0, seg->chunk, seg->nr_legs, legs);
+
+	for (nr = 0; nr < seg->len / seg->chunk; nr ++) {
+		i = nr % seg->nr_legs;
+		row = nr / seg->nr_legs;
+		if (map_range(stack, seg->start + nr * seg->chunk, seg->chunk, lower[i],
+			      seg->legs[i].offset + row * seg->chunk))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* a linear or striped target, on what is under each of its legs */
+static s32 add_segment(struct stack_resolver *r, struct dev_stack *stack,
+		       const struct dm_segment *seg)
+{
+	struct dev_stack *lower[DM_MAX_LEGS];
+	s32 i, ret = 0;
+
+	memset(lower, 0, sizeof(lower));
+	for (i = 0; i < seg->nr_legs && !ret; i ++) {
+		lower[i] = get_lower(r, seg->legs[i].major, seg->legs[i].minor);
+		if (NULL == lower[i])
+			ret = -1;
+	}
+	/* legs on something that isn't an array map to nothing */
+	if (!ret)
+		ret = map_segment(stack, seg, lower);
+
+	for (i = 0; i < seg->nr_legs; i ++) {
+		if (lower[i])
+			put_lower(r, lower[i]);
+	}
+
+	return ret;
+}
+
+static s32 resolve_dm(struct stack_resolver *r, struct dev_stack *stack)
+{
+	struct dm_segment seg;
+	s8 buf[DM_LINE_SIZE];
+	s32 ret = 0;
+	FILE *fp;
+
+	if (r->table && (ret = r->table(r, stack)) != 1)
+		return ret;
+	ret = 0;
+
+	sprintf(buf, "%s table -j %d -m %d", attr_root(ROOT_DMSETUP), stack->major, stack->minor);
+	fp = popen(buf, "r");
+	if (NULL == fp)
+		return -1;
+
+	while (!ret && fgets(buf, sizeof(buf), fp)) {
+		if (!dm_parse_segment(buf, &seg))
+			ret = add_segment(r, stack, &seg);
+	}
+
+	pclose(fp);
+
+	return ret;
+}
+
+/* a partition is its parent from start on, for size sectors */
+static s32 resolve_part(struct stack_resolver *r, struct dev_stack *stack, s64 start)
+{
+	struct attr_buf *buf = attr_local_buf();
+	struct dev_stack *parent;
+	s8 pathname[256];
+	s32 maj, min, ret;
+	s64 size;
+
+	sprintf(pathname, "%s/dev/block/%d:%d/size", attr_root(ROOT_SYS), stack->major,
+		stack->minor);
+	if (attr_read_s64(pathname, NULL, &size))
+		size = STACK_END;
+
+	/* the partition's directory sits in its disk's */
+	sprintf(pathname, "%s/dev/block/%d:%d/../dev", attr_root(ROOT_SYS), stack->major,
+		stack->minor);
+	if (NULL == buf || attr_read(pathname, buf) || sscanf(buf->data, "%d:%d", &maj, &min) != 2)
+		return -1;
+
+	parent = get_lower(r, maj, min);
+	if (NULL == parent)
+		return -1;
+
+	stack->status = parent->status;
+	ret = map_range(stack, 0, size, parent, start);
+	put_lower(r, parent);
+
+	return ret;
+}
+
+static struct dev_stack *resolve(struct stack_resolver *r, s32 major, s32 minor)
+{
+	struct stack_leg leg = {major, minor, 0};
+	struct dev_stack *stack;
+	s8 pathname[256];
+	s64 start;
+	s32 ret = 0;
+
+	if (r->depth >= STACK_MAX_DEPTH)
+		return NULL;
+
+	stack = calloc(1, sizeof(struct dev_stack));
+	if (NULL == stack)
+		return NULL;
+	stack->major = major;
+	stack->minor = minor;
+
+	r->depth ++;
+	sprintf(pathname, "%s/dev/block/%d:%d/start", attr_root(ROOT_SYS), major, minor);
+	if (major == MD_MAJOR)
+		ret = add_extent(stack, 0, STACK_END, 0, STACK_END, 1, &leg);
+	else if (major == r->dm_major)
+		ret = resolve_dm(r, stack);
+	else if (!attr_read_s64(pathname, NULL, &start))
+		ret = resolve_part(r, stack, start);
+	else if (major == r->mdp_major)
+		ret = add_extent(stack, 0, STACK_END, 0, STACK_END, 1, &leg);
+	else
+		stack->status = -1;
+	r->depth --;
+
+	if (ret) {
+		free_dev_stack(stack);
+		return NULL;
+	}
+
+	return stack;
+}
+
+/*
+ * build_dev_stack:
+ *
+ * Follow a partition to its disk and a dm device to the devices in its
+ * table, down to md arrays, and fold every level into one extent table.
+ * A device with no array under it gets status -1 so the answer is
+ * cached too. Return NULL if the stack can't be read.
+ */
+struct dev_stack *build_dev_stack(struct stack_resolver *r, s32 major, s32 minor)
+{
+	return resolve(r, major, minor);
+}
+
+/*
+ * dev_stack_add_segment:
+ *
+ * Add a target of a dm table read by the caller to stack, which starts
+ * out zeroed, for tools that already have the table of the device.
+ */
+s32 dev_stack_add_segment(struct stack_resolver *r, struct dev_stack *stack,
+			  const struct dm_segment *seg)
+{
+	return add_segment(r, stack, seg);
+}
+
+void free_stack_resolver(struct stack_resolver *r)
+{
+	s32 i;
+
+	for (i = 0; i < r->nr_kept; i ++)
+		free_dev_stack(r->kept[i]);
+	free(r->kept);
+	r->kept = NULL;
+	r->nr_kept = 0;
+}
+
+/*
+ * dev_stack_majors:
+ *
+ * The device-mapper and mdp majors from /proc/devices, -1 for a driver
+ * that isn't loaded.
+ */
+s32 dev_stack_majors(s32 *dm_major, s32 *mdp_major)
+{
+	struct attr_buf *buf = attr_local_buf();
+	const s8 *p, *end, *eol;
+	s8 pathname[256], name[64];
+	s32 major;
+
+	sprintf(pathname, "%s/devices", attr_root(ROOT_PROC));
+	if (NULL == buf || attr_read(pathname, buf))
+		return -1;
+
+	*dm_major = -1;
+	*mdp_major = -1;
+	end = buf->data + buf->len;
+	for (p = buf->data; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (NULL == eol)
+			eol = end;
+
+		if (sscanf(p, "%d %63s", &major, name) != 2)
+			continue;
+		if (0 == strcmp(name, "device-mapper"))
+			*dm_major = major;
+		else if (0 == strcmp(name, "mdp"))
+			*mdp_major = major;
+	}
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef __DEV_STACK_H__
+#define __DEV_STACK_H__
+
+#include "vbfscommon.h"
+#include "dm_table.h"
+
+/* deeper than any sane stack, and stops a dm table that loops */
+#define STACK_MAX_DEPTH 16
+/* a striped target that can't be kept whole is split per chunk up to this */
+#define STACK_MAX_EXTENTS (1 << 20)
+
+/* an md array under the device, and where a leg starts on it */
+struct stack_leg {
+	s32 major;
+	s32 minor;
+	u64 offset;
+};
+
+/*
+ * A run of the device that sits on one linear or striped range of
+ * arrays. Sector x of [start, start + len) is sector phase + x - start
+ * of that range, spread over legs [leg, leg + nr_legs) in chunks of
+ * chunk sectors like a dm striped target; one leg is just linear.
+ */
+struct stack_extent {
+	u64 start;
+	u64 len;
+	u64 phase;
+	u64 chunk;
+	s32 nr_legs;
+	s32 leg;
+};
+
+/*
+ * Everything between a device and the md arrays under it, partitions
+ * and dm tables on top of each other folded into one table sorted by
+ * start. Published like an md snapshot and never modified afterwards.
+ */
+struct dev_stack {
+	s32 major;
+	s32 minor;
+	s32 status;
+	s64 load_ms;
+
+	s32 nr;
+	s32 nr_legs;
+	struct stack_extent *ext;
+	struct stack_leg *legs;
+};
+
+/*
+ * How stacks are built. With keep set, the stacks of the devices under
+ * the one being built are kept and shared by later builds until
+ * free_stack_resolver(). table, if set, is asked for the targets of a
+ * dm device first; it returns 1 to have dmsetup read instead.
+ */
+struct stack_resolver {
+	s32 dm_major;
+	s32 mdp_major;
+	s32 depth;
+
+	s32 keep;
+	s32 nr_kept;
+	struct dev_stack **kept;
+
+	s32 (*table)(struct stack_resolver *r, struct dev_stack *stack);
+	void *arg;
+};
+
+struct dev_stack *build_dev_stack(struct stack_resolver *r, s32 major, s32 minor);
+void free_dev_stack(void *stack);
+s32 dev_stack_add_segment(struct stack_resolver *r, struct dev_stack *stack,
+			  const struct dm_segment *seg);
+void free_stack_resolver(struct stack_resolver *r);
+s32 dev_stack_majors(s32 *dm_major, s32 *mdp_major);
+s32 dev_stack_find(const struct dev_stack *stack, u64 sector);
+
+/* the sectors [a, b) of an extent, from its start, have on one of its legs */
+static inline void stack_leg_range(const struct dev_stack *stack, const struct stack_extent *ext,
+				   s32 leg, u64 a, u64 b, u64 *lo, u64 *hi)
+{
+	u64 offset = stack->legs[ext->leg + leg].offset;
+
+	*lo = offset + dm_stripe_to_leg(ext->chunk, ext->nr_legs, leg, ext->phase + a);
+	*hi = offset + dm_stripe_to_leg(ext->chunk, ext->nr_legs, leg, ext->phase + b);
+}
+
+#endif
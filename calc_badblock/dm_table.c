@@ -0,0 +1,70 @@
+#include "dm_table.h"
+
+/*
+ * dm_parse_segment:
+ *
+ * Parse "start len linear maj:min offset" or "start len striped
+ * #stripes chunk maj:min offset ...", the way dmsetup table prints
+ * them. Return -1 for any other target.
+ */
+s32 dm_parse_segment(const s8 *line, struct dm_segment *seg)
+{
+	unsigned long long start, len, chunk, offset;
+	s32 i, n, nr;
+
+	if (sscanf(line, "%llu %llu linear %d:%d %llu", &start, &len,
+		   &seg->legs[0].major, &seg->legs[0].minor, &offset) == 5) {
+		seg->start = start;
+		seg->len = len;
+		seg->chunk = len;
+		seg->nr_legs = 1;
+		seg->legs[0].offset = offset;
+		return len ? 0 : -1;
+	}
+
+	if (sscanf(line, "%llu %llu striped %d %llu%n", &start, &len, &nr, &chunk, &n) != 4 ||
+	    nr <= 0 || nr > DM_MAX_LEGS || 0 == chunk || len % nr || len / nr % chunk)
+		return -1;
+
+	seg->start = start;
+	seg->len = len;
+	seg->chunk = chunk;
+	seg->nr_legs = nr;
+	for (i = 0; i < nr; i ++) {
+		line += n;
+		if (sscanf(line, " %d:%d %llu%n", &seg->legs[i].major, &seg->legs[i].minor,
+			   &offset, &n) != 3)
+			return -1;
+		seg->legs[i].offset = offset;
+	}
+
+	return 0;
+}
+
+/*
+ * dm_stripe_to_leg:
+ *
+ * Where on leg of nr_legs, striped in chunks of chunk sectors, the
+ * first sector at or after sector of the striped range is. The sectors
+ * of [a, b) on a leg are [dm_stripe_to_leg(a), dm_stripe_to_leg(b)) of
+ * it. With one leg it is sector itself.
+ */
+u64 dm_stripe_to_leg(u64 chunk, s32 nr_legs, s32 leg, u64 sector)
+{
+	u64 nr = sector / chunk, row = nr / nr_legs;
+	s32 col = nr % nr_legs;
+
+	if (col == leg)
+		return row * chunk + sector % chunk;
+	if (col < leg)
+		return row * chunk;
+	return (row + 1) * chunk;
+}
+
+/* dm_stripe_to_dev: a sector of a leg as a sector of the striped range */
+u64 dm_stripe_to_dev(u64 chunk, s32 nr_legs, s32 leg, u64 sector)
+{
+	u64 row = sector / chunk;
+
+	return (row * nr_legs + leg) * chunk + sector % chunk;
+}
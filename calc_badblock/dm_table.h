@@ -0,0 +1,38 @@
+#ifndef __DM_TABLE_H__
+#define __DM_TABLE_H__
+
+#include "vbfscommon.h"
+
+/* a dmsetup table line with this many stripes is a few hundred bytes */
+#define DM_LINE_SIZE 4096
+#define DM_MAX_LEGS 64
+
+struct dm_leg {
+	s32 major;
+	s32 minor;
+	u64 offset;		/* where the leg starts on its device */
+};
+
+/*
+ * One target of a dm table, in sectors. A linear target is a single
+ * leg with one chunk as long as the target; a striped one puts chunk
+ * i on leg i % nr_legs, each leg len / nr_legs long.
+ */
+struct dm_segment {
+	u64 start;
+	u64 len;
+	u64 chunk;
+	s32 nr_legs;
+	struct dm_leg legs[DM_MAX_LEGS];
+};
+
+s32 dm_parse_segment(const s8 *line, struct dm_segment *seg);
+u64 dm_stripe_to_leg(u64 chunk, s32 nr_legs, s32 leg, u64 sector);
+u64 dm_stripe_to_dev(u64 chunk, s32 nr_legs, s32 leg, u64 sector);
+
+static inline u64 dm_leg_len(const struct dm_segment *seg)
+{
+	return seg->len / seg->nr_legs;
+}
+
+#endif
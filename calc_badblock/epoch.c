@@ -0,0 +1,165 @@
+#include "epoch.h"
+#include "vbfscommon.h"
+
+#include <pthread.h>
+
+/*
+ * Epoch based reclamation for the bad-block snapshots.
+ *
+ * A reader announces the global epoch it started in and clears the
+ * announcement when done; it never takes a lock. A writer unpublishes
+ * an object, then retires it with the current epoch. The epoch only
+ * moves on once every active reader has seen it, so an object retired
+ * in epoch e is unreachable to all readers once the epoch is e + 2.
+ * Sections nest: only the outermost enter and exit announce anything.
+ */
+struct epoch_rec {
+	struct epoch_rec *next;
+	u32 in_use;
+	u32 active;
+	u32 depth;		/* only the owning thread touches it */
+	u64 epoch;
+};
+
+struct retired {
+	struct retired *next;
+	void *ptr;
+	void (*free_fn)(void *);
+	u64 epoch;
+};
+
+static struct epoch_rec *epoch_recs;
+static u64 global_epoch = 1;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct retired *retire_list;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static __thread struct epoch_rec *local_rec;
+
+static void put_rec(void *arg)
+{
+	struct epoch_rec *rec = arg;
+
+	rec->depth = 0;
+	__atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_init(void)
+{
+	pthread_key_create(&epoch_key, put_rec);
+}
+
+/* records are never freed, a new thread reuses one left by a dead thread */
+static struct epoch_rec *get_rec(void)
+{
+	struct epoch_rec *rec;
+	u32 unused = 0;
+
+	pthread_once(&epoch_once, epoch_init);
+
+	for (rec = __atomic_load_n(&epoch_recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+		if (__atomic_compare_exchange_n(&rec->in_use, &unused, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			goto out;
+		unused = 0;
+	}
+
+	rec = calloc(1, sizeof(struct epoch_rec));
+	if (NULL == rec)
+		return NULL;
+	rec->in_use = 1;
+
+	rec->next = __atomic_load_n(&epoch_recs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&epoch_recs, &rec->next, rec, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+out:
+	pthread_setspecific(epoch_key, rec);
+	local_rec = rec;
+
+	return rec;
+}
+
+void epoch_enter(void)
+{
+	struct epoch_rec *rec = local_rec;
+
+	if (NULL == rec && NULL == (rec = get_rec())) {
+		/* can't happen short of ENOMEM; spin until a record frees up */
+		while (NULL == (rec = get_rec()))
+			;
+	}
+
+	if (rec->depth ++)
+		return;
+	__atomic_store_n(&rec->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&rec->active, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+	if (-- local_rec->depth)
+		return;
+	__atomic_store_n(&local_rec->active, 0, __ATOMIC_RELEASE);
+}
+
+/* called with retire_lock held */
+static void try_advance(void)
+{
+	struct epoch_rec *rec;
+	u64 epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (rec = __atomic_load_n(&epoch_recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+		if (__atomic_load_n(&rec->active, __ATOMIC_ACQUIRE) &&
+				__atomic_load_n(&rec->epoch, __ATOMIC_RELAXED) != epoch)
+			return;
+	}
+
+	__atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * epoch_retire:
+ * @ptr: an object that readers can no longer find.
+ *
+ * Free it with free_fn once no reader can still hold it.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *))
+{
+	struct retired *node, **pp;
+	u64 epoch;
+
+	node = malloc(sizeof(struct retired));
+
+	pthread_mutex_lock(&retire_lock);
+
+	if (node) {
+		node->ptr = ptr;
+		node->free_fn = free_fn;
+		node->epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+		node->next = retire_list;
+		retire_list = node;
+	}
+
+	try_advance();
+	epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+	pp = &retire_list;
+	while ((node = *pp) != NULL) {
+		if (node->epoch + 2 <= epoch) {
+			*pp = node->next;
+			node->free_fn(node->ptr);
+			free(node);
+		} else
+			pp = &node->next;
+	}
+
+	pthread_mutex_unlock(&retire_lock);
+}
@@ -0,0 +1,8 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+#endif
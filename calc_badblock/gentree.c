@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include "gentree.h"
+#include "dm_table.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+/*
+ * Fake sysfs/procfs tree for N md arrays and the dm devices on them,
+ * linear or striped over groups of arrays, optionally on a partition of
+ * each array and under more linear dm devices, laid out the way
+ * attr_set_tree() expects:
+ *
+ *	dir/sys/block/mdN/md/{level,raid_disks,chunk_size,degraded,uuid}
+ *	dir/sys/block/mdN/md/rdK/{offset,bad_blocks,unacknowledged_bad_blocks}
+ *	dir/sys/block/mdN/md/rdK/block/device/serial
+ *	dir/sys/block/mdN/mdNp1/{dev,partition,start,size,uevent}
+ *	dir/sys/dev/block/9:N/uevent
+ *	dir/sys/dev/block/259:N		link to the partition, as in sysfs
+ *	dir/sys/dev/block/240:K/dm/name
+ *	dir/proc/{devices,partitions}
+ *	dir/dev/			left empty, md status comes from sysfs
+ *	dir/dmsetup, dir/dm_tables	"dmsetup table" for the dm devices
+ *	dir/nodes/{mdN,dm-K}		device nodes for the benchmark, if mknod works
+ *	dir/failed			"array sector len" of each failed chunk, see
+ *					tree_failed()
+ *
+ * Layer l over LV k is dm minor l * arrays * lvs + k, and starts
+ * TREE_LAYER_SECTORS into the device under it.
+ *
+ * The nodes are kept out of dev/ so the library never opens them: on a
+ * host with md loaded, opening an unused md minor would create it.
+ */
+
+struct bb_entry {
+	u64 sector;
+	s32 len;
+};
+
+void default_tree_params(struct tree_params *params)
+{
+	params->nr_arrays = 4;
+	params->level = 6;
+	params->chunk_kb = 64;
+	params->raid_disks = 12;
+	params->data_offset = 262144;
+	params->member_sectors = 1ULL << 31;
+	params->nr_bb = 64;
+	params->nr_lvs = 4;
+	params->stripes = 1;
+	params->layers = 0;
+	params->partitioned = 0;
+	params->seed = 1;
+}
+
+static s32 make_dirs(const s8 *path)
+{
+	s8 tmp[512];
+	s8 *p;
+
+	if (strlen(path) >= sizeof(tmp))
+		return -1;
+	strcpy(tmp, path);
+
+	for (p = tmp + 1; *p; p ++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(tmp, 0755) && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(tmp, 0755) && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+static s32 write_file(const s8 *path, const s8 *fmt, ...)
+{
+	va_list ap;
+	FILE *fp;
+	s32 ret;
+
+	fp = fopen(path, "w");
+	if (NULL == fp)
+		return -1;
+
+	va_start(ap, fmt);
+	ret = vfprintf(fp, fmt, ap);
+	va_end(ap);
+
+	if (fclose(fp) || ret < 0)
+		return -1;
+
+	return 0;
+}
+
+static s32 cmp_entry(const void *a, const void *b)
+{
+	const struct bb_entry *ea = a, *eb = b;
+
+	if (ea->sector != eb->sector)
+		return ea->sector < eb->sector ? -1 : 1;
+	return 0;
+}
+
+static s32 max_degraded(const struct tree_params *params)
+{
+	switch (params->level) {
+	case 1:
+		return params->raid_disks - 1;
+	case 5:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+/*
+ * nr_bb random ranges per member, plus nr_bb / 4 ranges that hit the
+ * same sectors on max_degraded + 1 members so the array has failed
+ * stripes too. Every data chunk of those goes to failed, in array
+ * sectors.
+ */
+static s32 gen_bad_blocks(const s8 *md_dir, const struct tree_params *params, s32 array,
+			  FILE *failed, u32 *seed)
+{
+	struct bb_entry **lists;
+	s32 *counts, i, j, k, m, nr_shared = params->nr_bb / 4, ret = -1;
+	s32 data_disks = params->level == 1 ? 1 : params->raid_disks - max_degraded(params);
+	s32 chunk = params->chunk_kb * 2;
+	s32 max = params->nr_bb + nr_shared;
+	/* room for md_dir, which gen_tree() builds in 512 bytes, and the rdK files */
+	s8 path[512 + 64], serial[32];
+	u64 sector;
+	FILE *fp;
+
+	lists = calloc(params->raid_disks, sizeof(struct bb_entry *));
+	counts = calloc(params->raid_disks, sizeof(s32));
+	if (NULL == lists || NULL == counts)
+		goto out;
+
+	for (i = 0; i < params->raid_disks; i ++) {
+		lists[i] = malloc(sizeof(struct bb_entry) * (max + 1));
+		if (NULL == lists[i])
+			goto out;
+
+		for (j = 0; j < params->nr_bb; j ++) {
+			sector = ((u64)rand_r(seed) << 16 | rand_r(seed)) % params->member_sectors;
+			lists[i][j].sector = sector / 8 * 8;
+			lists[i][j].len = 8 * (1 + rand_r(seed) % 8);
+		}
+		counts[i] = params->nr_bb;
+	}
+
+	for (j = 0; j < nr_shared; j ++) {
+		sector = ((u64)rand_r(seed) << 16 | rand_r(seed)) % params->member_sectors / 8 * 8;
+		k = rand_r(seed) % params->raid_disks;
+
+		for (m = 0; m <= max_degraded(params) && m < params->raid_disks; m ++) {
+			i = (k + m) % params->raid_disks;
+			lists[i][counts[i]].sector = sector;
+			lists[i][counts[i]].len = 8;
+			counts[i] ++;
+		}
+
+		for (m = 0; m < data_disks; m ++)
+			fprintf(failed, "%d %llu 8\n", array,
+				(sector / chunk * data_disks + m) * chunk + sector % chunk);
+	}
+
+	for (i = 0; i < params->raid_disks; i ++) {
+		qsort(lists[i], counts[i], sizeof(struct bb_entry), cmp_entry);
+
+		snprintf(path, sizeof(path), "%s/rd%d", md_dir, i);
+		if (make_dirs(path))
+			goto out;
+
+		snprintf(path, sizeof(path), "%s/rd%d/offset", md_dir, i);
+		if (write_file(path, "%lld\n", params->data_offset))
+			goto out;
+
+		snprintf(path, sizeof(path), "%s/rd%d/block/device", md_dir, i);
+		if (make_dirs(path))
+			goto out;
+		tree_serial(array, i, serial, sizeof(serial));
+		snprintf(path, sizeof(path), "%s/rd%d/block/device/serial", md_dir, i);
+		if (write_file(path, "%s\n", serial))
+			goto out;
+
+		snprintf(path, sizeof(path), "%s/rd%d/unacknowledged_bad_blocks", md_dir, i);
+		if (write_file(path, ""))
+			goto out;
+
+		/* md lists sectors of the whole member, data_offset included */
+		snprintf(path, sizeof(path), "%s/rd%d/bad_blocks", md_dir, i);
+		fp = fopen(path, "w");
+		if (NULL == fp)
+			goto out;
+		for (j = 0; j < counts[i]; j ++)
+			fprintf(fp, "%llu %d\n", lists[i][j].sector + params->data_offset,
+				lists[i][j].len);
+		if (fclose(fp))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	if (lists) {
+		for (i = 0; i < params->raid_disks; i ++)
+			free(lists[i]);
+	}
+	free(lists);
+	free(counts);
+
+	return ret;
+}
+
+/* what the LVs of an array are carved from, its partition or all of it */
+static u64 lv_sectors(const struct tree_params *params)
+{
+	s32 data_disks = params->level == 1 ? 1 : params->raid_disks - max_degraded(params);
+	u64 sectors = params->member_sectors * data_disks;
+	/* a striped LV puts chunks of the array chunk size on each leg */
+	u64 chunk = params->stripes > 1 ? params->chunk_kb * 2 : 8;
+
+	if (params->partitioned)
+		sectors -= TREE_PART_START;
+
+	return sectors / params->nr_lvs / chunk * chunk;
+}
+
+/* tree_top_minor - the dm minor of the device on top of LV @lv */
+s32 tree_top_minor(const struct tree_params *params, s32 lv)
+{
+	return params->layers * params->nr_arrays * params->nr_lvs + lv;
+}
+
+/* tree_top_sectors - the length of the device on top of each LV */
+u64 tree_top_sectors(const struct tree_params *params)
+{
+	u64 sectors = lv_sectors(params) * (params->stripes > 1 ? params->stripes : 1);
+
+	return sectors - (u64)params->layers * TREE_LAYER_SECTORS;
+}
+
+/*
+ * tree_top_sector - where @sector of array @array shows on the device
+ * on top of its LV, with the LV in @lv; -1 if no LV covers it
+ */
+s64 tree_top_sector(const struct tree_params *params, s32 array, u64 sector, s32 *lv)
+{
+	s32 stripes = params->stripes > 1 ? params->stripes : 1, leg = array % stripes, k;
+	u64 lv_len = lv_sectors(params), chunk = params->chunk_kb * 2, header;
+
+	header = (u64)params->layers * TREE_LAYER_SECTORS;
+	if (params->partitioned) {
+		if (sector < TREE_PART_START)
+			return -1;
+		sector -= TREE_PART_START;
+	}
+	k = sector / lv_len;
+	if (k >= params->nr_lvs)
+		return -1;
+
+	/* the LV's chunks go round its legs, this array is leg @leg */
+	sector %= lv_len;
+	if (stripes > 1)
+		sector = (sector / chunk * stripes + leg) * chunk + sector % chunk;
+	if (sector < header)
+		return -1;
+
+	*lv = (array - leg) * params->nr_lvs + k;
+
+	return sector - header;
+}
+
+/* tree_failed - read back dir/failed; the number of chunks, or -1 */
+s32 tree_failed(const s8 *dir, struct tree_chunk **chunks)
+{
+	struct tree_chunk *p = NULL, *tmp;
+	s32 nr = 0, max = 0;
+	s8 path[512];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/failed", dir);
+	fp = fopen(path, "r");
+	if (NULL == fp)
+		return -1;
+
+	for (;;) {
+		if (nr == max) {
+			max = max ? max * 2 : 256;
+			tmp = realloc(p, sizeof(struct tree_chunk) * max);
+			if (NULL == tmp) {
+				nr = -1;
+				break;
+			}
+			p = tmp;
+		}
+		if (fscanf(fp, "%d %llu %d", &p[nr].array, &p[nr].sector, &p[nr].len) != 3)
+			break;
+		nr ++;
+	}
+	fclose(fp);
+
+	if (nr < 0) {
+		free(p);
+		p = NULL;
+	}
+	*chunks = p;
+
+	return nr;
+}
+
+/* tree_serial - the serial of the disk under member @role of array @array */
+void tree_serial(s32 array, s32 role, s8 *serial, s32 len)
+{
+	snprintf(serial, len, "TREE%04d-%03d", array, role);
+}
+
+/* tree_uuid - the md/uuid of array @array, as 16 bytes */
+void tree_uuid(s32 array, u8 *uuid)
+{
+	s32 i;
+
+	for (i = 0; i < 16; i ++)
+		uuid[i] = (array >> (i % 4 * 8)) ^ (0x5a + i);
+}
+
+/* the array's partition 1 in the sysfs and procfs files */
+static s32 gen_partition(const s8 *dir, FILE *parts, s32 i, const s8 *name, u64 sectors)
+{
+	s8 path[512], link[128];
+	s32 minor = TREE_MD_MINOR + i;
+
+	snprintf(path, sizeof(path), "%s/sys/block/%s/dev", dir, name);
+	if (write_file(path, "9:%d\n", minor))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/sys/block/%s/%sp1", dir, name, name);
+	if (make_dirs(path))
+		return -1;
+	snprintf(path, sizeof(path), "%s/sys/block/%s/%sp1/dev", dir, name, name);
+	if (write_file(path, "%d:%d\n", TREE_PART_MAJOR, i))
+		return -1;
+	snprintf(path, sizeof(path), "%s/sys/block/%s/%sp1/partition", dir, name, name);
+	if (write_file(path, "1\n"))
+		return -1;
+	snprintf(path, sizeof(path), "%s/sys/block/%s/%sp1/start", dir, name, name);
+	if (write_file(path, "%d\n", TREE_PART_START))
+		return -1;
+	snprintf(path, sizeof(path), "%s/sys/block/%s/%sp1/size", dir, name, name);
+	if (write_file(path, "%llu\n", sectors))
+		return -1;
+	snprintf(path, sizeof(path), "%s/sys/block/%s/%sp1/uevent", dir, name, name);
+	if (write_file(path, "MAJOR=%d\nMINOR=%d\nDEVNAME=%sp1\nDEVTYPE=partition\n",
+		       TREE_PART_MAJOR, i, name))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/sys/dev/block/%d:%d", dir, TREE_PART_MAJOR, i);
+	snprintf(link, sizeof(link), "../../block/%s/%sp1", name, name);
+	if (symlink(link, path) && errno != EEXIST)
+		return -1;
+
+	fprintf(parts, " %3d %5d %10llu %sp1\n", TREE_PART_MAJOR, i, sectors / 2, name);
+
+	return 0;
+}
+
+/* what get_bad_block finds a dm device under another one by */
+static s32 gen_dm_name(const s8 *dir, s32 minor, const s8 *name)
+{
+	s8 path[512];
+
+	snprintf(path, sizeof(path), "%s/sys/dev/block/%d:%d/dm", dir, TREE_DM_MAJOR, minor);
+	if (make_dirs(path))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/sys/dev/block/%d:%d/dm/name", dir, TREE_DM_MAJOR, minor);
+
+	return write_file(path, "%s\n", name);
+}
+
+static const s8 dmsetup_script[] =
+	"#!/bin/sh\n"
+	"# stand-in for dmsetup table, generated by bb_bench gentree\n"
+	"t=\"$(dirname \"$0\")/dm_tables\"\n"
+	"[ \"$1\" = table ] || exit 1\n"
+	"if [ $# -eq 1 ]; then\n"
+	"\tawk '{s = $1\":\"; for (i = 4; i <= NF; i ++) s = s\" \"$i; print s}' \"$t\"\n"
+	"elif [ \"$2\" = -j ]; then\n"
+	"\tawk -v j=\"$3\" -v m=\"$5\" '$2 == j && $3 == m {s = $4; for (i = 5; i <= NF; i ++) "
+	"s = s\" \"$i; print s}' \"$t\"\n"
+	"else\n"
+	"\tawk -v n=\"$2\" '$1 == n {s = $4; for (i = 5; i <= NF; i ++) s = s\" \"$i; print s}' "
+	"\"$t\"\n"
+	"fi\n";
+
+/*
+ * gen_tree:
+ * @dir: an existing, empty directory.
+ * @params: what to generate.
+ *
+ * Write a fake tree under dir. Device nodes for the arrays and dm
+ * devices are only created when mknod is permitted. Returns 0 or -1.
+ */
+s32 gen_tree(const s8 *dir, const struct tree_params *params)
+{
+	FILE *parts = NULL, *tables = NULL, *failed = NULL;
+	s8 path[512], name[32], dm_name[64], legs[DM_MAX_LEGS][32];
+	s32 i, j, k, l, lv, minor, data_disks, nodes, stripes = params->stripes, chunk;
+	u64 array_sectors, lv_len, top_len;
+	u32 seed = params->seed;
+	u8 uuid[16];
+
+	if (params->nr_arrays <= 0 || params->raid_disks < 2 || params->nr_lvs <= 0 ||
+	    params->chunk_kb <= 0 || params->member_sectors <= 0 ||
+	    (params->level != 1 && params->level != 5 && params->level != 6) ||
+	    (params->level == 6 && params->raid_disks < 4) ||
+	    (params->level == 5 && params->raid_disks < 3) ||
+	    params->stripes <= 0 || params->stripes > DM_MAX_LEGS || params->layers < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/proc", dir);
+	if (make_dirs(path))
+		return -1;
+	snprintf(path, sizeof(path), "%s/dev", dir);
+	if (make_dirs(path))
+		return -1;
+	snprintf(path, sizeof(path), "%s/nodes", dir);
+	if (make_dirs(path))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/proc/devices", dir);
+	if (write_file(path, "Block devices:\n  9 md\n%3d device-mapper\n%3d blkext\n",
+		       TREE_DM_MAJOR, TREE_PART_MAJOR))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/dmsetup", dir);
+	if (write_file(path, "%s", dmsetup_script) || chmod(path, 0755))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/proc/partitions", dir);
+	parts = fopen(path, "w");
+	snprintf(path, sizeof(path), "%s/dm_tables", dir);
+	tables = fopen(path, "w");
+	snprintf(path, sizeof(path), "%s/failed", dir);
+	failed = fopen(path, "w");
+	if (NULL == parts || NULL == tables || NULL == failed)
+		goto err;
+	fprintf(parts, "major minor  #blocks  name\n\n");
+
+	data_disks = params->level == 1 ? 1 : params->raid_disks - max_degraded(params);
+	array_sectors = params->member_sectors * data_disks;
+	chunk = params->chunk_kb * 2;
+	lv_len = lv_sectors(params);
+	top_len = tree_top_sectors(params);
+	if (0 == lv_len || (s64)top_len <= 0)
+		goto err;
+
+	/* creating nodes needs CAP_MKNOD, the file tree does not */
+	snprintf(path, sizeof(path), "%s/nodes/probe", dir);
+	nodes = !mknod(path, S_IFBLK | 0600, makedev(9, TREE_MD_MINOR));
+	unlink(path);
+
+	for (i = 0; i < params->nr_arrays; i ++) {
+		minor = TREE_MD_MINOR + i;
+		snprintf(name, sizeof(name), "md%d", minor);
+
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md", dir, name);
+		if (make_dirs(path))
+			goto err;
+
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/level", dir, name);
+		if (write_file(path, "raid%d\n", params->level))
+			goto err;
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/raid_disks", dir, name);
+		if (write_file(path, "%d\n", params->raid_disks))
+			goto err;
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/chunk_size", dir, name);
+		if (write_file(path, "%d\n", params->chunk_kb * 1024))
+			goto err;
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/degraded", dir, name);
+		if (write_file(path, "0\n"))
+			goto err;
+		tree_uuid(i, uuid);
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/uuid", dir, name);
+		if (write_file(path, "%02x%02x%02x%02x-%02x%02x%02x%02x-%02x%02x%02x%02x-%02x%02x%02x%02x\n",
+			       uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+			       uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14],
+			       uuid[15]))
+			goto err;
+
+		snprintf(path, sizeof(path), "%s/sys/dev/block/9:%d", dir, minor);
+		if (make_dirs(path))
+			goto err;
+		snprintf(path, sizeof(path), "%s/sys/dev/block/9:%d/uevent", dir, minor);
+		if (write_file(path, "MAJOR=9\nMINOR=%d\nDEVNAME=%s\nDEVTYPE=disk\n", minor, name))
+			goto err;
+
+		fprintf(parts, "   9 %5d %10llu %s\n", minor, array_sectors / 2, name);
+
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md", dir, name);
+		if (gen_bad_blocks(path, params, i, failed, &seed))
+			goto err;
+
+		if (params->partitioned &&
+		    gen_partition(dir, parts, i, name, array_sectors - TREE_PART_START))
+			goto err;
+
+		/* an LV leg is the array or its partition */
+		for (j = 0; j < stripes && i % stripes == 0; j ++) {
+			if (params->partitioned)
+				snprintf(legs[j], sizeof(legs[j]), "%d:%d", TREE_PART_MAJOR, i + j);
+			else
+				snprintf(legs[j], sizeof(legs[j]), "9:%d", minor + j);
+		}
+
+		/* a group of arrays takes the LVs striped over all of them */
+		for (k = 0; (stripes <= 1 || i % stripes == 0) && k < params->nr_lvs; k ++) {
+			lv = i * params->nr_lvs + k;
+			snprintf(dm_name, sizeof(dm_name), "vg%d-lv%d", i, k);
+			if (stripes <= 1) {
+				fprintf(tables, "%s %d %d 0 %llu linear %s %llu\n", dm_name,
+					TREE_DM_MAJOR, lv, lv_len, legs[0], k * lv_len);
+			} else {
+				fprintf(tables, "%s %d %d 0 %llu striped %d %d", dm_name,
+					TREE_DM_MAJOR, lv, lv_len * stripes, stripes, chunk);
+				for (j = 0; j < stripes; j ++)
+					fprintf(tables, " %s %llu", legs[j], k * lv_len);
+				fprintf(tables, "\n");
+			}
+			if (gen_dm_name(dir, lv, dm_name))
+				goto err;
+
+			/* each layer keeps its own header at the start of the one under it */
+			for (l = 1; l <= params->layers; l ++) {
+				snprintf(dm_name, sizeof(dm_name), "vg%d-lv%d-l%d", i, k, l);
+				fprintf(tables, "%s %d %d 0 %llu linear %d:%d %d\n", dm_name,
+					TREE_DM_MAJOR, lv + l * params->nr_arrays * params->nr_lvs,
+					top_len + (u64)(params->layers - l) * TREE_LAYER_SECTORS,
+					TREE_DM_MAJOR, lv + (l - 1) * params->nr_arrays * params->nr_lvs,
+					TREE_LAYER_SECTORS);
+				if (gen_dm_name(dir, lv + l * params->nr_arrays * params->nr_lvs,
+						dm_name))
+					goto err;
+			}
+		}
+
+		if (nodes) {
+			snprintf(path, sizeof(path), "%s/nodes/%s", dir, name);
+			if (mknod(path, S_IFBLK | 0600, makedev(9, minor)))
+				goto err;
+			for (l = 0; l <= params->layers; l ++) {
+				for (k = 0; k < params->nr_lvs; k ++) {
+					lv = (l * params->nr_arrays + i) * params->nr_lvs + k;
+					snprintf(path, sizeof(path), "%s/nodes/dm-%d", dir, lv);
+					if (mknod(path, S_IFBLK | 0600, makedev(TREE_DM_MAJOR, lv)))
+						goto err;
+				}
+			}
+		}
+	}
+
+	if (fclose(parts) | fclose(tables) | fclose(failed))
+		return -1;
+
+	return 0;
+
+err:
+	if (parts)
+		fclose(parts);
+	if (tables)
+		fclose(tables);
+	if (failed)
+		fclose(failed);
+	return -1;
+}
+
+static s32 remove_entry(const s8 *path, const struct stat *st, s32 flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+s32 remove_tree(const s8 *dir)
+{
+	return nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,47 @@
+#ifndef __GENTREE_H__
+#define __GENTREE_H__
+
+#include "vbfscommon.h"
+
+/* md minors and the dm major of a generated tree, clear of real devices */
+#define TREE_MD_MINOR 1000
+#define TREE_DM_MAJOR 240
+/* md partitions get the extended major, like the kernel gives them */
+#define TREE_PART_MAJOR 259
+/* where the partition starts on an array, and what each layer keeps */
+#define TREE_PART_START 2048
+#define TREE_LAYER_SECTORS 2048
+
+/* a chunk of an array that md can't read, from tree_failed() */
+struct tree_chunk {
+	s32 array;
+	u64 sector;
+	s32 len;
+};
+
+struct tree_params {
+	s32 nr_arrays;
+	s32 level;
+	s32 chunk_kb;
+	s32 raid_disks;
+	s64 data_offset;
+	s64 member_sectors;
+	s32 nr_bb;
+	s32 nr_lvs;
+	s32 stripes;		/* arrays an LV is striped over, 1 for linear */
+	s32 layers;		/* linear dm devices stacked on each LV */
+	s32 partitioned;	/* LVs on a partition of each array */
+	u32 seed;
+};
+
+void default_tree_params(struct tree_params *params);
+s32 tree_top_minor(const struct tree_params *params, s32 lv);
+u64 tree_top_sectors(const struct tree_params *params);
+s64 tree_top_sector(const struct tree_params *params, s32 array, u64 sector, s32 *lv);
+s32 tree_failed(const s8 *dir, struct tree_chunk **chunks);
+void tree_serial(s32 array, s32 role, s8 *serial, s32 len);
+void tree_uuid(s32 array, u8 *uuid);
+s32 gen_tree(const s8 *dir, const struct tree_params *params);
+s32 remove_tree(const s8 *dir);
+
+#endif
@@ -10,11 +10,16 @@
 #include <errno.h>
 #include <linux/types.h>
 
+#include "bbmap.h"
+#include "dev_stack.h"
+#include "sysfs_attr.h"
+#include "work_pool.h"
+
 #define STRIPE_SECTOR 8
 #define BUF_SIZE 256
 #define MAX_BBS 4096
 #define MD_MAJOR 9
-#define MAX_RDEV_NUM 64
+#define RAID_HASH_SIZE 64
 
 struct bad_range {
 	__u64 start_sector;
@@ -23,33 +28,46 @@ struct bad_range {
 
 struct lvm_bbs {
 	int bb_cnt;
+	int bb_max;
+	__u64 generation;
 
-	struct bad_range bb_range[MAX_BBS];
+	struct bad_range *bb_range;
 };
 
-static int get_sys_attr(const char *pathname, char *buf)
+static int get_sys_attr(const char *pathname, const char *prefix, int *val)
 {
-	int fd;
-	ssize_t size;
-
-	fd = open(pathname, O_RDONLY);
-	if (fd < 0) {
-		perror("open error");
-		goto err;
-	}
+	s64 tmp;
 
-	size = read(fd, buf, BUF_SIZE);
-	if (size < 0) {
+	if (attr_read_s64(pathname, prefix, &tmp)) {
 		perror("read error");
-		goto err;
+		return -1;
 	}
 
-	close(fd);
+	*val = tmp;
 	return 0;
+}
 
-err:
-	close(fd);
-	return -1;
+static int get_name_by_uevent(const int owner_maj, const int owner_min, char *name)
+{
+	char pathname[BUF_SIZE];
+	struct attr_buf *buf = attr_local_buf();
+	char *p, *eol;
+
+	sprintf(pathname, "%s/dev/block/%d:%d/uevent", attr_root(ROOT_SYS), owner_maj, owner_min);
+	if (NULL == buf || attr_read(pathname, buf))
+		return -1;
+
+	p = strstr(buf->data, "DEVNAME=");
+	if (NULL == p)
+		return -1;
+
+	p += 8;
+	eol = strchr(p, '\n');
+	if (eol)
+		*eol = '\0';
+	strcpy(name, p);
+
+	return 0;
 }
 
 static int get_name_by_devno(const int owner_maj, const int owner_min, char *name)
@@ -59,7 +77,12 @@ static int get_name_by_devno(const int owner_maj, const int owner_min, char *nam
 	int maj, min, ret;
 	__u64 size_kb;
 
-	fp = fopen("/proc/partitions", "r");
+	/* one open per devno instead of a /proc/partitions scan */
+	if (!get_name_by_uevent(owner_maj, owner_min, name))
+		return 0;
+
+	snprintf(buf, BUF_SIZE, "%s/partitions", attr_root(ROOT_PROC));
+	fp = fopen(buf, "r");
 	if (NULL == fp)
 		return -1;
 
@@ -80,35 +103,91 @@ static int get_name_by_devno(const int owner_maj, const int owner_min, char *nam
 	return -1;
 }
 
+/*
+ * A range and the members that have it bad, one bit per member in as
+ * many words as the array needs: a range of an array up to 64 members
+ * wide takes as much room as with a single __u64.
+ */
 struct rdev_bbs_range {
 	__u64 start_sector;
 	int len;
 
-	__u64 rdev_bitmap;
+	__u64 rdev_bitmap[];
 };
 
 struct rdev_bbs {
 	int bb_cnt;
+	int nr_words;
+	size_t stride;
 
-	struct rdev_bbs_range bb_range[MAX_BBS];
+	/* MAX_BBS ranges, then two to build new ones in */
+	char *bb_range;
 };
 
-static int count_one_bits(__u64 word)
+#define RDEV_RANGE(rdev_bb, i) \
+	((struct rdev_bbs_range *)((rdev_bb)->bb_range + (size_t)(i) * (rdev_bb)->stride))
+
+static struct rdev_bbs *alloc_rdev_bbs(int raid_disks)
 {
-	int i, ret = 0;
-	int len = MAX_RDEV_NUM;
+	struct rdev_bbs *rdev_bb;
+
+	rdev_bb = calloc(1, sizeof(struct rdev_bbs));
+	if (NULL == rdev_bb)
+		return NULL;
+
+	rdev_bb->nr_words = (raid_disks + 63) / 64;
+	rdev_bb->stride = sizeof(struct rdev_bbs_range) + sizeof(__u64) * rdev_bb->nr_words;
+	rdev_bb->bb_range = calloc(MAX_BBS + 2, rdev_bb->stride);
+	if (NULL == rdev_bb->bb_range) {
+		free(rdev_bb);
+		return NULL;
+	}
+
+	return rdev_bb;
+}
+
+static void free_rdev_bbs(struct rdev_bbs *rdev_bb)
+{
+	free(rdev_bb->bb_range);
+	free(rdev_bb);
+}
+
+static void set_rdev(struct rdev_bbs_range *range, int idx)
+{
+	range->rdev_bitmap[idx / 64] |= 1ULL << (idx % 64);
+}
+
+static int only_rdev(struct rdev_bbs *rdev_bb, struct rdev_bbs_range *range, int idx)
+{
+	int i;
 
-	for (i = 0; i < len; i ++) {
-		if (word & (1LL << i))
-			++ret;
+	for (i = 0; i < rdev_bb->nr_words; i ++) {
+		if (range->rdev_bitmap[i] != (i == idx / 64 ? 1ULL << (idx % 64) : 0))
+			return 0;
 	}
 
+	return 1;
+}
+
+static void copy_rdevs(struct rdev_bbs *rdev_bb, struct rdev_bbs_range *dst,
+		       const struct rdev_bbs_range *src)
+{
+	memcpy(dst->rdev_bitmap, src->rdev_bitmap, sizeof(__u64) * rdev_bb->nr_words);
+}
+
+static int count_rdevs(struct rdev_bbs *rdev_bb, struct rdev_bbs_range *range)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < rdev_bb->nr_words; i ++)
+		ret += __builtin_popcountll(range->rdev_bitmap[i]);
+
 	return ret;
 }
 
 static int insert_range(struct rdev_bbs *rdev_bb, struct rdev_bbs_range *new, int pos)
 {
-	struct rdev_bbs_range *range = &rdev_bb->bb_range[pos];
+	struct rdev_bbs_range *range = RDEV_RANGE(rdev_bb, pos);
 
 	if (rdev_bb->bb_cnt > MAX_BBS - 1) {
 		fprintf(stderr, "rdev no space to store badblocks\n");
@@ -116,8 +195,8 @@ static int insert_range(struct rdev_bbs *rdev_bb, struct rdev_bbs_range *new, in
 	}
 
 	if (rdev_bb->bb_cnt - pos > 0)
-		memmove(range + 1, range, sizeof(struct rdev_bbs_range) * (rdev_bb->bb_cnt - pos));
-	memcpy(range, new, sizeof(struct rdev_bbs_range));
+		memmove(RDEV_RANGE(rdev_bb, pos + 1), range, rdev_bb->stride * (rdev_bb->bb_cnt - pos));
+	memcpy(range, new, rdev_bb->stride);
 	rdev_bb->bb_cnt ++;
 
 	return 0;
@@ -133,48 +212,56 @@ static int is_last_range(struct rdev_bbs *rdev_bb, int pos)
 
 static void merge_or_split(struct rdev_bbs *rdev_bb, int idx, __u64 bad_sector, int len)
 {
-	int i, count;
+	int i, count, lo, hi, mid;
 	__u64 start_sector, end_sector, tmp_sector;
 	struct rdev_bbs_range *range;
-	struct rdev_bbs_range tmp;
+	struct rdev_bbs_range *tmp = RDEV_RANGE(rdev_bb, MAX_BBS);
+	struct rdev_bbs_range *split_range = RDEV_RANGE(rdev_bb, MAX_BBS + 1);
 
-	memset(&tmp, 0, sizeof(struct rdev_bbs_range));
-	tmp.start_sector = bad_sector;
-	tmp.len = len;
-	tmp.rdev_bitmap |= (1 << idx);
+	memset(tmp, 0, rdev_bb->stride);
+	tmp->start_sector = bad_sector;
+	tmp->len = len;
+	set_rdev(tmp, idx);
 
 	count = rdev_bb->bb_cnt;
 	if (0 == count) {
-		insert_range(rdev_bb, &tmp, 0);
+		insert_range(rdev_bb, tmp, 0);
 		return;
 	}
 
-	for (i = 0; i < count; i ++) {
-		range = &rdev_bb->bb_range[i];
-		start_sector = range->start_sector;
-		end_sector = range->len + start_sector - 1;
-
-		if (rdev_bb->bb_range[i].start_sector > tmp.start_sector)
-			break;
-
-		if (start_sector <= (tmp.start_sector + len) && end_sector >= tmp.start_sector)
-			break;
+	/*
+	 * The ranges are sorted and apart, so the first one that ends at or
+	 * after the new one starts is where it goes, or what it overlaps.
+	 */
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		range = RDEV_RANGE(rdev_bb, mid);
+		if (range->start_sector + range->len - 1 < tmp->start_sector)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	i = lo;
+	range = RDEV_RANGE(rdev_bb, i < count ? i : count - 1);
+	start_sector = range->start_sector;
+	end_sector = range->len + start_sector - 1;
 
 	while (1) {
-		if (start_sector > (tmp.start_sector + tmp.len) || end_sector < tmp.start_sector) {
-			insert_range(rdev_bb, &tmp, i);
+		if (start_sector > (tmp->start_sector + tmp->len) || end_sector < tmp->start_sector) {
+			insert_range(rdev_bb, tmp, i);
 			break;
 		}
 
 		/* overlap */
-		if (range->rdev_bitmap == (1 << idx)) {
-			if (start_sector > tmp.start_sector) {
-				range->start_sector = tmp.start_sector;
-				range->len += start_sector - tmp.start_sector;
+		if (only_rdev(rdev_bb, range, idx)) {
+			if (start_sector > tmp->start_sector) {
+				range->start_sector = tmp->start_sector;
+				range->len += start_sector - tmp->start_sector;
 			}
 
-			tmp_sector = tmp.start_sector + tmp.len - 1;
+			tmp_sector = tmp->start_sector + tmp->len - 1;
 			if (end_sector >= tmp_sector)
 				return;
 
@@ -183,81 +270,80 @@ static void merge_or_split(struct rdev_bbs *rdev_bb, int idx, __u64 bad_sector,
 				return;
 			}
 
-			tmp_sector = rdev_bb->bb_range[i + 1].start_sector;
-			if (tmp.start_sector + tmp.len > tmp_sector) {
+			tmp_sector = RDEV_RANGE(rdev_bb, i + 1)->start_sector;
+			if (tmp->start_sector + tmp->len > tmp_sector) {
 				range->len = tmp_sector - range->start_sector;
 
-				tmp.len = tmp.start_sector + tmp.len - tmp_sector;
-				tmp.start_sector = tmp_sector;
+				tmp->len = tmp->start_sector + tmp->len - tmp_sector;
+				tmp->start_sector = tmp_sector;
 
-				range = &rdev_bb->bb_range[++i];
+				range = RDEV_RANGE(rdev_bb, ++i);
 				start_sector = range->start_sector;
 				end_sector = range->len + start_sector - 1;
 			} else {
-				range->len += tmp.start_sector + tmp.len - 1 - end_sector;
+				range->len += tmp->start_sector + tmp->len - 1 - end_sector;
 				return;
 			}
 		} else {
-			struct rdev_bbs_range split_range;
 			int is_split = 0;
 
-			if (start_sector > tmp.start_sector) {
-				split_range.start_sector = tmp.start_sector;
-				split_range.len = start_sector - tmp.start_sector;
-				split_range.rdev_bitmap = tmp.rdev_bitmap;
-				if (insert_range(rdev_bb, &split_range, i))
+			if (start_sector > tmp->start_sector) {
+				split_range->start_sector = tmp->start_sector;
+				split_range->len = start_sector - tmp->start_sector;
+				copy_rdevs(rdev_bb, split_range, tmp);
+				if (insert_range(rdev_bb, split_range, i))
 					return;
 
-				tmp.len = tmp.start_sector + tmp.len - start_sector;
-				tmp.start_sector = start_sector;
+				tmp->len = tmp->start_sector + tmp->len - start_sector;
+				tmp->start_sector = start_sector;
 				is_split = 1;
-			} else if (start_sector < tmp.start_sector) {
-				range->len = range->start_sector + range->len - tmp.start_sector;
-				range->start_sector = tmp.start_sector;
-
-				split_range.start_sector = start_sector;
-				split_range.len = tmp.start_sector - start_sector;
-				split_range.rdev_bitmap = range->rdev_bitmap;
-				if (insert_range(rdev_bb, &split_range, i))
+			} else if (start_sector < tmp->start_sector) {
+				range->len = range->start_sector + range->len - tmp->start_sector;
+				range->start_sector = tmp->start_sector;
+
+				split_range->start_sector = start_sector;
+				split_range->len = tmp->start_sector - start_sector;
+				copy_rdevs(rdev_bb, split_range, range);
+				if (insert_range(rdev_bb, split_range, i))
 					return;
 				is_split = 1;
 			}
 
 			if (is_split) {
-				range = &rdev_bb->bb_range[++i];
+				range = RDEV_RANGE(rdev_bb, ++i);
 				start_sector = range->start_sector;
 				end_sector = range->len + start_sector - 1;
 			}
 
-			tmp_sector = tmp.start_sector + tmp.len - 1;
+			tmp_sector = tmp->start_sector + tmp->len - 1;
 			if (tmp_sector > end_sector) {
-				tmp.start_sector = end_sector + 1;
-				tmp.len = tmp_sector - end_sector;
+				tmp->start_sector = end_sector + 1;
+				tmp->len = tmp_sector - end_sector;
 
-				range->rdev_bitmap |= (1 << idx);
-				//printf("start_sector %llu, len %d\n", tmp.start_sector, tmp.len);
+				set_rdev(range, idx);
+				//printf("start_sector %llu, len %d\n", tmp->start_sector, tmp->len);
 
 				if (! is_last_range(rdev_bb, i)) {
-					range = &rdev_bb->bb_range[++i];
+					range = RDEV_RANGE(rdev_bb, ++i);
 					start_sector = range->start_sector;
 					end_sector = range->len + start_sector - 1;
 				}
 
 				continue;
 			} else if (tmp_sector < end_sector) {
-				split_range.start_sector = tmp_sector + 1;
-				split_range.len = end_sector - tmp_sector;
-				split_range.rdev_bitmap = range->rdev_bitmap;
+				split_range->start_sector = tmp_sector + 1;
+				split_range->len = end_sector - tmp_sector;
+				copy_rdevs(rdev_bb, split_range, range);
 
-				if (insert_range(rdev_bb, &split_range, i + 1))
+				if (insert_range(rdev_bb, split_range, i + 1))
 					return;
 
 				range->len = tmp_sector - range->start_sector + 1;
-				range->rdev_bitmap |= (1 << idx);
+				set_rdev(range, idx);
 
 				break;
 			} else {
-				range->rdev_bitmap |= (1 << idx);
+				set_rdev(range, idx);
 				break;
 			}
 		}
@@ -283,48 +369,143 @@ static void align_with_stripe(__u64 *sector, int *len)
 	*len = tmp_len;
 }
 
-static int get_rdev_badblocks(const char *raid_name, int idx, struct rdev_bbs *rdev_badblocks)
+/* bad range map given with -m, read as warm-start cache and rewritten */
+static struct bbmap *warm_map;
+static struct bbmap_writer *map_writer;
+
+/* bad ranges of one member, parsed on its own before the merge */
+struct rdev_arena {
+	int ret;
+	__u64 generation;
+	int bb_cnt;
+	int bb_max;
+
+	struct bad_range *bb_range;
+};
+
+static int add_arena_range(struct rdev_arena *arena, __u64 bad_block, int len)
+{
+	struct bad_range *range;
+
+	if (arena->bb_cnt == arena->bb_max) {
+		int max = arena->bb_max ? arena->bb_max * 2 : 64;
+
+		range = realloc(arena->bb_range, sizeof(struct bad_range) * max);
+		if (NULL == range)
+			return -1;
+		arena->bb_range = range;
+		arena->bb_max = max;
+	}
+
+	range = &arena->bb_range[arena->bb_cnt++];
+	range->start_sector = bad_block;
+	range->len = len;
+
+	return 0;
+}
+
+/*
+ * What fix_sector -m found unreadable on member idx, from the -m map.
+ * The section is skipped when it was made on another array or with
+ * another data offset, or when that can't be told because md/uuid
+ * can't be read.
+ */
+static int get_rdev_mapped(const char *raid_name, int idx, s64 data_offset,
+			   struct rdev_arena *arena)
 {
-	char pathname[BUF_SIZE];
-	char buf[BUF_SIZE];
-	int data_offset, is_bad = 0, i, len;
-	FILE *fp;
+	const struct bbmap_section *sec;
+	struct bbmap_range *ranges;
+	char name[BBMAP_NAME_LEN], serial[BBMAP_NAME_LEN - 16];
 	__u64 bad_block;
+	u8 uuid[16];
+	int i, nr, len;
+
+	if (NULL == warm_map || attr_md_serial(raid_name, idx, serial, sizeof(serial)))
+		return 0;
 
-	sprintf(pathname, "/sys/block/%s/md/rd%d", raid_name, idx);
-	/* rdev may be faulty */
-	if (access(pathname, R_OK))
+	snprintf(name, sizeof(name), "%s:%d", serial, idx);
+	sec = bbmap_find(warm_map, BBMAP_MEMBER, name);
+	if (NULL == sec)
 		return 0;
 
-	sprintf(pathname, "/sys/block/%s/md/rd%d/offset", raid_name, idx);
-	if (get_sys_attr(pathname, buf) ||
-				(sscanf(buf, "%d", &data_offset)) != 1)
+	if (attr_md_uuid(raid_name, uuid) ||
+	    bbmap_member_generation(uuid, data_offset) != sec->generation)
+		return 0;
+
+	ranges = malloc(sizeof(struct bbmap_range) * (sec->nr_ranges + 1));
+	if (NULL == ranges)
+		return -1;
+
+	nr = bbmap_decode(warm_map, sec, ranges, sec->nr_ranges);
+	for (i = 0; i < nr; i ++) {
+		/* whole member sectors, like bad_blocks */
+		if (ranges[i].start + ranges[i].len <= (__u64)data_offset)
+			continue;
+		if (ranges[i].start < (__u64)data_offset) {
+			bad_block = 0;
+			len = ranges[i].start + ranges[i].len - data_offset;
+		} else {
+			bad_block = ranges[i].start - data_offset;
+			len = ranges[i].len;
+		}
+		align_with_stripe(&bad_block, &len);
+		if (add_arena_range(arena, bad_block, len))
+			break;
+	}
+	arena->generation = bbmap_hash(arena->generation, ranges, sizeof(struct bbmap_range) * i);
+	free(ranges);
+
+	return nr < 0 || i < nr ? -1 : 0;
+}
+
+static int get_rdev_badblocks(const char *raid_name, int idx, struct rdev_arena *arena)
+{
+	char pathname[BUF_SIZE];
+	struct attr_buf *buf = attr_local_buf();
+	const char *pos, *end;
+	int data_offset, is_bad, i, len, ret;
+	s64 offset;
+	__u64 bad_block;
+
+	if (NULL == buf)
 		return -1;
 
+	arena->generation = BBMAP_HASH_INIT;
+
+	sprintf(pathname, "%s/block/%s/md/rd%d/offset", attr_root(ROOT_SYS), raid_name, idx);
+	if (attr_read_s64(pathname, NULL, &offset)) {
+		/* rdev may be faulty */
+		if (ENOENT == errno)
+			return 0;
+		perror("read error");
+		return -1;
+	}
+	data_offset = offset;
+	arena->generation = bbmap_hash(arena->generation, &offset, sizeof(offset));
+
+	if (get_rdev_mapped(raid_name, idx, offset, arena))
+		return -1;
 
 	for (i = 0; i < 2; i ++) {
 		if (0 == i)
-			sprintf(pathname, "/sys/block/%s/md/rd%d/bad_blocks", raid_name, idx);
+			sprintf(pathname, "%s/block/%s/md/rd%d/bad_blocks",
+					attr_root(ROOT_SYS), raid_name, idx);
 		else
-			sprintf(pathname, "/sys/block/%s/md/rd%d/unacknowledged_bad_blocks", raid_name, idx);
+			sprintf(pathname, "%s/block/%s/md/rd%d/unacknowledged_bad_blocks",
+					attr_root(ROOT_SYS), raid_name, idx);
 
-		fp = fopen(pathname, "r");
-		if (NULL == fp) {
+		if (attr_read(pathname, buf)) {
 			//if (errno == ENOENT)
 			return 0;
 		}
+		arena->generation = bbmap_hash(arena->generation, buf->data, buf->len);
 
-		while (!feof(fp)) {
-			memset(buf, 0, BUF_SIZE);
-			fgets(buf, BUF_SIZE, fp);
-			switch(sscanf(buf, "%llu %d", &bad_block, &len)) {
-			case 2:
-				if (len <= 0)
-					is_bad = 1;
-				break;
-			default:
+		pos = buf->data;
+		end = buf->data + buf->len;
+		is_bad = 0;
+		while ((ret = attr_next_range(&pos, end, &bad_block, &len)) != 0) {
+			if (ret < 0 || len <= 0)
 				is_bad = 1;
-			}
 			if (is_bad)
 				break;
 
@@ -338,203 +519,928 @@ static int get_rdev_badblocks(const char *raid_name, int idx, struct rdev_bbs *r
 				bad_block -= data_offset;
 
 			align_with_stripe(&bad_block, &len);
-			/* split or merge */
-			merge_or_split(rdev_badblocks, idx, bad_block, len);
-			/*
-			int m;
-			for (m = 0; m < rdev_badblocks->bb_cnt; m ++) {
-				struct rdev_bbs_range *range = &rdev_badblocks->bb_range[m];
-				printf("range start_sector %llu, len %d, %lx\n", range->start_sector, range->len, range->rdev_bitmap);
-			}
-			*/
+			if (add_arena_range(arena, bad_block, len))
+				return -1;
 		}
 	}
 
-	fclose(fp);
-
 	return 0;
 }
 
-static int fill_lvm_bbs(const char *raid_name, __u64 start, __u64 end,
-						__u64 lvm_offset, struct lvm_bbs *lvm_badblocks)
+/*
+ * Per-array state shared by every dm segment on the array, so the md
+ * attributes and member bad_blocks are parsed once per run.
+ */
+struct raid_info {
+	int maj, min;
+	char name[64];
+	int state;
+
+	int chunk_sector;
+	int raid_disks;
+	int degraded;
+	int max_degraded;
+
+	/* one per member while loading */
+	struct rdev_arena *rdev;
+
+	/* sorted, coalesced failed ranges in array sectors */
+	int bb_cnt;
+	struct bbmap_range *bb_range;
+	__u64 generation;
+
+	struct raid_info *next;
+};
+
+enum {
+	RAID_UNLOADED,
+	RAID_ACTIVE,
+	RAID_INACTIVE,
+};
+
+static struct raid_info *raid_hash[RAID_HASH_SIZE];
+static int nr_workers = 1;
+
+static int get_raid_attr(struct raid_info *raid)
 {
 	char pathname[BUF_SIZE];
-	char buf[BUF_SIZE];
-	int chunk_sector, raid_disks, level, ret, i;
-	struct rdev_bbs *rdev_badblocks;
+	const char *raid_name = raid->name;
+	int chunk_sector, raid_disks, level;
 	int degraded, max_degraded;
 
-	__u64 failed_stripe, raid_failed_stripe, raid_len;
-	int chunk_offset;
-
 	/* get raid attr */
-	sprintf(pathname, "/sys/block/%s/md/chunk_size", raid_name);
-	if (get_sys_attr(pathname, buf) ||
-				(sscanf(buf, "%d", &chunk_sector) != 1))
-		goto err;
+	sprintf(pathname, "%s/block/%s/md/chunk_size", attr_root(ROOT_SYS), raid_name);
+	if (get_sys_attr(pathname, NULL, &chunk_sector))
+		return -1;
 	chunk_sector = chunk_sector >> 9;
 
-	sprintf(pathname, "/sys/block/%s/md/raid_disks", raid_name);
-	if (get_sys_attr(pathname, buf) ||
-				(sscanf(buf, "%d", &raid_disks) != 1))
-		goto err;
+	sprintf(pathname, "%s/block/%s/md/raid_disks", attr_root(ROOT_SYS), raid_name);
+	if (get_sys_attr(pathname, NULL, &raid_disks))
+		return -1;
 
-	sprintf(pathname, "/sys/block/%s/md/degraded", raid_name);
-	if (get_sys_attr(pathname, buf) ||
-				(sscanf(buf, "%d", &degraded)) != 1)
-		goto err;
+	sprintf(pathname, "%s/block/%s/md/degraded", attr_root(ROOT_SYS), raid_name);
+	if (get_sys_attr(pathname, NULL, &degraded))
+		return -1;
 
-	sprintf(pathname, "/sys/block/%s/md/level", raid_name);
-	if (get_sys_attr(pathname, buf) ||
-				(sscanf(buf, "raid%d", &level)) != 1)
-		goto err;
+	sprintf(pathname, "%s/block/%s/md/level", attr_root(ROOT_SYS), raid_name);
+	if (get_sys_attr(pathname, "raid", &level))
+		return -1;
 	if (6 == level)
 		max_degraded = 2;
 	else if (5 == level)
 		max_degraded = 1;
 	else
-		goto err;
+		return -1;
+
+	raid->chunk_sector = chunk_sector;
+	raid->raid_disks = raid_disks;
+	raid->degraded = degraded;
+	raid->max_degraded = max_degraded;
+
+	raid->rdev = calloc(raid_disks, sizeof(struct rdev_arena));
+	if (NULL == raid->rdev)
+		return -1;
+
+	return 0;
+}
+
+/* merge the member arenas in role order, as a serial load would */
+static int merge_raid_badblocks(struct raid_info *raid)
+{
+	struct rdev_bbs *rdev_badblocks;
+	int chunk_sector = raid->chunk_sector;
+	int raid_disks = raid->raid_disks;
+	int max_degraded = raid->max_degraded;
+	int data_disks = raid_disks - max_degraded;
+	int i, k;
+
+	__u64 failed_stripe;
+	int chunk_offset;
 
 	/* get rdev badblocks */
-	rdev_badblocks = malloc(sizeof(struct rdev_bbs));
+	rdev_badblocks = alloc_rdev_bbs(raid_disks);
 	if (NULL == rdev_badblocks)
-		goto err;
-
-	memset(rdev_badblocks, 0, sizeof(struct rdev_bbs));
+		return -1;
 
 	for (i = 0; i < raid_disks; i ++) {
-		ret = get_rdev_badblocks(raid_name, i, rdev_badblocks);
-		if (ret) {
-			free(rdev_badblocks);
-			return -1;
-		}
+		struct rdev_arena *arena = &raid->rdev[i];
+
+		if (arena->ret)
+			goto err_free;
+
+		/* split or merge */
+		for (k = 0; k < arena->bb_cnt; k ++)
+			merge_or_split(rdev_badblocks, i, arena->bb_range[k].start_sector,
+						arena->bb_range[k].len);
+	}
+
+	if (rdev_badblocks->bb_cnt && raid->degraded > max_degraded) {
+		fprintf(stderr, "raid is inactive\n");
+		goto err_free;
 	}
 
+	raid->bb_range = malloc(sizeof(struct bbmap_range) *
+					(rdev_badblocks->bb_cnt * data_disks + 1));
+	if (NULL == raid->bb_range)
+		goto err_free;
+
 	/* calculate raid badblocks */
 	for (i = 0; i < rdev_badblocks->bb_cnt; i ++) {
 		int j;
 		struct rdev_bbs_range *range;
 
-		range = &rdev_badblocks->bb_range[i];
-		if (degraded > max_degraded) {
-			fprintf(stderr, "raid is inactive\n");
-			free(rdev_badblocks);
-			return -1;
-		}
-
-		if ((count_one_bits(range->rdev_bitmap) + degraded) <= max_degraded)
+		range = RDEV_RANGE(rdev_badblocks, i);
+		if ((count_rdevs(rdev_badblocks, range) + raid->degraded) <= max_degraded)
 			continue;
 
 		failed_stripe = range->start_sector / chunk_sector;
 		chunk_offset = range->start_sector % chunk_sector;
 		//printf("failed stripe %llu, chunk offset %d\n", failed_stripe, chunk_offset);
-		for (j = 0; j < raid_disks; j ++) {
-			raid_failed_stripe = (failed_stripe * (raid_disks - max_degraded) + j)
+		/* a stripe holds data_disks chunks of the array, parity is not mapped */
+		for (j = 0; j < data_disks; j ++) {
+			struct bbmap_range *bb = &raid->bb_range[raid->bb_cnt++];
+
+			bb->start = (failed_stripe * data_disks + j)
 							* chunk_sector + chunk_offset;
-			raid_len = range->len;
-			//printf("raid %llu, len %d\n", raid_failed_stripe, raid_len);
+			bb->len = range->len;
+		}
+	}
+	raid->bb_cnt = bbmap_normalize(raid->bb_range, raid->bb_cnt);
 
-			/* calculate lvm badblocks */
-			if ((lvm_offset > raid_failed_stripe + raid_len) ||
-					(lvm_offset + end < raid_failed_stripe))
-				continue;
+	free_rdev_bbs(rdev_badblocks);
 
-			if (raid_failed_stripe >= lvm_offset)
-				lvm_badblocks->bb_range[lvm_badblocks->bb_cnt].start_sector =
-							start + raid_failed_stripe - lvm_offset;
-			else
-				lvm_badblocks->bb_range[lvm_badblocks->bb_cnt].start_sector = start;
-
-			if ((lvm_offset + end) >= (raid_failed_stripe + raid_len))
-				lvm_badblocks->bb_range[lvm_badblocks->bb_cnt].len = range->len;
-			else {
-				int m;
-				m = raid_failed_stripe + raid_len - lvm_offset - end;
-				lvm_badblocks->bb_range[lvm_badblocks->bb_cnt].len =
-						range->len - m;
-			}
+	return 0;
+
+err_free:
+	free_rdev_bbs(rdev_badblocks);
+	return -1;
+}
+
+/*
+ * The kernel keeps no generation counter for bad block lists, so the
+ * key is a hash of the md attributes and of the raw member lists.
+ */
+static int raid_generation(struct raid_info *raid)
+{
+	__u64 gen = BBMAP_HASH_INIT;
+	int i;
+
+	gen = bbmap_hash(gen, &raid->chunk_sector, sizeof(int));
+	gen = bbmap_hash(gen, &raid->raid_disks, sizeof(int));
+	gen = bbmap_hash(gen, &raid->degraded, sizeof(int));
+	gen = bbmap_hash(gen, &raid->max_degraded, sizeof(int));
+
+	for (i = 0; i < raid->raid_disks; i ++) {
+		if (raid->rdev[i].ret)
+			return -1;
+		gen = bbmap_hash(gen, &raid->rdev[i].generation, sizeof(__u64));
+	}
+
+	raid->generation = gen;
+	return 0;
+}
+
+/* take the array ranges from the -m map if its generation still matches */
+static int load_cached_raid(struct raid_info *raid)
+{
+	const struct bbmap_section *sec;
+	int nr;
+
+	if (NULL == warm_map)
+		return -1;
+
+	sec = bbmap_find(warm_map, BBMAP_ARRAY, raid->name);
+	if (NULL == sec || sec->generation != raid->generation)
+		return -1;
+
+	raid->bb_range = malloc(sizeof(struct bbmap_range) * (sec->nr_ranges + 1));
+	if (NULL == raid->bb_range)
+		return -1;
+
+	nr = bbmap_decode(warm_map, sec, raid->bb_range, sec->nr_ranges);
+	if (nr < 0) {
+		free(raid->bb_range);
+		raid->bb_range = NULL;
+		return -1;
+	}
+	raid->bb_cnt = nr;
+
+	return 0;
+}
+
+static void free_raid_arena(struct raid_info *raid)
+{
+	int i;
+
+	if (NULL == raid->rdev)
+		return;
+
+	for (i = 0; i < raid->raid_disks; i ++)
+		free(raid->rdev[i].bb_range);
+	free(raid->rdev);
+	raid->rdev = NULL;
+}
+
+struct raid_load {
+	struct raid_info **raids;
+	int nr_raids;
+
+	/* (array, member) pairs of the member stage */
+	struct raid_info **job_raid;
+	int *job_idx;
+};
+
+static void load_attr_work(void *ctx, int job)
+{
+	struct raid_load *load = ctx;
+	struct raid_info *raid = load->raids[job];
+
+	if (get_raid_attr(raid))
+		raid->state = RAID_INACTIVE;
+}
+
+static void load_rdev_work(void *ctx, int job)
+{
+	struct raid_load *load = ctx;
+	struct raid_info *raid = load->job_raid[job];
+	int idx = load->job_idx[job];
+
+	raid->rdev[idx].ret = get_rdev_badblocks(raid->name, idx, &raid->rdev[idx]);
+}
+
+static void load_merge_work(void *ctx, int job)
+{
+	struct raid_load *load = ctx;
+	struct raid_info *raid = load->raids[job];
+
+	if (raid->state == RAID_UNLOADED) {
+		if (raid_generation(raid))
+			raid->state = RAID_INACTIVE;
+		else if (!load_cached_raid(raid) || !merge_raid_badblocks(raid))
+			raid->state = RAID_ACTIVE;
+		else
+			raid->state = RAID_INACTIVE;
+	}
+	free_raid_arena(raid);
+}
+
+/*
+ * Load arrays in three stages on the worker pool: md attributes per
+ * array, bad_blocks per (array, member), then the per-array merge.
+ * Every stage writes only its own slot and the merge walks members in
+ * role order, so the result does not depend on the number of workers.
+ */
+static int load_raid_info(struct raid_info **raids, int nr_raids)
+{
+	struct raid_load load;
+	int i, j, nr_jobs = 0;
+
+	load.raids = raids;
+	load.nr_raids = nr_raids;
+	run_work_pool(nr_workers, nr_raids, load_attr_work, &load);
+
+	for (i = 0; i < nr_raids; i ++) {
+		if (raids[i]->state == RAID_UNLOADED)
+			nr_jobs += raids[i]->raid_disks;
+	}
+
+	load.job_raid = malloc(sizeof(struct raid_info *) * (nr_jobs + 1));
+	load.job_idx = malloc(sizeof(int) * (nr_jobs + 1));
+	if (NULL == load.job_raid || NULL == load.job_idx) {
+		free(load.job_raid);
+		free(load.job_idx);
+		for (i = 0; i < nr_raids; i ++) {
+			free_raid_arena(raids[i]);
+			raids[i]->state = RAID_INACTIVE;
+		}
+		return -1;
+	}
+
+	nr_jobs = 0;
+	for (i = 0; i < nr_raids; i ++) {
+		if (raids[i]->state != RAID_UNLOADED)
+			continue;
+		for (j = 0; j < raids[i]->raid_disks; j ++) {
+			load.job_raid[nr_jobs] = raids[i];
+			load.job_idx[nr_jobs] = j;
+			nr_jobs ++;
+		}
+	}
+	run_work_pool(nr_workers, nr_jobs, load_rdev_work, &load);
+	run_work_pool(nr_workers, nr_raids, load_merge_work, &load);
+
+	free(load.job_raid);
+	free(load.job_idx);
+
+	return 0;
+}
+
+static struct raid_info *lookup_raid_info(int maj, int min)
+{
+	struct raid_info *raid;
+	int hash = (maj * 31 + min) % RAID_HASH_SIZE;
+
+	for (raid = raid_hash[hash]; raid; raid = raid->next) {
+		if (raid->maj == maj && raid->min == min)
+			return raid;
+	}
+
+	raid = calloc(1, sizeof(struct raid_info));
+	if (NULL == raid)
+		return NULL;
+
+	if (get_name_by_devno(maj, min, raid->name)) {
+		fprintf(stderr, "can't find %d:%d devname\n", maj, min);
+		free(raid);
+		return NULL;
+	}
+
+	raid->maj = maj;
+	raid->min = min;
+	raid->state = RAID_UNLOADED;
+
+	raid->next = raid_hash[hash];
+	raid_hash[hash] = raid;
+
+	return raid;
+}
+
+static struct raid_info *get_raid_info(int maj, int min)
+{
+	struct raid_info *raid;
+
+	raid = lookup_raid_info(maj, min);
+	if (raid && raid->state == RAID_UNLOADED)
+		load_raid_info(&raid, 1);
+
+	return raid;
+}
+
+static void put_raid_info(void)
+{
+	struct raid_info *raid;
+	int i;
+
+	for (i = 0; i < RAID_HASH_SIZE; i ++) {
+		while ((raid = raid_hash[i]) != NULL) {
+			raid_hash[i] = raid->next;
+			free_raid_arena(raid);
+			free(raid->bb_range);
+			free(raid);
+		}
+	}
+}
+
+/* segments are filled in table order, sort and merge across their boundaries */
+static int sort_lvm_bbs(struct lvm_bbs *lvm_badblocks)
+{
+	struct bbmap_range *ranges;
+	int i, nr = lvm_badblocks->bb_cnt;
+
+	ranges = malloc(sizeof(struct bbmap_range) * (nr + 1));
+	if (NULL == ranges)
+		return -1;
+
+	for (i = 0; i < nr; i ++) {
+		ranges[i].start = lvm_badblocks->bb_range[i].start_sector;
+		ranges[i].len = lvm_badblocks->bb_range[i].len;
+	}
+
+	nr = bbmap_normalize(ranges, nr);
+	for (i = 0; i < nr; i ++) {
+		lvm_badblocks->bb_range[i].start_sector = ranges[i].start;
+		lvm_badblocks->bb_range[i].len = ranges[i].len;
+	}
+	lvm_badblocks->bb_cnt = nr;
+
+	free(ranges);
+	return 0;
+}
+
+/*
+ * A failed range on a striped leg comes back one chunk at a time, and
+ * the chunks of the other legs often fill the gaps in between: merge
+ * what is there before growing, and grow only while that doesn't free
+ * half of it.
+ */
+static int add_lvm_bb(struct lvm_bbs *lvm_badblocks, __u64 start, __u64 len)
+{
+	struct bad_range *range;
+	int max;
+
+	if (lvm_badblocks->bb_cnt == lvm_badblocks->bb_max &&
+	    (sort_lvm_bbs(lvm_badblocks) || lvm_badblocks->bb_cnt * 2 >= lvm_badblocks->bb_max)) {
+		max = lvm_badblocks->bb_max ? lvm_badblocks->bb_max * 2 : MAX_BBS;
+		range = realloc(lvm_badblocks->bb_range, sizeof(struct bad_range) * max);
+		if (NULL == range) {
+			fprintf(stderr, "No space to store lvm badblocks\n");
+			return -1;
+		}
+		lvm_badblocks->bb_range = range;
+		lvm_badblocks->bb_max = max;
+	}
+
+	range = &lvm_badblocks->bb_range[lvm_badblocks->bb_cnt ++];
+	range->start_sector = start;
+	range->len = len;
+
+	return 0;
+}
+
+/* devices under the dm devices are resolved once a run and shared */
+static struct stack_resolver resolver = {.keep = 1};
+static int majors_loaded;
+
+/*
+ * Project the array ranges under leg @leg of an extent of the stack
+ * onto the dm device. A range on a striped leg goes back one chunk at
+ * a time, the chunks around it belong to the other legs.
+ */
+static int fill_lvm_bbs(struct raid_info *raid, const struct dev_stack *stack,
+			const struct stack_extent *ext, int leg, struct lvm_bbs *lvm_badblocks)
+{
+	struct bbmap_range *range;
+	__u64 lo, hi, end, leg_lo, leg_hi, offset = stack->legs[ext->leg + leg].offset;
+	int l = 0, h, m;
+
+	stack_leg_range(stack, ext, leg, 0, ext->len, &leg_lo, &leg_hi);
+
+	/* ranges are sorted and disjoint, find the first one ending past leg_lo */
+	h = raid->bb_cnt;
+	while (l < h) {
+		m = (l + h) / 2;
+		range = &raid->bb_range[m];
+		if (range->start + range->len > leg_lo)
+			h = m;
+		else
+			l = m + 1;
+	}
 
-			lvm_badblocks->bb_cnt ++;
-			if (lvm_badblocks->bb_cnt == MAX_BBS) {
-				fprintf(stderr, "No space to store lvm badblocks\n");
-				free(rdev_badblocks);
+	for (; l < raid->bb_cnt; l ++) {
+		range = &raid->bb_range[l];
+		if (range->start >= leg_hi)
+			break;
+
+		lo = (range->start > leg_lo ? range->start : leg_lo) - offset;
+		hi = (range->start + range->len < leg_hi ? range->start + range->len : leg_hi) -
+			offset;
+
+		for (; lo < hi; lo = end) {
+			end = (lo / ext->chunk + 1) * ext->chunk;
+			if (end > hi)
+				end = hi;
+			if (add_lvm_bb(lvm_badblocks, ext->start - ext->phase +
+				       dm_stripe_to_dev(ext->chunk, ext->nr_legs, leg, lo), end - lo))
 				return -1;
-			}
 		}
 	}
 
-	free(rdev_badblocks);
+	return 0;
+}
+
+/*
+ * Every extent of a dm device's stack, on the arrays under its legs.
+ * The generation covers the whole folded mapping, so a change in any
+ * table or partition under the device is seen as well.
+ */
+static int fill_lvm_stack(const struct dev_stack *stack, struct lvm_bbs *lvm_badblocks)
+{
+	const struct stack_extent *ext;
+	struct stack_leg *leg;
+	struct raid_info *raid;
+	int i, j;
+
+	lvm_badblocks->generation = bbmap_hash(lvm_badblocks->generation, stack->ext,
+						sizeof(struct stack_extent) * stack->nr);
+	lvm_badblocks->generation = bbmap_hash(lvm_badblocks->generation, stack->legs,
+						sizeof(struct stack_leg) * stack->nr_legs);
+
+	for (i = 0; i < stack->nr; i ++) {
+		ext = &stack->ext[i];
+		for (j = 0; j < ext->nr_legs; j ++) {
+			leg = &stack->legs[ext->leg + j];
+			raid = get_raid_info(leg->major, leg->minor);
+			if (NULL == raid)
+				continue;
+
+			lvm_badblocks->generation = bbmap_hash(lvm_badblocks->generation,
+								&raid->generation, sizeof(__u64));
+			if (raid->state != RAID_ACTIVE) {
+				fprintf(stderr, "raid %s is inactive\n", raid->name);
+				return -1;
+			}
+			if (fill_lvm_bbs(raid, stack, ext, j, lvm_badblocks))
+				return -1;
+		}
+	}
 
 	return 0;
+}
 
-err:
-	return -1;
+/*
+ * One line of dmsetup table, without the device name prefix: a linear
+ * target, or a striped one with a leg on each of several devices. The
+ * legs are followed through partitions and dm devices to the arrays.
+ */
+static int add_lvm_segment(struct dev_stack *stack, const char *line)
+{
+	struct dm_segment seg;
+
+	if (!majors_loaded) {
+		if (dev_stack_majors(&resolver.dm_major, &resolver.mdp_major))
+			return -1;
+		majors_loaded = 1;
+	}
+
+	if (dm_parse_segment(line, &seg))
+		return 0;
+
+	return dev_stack_add_segment(&resolver, stack, &seg);
+}
+
+struct dm_listing {
+	char **names;
+	char **lines;
+	int nr_lines;
+};
+
+/* a dm device under another from the table already read, found by its dm/name */
+static int listed_table(struct stack_resolver *r, struct dev_stack *stack)
+{
+	struct dm_listing *listing = r->arg;
+	struct attr_buf *buf = attr_local_buf();
+	char pathname[256], name[128];
+	int i, found = 0;
+
+	snprintf(pathname, sizeof(pathname), "%s/dev/block/%d:%d/dm/name", attr_root(ROOT_SYS),
+		 stack->major, stack->minor);
+	if (NULL == buf || attr_read(pathname, buf))
+		return 1;
+	/* the buffer is reused further down the stack */
+	snprintf(name, sizeof(name), "%.*s", (int)strcspn(buf->data, "\n"), buf->data);
+
+	for (i = 0; i < listing->nr_lines; i ++) {
+		if (strcmp(listing->names[i], name))
+			continue;
+		if (add_lvm_segment(stack, listing->lines[i]))
+			return -1;
+		found = 1;
+	}
+
+	return found ? 0 : 1;
 }
 
 int get_lvm_bbs(const char *lvm_name, struct lvm_bbs *lvm_badblocks)
 {
 	FILE *fp;
-	char buf[BUF_SIZE];
-	int maj, min, ret;
-	__u64 start, end, offset;
+	char buf[DM_LINE_SIZE];
+	struct dev_stack *stack;
+	int ret = 0;
 
 	/* clear badblocks table everytime */
 	lvm_badblocks->bb_cnt = 0;
+	lvm_badblocks->generation = BBMAP_HASH_INIT;
 
-	sprintf(buf, "dmsetup table %s", lvm_name);
+	stack = calloc(1, sizeof(struct dev_stack));
+	if (NULL == stack)
+		return -1;
+
+	snprintf(buf, DM_LINE_SIZE, "%s table %s", attr_root(ROOT_DMSETUP), lvm_name);
 	fp = popen(buf, "r");
-	if (NULL == fp)
+	if (NULL == fp) {
+		free_dev_stack(stack);
 		return -1;
+	}
 
-	while (!feof(fp)) {
-		memset(buf, 0, BUF_SIZE);
-		fgets(buf, BUF_SIZE, fp);
-		if ((strstr(buf, "linear")) == NULL)
-			continue;
+	while (!ret && fgets(buf, DM_LINE_SIZE, fp))
+		ret = add_lvm_segment(stack, buf);
 
-		ret = sscanf(buf, "%llu %llu linear %d:%d %llu",
-					&start, &end, &maj, &min, &offset);
-		if (ret != 5)
-			continue;
+	pclose(fp);
 
-		memset(buf, 0, BUF_SIZE);
-		if (get_name_by_devno(maj, min, buf)) {
-			fprintf(stderr, "can't find %d:%d devname\n", maj, min);
-			continue;
+	if (!ret)
+		ret = fill_lvm_stack(stack, lvm_badblocks);
+	free_dev_stack(stack);
+
+	return ret ? -1 : sort_lvm_bbs(lvm_badblocks);
+}
+
+/* load every array under the stacks in one parallel pass */
+static void prefetch_raid_info(struct dev_stack **stacks, int nr_stacks)
+{
+	struct raid_info **raids = NULL, **more, *raid;
+	struct stack_leg *leg;
+	int i, j, k, nr_raids = 0, max_raids = 0;
+
+	for (i = 0; i < nr_stacks; i ++) {
+		for (k = 0; stacks[i] && k < stacks[i]->nr_legs; k ++) {
+			leg = &stacks[i]->legs[k];
+			raid = lookup_raid_info(leg->major, leg->minor);
+			if (NULL == raid || raid->state != RAID_UNLOADED)
+				continue;
+
+			for (j = 0; j < nr_raids; j ++) {
+				if (raids[j] == raid)
+					break;
+			}
+			if (j < nr_raids)
+				continue;
+			if (nr_raids == max_raids) {
+				max_raids = max_raids ? max_raids * 2 : 64;
+				more = realloc(raids, sizeof(struct raid_info *) * max_raids);
+				if (NULL == more)
+					break;
+				raids = more;
+			}
+			raids[nr_raids++] = raid;
 		}
+	}
 
-		ret = fill_lvm_bbs(buf, start, end, offset, lvm_badblocks);
-		if (ret) {
-			fprintf(stderr, "raid %s is inactive\n", buf);
+	load_raid_info(raids, nr_raids);
+	free(raids);
+}
+
+/*
+ * get_all_lvm_bbs:
+ * @report: called once per dm device with its badblocks, or NULL
+ *          badblocks if one of its arrays is inactive.
+ *
+ * Walk the tables of all dm devices with a single dmsetup call.
+ */
+int get_all_lvm_bbs(void (*report)(const char *, struct lvm_bbs *))
+{
+	FILE *fp;
+	char buf[DM_LINE_SIZE];
+	char **names = NULL, **lines = NULL, **more;
+	char *p;
+	struct lvm_bbs *lvm_badblocks;
+	struct dev_stack **stacks = NULL;
+	struct dm_listing listing;
+	int i, nr_lines = 0, max_lines = 0, failed;
+
+	snprintf(buf, DM_LINE_SIZE, "%s table", attr_root(ROOT_DMSETUP));
+	fp = popen(buf, "r");
+	if (NULL == fp)
+		return -1;
+
+	while (fgets(buf, DM_LINE_SIZE, fp)) {
+		if ((p = strstr(buf, ": ")) == NULL)
+			continue;
+		*p = '\0';
+		p += 2;
+
+		if (nr_lines == max_lines) {
+			max_lines = max_lines ? max_lines * 2 : 256;
+			more = realloc(names, sizeof(char *) * max_lines);
+			if (more)
+				names = more;
+			if (more && (more = realloc(lines, sizeof(char *) * max_lines)))
+				lines = more;
+			if (NULL == more) {
+				pclose(fp);
+				goto err;
+			}
+		}
+		names[nr_lines] = strdup(buf);
+		lines[nr_lines] = strdup(p);
+		if (NULL == names[nr_lines] || NULL == lines[nr_lines]) {
+			free(names[nr_lines]);
+			free(lines[nr_lines]);
 			pclose(fp);
-			return -1;
+			goto err;
 		}
+		nr_lines ++;
 	}
 
 	pclose(fp);
 
+	listing.names = names;
+	listing.lines = lines;
+	listing.nr_lines = nr_lines;
+	resolver.table = listed_table;
+	resolver.arg = &listing;
+
+	/* dmsetup prints the lines of one device back to back, the stack is on its last */
+	stacks = calloc(nr_lines + 1, sizeof(struct dev_stack *));
+	if (NULL == stacks)
+		goto err;
+	for (i = 0, failed = 0; i < nr_lines; i ++) {
+		if (0 == i || strcmp(names[i - 1], names[i])) {
+			stacks[i] = calloc(1, sizeof(struct dev_stack));
+			failed = NULL == stacks[i];
+		} else {
+			stacks[i] = stacks[i - 1];
+			stacks[i - 1] = NULL;
+		}
+
+		if (!failed && add_lvm_segment(stacks[i], lines[i])) {
+			free_dev_stack(stacks[i]);
+			stacks[i] = NULL;
+			failed = 1;
+		}
+	}
+
+	prefetch_raid_info(stacks, nr_lines);
+
+	lvm_badblocks = calloc(1, sizeof(struct lvm_bbs));
+	if (NULL == lvm_badblocks)
+		goto err;
+
+	for (i = 0; i < nr_lines; i ++) {
+		if (i < nr_lines - 1 && 0 == strcmp(names[i], names[i + 1]))
+			continue;
+
+		lvm_badblocks->bb_cnt = 0;
+		lvm_badblocks->generation = BBMAP_HASH_INIT;
+		failed = NULL == stacks[i] || fill_lvm_stack(stacks[i], lvm_badblocks) ||
+			 sort_lvm_bbs(lvm_badblocks);
+		report(names[i], failed ? NULL : lvm_badblocks);
+	}
+
+	free(lvm_badblocks->bb_range);
+	free(lvm_badblocks);
+	resolver.table = NULL;
+	for (i = 0; i < nr_lines; i ++) {
+		free_dev_stack(stacks[i]);
+		free(names[i]);
+		free(lines[i]);
+	}
+	free(stacks);
+	free(names);
+	free(lines);
+
 	return 0;
+
+err:
+	resolver.table = NULL;
+	for (i = 0; i < nr_lines; i ++) {
+		if (stacks)
+			free_dev_stack(stacks[i]);
+		free(names[i]);
+		free(lines[i]);
+	}
+	free(stacks);
+	free(names);
+	free(lines);
+
+	return -1;
 }
 
-int main(int argc, char **argv)
+static void print_lvm_bbs(const char *lvm_name, struct lvm_bbs *bad_blocks)
 {
-	int i, ret;
-	struct lvm_bbs bad_blocks;
+	int i;
 
-	if (argc != 2)
-		exit(1);
+	if (NULL == bad_blocks) {
+		fprintf(stderr, "get %s badblocks error\n", lvm_name);
+		return;
+	}
 
-	ret = get_lvm_bbs(argv[1], &bad_blocks);
-	if (ret) {
-		fprintf(stderr, "get lvm badblocks error\n");
-		exit(1);
+	printf("%s has %d bad sectors:\n", lvm_name, bad_blocks->bb_cnt);
+	for (i = 0; i < bad_blocks->bb_cnt; i ++) {
+		printf("start %llu len %d\n", bad_blocks->bb_range[i].start_sector, bad_blocks->bb_range[i].len);
+	}
+}
+
+static void report_lvm_bbs(const char *lvm_name, struct lvm_bbs *bad_blocks)
+{
+	struct bbmap_range *ranges;
+	int i;
+
+	print_lvm_bbs(lvm_name, bad_blocks);
+
+	if (NULL == map_writer || NULL == bad_blocks)
+		return;
+
+	ranges = malloc(sizeof(struct bbmap_range) * (bad_blocks->bb_cnt + 1));
+	if (NULL == ranges)
+		return;
+
+	for (i = 0; i < bad_blocks->bb_cnt; i ++) {
+		ranges[i].start = bad_blocks->bb_range[i].start_sector;
+		ranges[i].len = bad_blocks->bb_range[i].len;
+	}
+
+	if (bbmap_add_section(map_writer, BBMAP_LV, lvm_name, bad_blocks->generation,
+				ranges, bad_blocks->bb_cnt))
+		fprintf(stderr, "can't export %s badblocks\n", lvm_name);
+	free(ranges);
+}
+
+/* write every loaded array and every section of the old map not refreshed */
+static int save_bad_range_map(const char *pathname)
+{
+	struct raid_info *raid;
+	int i;
+
+	for (i = 0; i < RAID_HASH_SIZE; i ++) {
+		for (raid = raid_hash[i]; raid; raid = raid->next) {
+			if (raid->state != RAID_ACTIVE)
+				continue;
+			if (bbmap_add_section(map_writer, BBMAP_ARRAY, raid->name,
+					raid->generation, raid->bb_range, raid->bb_cnt))
+				return -1;
+		}
 	}
 
-	printf("%s has %d bad sectors:\n", argv[1], bad_blocks.bb_cnt);
-	for (i = 0; i < bad_blocks.bb_cnt; i ++) {
-		printf("start %llu len %d\n", bad_blocks.bb_range[i].start_sector, bad_blocks.bb_range[i].len);
+	if (warm_map && bbmap_merge(map_writer, warm_map))
+		return -1;
+
+	return bbmap_write(map_writer, pathname);
+}
+
+static void usage(const char *prog)
+{
+	printf("%s [-j workers] [-m map] [-R root] [lvm_name]...: show badblocks of the given lvm volumes\n", prog);
+	printf("%s [-j workers] [-m map] [-R root] -a: show badblocks of all lvm volumes\n", prog);
+	printf("\t-m: warm start from the bad range map and write it back; what\n"
+	       "\t    fix_sector -m mapped in it counts as bad\n");
+	printf("\t-R: read root/sys, root/proc and root/dmsetup instead of the host's\n");
+	exit(1);
+}
+
+static int finish(const char *map_path, int ret)
+{
+	if (map_path) {
+		if (save_bad_range_map(map_path)) {
+			perror("write bad range map");
+			ret = 1;
+		}
+		bbmap_writer_free(map_writer);
+		bbmap_close(warm_map);
 	}
+	put_raid_info();
+	free_stack_resolver(&resolver);
 
-	return 0;
+	return ret;
 }
 
+int main(int argc, char **argv)
+{
+	int i, ret = 0, all = 0, option;
+	const char *map_path = NULL;
+	struct lvm_bbs *bad_blocks;
+
+	while ((option = getopt(argc, argv, "aj:m:R:")) != EOF) {
+		switch (option) {
+		case 'a':
+			all = 1;
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			if (nr_workers < 1)
+				usage(argv[0]);
+			break;
+		case 'm':
+			map_path = optarg;
+			break;
+		case 'R':
+			if (attr_set_tree(optarg)) {
+				fprintf(stderr, "root path too long\n");
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (map_path) {
+		/* a missing or damaged map just means a cold start */
+		warm_map = bbmap_open(map_path);
+		map_writer = bbmap_writer_new();
+		if (NULL == map_writer)
+			exit(1);
+	}
+
+	if (all) {
+		if (optind != argc)
+			usage(argv[0]);
+		ret = get_all_lvm_bbs(report_lvm_bbs);
+		if (ret) {
+			fprintf(stderr, "get lvm badblocks error\n");
+			finish(map_path, ret);
+			exit(1);
+		}
+		return finish(map_path, 0);
+	}
+
+	if (optind == argc)
+		usage(argv[0]);
+
+	bad_blocks = calloc(1, sizeof(struct lvm_bbs));
+	if (NULL == bad_blocks)
+		exit(1);
+
+	for (i = optind; i < argc; i ++) {
+		if (get_lvm_bbs(argv[i], bad_blocks)) {
+			fprintf(stderr, "get lvm badblocks error\n");
+			ret = 1;
+			continue;
+		}
+		report_lvm_bbs(argv[i], bad_blocks);
+	}
+
+	free(bad_blocks->bb_range);
+	free(bad_blocks);
+
+	return finish(map_path, ret);
+}
@@ -0,0 +1,411 @@
+#include "sysfs_attr.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define ATTR_CACHE_SIZE 512
+#define ATTR_PATH_LEN 256
+#define ATTR_MIN_BUF 4096
+
+/*
+ * Direct mapped cache of open attribute fds. sysfs regenerates an
+ * attribute on every pread() at offset 0, so the fd can be kept and
+ * re-read instead of paying open/close per query. A colliding path
+ * simply replaces the slot, which bounds the number of open fds.
+ */
+struct attr_slot {
+	pthread_mutex_t lock;
+	s32 fd;
+	s8 path[ATTR_PATH_LEN];
+};
+
+static struct attr_slot attr_cache[ATTR_CACHE_SIZE];
+static pthread_once_t attr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t attr_buf_key;
+
+static void free_local_buf(void *arg)
+{
+	struct attr_buf *buf = arg;
+
+	free(buf->data);
+	free(buf);
+}
+
+static void attr_init(void)
+{
+	s32 i;
+
+	for (i = 0; i < ATTR_CACHE_SIZE; i ++) {
+		pthread_mutex_init(&attr_cache[i].lock, NULL);
+		attr_cache[i].fd = -1;
+	}
+
+	pthread_key_create(&attr_buf_key, free_local_buf);
+}
+
+/* per-thread buffer for attribute lists, freed when the thread exits */
+struct attr_buf *attr_local_buf(void)
+{
+	static __thread struct attr_buf *local;
+
+	if (local)
+		return local;
+
+	pthread_once(&attr_once, attr_init);
+	local = calloc(1, sizeof(struct attr_buf));
+	if (NULL == local)
+		return NULL;
+	local->grow = 1;
+	pthread_setspecific(attr_buf_key, local);
+
+	return local;
+}
+
+/*
+ * "/sys", "/proc", "/dev" and the dmsetup command, each overridable
+ * from BB_SYSFS_ROOT, BB_PROCFS_ROOT, BB_DEV_ROOT and BB_DMSETUP so the
+ * tools can run against a generated tree. Set them before the first
+ * query; they are not meant to change under running readers.
+ */
+static s8 roots[NR_ROOTS][ROOT_LEN] = {"/sys", "/proc", "/dev", "dmsetup"};
+static const s8 *root_env[NR_ROOTS] = {
+	"BB_SYSFS_ROOT", "BB_PROCFS_ROOT", "BB_DEV_ROOT", "BB_DMSETUP",
+};
+static pthread_once_t root_once = PTHREAD_ONCE_INIT;
+
+static void root_init(void)
+{
+	const s8 *env;
+	s32 i;
+
+	for (i = 0; i < NR_ROOTS; i ++) {
+		env = getenv(root_env[i]);
+		if (env && strlen(env) < ROOT_LEN)
+			strcpy(roots[i], env);
+	}
+}
+
+const s8 *attr_root(s32 which)
+{
+	pthread_once(&root_once, root_init);
+
+	return roots[which];
+}
+
+s32 attr_set_root(s32 which, const s8 *path)
+{
+	if (which < 0 || which >= NR_ROOTS || strlen(path) >= ROOT_LEN)
+		return -1;
+
+	pthread_once(&root_once, root_init);
+	strcpy(roots[which], path);
+
+	return 0;
+}
+
+/* dir/sys, dir/proc, dir/dev and dir/dmsetup, as bb_bench gentree lays them out */
+s32 attr_set_tree(const s8 *dir)
+{
+	static const s8 *sub[NR_ROOTS] = {"sys", "proc", "dev", "dmsetup"};
+	s8 path[ROOT_LEN];
+	s32 i;
+
+	for (i = 0; i < NR_ROOTS; i ++) {
+		if (snprintf(path, ROOT_LEN, "%s/%s", dir, sub[i]) >= ROOT_LEN ||
+		    attr_set_root(i, path))
+			return -1;
+	}
+
+	return 0;
+}
+
+static u32 attr_hash(const s8 *pathname)
+{
+	u32 hash = 2166136261u;
+
+	while (*pathname) {
+		hash ^= (u8)*pathname++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* read the whole attribute from offset 0, coping with short reads */
+static s32 read_whole(s32 fd, struct attr_buf *buf)
+{
+	ssize_t size;
+
+	buf->len = 0;
+	while (1) {
+		if (buf->size - buf->len < 2) {
+			u32 new_size;
+			s8 *data;
+
+			if (!buf->grow)
+				break;
+
+			new_size = buf->size ? buf->size * 2 : ATTR_MIN_BUF;
+			data = realloc(buf->data, new_size);
+			if (NULL == data)
+				return -1;
+			buf->data = data;
+			buf->size = new_size;
+		}
+
+		size = pread(fd, buf->data + buf->len, buf->size - buf->len - 1, buf->len);
+		if (size < 0) {
+			if (EINTR == errno)
+				continue;
+			return -1;
+		}
+		if (0 == size)
+			break;
+		buf->len += size;
+	}
+
+	buf->data[buf->len] = '\0';
+
+	return 0;
+}
+
+/*
+ * attr_read:
+ * @pathname: the sysfs or procfs file.
+ * @buf: grown as needed, and kept by the caller for the next read.
+ *
+ * Return 0 on success, -1 with errno set if the file can't be read.
+ */
+s32 attr_read(const s8 *pathname, struct attr_buf *buf)
+{
+	struct attr_slot *slot;
+	s32 fd, ret, reopen = 0;
+
+	pthread_once(&attr_once, attr_init);
+
+	if (strlen(pathname) >= ATTR_PATH_LEN) {
+		fd = open(pathname, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		ret = read_whole(fd, buf);
+		close(fd);
+		return ret;
+	}
+
+	slot = &attr_cache[attr_hash(pathname) % ATTR_CACHE_SIZE];
+	pthread_mutex_lock(&slot->lock);
+
+	if (slot->fd >= 0 && strcmp(slot->path, pathname)) {
+		close(slot->fd);
+		slot->fd = -1;
+	}
+
+	while (1) {
+		if (slot->fd < 0) {
+			slot->fd = open(pathname, O_RDONLY | O_CLOEXEC);
+			if (slot->fd < 0) {
+				ret = -1;
+				break;
+			}
+			strcpy(slot->path, pathname);
+			reopen = 1;
+		}
+
+		ret = read_whole(slot->fd, buf);
+		if (0 == ret || reopen)
+			break;
+
+		/* the attribute may have gone with its device, try it again */
+		close(slot->fd);
+		slot->fd = -1;
+	}
+
+	pthread_mutex_unlock(&slot->lock);
+
+	return ret;
+}
+
+/* read a single integer attribute, after an optional text prefix */
+s32 attr_read_s64(const s8 *pathname, const s8 *prefix, s64 *val)
+{
+	s8 data[64];
+	struct attr_buf buf = {data, 0, sizeof(data), 0};
+	const s8 *p = data;
+	s32 len;
+
+	if (attr_read(pathname, &buf))
+		return -1;
+
+	if (prefix) {
+		len = strlen(prefix);
+		if (strncmp(p, prefix, len)) {
+			errno = EINVAL;
+			return -1;
+		}
+		p += len;
+	}
+
+	if (NULL == attr_parse_s64(p, data + buf.len, val)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void attr_close_all(void)
+{
+	s32 i;
+
+	pthread_once(&attr_once, attr_init);
+
+	for (i = 0; i < ATTR_CACHE_SIZE; i ++) {
+		pthread_mutex_lock(&attr_cache[i].lock);
+		if (attr_cache[i].fd >= 0)
+			close(attr_cache[i].fd);
+		attr_cache[i].fd = -1;
+		pthread_mutex_unlock(&attr_cache[i].lock);
+	}
+}
+
+/*
+ * attr_parse_s64:
+ *
+ * Parse a decimal integer after optional blanks.
+ * Return the first byte after the number, NULL if there is none.
+ */
+const s8 *attr_parse_s64(const s8 *p, const s8 *end, s64 *val)
+{
+	const s8 *start;
+	u64 v = 0;
+	s32 neg = 0;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p ++;
+
+	if (p < end && *p == '-') {
+		neg = 1;
+		p ++;
+	}
+
+	start = p;
+	while (p < end && *p >= '0' && *p <= '9')
+		v = v * 10 + (*p++ - '0');
+
+	if (p == start)
+		return NULL;
+
+	*val = neg ? -(s64)v : (s64)v;
+
+	return p;
+}
+
+/*
+ * attr_next_range:
+ * @pos: the current line, moved to the next one.
+ *
+ * Parse one "sector len" line of a bad_blocks attribute.
+ * Return 1 for a range, 0 at the end, -1 for a malformed line.
+ */
+s32 attr_next_range(const s8 **pos, const s8 *end, u64 *sector, s32 *len)
+{
+	const s8 *p = *pos;
+	const s8 *eol;
+	s64 start, count;
+
+	if (p >= end)
+		return 0;
+
+	eol = memchr(p, '\n', end - p);
+	if (NULL == eol)
+		eol = end;
+	*pos = eol < end ? eol + 1 : end;
+
+	p = attr_parse_s64(p, eol, &start);
+	if (NULL == p)
+		return -1;
+	if (NULL == attr_parse_s64(p, eol, &count))
+		return -1;
+
+	*sector = start;
+	*len = count;
+
+	return 1;
+}
+
+/*
+ * attr_md_serial:
+ * @array: md device name, e.g. "md0".
+ * @idx: role of the member.
+ *
+ * The serial of the disk under a member, which is what fix_sector -m
+ * keys its map sections by. Return -1 if no serial can be found.
+ */
+s32 attr_md_serial(const s8 *array, s32 idx, s8 *serial, s32 len)
+{
+	static const s8 *paths[] = {
+		"block/device/serial", "block/device/vpd_pg80",
+		/* a partition, the disk is its parent */
+		"block/../device/serial", "block/../device/vpd_pg80",
+	};
+	s8 pathname[384];
+	struct attr_buf *buf = attr_local_buf();
+	const s8 *p, *end;
+	s32 i;
+
+	if (NULL == buf)
+		return -1;
+
+	for (i = 0; i < 4; i ++) {
+		snprintf(pathname, sizeof(pathname), "%s/block/%s/md/rd%d/%s",
+			 attr_root(ROOT_SYS), array, idx, paths[i]);
+		if (attr_read(pathname, buf))
+			continue;
+
+		p = buf->data;
+		end = buf->data + buf->len;
+		/* page 80h: 4 bytes of header, then the serial */
+		if (i % 2) {
+			if (buf->len < 4 || 4 + (u8)p[3] > buf->len)
+				continue;
+			end = p + 4 + (u8)p[3];
+			p += 4;
+		}
+		while (p < end && (' ' == *p || '\0' == *p))
+			p ++;
+		while (end > p && (' ' == end[-1] || '\n' == end[-1] || '\0' == end[-1]))
+			end --;
+		if (p == end || end - p >= len)
+			continue;
+
+		memcpy(serial, p, end - p);
+		serial[end - p] = '\0';
+		return 0;
+	}
+
+	return -1;
+}
+
+/* md/uuid as the bytes of the superblock's uuid, -1 on kernels without it */
+s32 attr_md_uuid(const s8 *array, u8 *uuid)
+{
+	s8 pathname[384];
+	struct attr_buf *buf = attr_local_buf();
+	const s8 *p;
+	s32 i;
+
+	snprintf(pathname, sizeof(pathname), "%s/block/%s/md/uuid", attr_root(ROOT_SYS), array);
+	if (NULL == buf || attr_read(pathname, buf))
+		return -1;
+
+	for (i = 0, p = buf->data; i < 16; i ++, p += 2) {
+		if ('-' == *p)
+			p ++;
+		if (sscanf(p, "%2hhx", &uuid[i]) != 1)
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef __SYSFS_ATTR_H__
+#define __SYSFS_ATTR_H__
+
+#include "vbfscommon.h"
+
+/* reusable read buffer, data is always NUL terminated after a read */
+struct attr_buf {
+	s8 *data;
+	u32 len;
+	u32 size;
+	s32 grow;
+};
+
+/* path prefixes the tools read from, see attr_root() */
+enum {
+	ROOT_SYS,
+	ROOT_PROC,
+	ROOT_DEV,
+	ROOT_DMSETUP,
+	NR_ROOTS,
+};
+
+#define ROOT_LEN 128
+
+struct attr_buf *attr_local_buf(void);
+
+const s8 *attr_root(s32 which);
+s32 attr_set_root(s32 which, const s8 *path);
+s32 attr_set_tree(const s8 *dir);
+
+s32 attr_read(const s8 *pathname, struct attr_buf *buf);
+s32 attr_read_s64(const s8 *pathname, const s8 *prefix, s64 *val);
+void attr_close_all(void);
+
+const s8 *attr_parse_s64(const s8 *p, const s8 *end, s64 *val);
+s32 attr_next_range(const s8 **pos, const s8 *end, u64 *sector, s32 *len);
+
+s32 attr_md_serial(const s8 *array, s32 idx, s8 *serial, s32 len);
+s32 attr_md_uuid(const s8 *array, u8 *uuid);
+
+#endif
@@ -7,6 +7,7 @@
 
 typedef unsigned char u8;
 typedef char s8;
+typedef unsigned short u16;
 typedef int s32;
 typedef unsigned int u32;
 
@@ -0,0 +1,64 @@
+#include "work_pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#define MAX_WORKERS 64
+
+struct work_pool {
+	int next_job;
+	int nr_jobs;
+	work_fn_t fn;
+	void *ctx;
+};
+
+static void *work_thread(void *arg)
+{
+	struct work_pool *pool = arg;
+	int job;
+
+	while ((job = __sync_fetch_and_add(&pool->next_job, 1)) < pool->nr_jobs)
+		pool->fn(pool->ctx, job);
+
+	return NULL;
+}
+
+/*
+ * run_work_pool:
+ * @nr_workers: threads to use, the caller counts as one of them.
+ * @nr_jobs: jobs are numbered 0 .. nr_jobs - 1.
+ *
+ * Run fn on every job and return when all of them are done. Jobs are
+ * handed out in order but finish in any order, so each job must write
+ * only its own slot of ctx; the caller merges the slots afterwards.
+ * Falls back to the calling thread if no worker can be started.
+ */
+int run_work_pool(int nr_workers, int nr_jobs, work_fn_t fn, void *ctx)
+{
+	struct work_pool pool;
+	pthread_t tids[MAX_WORKERS];
+	int i, nr_threads = 0;
+
+	pool.next_job = 0;
+	pool.nr_jobs = nr_jobs;
+	pool.fn = fn;
+	pool.ctx = ctx;
+
+	if (nr_workers > nr_jobs)
+		nr_workers = nr_jobs;
+	if (nr_workers > MAX_WORKERS)
+		nr_workers = MAX_WORKERS;
+
+	for (i = 1; i < nr_workers; i ++) {
+		if (pthread_create(&tids[nr_threads], NULL, work_thread, &pool))
+			break;
+		nr_threads ++;
+	}
+
+	work_thread(&pool);
+
+	for (i = 0; i < nr_threads; i ++)
+		pthread_join(tids[i], NULL);
+
+	return 0;
+}
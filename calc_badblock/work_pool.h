@@ -0,0 +1,8 @@
+#ifndef __WORK_POOL_H__
+#define __WORK_POOL_H__
+
+typedef void (*work_fn_t)(void *ctx, int job);
+
+int run_work_pool(int nr_workers, int nr_jobs, work_fn_t fn, void *ctx);
+
+#endif
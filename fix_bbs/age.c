@@ -0,0 +1,157 @@
+#include "age.h"
+#include "state_file.h"
+
+int age_init(struct age_map *map, off64_t base, off64_t size, __u64 region_size)
+{
+	memset(map, 0, sizeof(struct age_map));
+	if (size <= 0 || 0 == region_size)
+		return -1;
+
+	map->base = base;
+	map->size = size;
+	map->region_size = region_size;
+	map->nr = (size + region_size - 1) / region_size;
+	map->verified = calloc(map->nr, sizeof(time_t));
+
+	return map->verified ? 0 : -1;
+}
+
+void age_free(struct age_map *map)
+{
+	free(map->verified);
+	memset(map, 0, sizeof(struct age_map));
+}
+
+void age_region(const struct age_map *map, int i, struct scan_range *range)
+{
+	range->start = map->base + i * map->region_size;
+	range->end = range->start + map->region_size;
+	if (range->end > map->base + map->size)
+		range->end = map->base + map->size;
+}
+
+/* mark the regions [start, end) covers whole, return how many */
+int age_mark(struct age_map *map, off64_t start, off64_t end, time_t when)
+{
+	struct scan_range range;
+	int i, nr = 0;
+
+	if (start < map->base)
+		start = map->base;
+	if (end <= start)
+		return 0;
+
+	i = (start - map->base + map->region_size - 1) / map->region_size;
+	for (; i < map->nr; i ++) {
+		age_region(map, i, &range);
+		if (range.end > end)
+			break;
+		if (map->verified[i] != when) {
+			map->verified[i] = when;
+			nr ++;
+		}
+	}
+
+	return nr;
+}
+
+static const struct age_map *sort_map;
+
+static int cmp_age(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	if (sort_map->verified[x] != sort_map->verified[y])
+		return sort_map->verified[x] < sort_map->verified[y] ? -1 : 1;
+	return x - y;
+}
+
+/*
+ * age_order:
+ *
+ * Fill order with the region indexes, stalest first; regions never
+ * verified come first, and ties go from the start of the disk.
+ */
+int age_order(const struct age_map *map, int *order)
+{
+	int i;
+
+	for (i = 0; i < map->nr; i ++)
+		order[i] = i;
+
+	sort_map = map;
+	qsort(order, map->nr, sizeof(int), cmp_age);
+	sort_map = NULL;
+
+	return map->nr;
+}
+
+/* the oldest verification time, and how many were never verified */
+time_t age_stalest(const struct age_map *map, int *never)
+{
+	time_t stalest = 0;
+	int i;
+
+	*never = 0;
+	for (i = 0; i < map->nr; i ++) {
+		if (0 == map->verified[i])
+			(*never) ++;
+		else if (0 == stalest || map->verified[i] < stalest)
+			stalest = map->verified[i];
+	}
+
+	return stalest;
+}
+
+/*
+ * "base size region_size nr" then one time per region. A map saved
+ * for another layout is no use and reads as an error.
+ */
+int age_load(const char *pathname, struct age_map *map)
+{
+	unsigned long long base, size, region_size;
+	long long verified;
+	int nr, i, ret = -1;
+	FILE *fp;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+
+	if (fscanf(fp, "%llu %llu %llu %d", &base, &size, &region_size, &nr) != 4)
+		goto out;
+	if (base != map->base || size != map->size || region_size != map->region_size ||
+	    nr != map->nr)
+		goto out;
+
+	for (i = 0; i < nr; i ++) {
+		if (fscanf(fp, "%lld", &verified) != 1)
+			goto out;
+		map->verified[i] = verified;
+	}
+	ret = 0;
+out:
+	fclose(fp);
+	if (ret)
+		memset(map->verified, 0, sizeof(time_t) * map->nr);
+
+	return ret;
+}
+
+int age_save(const char *pathname, const struct age_map *map)
+{
+	char tmpname[256];
+	FILE *out;
+	int i;
+
+	out = state_file_open(pathname, tmpname, sizeof(tmpname));
+	if (NULL == out)
+		return -1;
+
+	fprintf(out, "%llu %llu %llu %d\n", (unsigned long long)map->base,
+		(unsigned long long)map->size, (unsigned long long)map->region_size, map->nr);
+	for (i = 0; i < map->nr; i ++)
+		fprintf(out, "%lld\n", (long long)map->verified[i]);
+
+	return state_file_commit(out, tmpname, pathname);
+}
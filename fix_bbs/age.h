@@ -0,0 +1,29 @@
+#ifndef __AGE_H_
+#define __AGE_H_
+
+#include "alloc.h"
+#include <time.h>
+
+/* one file per member, named after its serial */
+#define AGE_PATHNAME "/var/lib/fix_sector/age"
+#define AGE_REGION_SIZE (1024ULL * 1024 * 1024)
+
+/* when each region of a member was last read through */
+struct age_map {
+	off64_t base;		/* where the first region starts */
+	off64_t size;		/* bytes from base the regions cover */
+	__u64 region_size;
+	int nr;
+	time_t *verified;	/* 0 if never */
+};
+
+int age_init(struct age_map *map, off64_t base, off64_t size, __u64 region_size);
+void age_free(struct age_map *map);
+void age_region(const struct age_map *map, int i, struct scan_range *range);
+int age_mark(struct age_map *map, off64_t start, off64_t end, time_t when);
+int age_order(const struct age_map *map, int *order);
+time_t age_stalest(const struct age_map *map, int *never);
+int age_load(const char *pathname, struct age_map *map);
+int age_save(const char *pathname, const struct age_map *map);
+
+#endif
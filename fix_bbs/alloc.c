@@ -0,0 +1,207 @@
+#include "alloc.h"
+#include "dm_table.h"
+#include <sys/sysmacros.h>
+
+int add_range(struct range_list *list, off64_t start, off64_t end)
+{
+	struct scan_range *ranges;
+	int max;
+
+	if (start >= end)
+		return 0;
+
+	if (list->nr == list->max) {
+		max = list->max ? list->max * 2 : 64;
+		ranges = realloc(list->ranges, sizeof(struct scan_range) * max);
+		if (NULL == ranges)
+			return -1;
+		list->ranges = ranges;
+		list->max = max;
+	}
+
+	list->ranges[list->nr].start = start;
+	list->ranges[list->nr].end = end;
+	list->nr ++;
+
+	return 0;
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+	const struct scan_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/* round every range out to align, sort them and merge what touches */
+void coalesce_ranges(struct range_list *list, __u32 align)
+{
+	int i, j;
+
+	for (i = 0; i < list->nr; i ++) {
+		list->ranges[i].start -= list->ranges[i].start % align;
+		if (list->ranges[i].end % align)
+			list->ranges[i].end += align - list->ranges[i].end % align;
+	}
+
+	qsort(list->ranges, list->nr, sizeof(struct scan_range), cmp_range);
+
+	for (i = 0, j = -1; i < list->nr; i ++) {
+		if (list->ranges[i].start >= list->ranges[i].end)
+			continue;
+		if (j >= 0 && list->ranges[i].start <= list->ranges[j].end) {
+			if (list->ranges[i].end > list->ranges[j].end)
+				list->ranges[j].end = list->ranges[i].end;
+			continue;
+		}
+		list->ranges[++ j] = list->ranges[i];
+	}
+	list->nr = j + 1;
+}
+
+__u64 ranges_bytes(const struct range_list *list)
+{
+	__u64 bytes = 0;
+	int i;
+
+	for (i = 0; i < list->nr; i ++)
+		bytes += list->ranges[i].end - list->ranges[i].start;
+
+	return bytes;
+}
+
+void free_ranges(struct range_list *list)
+{
+	free(list->ranges);
+	memset(list, 0, sizeof(struct range_list));
+}
+
+/* LVM's label and metadata area, where it puts the first extent by default */
+#define PV_META_SECTORS 2048
+
+/*
+ * Collect the linear and striped segments on the array from "dmsetup
+ * table" output, as array byte ranges: a striped leg on the array
+ * covers len / stripes of it. The PV label and metadata before the
+ * first segment are kept too.
+ */
+int read_lv_segments(FILE *fp, dev_t array, struct range_list *array_ranges)
+{
+	unsigned long long offset, first = ~0ULL;
+	char line[DM_LINE_SIZE], *p;
+	struct dm_segment seg;
+	int i;
+
+	while (fgets(line, sizeof(line), fp)) {
+		/* "name: " when the table of every device is listed */
+		p = strstr(line, ": ");
+		p = p ? p + 2 : line;
+
+		if (dm_parse_segment(p, &seg))
+			continue;
+		for (i = 0; i < seg.nr_legs; i ++) {
+			if (makedev(seg.legs[i].major, seg.legs[i].minor) != array)
+				continue;
+
+			offset = seg.legs[i].offset;
+			if (add_range(array_ranges, offset * SECTOR_SIZE,
+				      (offset + dm_leg_len(&seg)) * SECTOR_SIZE))
+				return -1;
+			if (offset < first)
+				first = offset;
+		}
+	}
+
+	if (first > PV_META_SECTORS)
+		first = PV_META_SECTORS;
+	if (array_ranges->nr && add_range(array_ranges, 0, first * SECTOR_SIZE))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The array chunk a member holds in a stripe, for md's left-symmetric
+ * layout. Return 0 when it holds parity there.
+ */
+static int member_chunk(const struct raid_geom *geom, __u64 stripe, __u64 *chunk)
+{
+	int n = geom->raid_disks, pd, k;
+
+	if (geom->level == 6) {
+		pd = n - 1 - stripe % n;
+		if (geom->role == pd || geom->role == (pd + 1) % n)
+			return 0;
+		k = (geom->role - pd - 2 + 2 * n) % n;
+	} else {
+		pd = geom->data_disks - stripe % n;
+		if (geom->role == pd)
+			return 0;
+		k = (geom->role - pd - 1 + n) % n;
+	}
+
+	*chunk = stripe * geom->data_disks + k;
+	return 1;
+}
+
+/* the part of [start, end) the member holds in one stripe */
+static int map_stripe(const struct raid_geom *geom, __u64 stripe, __u64 start, __u64 end,
+		      struct range_list *member_ranges)
+{
+	__u64 chunk_size = geom->chunk_size, base = stripe * chunk_size, chunk, lo, hi;
+
+	if (geom->layout != ALGORITHM_LEFT_SYMMETRIC || !member_chunk(geom, stripe, &chunk))
+		return add_range(member_ranges, base, base + chunk_size);
+
+	lo = start > chunk * chunk_size ? start : chunk * chunk_size;
+	hi = end < (chunk + 1) * chunk_size ? end : (chunk + 1) * chunk_size;
+	if (lo >= hi)
+		return 0;
+
+	return add_range(member_ranges, base + lo - chunk * chunk_size,
+			 base + hi - chunk * chunk_size);
+}
+
+/*
+ * map_to_member:
+ *
+ * Translate array byte ranges to the member byte ranges that hold
+ * their data or its parity. Whole stripes map to one chunk of every
+ * member; a stripe a range only partly covers maps exactly for the
+ * left-symmetric layout, and to the whole chunk otherwise.
+ */
+int map_to_member(const struct raid_geom *geom, const struct range_list *array_ranges,
+		  struct range_list *member_ranges)
+{
+	__u64 stripe_size = (__u64)geom->chunk_size * geom->data_disks;
+	__u64 start, end, first, last;
+	int i, ret = 0;
+
+	if (0 == stripe_size)
+		return -1;
+
+	for (i = 0; i < array_ranges->nr && !ret; i ++) {
+		start = array_ranges->ranges[i].start;
+		end = array_ranges->ranges[i].end;
+		first = start / stripe_size;
+		last = (end - 1) / stripe_size;
+
+		ret = map_stripe(geom, first, start, end, member_ranges);
+		if (!ret && last > first)
+			ret = map_stripe(geom, last, start, end, member_ranges);
+		if (!ret && last > first + 1)
+			ret = add_range(member_ranges, (first + 1) * geom->chunk_size,
+					last * geom->chunk_size);
+	}
+
+	for (i = 0; i < member_ranges->nr; i ++) {
+		member_ranges->ranges[i].start += geom->data_offset;
+		member_ranges->ranges[i].end += geom->data_offset;
+		if (member_ranges->ranges[i].end > geom->data_offset + geom->data_size)
+			member_ranges->ranges[i].end = geom->data_offset + geom->data_size;
+	}
+
+	return ret;
+}
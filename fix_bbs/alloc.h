@@ -0,0 +1,39 @@
+#ifndef __ALLOC_H_
+#define __ALLOC_H_
+
+#include "fix_sector.h"
+
+#define ALGORITHM_LEFT_SYMMETRIC 2
+
+/* how the array lays its data out on the member being scanned */
+struct raid_geom {
+	int level;
+	int layout;
+	int raid_disks;
+	int data_disks;
+	__u32 chunk_size;	/* bytes */
+	int role;
+	off64_t data_offset;	/* where array data starts on the member */
+	off64_t data_size;	/* array data on the member */
+};
+
+struct scan_range {
+	off64_t start;
+	off64_t end;
+};
+
+struct range_list {
+	struct scan_range *ranges;
+	int nr, max;
+};
+
+int add_range(struct range_list *list, off64_t start, off64_t end);
+void coalesce_ranges(struct range_list *list, __u32 align);
+__u64 ranges_bytes(const struct range_list *list);
+void free_ranges(struct range_list *list);
+
+int read_lv_segments(FILE *fp, dev_t array, struct range_list *array_ranges);
+int map_to_member(const struct raid_geom *geom, const struct range_list *array_ranges,
+		  struct range_list *member_ranges);
+
+#endif
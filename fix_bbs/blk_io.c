@@ -0,0 +1,460 @@
+#include "blk_io.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Real device: positioned I/O on the fd, so the scan never depends on
+ * a shared file offset.
+ */
+static ssize_t dev_pread(struct blk_dev *dev, void *buf, size_t len, off64_t offset)
+{
+	return pread64(dev->fd, buf, len, offset);
+}
+
+static ssize_t dev_pwrite(struct blk_dev *dev, const void *buf, size_t len, off64_t offset)
+{
+	return pwrite64(dev->fd, buf, len, offset);
+}
+
+static void dev_close(struct blk_dev *dev)
+{
+}
+
+static const struct blk_ops dev_ops = {
+	.pread = dev_pread,
+	.pwrite = dev_pwrite,
+	.close = dev_close,
+};
+
+/* the fd stays owned by the caller */
+struct blk_dev *blk_open_fd(int fd)
+{
+	struct blk_dev *dev;
+	struct stat st;
+	__u64 size;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+			return NULL;
+	} else
+		size = st.st_size;
+
+	dev = calloc(1, sizeof(struct blk_dev));
+	if (NULL == dev)
+		return NULL;
+
+	dev->ops = &dev_ops;
+	dev->fd = fd;
+	dev->size = size;
+
+	return dev;
+}
+
+/*
+ * File-backed device with injected faults. Bad sectors are kept one
+ * entry per physical sector so a rewrite heals exactly what it covers;
+ * slow extents stay whole. The entries are sorted by LBA with the
+ * furthest end seen so far, which bounds the walk back from a binary
+ * search even when slow extents overlap bad sectors.
+ */
+struct fault {
+	__u64 lba;
+	__u32 count;
+	int type;
+	__u32 arg;		/* EIO: failures left, HEAL: not yet rewritten, SLOW: usecs */
+	__u64 reach;
+};
+
+struct fault_dev {
+	pthread_mutex_t lock;
+	__u32 sector_size;
+	__u32 latency_us;
+	__u32 mbps;
+	__u64 busy_until;
+
+	struct fault *faults;
+	int nr, max;
+	int sorted;
+};
+
+static int cmp_fault(const void *a, const void *b)
+{
+	const struct fault *fa = a, *fb = b;
+
+	if (fa->lba != fb->lba)
+		return fa->lba < fb->lba ? -1 : 1;
+	return fa->type - fb->type;
+}
+
+static void sort_faults(struct fault_dev *fdev)
+{
+	__u64 reach = 0;
+	int i, j;
+
+	qsort(fdev->faults, fdev->nr, sizeof(struct fault), cmp_fault);
+
+	/* the same bad sector given twice counts once */
+	for (i = 0, j = 0; i < fdev->nr; i ++) {
+		if (j && fdev->faults[i].type != FAULT_SLOW &&
+		    fdev->faults[j - 1].lba == fdev->faults[i].lba &&
+		    fdev->faults[j - 1].type == fdev->faults[i].type)
+			continue;
+		fdev->faults[j] = fdev->faults[i];
+		if (fdev->faults[j].lba + fdev->faults[j].count > reach)
+			reach = fdev->faults[j].lba + fdev->faults[j].count;
+		fdev->faults[j].reach = reach;
+		j ++;
+	}
+	fdev->nr = j;
+	fdev->sorted = 1;
+}
+
+/*
+ * Apply the faults of an I/O over [lba, lba + count): return the usecs
+ * it should take on top of the device model, with *eio set if it fails.
+ */
+static __u64 apply_faults(struct fault_dev *fdev, __u64 lba, __u64 count, int write, int *eio)
+{
+	struct fault *f;
+	__u64 delay = 0;
+	int lo = 0, hi, mid;
+
+	*eio = 0;
+	if (!fdev->sorted)
+		sort_faults(fdev);
+
+	/* first entry starting at or after the end of the I/O */
+	hi = fdev->nr;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (fdev->faults[mid].lba < lba + count)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	while (-- lo >= 0 && fdev->faults[lo].reach > lba) {
+		f = &fdev->faults[lo];
+		if (f->lba + f->count <= lba)
+			continue;
+
+		switch (f->type) {
+		case FAULT_EIO:
+			if (!write && f->arg) {
+				f->arg --;
+				*eio = 1;
+			}
+			break;
+		case FAULT_HEAL:
+			if (write)
+				f->arg = 0;
+			else if (f->arg)
+				*eio = 1;
+			break;
+		case FAULT_DEAD:
+			*eio = 1;
+			break;
+		case FAULT_SLOW:
+			delay += f->arg;
+			break;
+		}
+	}
+
+	return delay;
+}
+
+static __u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * The device model: command latency overlaps between I/Os in flight,
+ * transfers take turns on one channel. Deeper queues hide latency but
+ * never go past the bandwidth, they only wait longer for it. A slow
+ * extent holds the channel while the drive retries it.
+ */
+static __u64 fault_due(struct fault_dev *fdev, size_t len, __u64 delay)
+{
+	__u64 due = now_us() + fdev->latency_us;
+
+	if (fdev->mbps) {
+		if (due < fdev->busy_until)
+			due = fdev->busy_until;
+		due += len / fdev->mbps + delay;
+		fdev->busy_until = due;
+		return due;
+	}
+
+	return due + delay;
+}
+
+static void fault_wait(__u64 due)
+{
+	struct timespec ts;
+
+	if (due <= now_us())
+		return;
+
+	ts.tv_sec = due / 1000000;
+	ts.tv_nsec = (due % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static ssize_t fault_io(struct blk_dev *dev, void *buf, size_t len, off64_t offset, int write)
+{
+	struct fault_dev *fdev = dev->priv;
+	__u64 delay, due;
+	int eio;
+
+	pthread_mutex_lock(&fdev->lock);
+	delay = apply_faults(fdev, offset / SECTOR_SIZE,
+			     (len + SECTOR_SIZE - 1) / SECTOR_SIZE, write, &eio);
+	due = fault_due(fdev, len, delay);
+	pthread_mutex_unlock(&fdev->lock);
+
+	fault_wait(due);
+
+	if (eio) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (write)
+		return pwrite64(dev->fd, buf, len, offset);
+	return pread64(dev->fd, buf, len, offset);
+}
+
+static ssize_t fault_pread(struct blk_dev *dev, void *buf, size_t len, off64_t offset)
+{
+	return fault_io(dev, buf, len, offset, 0);
+}
+
+static ssize_t fault_pwrite(struct blk_dev *dev, const void *buf, size_t len, off64_t offset)
+{
+	return fault_io(dev, (void *)buf, len, offset, 1);
+}
+
+static void fault_close(struct blk_dev *dev)
+{
+	struct fault_dev *fdev = dev->priv;
+
+	close(dev->fd);
+	pthread_mutex_destroy(&fdev->lock);
+	free(fdev->faults);
+	free(fdev);
+}
+
+static const struct blk_ops fault_ops = {
+	.pread = fault_pread,
+	.pwrite = fault_pwrite,
+	.close = fault_close,
+};
+
+/*
+ * blk_open_fault:
+ * @pathname: regular file holding the data, its size is the device size.
+ * @sector_size: physical sector size, the unit bad sectors heal in.
+ *
+ * Open a device that behaves like @pathname until faults are added.
+ */
+struct blk_dev *blk_open_fault(const char *pathname, __u32 sector_size)
+{
+	struct blk_dev *dev;
+	struct fault_dev *fdev;
+	int fd;
+
+	if (sector_size < SECTOR_SIZE || sector_size % SECTOR_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fd = open(pathname, O_RDWR | O_LARGEFILE);
+	if (fd < 0)
+		return NULL;
+
+	dev = blk_open_fd(fd);
+	fdev = calloc(1, sizeof(struct fault_dev));
+	if (NULL == dev || NULL == fdev) {
+		free(dev);
+		free(fdev);
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_init(&fdev->lock, NULL);
+	fdev->sector_size = sector_size;
+	fdev->sorted = 1;
+
+	dev->ops = &fault_ops;
+	dev->priv = fdev;
+
+	return dev;
+}
+
+static int push_fault(struct fault_dev *fdev, int type, __u64 lba, __u32 count, __u32 arg)
+{
+	struct fault *faults;
+	int max;
+
+	if (fdev->nr == fdev->max) {
+		max = fdev->max ? fdev->max * 2 : 64;
+		faults = realloc(fdev->faults, sizeof(struct fault) * max);
+		if (NULL == faults)
+			return -1;
+		fdev->faults = faults;
+		fdev->max = max;
+	}
+
+	fdev->faults[fdev->nr].lba = lba;
+	fdev->faults[fdev->nr].count = count;
+	fdev->faults[fdev->nr].type = type;
+	fdev->faults[fdev->nr].arg = arg;
+	fdev->nr ++;
+	fdev->sorted = 0;
+
+	return 0;
+}
+
+/*
+ * blk_fault_add:
+ * @type: FAULT_EIO, FAULT_HEAL, FAULT_DEAD or FAULT_SLOW.
+ * @lba: first 512 byte sector.
+ * @count: sectors covered, bad ones round out to whole physical sectors.
+ * @arg: failures before an EIO sector reads fine, usecs of a slow extent,
+ *        unused otherwise.
+ */
+int blk_fault_add(struct blk_dev *dev, int type, __u64 lba, __u32 count, __u32 arg)
+{
+	struct fault_dev *fdev = dev->priv;
+	__u32 per = fdev->sector_size / SECTOR_SIZE;
+	__u64 end = lba + count;
+	int ret = 0;
+
+	if (type < FAULT_EIO || type > FAULT_SLOW || 0 == count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&fdev->lock);
+	if (type == FAULT_SLOW) {
+		ret = push_fault(fdev, type, lba, count, arg);
+	} else {
+		if (type == FAULT_HEAL)
+			arg = 1;
+		for (lba -= lba % per; lba < end && !ret; lba += per)
+			ret = push_fault(fdev, type, lba, per, arg);
+	}
+	pthread_mutex_unlock(&fdev->lock);
+
+	return ret;
+}
+
+/*
+ * blk_fault_load:
+ *
+ * Read faults from a file, one per line, '#' starts a comment:
+ *	latency <usecs>			every I/O, overlaps when queued
+ *	bandwidth <MB/s>		transfer time on top, one at a time
+ *	eio <lba> [count] [times]	reads fail @times (default 1) times
+ *	heal <lba> [count]		reads fail until rewritten
+ *	dead <lba> [count]		never heals
+ *	slow <lba> <count> <usecs>
+ */
+int blk_fault_load(struct blk_dev *dev, const char *pathname)
+{
+	struct fault_dev *fdev = dev->priv;
+	char line[256], kind[16];
+	unsigned long long lba;
+	unsigned int count, arg;
+	int nr, type, lineno = 0, ret = 0;
+	FILE *fp;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno ++;
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+
+		count = 1;
+		arg = 1;
+		nr = sscanf(line, "%15s %llu %u %u", kind, &lba, &count, &arg);
+		if (nr <= 0)
+			continue;
+
+		if (!strcmp(kind, "latency") && nr == 2) {
+			fdev->latency_us = lba;
+			continue;
+		} else if (!strcmp(kind, "bandwidth") && nr == 2) {
+			fdev->mbps = lba;
+			continue;
+		} else if (!strcmp(kind, "eio") && nr >= 2)
+			type = FAULT_EIO;
+		else if (!strcmp(kind, "heal") && nr >= 2 && nr <= 3)
+			type = FAULT_HEAL;
+		else if (!strcmp(kind, "dead") && nr >= 2 && nr <= 3)
+			type = FAULT_DEAD;
+		else if (!strcmp(kind, "slow") && nr == 4)
+			type = FAULT_SLOW;
+		else {
+			fprintf(stderr, "%s:%d: bad fault line\n", pathname, lineno);
+			ret = -1;
+			break;
+		}
+
+		if (blk_fault_add(dev, type, lba, count, arg)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return ret;
+}
+
+void blk_fault_model(struct blk_dev *dev, __u32 latency_us, __u32 mbps)
+{
+	struct fault_dev *fdev = dev->priv;
+
+	fdev->latency_us = latency_us;
+	fdev->mbps = mbps;
+}
+
+/* physical sectors that have been set up to fail */
+__u64 blk_fault_sectors(struct blk_dev *dev)
+{
+	struct fault_dev *fdev = dev->priv;
+	__u64 nr = 0;
+	int i;
+
+	pthread_mutex_lock(&fdev->lock);
+	if (!fdev->sorted)
+		sort_faults(fdev);
+	for (i = 0; i < fdev->nr; i ++) {
+		if (fdev->faults[i].type != FAULT_SLOW)
+			nr ++;
+	}
+	pthread_mutex_unlock(&fdev->lock);
+
+	return nr;
+}
+
+void blk_close(struct blk_dev *dev)
+{
+	if (NULL == dev)
+		return;
+
+	dev->ops->close(dev);
+	free(dev);
+}
@@ -0,0 +1,56 @@
+#ifndef __BLK_IO_H_
+#define __BLK_IO_H_
+
+#include "fix_sector.h"
+
+/* fault kinds of the file-backed device, offsets are 512 byte LBAs */
+enum {
+	FAULT_EIO = 1,		/* reads fail a given number of times */
+	FAULT_HEAL,		/* reads fail until the sector is rewritten */
+	FAULT_DEAD,		/* reads and writes always fail */
+	FAULT_SLOW,		/* every I/O touching it takes extra time */
+};
+
+struct blk_dev;
+
+struct blk_ops {
+	ssize_t (*pread)(struct blk_dev *dev, void *buf, size_t len, off64_t offset);
+	ssize_t (*pwrite)(struct blk_dev *dev, const void *buf, size_t len, off64_t offset);
+	void (*close)(struct blk_dev *dev);
+};
+
+struct blk_dev {
+	const struct blk_ops *ops;
+	int fd;
+	__u64 size;
+	void *priv;
+
+	__u64 nr_reads;
+	__u64 nr_writes;
+	__u64 read_bytes;
+	__u64 write_bytes;
+};
+
+static inline ssize_t blk_read(struct blk_dev *dev, void *buf, size_t len, off64_t offset)
+{
+	__atomic_add_fetch(&dev->nr_reads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dev->read_bytes, len, __ATOMIC_RELAXED);
+	return dev->ops->pread(dev, buf, len, offset);
+}
+
+static inline ssize_t blk_write(struct blk_dev *dev, const void *buf, size_t len, off64_t offset)
+{
+	__atomic_add_fetch(&dev->nr_writes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dev->write_bytes, len, __ATOMIC_RELAXED);
+	return dev->ops->pwrite(dev, buf, len, offset);
+}
+
+struct blk_dev *blk_open_fd(int fd);
+struct blk_dev *blk_open_fault(const char *pathname, __u32 sector_size);
+int blk_fault_add(struct blk_dev *dev, int type, __u64 lba, __u32 count, __u32 arg);
+int blk_fault_load(struct blk_dev *dev, const char *pathname);
+void blk_fault_model(struct blk_dev *dev, __u32 latency_us, __u32 mbps);
+__u64 blk_fault_sectors(struct blk_dev *dev);
+void blk_close(struct blk_dev *dev);
+
+#endif
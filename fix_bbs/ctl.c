@@ -0,0 +1,215 @@
+#include "ctl.h"
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <libgen.h>
+
+/*
+ * ctl_lock:
+ *
+ * Take the lock file of a device for this process: only one scanner
+ * runs on a device. The lock goes with the fd, across fork() and
+ * until the last copy is closed. Return the fd, -2 if another process
+ * holds it, or -1.
+ */
+int ctl_lock(const char *lock_path)
+{
+	char dir[256];
+	int fd;
+
+	snprintf(dir, sizeof(dir), "%s", lock_path);
+	mkdir(dirname(dir), 0755);
+
+	fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		close(fd);
+		return EWOULDBLOCK == errno ? -2 : -1;
+	}
+
+	return fd;
+}
+
+/* record the pid holding the lock, once it is the one that stays */
+void ctl_set_owner(int lock_fd)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%d\n", getpid());
+	if (ftruncate(lock_fd, 0) == 0)
+		pwrite(lock_fd, buf, len, 0);
+}
+
+/* the pid holding the lock, 0 if nobody does */
+pid_t ctl_owner(const char *lock_path)
+{
+	char buf[32];
+	pid_t pid = 0;
+	ssize_t len;
+	int fd;
+
+	fd = open(lock_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+		flock(fd, LOCK_UN);
+	} else {
+		len = pread(fd, buf, sizeof(buf) - 1, 0);
+		if (len > 0) {
+			buf[len] = '\0';
+			pid = atoi(buf);
+		}
+	}
+	close(fd);
+
+	return pid;
+}
+
+/* read one line from a client that may be slow, or never send it */
+static ssize_t read_request(int fd, char *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len - 1) {
+		if (poll(&pfd, 1, CTL_TIMEOUT_MS) <= 0)
+			return -1;
+		ret = read(fd, buf + done, len - 1 - done);
+		if (ret <= 0)
+			break;
+		done += ret;
+		if (memchr(buf + done - ret, '\n', ret))
+			break;
+	}
+
+	buf[done] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return done;
+}
+
+static void *serve(void *arg)
+{
+	struct ctl_server *server = arg;
+	struct pollfd pfd = { .fd = server->sock_fd, .events = POLLIN };
+	char request[CTL_MAX_MSG], reply[CTL_MAX_MSG];
+	int fd;
+
+	while (!__atomic_load_n(&server->stop, __ATOMIC_RELAXED)) {
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+
+		fd = accept4(server->sock_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		if (read_request(fd, request, sizeof(request)) > 0) {
+			reply[0] = '\0';
+			server->handler(request, reply, sizeof(reply), server->arg);
+			write(fd, reply, strlen(reply));
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * ctl_serve:
+ *
+ * Listen on server->sock_path, replacing what a dead scanner left
+ * there, and answer every connection in a thread of its own: one
+ * request line in, one reply out. The caller holds the device lock,
+ * so nobody else is serving on the path.
+ */
+int ctl_serve(struct ctl_server *server)
+{
+	struct sockaddr_un addr;
+	char dir[sizeof(server->sock_path)];
+
+	snprintf(dir, sizeof(dir), "%s", server->sock_path);
+	mkdir(dirname(dir), 0755);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", server->sock_path);
+
+	server->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server->sock_fd < 0)
+		return -1;
+
+	unlink(server->sock_path);
+	if (bind(server->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(server->sock_fd, 8))
+		goto err;
+
+	server->stop = 0;
+	if (pthread_create(&server->tid, NULL, serve, server)) {
+		unlink(server->sock_path);
+		goto err;
+	}
+
+	return 0;
+err:
+	close(server->sock_fd);
+	server->sock_fd = -1;
+	return -1;
+}
+
+void ctl_close(struct ctl_server *server)
+{
+	__atomic_store_n(&server->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(server->tid, NULL);
+	unlink(server->sock_path);
+	close(server->sock_fd);
+	server->sock_fd = -1;
+}
+
+/*
+ * ctl_request:
+ *
+ * Send a request to the scanner serving on sock_path and read its
+ * reply. Return -1 if no scanner is there.
+ */
+int ctl_request(const char *sock_path, const char *request, char *reply, size_t len)
+{
+	struct sockaddr_un addr;
+	struct pollfd pfd;
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    write(fd, request, strlen(request)) != strlen(request) || write(fd, "\n", 1) != 1) {
+		close(fd);
+		return -1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (done < len - 1) {
+		if (poll(&pfd, 1, CTL_TIMEOUT_MS) <= 0)
+			break;
+		ret = read(fd, reply + done, len - 1 - done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	reply[done] = '\0';
+	close(fd);
+
+	return done ? 0 : -1;
+}
@@ -0,0 +1,32 @@
+#ifndef __CTL_H_
+#define __CTL_H_
+
+#include "fix_sector.h"
+#include <pthread.h>
+
+#define CTL_RUNDIR "/run/fix_sector"
+/* a zones reply is a rate for each of ZONE_COUNT */
+#define CTL_MAX_MSG 4096
+#define CTL_TIMEOUT_MS 2000
+
+/* answer one request line in reply, from the server thread */
+typedef void (*ctl_handler_fn)(const char *request, char *reply, size_t len, void *arg);
+
+struct ctl_server {
+	char sock_path[108];
+	int sock_fd;
+	ctl_handler_fn handler;
+	void *arg;
+
+	pthread_t tid;
+	int stop;
+};
+
+int ctl_lock(const char *lock_path);
+void ctl_set_owner(int lock_fd);
+pid_t ctl_owner(const char *lock_path);
+int ctl_serve(struct ctl_server *server);
+void ctl_close(struct ctl_server *server);
+int ctl_request(const char *sock_path, const char *request, char *reply, size_t len);
+
+#endif
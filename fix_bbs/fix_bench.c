@@ -0,0 +1,813 @@
+#include "scan.h"
+#include "alloc.h"
+#include "kmsg.h"
+#include "smart.h"
+#include "md.h"
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
+#include <ftw.h>
+
+#define DEF_SIZE_MB 4096
+#define DEF_BUF_KB 1024
+
+/* the array the device is a member of for -u */
+#define BENCH_RAID_DISKS 12
+#define BENCH_CHUNK (64 * 1024)
+#define BENCH_ROLE 3
+#define BENCH_SLOTS 64
+
+struct bench {
+	pthread_mutex_t lock;
+	double start;
+	double *found;
+	int nr_found, max_found;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the kernel reporting errors on the known defects, delay seconds in */
+struct kernel_log {
+	const char *pathname;
+	const struct range_list *known;
+	double delay;
+	double written;
+};
+
+static void *write_log(void *arg)
+{
+	struct kernel_log *log = arg;
+	double start = now();
+	FILE *fp;
+	int i;
+
+	usleep(log->delay * 1e6);
+	fp = fopen(log->pathname, "a");
+	if (NULL == fp)
+		return NULL;
+	for (i = 0; i < log->known->nr; i ++)
+		fprintf(fp, "3,%d,%.0f,-;blk_update_request: I/O error, dev fbench, sector %llu "
+			"op 0x0:(READ) flags 0x0 phys_seg 1 prio class 0\n", i, now() * 1e6,
+			(unsigned long long)log->known->ranges[i].start / SECTOR_SIZE);
+	fclose(fp);
+	log->written = now() - start;
+
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void found_sector(struct scan_ctx *ctx, off64_t offset, int fixed)
+{
+	struct bench *bench = ctx->arg;
+	double *found;
+	int max;
+
+	pthread_mutex_lock(&bench->lock);
+	if (bench->nr_found == bench->max_found) {
+		max = bench->max_found ? bench->max_found * 2 : 64;
+		found = realloc(bench->found, sizeof(double) * max);
+		if (NULL == found)
+			goto out;
+		bench->found = found;
+		bench->max_found = max;
+	}
+
+	bench->found[bench->nr_found ++] = now() - bench->start;
+out:
+	pthread_mutex_unlock(&bench->lock);
+}
+
+/*
+ * Media defects cluster: spread the bad sectors over a few spots, each
+ * within a couple of MB of its centre. The first @dead never heal, and
+ * the first sector of the first @known defects goes to @seeds, like md
+ * would have logged it.
+ */
+static int gen_faults(struct blk_dev *dev, __u32 sector_size, int nr_bad, int cluster, int dead,
+		      int known, struct range_list *seeds)
+{
+	__u64 sectors = dev->size / sector_size, centre = 0, spread;
+	__u32 per = sector_size / SECTOR_SIZE;
+	__u64 lba;
+	int i;
+
+	spread = (4 << 20) / sector_size;
+	if (spread > sectors)
+		spread = sectors;
+
+	for (i = 0; i < nr_bad; i ++) {
+		if (i % cluster == 0)
+			centre = (((__u64)random() << 31) | random()) % (sectors - spread + 1);
+		lba = (centre + random() % spread) * per;
+		if (blk_fault_add(dev, i < dead ? FAULT_DEAD : FAULT_HEAL, lba, per, 0))
+			return -1;
+		if (i % cluster == 0 && i / cluster < known &&
+		    add_range(seeds, lba * SECTOR_SIZE, (lba + per) * SECTOR_SIZE))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The drive logging the known defects instead of md: every other one
+ * as an uncorrectable read in its extended error log, the rest as
+ * failed self-tests, with an interface CRC error in the error log that
+ * says nothing of the media. The pages go to a simulated drive and the
+ * LBAs come back the way fix_sector reads them, into seeds.
+ */
+static int drive_logs(const struct range_list *known, __u32 sector_size,
+		      struct range_list *seeds)
+{
+	int nr_err = known->nr / 2 + 2, nr_test = (known->nr + 1) / 2;
+	int err_pages = (nr_err + 3) / 4, test_pages = (nr_test + 18) / 19 + 1;
+	__u8 *err, *test, *p;
+	struct smart_lbas found;
+	struct ata_dev *ata;
+	__u64 lba;
+	int i, j, k, ret = -1;
+
+	err = calloc(err_pages, 512);
+	test = calloc(test_pages, 512);
+	ata = ata_open_sim();
+	if (NULL == err || NULL == test || NULL == ata)
+		goto out;
+
+	/* entry 0 is the CRC error, the known defects follow */
+	p = err + 4 + 90;
+	p[1] = 0x84;
+	p[11] = 0x51;
+	for (i = 0, j = 1, k = 0; i < known->nr; i ++) {
+		lba = known->ranges[i].start / SECTOR_SIZE;
+		if (i % 2 == 0) {
+			p = err + (j / 4) * 512 + 4 + (j % 4) * 124 + 90;
+			p[1] = ATA_ERR_UNC;
+			p[4] = lba;
+			p[6] = lba >> 8;
+			p[8] = lba >> 16;
+			p[5] = lba >> 24;
+			p[7] = lba >> 32;
+			p[9] = lba >> 40;
+			p[11] = 0x51;
+			j ++;
+		} else {
+			p = test + (k / 19) * 512 + 4 + (k % 19) * 26;
+			p[0] = 0x02;	/* extended off-line */
+			p[1] = 0x70 | 9;	/* read failure, 90% to go */
+			p[5] = lba;
+			p[6] = lba >> 8;
+			p[7] = lba >> 16;
+			p[8] = lba >> 24;
+			p[9] = lba >> 32;
+			p[10] = lba >> 40;
+			k ++;
+		}
+	}
+	err[2] = j;
+
+	if (ata_sim_log(ata, ATA_LOG_EXT_ERROR, 1, err, err_pages) ||
+	    ata_sim_log(ata, ATA_LOG_EXT_SELFTEST, 1, test, test_pages))
+		goto out;
+
+	memset(&found, 0, sizeof(found));
+	ret = smart_read_lbas(ata, &found);
+	if (0 == ret) {
+		printf("drive logs: %d uncorrectable reads, %d failed self-tests, of %d known\n",
+		       found.nr_errors, found.nr_selftests, known->nr);
+		for (i = 0; i < found.lbas.nr && !ret; i ++)
+			ret = add_range(seeds, found.lbas.ranges[i].start * SECTOR_SIZE,
+					found.lbas.ranges[i].start * SECTOR_SIZE + sector_size);
+	}
+	free_ranges(&found.lbas);
+out:
+	if (ata)
+		ata_close(ata);
+	free(err);
+	free(test);
+
+	return ret;
+}
+
+/*
+ * Lay logical volumes over pct of a raid6 array made of devices like
+ * this one, in slots picked at random, and map them back to it the way
+ * fix_sector -F does.
+ */
+static int alloc_ranges(struct blk_dev *dev, int pct, __u32 sector_size,
+			struct range_list *ranges)
+{
+	struct range_list array_ranges;
+	struct raid_geom geom;
+	int slots[BENCH_SLOTS], i, j, tmp, nr, ret;
+	__u64 slot;
+	FILE *fp;
+
+	memset(&geom, 0, sizeof(geom));
+	geom.level = 6;
+	geom.layout = ALGORITHM_LEFT_SYMMETRIC;
+	geom.raid_disks = BENCH_RAID_DISKS;
+	geom.data_disks = BENCH_RAID_DISKS - 2;
+	geom.chunk_size = BENCH_CHUNK;
+	geom.role = BENCH_ROLE;
+	geom.data_size = dev->size - dev->size % BENCH_CHUNK;
+
+	fp = tmpfile();
+	if (NULL == fp)
+		return -1;
+
+	for (i = 0; i < BENCH_SLOTS; i ++)
+		slots[i] = i;
+	nr = (BENCH_SLOTS * pct + 50) / 100;
+	slot = geom.data_size * geom.data_disks / SECTOR_SIZE / BENCH_SLOTS;
+	for (i = 0; i < nr; i ++) {
+		j = i + random() % (BENCH_SLOTS - i);
+		tmp = slots[i];
+		slots[i] = slots[j];
+		slots[j] = tmp;
+		/* a PV starting 1 MB in, like LVM puts its first extent */
+		fprintf(fp, "vg-lv%d: 0 %llu linear 9:127 %llu\n", i, slot - 2048,
+			slots[i] * slot + 2048);
+	}
+	rewind(fp);
+
+	memset(&array_ranges, 0, sizeof(array_ranges));
+	ret = read_lv_segments(fp, makedev(9, 127), &array_ranges);
+	fclose(fp);
+	if (!ret)
+		ret = map_to_member(&geom, &array_ranges, ranges);
+	free_ranges(&array_ranges);
+	coalesce_ranges(ranges, sector_size);
+
+	return ret;
+}
+
+/* what fix_sector -z would show of the device */
+static void report_zones(const struct zone_map *zones)
+{
+	unsigned int median = zone_median(zones), rate, slowest = 0;
+	int i, nr = 0, at = -1;
+
+	for (i = 0; i < zones->nr; i ++) {
+		rate = zone_rate(zones, i);
+		if (0 == rate)
+			continue;
+		if (rate < median / 2)
+			nr ++;
+		if (at < 0 || rate < slowest) {
+			slowest = rate;
+			at = i;
+		}
+	}
+	if (at < 0)
+		return;
+
+	printf("zones: %d of %llu MB, median %u MB/s, %d under half that, slowest %d at %u MB/s\n",
+	       zones->nr, zones->zone_size >> 20, median, nr, at, slowest);
+}
+
+static void report(struct scan_ctx *ctx, struct bench *bench, __u64 injected, double secs, int ret)
+{
+	__u64 repair_ios;
+	int nr = bench->nr_found;
+
+	printf("scan: %.0f MB in %.3f s, %.1f MB/s", ctx->scanned / 1e6, secs,
+	       ctx->scanned / 1e6 / secs);
+	if (ret)
+		printf(", stopped at %.0f MB by an unfixable sector", ctx->offset / 1e6);
+	printf("\n");
+
+	qsort(bench->found, nr, sizeof(double), cmp_double);
+	printf("found %d/%llu bad sectors", nr, injected);
+	if (nr)
+		printf(": first %.3f s, 50%% %.3f s, 90%% %.3f s, last %.3f s",
+		       bench->found[0], bench->found[(nr - 1) / 2],
+		       bench->found[(nr - 1) * 9 / 10], bench->found[nr - 1]);
+	printf("\n");
+
+	repair_ios = ctx->repair_reads + ctx->repair_writes;
+	printf("repair: %llu windows, %llu in the reader, %llu reads, %llu writes",
+	       ctx->bad_windows, ctx->inline_repairs, ctx->repair_reads, ctx->repair_writes);
+	if (ctx->bad_sectors)
+		printf(", %.1f I/Os per bad sector", (double)repair_ios / ctx->bad_sectors);
+	printf("\n");
+	if (ctx->verify_only)
+		printf("verify: %llu unreadable sectors, %llu slow windows, %llu writes in all\n",
+		       ctx->bad_sectors, ctx->slow_windows, ctx->dev->nr_writes);
+
+	if (ctx->zones)
+		report_zones(ctx->zones);
+
+	if (ctx->tuner)
+		printf("tuned: %u KB x %u after %u trials, last trial %.1f MB/s p99 %.1f ms\n",
+		       ctx->tuner->best.io_size / 1024, ctx->tuner->best.depth,
+		       ctx->tuner->trials, ctx->tuner->rate, ctx->tuner->p99_us / 1e3);
+}
+
+/* a member image for -M, with a bad block log next to its superblock */
+#define CHECK_SIZE (64ULL << 20)
+#define CHECK_MAX_DEV 5		/* odd, so the checksum ends on half a word */
+#define CHECK_DEV_NUMBER 3
+#define CHECK_ROLE 2
+
+/* block, length; the log keeps touching entries apart, so do the ranges */
+static const __u64 check_bblog[][2] = { { 16, 1 }, { 1000, 8 }, { 1008, 4 } };
+#define CHECK_BBS (sizeof(check_bblog) / sizeof(check_bblog[0]))
+
+/* the kernel's sum, written out the long way round */
+static __u32 check_csum(const struct mdp_superblock_1 *sb)
+{
+	unsigned char raw[MD_SB1_BYTES];
+	struct mdp_superblock_1 *copy = (struct mdp_superblock_1 *)raw;
+	int size = 256 + le32toh(sb->max_dev) * 2, i;
+	__u64 sum = 0;
+	__u32 word;
+
+	memcpy(raw, sb, size);
+	copy->sb_csum = 0;
+	for (i = 0; i + 4 <= size; i += 4) {
+		memcpy(&word, raw + i, 4);
+		sum += le32toh(word);
+	}
+	if (i < size)
+		sum += raw[i] | raw[i + 1] << 8;
+
+	return (sum & 0xffffffff) + (sum >> 32);
+}
+
+/*
+ * Write a 1.<minor> superblock and its bad block log where mdadm puts
+ * them, read them back the way fix_sector does, and compare. With
+ * corrupt set the checksum is off and no superblock must be found.
+ */
+static int check_super1(int minor, int corrupt)
+{
+	char pathname[] = "/tmp/fix_bench_sb_XXXXXX";
+	struct mdp_superblock_1 *sb;
+	struct range_list ranges;
+	struct scan_range want[CHECK_BBS];
+	off64_t sb_offset, found, data_offset, bblog;
+	int shift = minor, fd, i, ret = -1;
+	__le64 log[512];
+
+	/* 1.0 sits near the end with its log just before it, 1.1 and 1.2 ahead of their data */
+	sb_offset = minor == 2 ? 8 * 512 : minor == 1 ? 0 :
+		    (((CHECK_SIZE >> 9) - 16) & ~7ULL) * 512;
+	data_offset = minor ? 2048 * 512 : 0;
+	bblog = minor ? 8 : -8;
+
+	sb = calloc(1, MD_SB1_BYTES);
+	fd = mkstemp(pathname);
+	if (NULL == sb || fd < 0 || ftruncate(fd, CHECK_SIZE)) {
+		perror("create member image");
+		goto out;
+	}
+	unlink(pathname);
+
+	sb->magic = htole32(MD_SB_MAGIC);
+	sb->major_version = htole32(1);
+	sb->feature_map = htole32(MD_FEATURE_BAD_BLOCKS);
+	memset(sb->set_uuid, 0x5a, sizeof(sb->set_uuid));
+	sb->level = htole32(5);
+	sb->raid_disks = htole32(4);
+	sb->size = htole64((CHECK_SIZE - 2 * 2048 * 512) >> 9);
+	sb->data_offset = htole64(data_offset >> 9);
+	sb->super_offset = htole64(sb_offset >> 9);
+	sb->dev_number = htole32(CHECK_DEV_NUMBER);
+	sb->bblog_shift = shift;
+	sb->bblog_size = htole16(sizeof(log) >> 9);
+	sb->bblog_offset = htole32((__u32)bblog);
+	sb->max_dev = htole32(CHECK_MAX_DEV);
+	for (i = 0; i < CHECK_MAX_DEV; i ++)
+		sb->dev_roles[i] = htole16(MD_DISK_ROLE_SPARE);
+	sb->dev_roles[CHECK_DEV_NUMBER] = htole16(CHECK_ROLE);
+	sb->sb_csum = htole32(check_csum(sb) + !!corrupt);
+
+	/* unused entries are all ones, as mdadm leaves them */
+	memset(log, 0xff, sizeof(log));
+	for (i = 0; i < CHECK_BBS; i ++) {
+		log[i] = htole64(check_bblog[i][0] << 10 | check_bblog[i][1]);
+		want[i].start = (check_bblog[i][0] << shift) * 512;
+		want[i].end = want[i].start + (check_bblog[i][1] << shift) * 512;
+	}
+
+	if (pwrite64(fd, sb, MD_SB1_BYTES, sb_offset) != MD_SB1_BYTES ||
+	    pwrite64(fd, log, sizeof(log), sb_offset + bblog * 512) != sizeof(log)) {
+		perror("write member image");
+		goto out;
+	}
+
+	memset(sb, 0, MD_SB1_BYTES);
+	i = md_read_super1(fd, sb, &found);
+	if (corrupt) {
+		ret = i == -2 ? 0 : -1;
+		printf("super1 1.%d bad checksum: %s\n", minor, ret ? "accepted" : "rejected");
+		goto out;
+	}
+	if (i || found != sb_offset) {
+		printf("super1 1.%d: not found (%d)\n", minor, i);
+		goto out;
+	}
+	if (md_super1_role(sb) != CHECK_ROLE || le64toh(sb->data_offset) * 512 != data_offset ||
+	    (__s32)le32toh(sb->bblog_offset) != bblog || sb->bblog_shift != shift) {
+		printf("super1 1.%d: role %d data_offset %llu bblog %d decoded wrong\n", minor,
+		       md_super1_role(sb), (unsigned long long)le64toh(sb->data_offset),
+		       (__s32)le32toh(sb->bblog_offset));
+		goto out;
+	}
+
+	if (pread64(fd, log, sizeof(log), found + bblog * 512) != sizeof(log)) {
+		perror("read bad block log");
+		goto out;
+	}
+	memset(&ranges, 0, sizeof(ranges));
+	if (md_parse_bblog(log, le16toh(sb->bblog_size) * 512, shift, &ranges)) {
+		free_ranges(&ranges);
+		goto out;
+	}
+	ret = ranges.nr == CHECK_BBS && 0 == memcmp(ranges.ranges, want, sizeof(want)) ? 0 : -1;
+	printf("super1 1.%d at %llu: role %d, data_offset %llu, %d bad ranges: %s\n", minor,
+	       (unsigned long long)found, md_super1_role(sb), (unsigned long long)data_offset,
+	       ranges.nr, ret ? "wrong" : "ok");
+	free_ranges(&ranges);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(sb);
+
+	return ret;
+}
+
+/* a file of the fake sysfs for check_registry(), and the directories to it */
+static int put_attr(const char *dir, const char *name, const void *data, size_t len)
+{
+	char pathname[PATH_MAX], *p;
+	FILE *fp;
+	int ret;
+
+	snprintf(pathname, sizeof(pathname), "%s/%s", dir, name);
+	for (p = pathname + strlen(dir) + 1; (p = strchr(p, '/')) != NULL; p ++) {
+		*p = '\0';
+		mkdir(pathname, 0755);
+		*p = '/';
+	}
+
+	fp = fopen(pathname, "w");
+	if (NULL == fp)
+		return -1;
+	ret = fwrite(data, 1, len, fp) != len;
+
+	return fclose(fp) || ret ? -1 : 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/*
+ * One array in a fake sysfs, with a member serial in each of the places
+ * md_scan() looks: the disk's serial, its page 80h, and those of the
+ * disk a partition is on. Each must lead back to the array and role.
+ */
+static int check_registry(void)
+{
+	static const char vpd[] = "\0\x80\0\x0a  SER-C   ";
+	static const struct {
+		const char *serial;
+		int role;
+	} want[] = { { "SER-B", 0 }, { "SER-C", 1 }, { "SER-D", 2 } };
+	char dir[] = "/tmp/fix_bench_md_XXXXXX";
+	struct md_registry reg = { .sysfs = dir };
+	const struct md_member *member;
+	const struct md_array *array;
+	int i, ret = -1;
+
+	if (NULL == mkdtemp(dir)) {
+		perror("create sysfs");
+		return -1;
+	}
+
+	if (put_attr(dir, "md0/dev", "9:0\n", 4) ||
+	    put_attr(dir, "md0/md/uuid", "01234567-89abcdef-01234567-89abcdef\n", 36) ||
+	    put_attr(dir, "md0/md/dev-sdb/slot", "0\n", 2) ||
+	    put_attr(dir, "md0/md/dev-sdb/block/dev", "8:16\n", 5) ||
+	    put_attr(dir, "md0/md/dev-sdb/block/device/serial", "SER-B\n", 6) ||
+	    put_attr(dir, "md0/md/dev-sdc/slot", "1\n", 2) ||
+	    put_attr(dir, "md0/md/dev-sdc/block/dev", "8:32\n", 5) ||
+	    put_attr(dir, "md0/md/dev-sdc/block/device/vpd_pg80", vpd, sizeof(vpd) - 1) ||
+	    put_attr(dir, "md0/md/dev-sdd1/slot", "2\n", 2) ||
+	    put_attr(dir, "md0/md/dev-sdd1/block/dev", "8:49\n", 5) ||
+	    put_attr(dir, "md0/md/dev-sdd1/device/serial", "SER-D\n", 6)) {
+		perror("write sysfs");
+		goto out;
+	}
+
+	for (i = 0; i < 3; i ++) {
+		member = NULL;
+		array = md_find_serial(&reg, want[i].serial, &member);
+		if (NULL == array || strcmp(array->name, "md0") || member->role != want[i].role)
+			break;
+	}
+	ret = i == 3 && NULL == md_find_serial(&reg, "SER-X", NULL) ? 0 : -1;
+	printf("md registry: %d of 3 members found by serial: %s\n", i, ret ? "wrong" : "ok");
+
+out:
+	md_free(&reg);
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	printf("%s [options]: scan and repair a file-backed device with injected faults\n", prog);
+	printf("\t-s size_mb: device size, default %d\n", DEF_SIZE_MB);
+	printf("\t-p sector_size: physical sector size, default 4096\n");
+	printf("\t-b buf_kb: scan I/O size, the largest one when tuning, default %d\n",
+	       DEF_BUF_KB);
+	printf("\t-q depth: reads in flight, the most when tuning, default 1\n");
+	printf("\t-R workers: repair workers, 0 to repair in the reader, default %d\n",
+	       SCAN_REPAIR_DEPTH);
+	printf("\t-t: tune I/O size and depth while scanning\n");
+	printf("\t-L ms: latency ceiling for tuning, default %d\n", TUNE_LAT_CEILING_MS);
+	printf("\t-a trials: steady trials between two probes, default %d\n",
+	       TUNE_ADAPT_TRIALS);
+	printf("\t-T file: start from and save tuning to file\n");
+	printf("\t-n bad: bad sectors to inject, default 32\n");
+	printf("\t-c cluster: bad sectors per defect, default 8\n");
+	printf("\t-d dead: how many of them never heal, default 0\n");
+	printf("\t-l usecs: latency of every I/O\n");
+	printf("\t-w MB/s: transfer rate\n");
+	printf("\t-m MB/s: limit the scan to that, as fix_sector -t does\n");
+	printf("\t-v usecs: only map, as fix_sector -m does, reads slower than usecs a MB as slow\n");
+	printf("\t-f spec: load faults from a file instead\n");
+	printf("\t-k known: defects md already has a sector of in its bad block list\n");
+	printf("\t-K secs: the kernel logs the known defects that far in, instead\n");
+	printf("\t-S: the drive's error and self-test logs have the known defects, instead\n");
+	printf("\t-o: plain linear sweep, nothing first around bad sectors\n");
+	printf("\t-u percent: scan only where logical volumes cover that much of the array\n");
+	printf("\t-r seed: random seed\n");
+	printf("\t-M: check 1.x superblock and bad block log decoding and member lookup\n"
+	       "\t    by serial, then exit\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char pathname[] = "/tmp/fix_bench_XXXXXX";
+	const char *spec = NULL, *tune_file = NULL;
+	struct tune_params saved;
+	struct range_list ranges, seeds, none, logged;
+	char logname[] = "/tmp/fix_bench_kmsg_XXXXXX";
+	struct kmsg_follower follower;
+	struct kernel_log log;
+	pthread_t log_tid;
+	struct tuner tuner;
+	struct zone_map zones;
+	struct scan_ctx ctx;
+	struct bench bench;
+	struct blk_dev *dev;
+	__u64 size_mb = DEF_SIZE_MB, injected;
+	__u32 sector_size = 4096, buf_kb = DEF_BUF_KB, latency = 0, mbps = 0, limit = 0;
+	__u64 slow_us = 0;
+	__u32 depth = 1, repair_depth = SCAN_REPAIR_DEPTH, ceiling_ms = TUNE_LAT_CEILING_MS, adapt = TUNE_ADAPT_TRIALS;
+	int nr_bad = 32, cluster = 8, dead = 0, seed = 1, tune = 0, alloc = -1;
+	int known = 0, linear = 0, verify = 0, smart = 0, option, fd, ret;
+	double log_delay = -1;
+	double secs;
+
+	while ((option = getopt(argc, argv, "s:p:b:q:R:tL:a:T:n:c:d:l:w:m:v:f:k:K:Sou:r:M")) != EOF) {
+		switch (option) {
+		case 's':
+			size_mb = atoll(optarg);
+			break;
+		case 'p':
+			sector_size = atoi(optarg);
+			break;
+		case 'b':
+			buf_kb = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'R':
+			repair_depth = atoi(optarg);
+			break;
+		case 't':
+			tune = 1;
+			break;
+		case 'L':
+			ceiling_ms = atoi(optarg);
+			break;
+		case 'a':
+			adapt = atoi(optarg);
+			break;
+		case 'T':
+			tune_file = optarg;
+			tune = 1;
+			break;
+		case 'n':
+			nr_bad = atoi(optarg);
+			break;
+		case 'c':
+			cluster = atoi(optarg);
+			break;
+		case 'd':
+			dead = atoi(optarg);
+			break;
+		case 'l':
+			latency = atoi(optarg);
+			break;
+		case 'w':
+			mbps = atoi(optarg);
+			break;
+		case 'm':
+			limit = atoi(optarg);
+			break;
+		case 'v':
+			slow_us = atoll(optarg);
+			verify = 1;
+			break;
+		case 'f':
+			spec = optarg;
+			break;
+		case 'k':
+			known = atoi(optarg);
+			break;
+		case 'K':
+			log_delay = atof(optarg);
+			break;
+		case 'S':
+			smart = 1;
+			break;
+		case 'o':
+			linear = 1;
+			break;
+		case 'u':
+			alloc = atoi(optarg);
+			break;
+		case 'r':
+			seed = atoi(optarg);
+			break;
+		case 'M':
+			for (option = 0, ret = 0; option < 3; option ++)
+				ret |= check_super1(option, 0) | check_super1(option, 1);
+			ret |= check_registry();
+			return ret ? 1 : 0;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || 0 == size_mb || 0 == buf_kb || cluster <= 0 || alloc > 100 ||
+	    depth < 1 || depth > SCAN_MAX_DEPTH || repair_depth > SCAN_MAX_REPAIR ||
+	    (buf_kb * 1024) % sector_size)
+		usage(argv[0]);
+
+	fd = mkstemp(pathname);
+	if (fd < 0 || ftruncate(fd, size_mb << 20)) {
+		perror("create backing file");
+		return 1;
+	}
+	close(fd);
+
+	dev = blk_open_fault(pathname, sector_size);
+	unlink(pathname);
+	if (NULL == dev) {
+		perror("open backing file");
+		return 1;
+	}
+
+	memset(&seeds, 0, sizeof(seeds));
+	srandom(seed);
+	blk_fault_model(dev, latency, mbps);
+	if (spec)
+		ret = blk_fault_load(dev, spec);
+	else
+		ret = gen_faults(dev, sector_size, nr_bad, cluster, dead, known, &seeds);
+	if (ret) {
+		fprintf(stderr, "set up faults error\n");
+		return 1;
+	}
+	injected = blk_fault_sectors(dev);
+	if (smart) {
+		logged = seeds;
+		memset(&seeds, 0, sizeof(seeds));
+		ret = drive_logs(&logged, sector_size, &seeds);
+		free_ranges(&logged);
+		if (ret) {
+			fprintf(stderr, "read drive logs error\n");
+			return 1;
+		}
+	}
+
+	memset(&bench, 0, sizeof(bench));
+	pthread_mutex_init(&bench.lock, NULL);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.dev = dev;
+	ctx.buf_size = buf_kb * 1024;
+	ctx.buf = valloc(ctx.buf_size);
+	ctx.sector_size = sector_size;
+	ctx.depth = depth;
+	ctx.repair_depth = repair_depth;
+	ctx.sector_fn = found_sector;
+	ctx.arg = &bench;
+	memset(&none, 0, sizeof(none));
+	ctx.seeds = log_delay < 0 ? &seeds : &none;
+	ctx.hot_radius = linear ? 0 : SCAN_HOT_RADIUS;
+	ctx.throttle = (__u64)limit << 20;
+	ctx.verify_only = verify;
+	ctx.slow_us = slow_us;
+	if (zone_init(&zones, 0, dev->size, ZONE_COUNT) == 0)
+		ctx.zones = &zones;
+	if (NULL == ctx.buf) {
+		perror("alloc error");
+		return 1;
+	}
+
+	if (tune) {
+		ret = tune_file ? tune_load(tune_file, "fix_bench", "fix_bench", &saved) : -1;
+		tune_init(&tuner, ctx.buf_size, depth > 1 ? depth : TUNE_MAX_DEPTH,
+			  ret ? NULL : &saved);
+		tuner.lat_ceiling_us = ceiling_ms * 1000;
+		tuner.adapt_trials = adapt;
+		ctx.tuner = &tuner;
+	}
+
+	printf("%llu MB, %u byte sectors, %u KB I/O x %u%s, %llu bad sectors\n", size_mb,
+	       sector_size, buf_kb, ctx.tuner ? tuner.max_depth : depth,
+	       ctx.tuner ? " at most, tuned" : "", injected);
+
+	memset(&ranges, 0, sizeof(ranges));
+	if (alloc >= 0) {
+		if (alloc_ranges(dev, alloc, sector_size, &ranges)) {
+			fprintf(stderr, "map logical volumes error\n");
+			return 1;
+		}
+		printf("%.1f%% of the device allocated in %d ranges\n",
+		       100.0 * ranges_bytes(&ranges) / dev->size, ranges.nr);
+	} else
+		add_range(&ranges, 0, dev->size);
+
+	ctx.ranges = &ranges;
+
+	if (log_delay >= 0) {
+		fd = mkstemp(logname);
+		if (fd < 0) {
+			perror("create kernel log");
+			return 1;
+		}
+		close(fd);
+		memset(&follower, 0, sizeof(follower));
+		follower.pathname = logname;
+		snprintf(follower.disk, sizeof(follower.disk), "fbench");
+		follower.size = dev->size;
+		follower.ctx = &ctx;
+		log.pathname = logname;
+		log.known = &seeds;
+		log.delay = log_delay;
+		if (kmsg_start(&follower) ||
+		    pthread_create(&log_tid, NULL, write_log, &log)) {
+			fprintf(stderr, "follow kernel log error\n");
+			return 1;
+		}
+	}
+
+	bench.start = now();
+	ret = scan_sectors(&ctx);
+	secs = now() - bench.start;
+
+	if (log_delay >= 0) {
+		pthread_join(log_tid, NULL);
+		kmsg_stop(&follower);
+		unlink(logname);
+		printf("kernel log: %d errors written at %.3f s, %llu read, %llu queued\n",
+		       seeds.nr, log.written, follower.nr_errors, follower.nr_pushed);
+	}
+
+	report(&ctx, &bench, injected, secs, ret);
+	if (tune_file && tune_save(tune_file, "fix_bench", "fix_bench", &tuner.best))
+		perror("save tuning");
+
+	blk_close(dev);
+	free_ranges(&ranges);
+	free_ranges(&seeds);
+	zone_free(&zones);
+	free(ctx.buf);
+	free(bench.found);
+
+	return 0;
+}
@@ -1,19 +1,38 @@
 #include "fix_sector.h"
+#include "scan.h"
+#include "alloc.h"
+#include "age.h"
+#include "kmsg.h"
+#include "ctl.h"
+#include "md.h"
+#include "bbmap.h"
+#include "zone.h"
+#include "state_file.h"
+#include "sgio.h"
+#include "smart.h"
+#include <sys/sysmacros.h>
+#include <libgen.h>
+#include <limits.h>
 #include "md_u.h"
 #include "md_p.h"
 #include <sys/resource.h>
 
-#define PROC_NAME "fix_sector"
-#define BUF_SIZE (1024 * 1024)
-#define RETRY 3
-#define SECTOR_SIZE 512
+/* the largest scan I/O the tuner may pick */
+#define BUF_SIZE (4 * 1024 * 1024)
 #define INTERVAL 2
+/* how much each INTERVAL's rate moves the speed */
+#define SPEED_WEIGHT 0.25
 #define HD_SERIAL_LEN 21
-#define ARRAY_PATHNAME "/dev/shm/fix_array_info"
+#define HD_MODEL_LEN 41
+/* what -m found on every member, read by later fixes and get_bad_block */
+#define SURFACE_PATHNAME "/var/lib/fix_sector/surface.bbmap"
+/* a window up to 1 MB the disk takes longer than this on is mapped as slow */
+#define SURFACE_SLOW_US (200 * 1000)
 
 struct device_info {
 	char *name;
 	char serialno[HD_SERIAL_LEN];
+	char model[HD_MODEL_LEN];
 
 	__u64 total_sectors;
 	__u32 sector_size;
@@ -23,55 +42,119 @@ struct device_info {
 	struct timeval stime;
 
 	int raid_uuid[4];
+	int level;
+	int layout;
+	int raid_disks;
 	int data_disks;
 	int chunk_size;
 	int role;
-	int data_offset;
-	off64_t data_size;
+	off64_t data_offset;
+	off64_t data_size;	/* from data_offset */
+
+	/* the member's own bad block log, 1.x only */
+	off64_t bblog_offset;
+	__u32 bblog_size;
+	int bblog_shift;
 };
 
 struct device_info dinfo;
 char *buf;
-static unsigned int cur_spd = 0;
+static unsigned int cur_spd = 0;	/* bytes per second, smoothed */
+static long cur_eta = -1;		/* seconds, -1 before there is a speed */
 
 static void usage()
 {
 	printf("Version: v0.8\n");
 	printf("Usage:\n");
 	printf("\t-f [dev_name] [start_percent]: fix disk bad sector\n");
+	printf("\t-F [dev_name] [start_percent]: same, only where logical volumes are\n");
+	printf("\t-r [dev_name] [budget]: fix the least recently verified regions first,\n"
+	       "\t\tfor a time (30m, 2h) or an amount of data (500G)\n");
+	printf("\t-m [dev_name]: map unreadable and slow sectors, writing nothing\n");
 	printf("\t-s [dev_name]: query disk current status\n");
+	printf("\t-z [dev_name]: show how fast each zone of the disk reads\n");
 	printf("\t-x [dev_name]: stop fixing disk\n");
+	printf("\t-p [dev_name]: pause fixing disk\n");
+	printf("\t-c [dev_name]: continue a paused fix\n");
+	printf("\t-t [dev_name] [MB/s]: limit the scan rate, 0 for no limit\n");
 	exit(1);
 }
 
-int load_super0(int fd)
+static int set_geometry(int level, int layout, int raid_disks, int chunk_size, int role)
 {
-	off64_t dsize;
-	off64_t offset;
-	mdp_super_t super;
+	if (level == 5) {
+		dinfo.data_disks = raid_disks - 1;
+	} else if (level == 6) {
+		dinfo.data_disks = raid_disks - 2;
+	} else {
+		perror("Unsupport raid level");
+		return -2;
+	}
 
-	if (ioctl(fd, BLKGETSIZE64, &dsize) != 0) {
+	dinfo.level = level;
+	dinfo.layout = layout;
+	dinfo.raid_disks = raid_disks;
+	dinfo.chunk_size = chunk_size;
+	dinfo.role = role;
+
+	return 0;
+}
+
+int load_super1(int fd)
+{
+	struct mdp_superblock_1 *sb;
+	off64_t sb_offset;
+	int ret, role;
+
+	sb = malloc(MD_SB1_BYTES);
+	if (NULL == sb)
 		return -1;
+
+	ret = md_read_super1(fd, sb, &sb_offset);
+	if (ret == -2) {
+		perror("Not metadata 0.9 or 1.x");
+		goto out;
+	} else if (ret) {
+		perror("read superblock error");
+		goto out;
 	}
-	offset = MD_NEW_SIZE_SECTORS(dsize >> 9);
-	offset *= 512;
-	ioctl(fd, BLKFLSBUF, 0);
 
-	if (lseek64(fd, offset, 0) < 0LL) {
-		perror("lseek64 error");
-		return -1;
+	role = md_super1_role(sb);
+	if (role < 0) {
+		perror("not an active member");
+		ret = -2;
+		goto out;
 	}
 
-	memset(buf, 0, sizeof(super));
-	if (read(fd, buf, sizeof(super)) != MD_SB_BYTES) {
-		perror("read superblock error");
-		return -1;
+	memcpy(dinfo.raid_uuid, sb->set_uuid, sizeof(dinfo.raid_uuid));
+	dinfo.data_offset = le64toh(sb->data_offset) * SECTOR_SIZE;
+	dinfo.data_size = le64toh(sb->size) * SECTOR_SIZE;
+
+	if ((le32toh(sb->feature_map) & MD_FEATURE_BAD_BLOCKS) && sb->bblog_size) {
+		dinfo.bblog_offset = sb_offset + (__s32)le32toh(sb->bblog_offset) * SECTOR_SIZE;
+		dinfo.bblog_size = le16toh(sb->bblog_size) * SECTOR_SIZE;
+		dinfo.bblog_shift = sb->bblog_shift;
 	}
-	memcpy(&super, buf, sizeof(super));
 
-	if (super.md_magic != MD_SB_MAGIC) {
-		perror("Not metadata 0.9");
-		return -2;
+	ret = set_geometry(le32toh(sb->level), le32toh(sb->layout), le32toh(sb->raid_disks),
+			   le32toh(sb->chunksize) * SECTOR_SIZE, role);
+out:
+	free(sb);
+	return ret;
+}
+
+int load_super0(int fd)
+{
+	mdp_super_t super;
+	int ret;
+
+	ret = md_read_super0(fd, &super);
+	if (ret == -2) {
+		/* no 0.90 superblock, maybe a 1.x one */
+		return load_super1(fd);
+	} else if (ret) {
+		perror("read superblock error");
+		return -1;
 	}
 
 	dinfo.raid_uuid[0] = super.set_uuid0;
@@ -81,26 +164,11 @@ int load_super0(int fd)
 		dinfo.raid_uuid[3] = super.set_uuid3;
 	}
 
-	if (super.level == 5) {
-		dinfo.data_disks = super.raid_disks - 1;
-	} else if (super.level == 6) {
-		dinfo.data_disks = super.raid_disks - 2;
-	} else {
-		perror("Unsupport raid level");
-		return -2;
-	}
-
-	dinfo.chunk_size = super.chunk_size;
-	dinfo.role = super.this_disk.raid_disk;
 	dinfo.data_offset = 0;
 	dinfo.data_size = (off64_t)super.size * 1024;
 
-	return 0;
-}
-
-int load_super1(int fd)
-{
-	return -1;
+	return set_geometry(super.level, super.layout, super.raid_disks, super.chunk_size,
+			    super.this_disk.raid_disk);
 }
 
 static char *strip(char *s)
@@ -167,6 +235,11 @@ static int get_devinfo(int fd)
 		perror("get serial number error");
 	}
 
+	memset(dinfo.model, 0, sizeof(dinfo.model));
+	memcpy(dinfo.model, (char *)&id[27], 40);
+	p = strip(dinfo.model);
+	memmove(dinfo.model, p, strlen(p) + 1);
+
 	if((id[106] & 0xc000) != 0x4000) {
 		dinfo.phy_sector_size = 512;
 	} else {
@@ -215,50 +288,205 @@ static int get_array_info(const char *array_name, mdu_array_info_t *array)
 	return 0;
 }
 
+/* read once, and again only for an array it does not know */
+static struct md_registry arrays;
+
+/* the assembled array this disk belongs to, by uuid or else by its serial */
+static int find_array(char *devname, int len)
+{
+	const struct md_array *array;
+
+	array = md_find_uuid(&arrays, dinfo.raid_uuid);
+	if (NULL == array)
+		array = md_find_serial(&arrays, dinfo.serialno, NULL);
+	if (NULL == array)
+		return -1;
+
+	snprintf(devname, len, "/dev/%s", array->name);
+	return 0;
+}
+
 static int check_array_status()
 {
-	char cmd[128], buf[512], devname[16], *p;
-	int uuid[4], ret, found = 0;
-	FILE *fp;
+	char devname[64];
 	mdu_array_info_t array;
 
-	sprintf(cmd, "mdadm -Ds 1>%s 2>/dev/null", ARRAY_PATHNAME);
-	system(cmd);
-	fp = fopen(ARRAY_PATHNAME, "r");
-	while (!feof(fp)) {
-		memset(buf, 0, sizeof(buf));
-		fgets(buf, sizeof(buf), fp);
-		if ((p = strstr(buf, "UUID=")) == NULL)
-			continue;
+	if (find_array(devname, sizeof(devname)) == 0) {
+		memset(&array, 0, sizeof(array));
+		if (!get_array_info(devname, &array)) {
+			/* Fixme: only use of raid5 */
+			if (array.raid_disks <= array.active_disks + 1)
+				return 1;
+		}
+	}
 
-		memset(devname, 0, sizeof(devname));
-		memset(uuid, 0, sizeof(uuid));
-		ret = sscanf(buf, "ARRAY %s", devname);
-		if (ret != 1)
-			continue;
+	return 0;
+}
+
+/*
+ * The member ranges behind the logical volumes on the array, clipped
+ * to start at start_offset. Return -1 if the array or its volumes
+ * can't be found, the caller then scans everything.
+ */
+static int get_alloc_ranges(off64_t start_offset, struct range_list *ranges)
+{
+	struct range_list array_ranges;
+	struct raid_geom geom;
+	struct stat st;
+	char devname[64];
+	int i, ret;
+	FILE *fp;
+
+	if (find_array(devname, sizeof(devname)) || stat(devname, &st) || !S_ISBLK(st.st_mode))
+		return -1;
+
+	fp = popen("dmsetup table 2>/dev/null", "r");
+	if (NULL == fp)
+		return -1;
+
+	memset(&array_ranges, 0, sizeof(array_ranges));
+	ret = read_lv_segments(fp, st.st_rdev, &array_ranges);
+	pclose(fp);
+	if (ret || 0 == array_ranges.nr) {
+		free_ranges(&array_ranges);
+		return -1;
+	}
 
-		ret = sscanf(p, "UUID=%x:%x:%x:%x", 
-				&uuid[0], &uuid[1], &uuid[2], &uuid[3]);
-		if (ret != 4)
+	geom.level = dinfo.level;
+	geom.layout = dinfo.layout;
+	geom.raid_disks = dinfo.raid_disks;
+	geom.data_disks = dinfo.data_disks;
+	geom.chunk_size = dinfo.chunk_size;
+	geom.role = dinfo.role;
+	geom.data_offset = dinfo.data_offset;
+	geom.data_size = dinfo.data_size;
+
+	ret = map_to_member(&geom, &array_ranges, ranges);
+	free_ranges(&array_ranges);
+	if (ret)
+		return -1;
+
+	coalesce_ranges(ranges, dinfo.phy_sector_size);
+	for (i = 0; i < ranges->nr; i ++) {
+		if (ranges->ranges[i].start < start_offset)
+			ranges->ranges[i].start = start_offset;
+	}
+	coalesce_ranges(ranges, dinfo.phy_sector_size);
+
+	return 0;
+}
+
+/*
+ * Bad blocks md has already recorded for this member, acknowledged
+ * or not, as member byte ranges to look at first.
+ */
+static int get_md_bad_blocks(struct range_list *seeds)
+{
+	static const char *files[] = { "bad_blocks", "unacknowledged_bad_blocks" };
+	const struct md_array *array;
+	const struct md_member *member;
+	char pathname[PATH_MAX];
+	unsigned long long sector;
+	struct stat st;
+	int i, len;
+	FILE *fp;
+
+	if (stat(dinfo.name, &st) || !S_ISBLK(st.st_mode))
+		return -1;
+	array = md_find_member(&arrays, st.st_rdev, &member);
+	if (NULL == array)
+		return -1;
+
+	for (i = 0; i < 2; i ++) {
+		snprintf(pathname, sizeof(pathname), "%s/%s/md/dev-%s/%s",
+			 arrays.sysfs ? arrays.sysfs : MD_SYSFS, array->name, member->name, files[i]);
+		fp = fopen(pathname, "r");
+		if (NULL == fp)
 			continue;
 
-		if (uuid[0] == dinfo.raid_uuid[0] && uuid[1] == dinfo.raid_uuid[1] &&
-			uuid[2] == dinfo.raid_uuid[2] && uuid[3] == dinfo.raid_uuid[3]) {
-			found = 1;
-			break;
+		while (fscanf(fp, "%llu %d", &sector, &len) == 2) {
+			/* md lists sectors of the whole member, data_offset included */
+			if (add_range(seeds, sector * SECTOR_SIZE, (sector + len) * SECTOR_SIZE))
+				break;
 		}
+		fclose(fp);
 	}
 
+	return 0;
+}
+
+/*
+ * The bad block log in a 1.x member's own metadata, in one read: what
+ * md knew about the member when it last wrote its superblock.
+ */
+static int get_disk_bad_blocks(struct blk_dev *dev, struct range_list *seeds)
+{
+	if (0 == dinfo.bblog_size || dinfo.bblog_size > BUF_SIZE)
+		return -1;
+	if (blk_read(dev, buf, dinfo.bblog_size, dinfo.bblog_offset) != dinfo.bblog_size)
+		return -1;
+
+	return md_parse_bblog(buf, dinfo.bblog_size, dinfo.bblog_shift, seeds);
+}
+
+/* where the member starts on its disk, 0 if it is the whole disk */
+static off64_t partition_start(int fd)
+{
+	char pathname[64], line[32];
+	struct stat st;
+	FILE *fp;
+	long long start = 0;
+
+	if (fstat(fd, &st) < 0)
+		return 0;
+	snprintf(pathname, sizeof(pathname), "/sys/dev/block/%u:%u/start",
+		 major(st.st_rdev), minor(st.st_rdev));
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return 0;
+	if (NULL == fgets(line, sizeof(line), fp) || sscanf(line, "%lld", &start) != 1)
+		start = 0;
 	fclose(fp);
 
-	if (found) {
-		memset(&array, 0, sizeof(array));
-		if (!get_array_info(devname, &array)) {
-			/* Fixme: only use of raid5 */
-			if (array.raid_disks <= array.active_disks + 1)
-				return 1;
-		}
+	return start * SECTOR_SIZE;
+}
+
+/*
+ * What the drive logged itself as unreadable, in its error and
+ * self-test logs. Those are LBAs of the whole disk; keep the ones in
+ * the member's data.
+ */
+static int get_drive_bad_blocks(struct blk_dev *dev, struct range_list *seeds)
+{
+	struct smart_lbas found;
+	struct ata_dev *ata;
+	off64_t start, offset;
+	int i, nr = 0, ret;
+
+	ata = ata_open_fd(dev->fd);
+	if (NULL == ata)
+		return -1;
+	memset(&found, 0, sizeof(found));
+	ret = smart_read_lbas(ata, &found);
+	ata_close(ata);
+	if (ret) {
+		free_ranges(&found.lbas);
+		return -1;
+	}
+
+	start = partition_start(dev->fd);
+	for (i = 0; i < found.lbas.nr; i ++) {
+		offset = found.lbas.ranges[i].start * dinfo.sector_size - start;
+		if (offset < dinfo.data_offset || offset >= dinfo.data_offset + dinfo.data_size)
+			continue;
+		if (add_range(seeds, offset, offset + dinfo.sector_size))
+			break;
+		nr ++;
 	}
+	syslog(LOG_INFO, "%s %s: drive logged %d unreadable LBAs and %d failed self-tests, "
+		"%d in this member's data\n", dinfo.name, dinfo.serialno, found.nr_errors,
+		found.nr_selftests, nr);
+	free_ranges(&found.lbas);
 
 	return 0;
 }
@@ -304,69 +532,85 @@ static int clear_status()
 	return 0;
 }
 
-static int write_status(int fd, off64_t offset, int status)
+/* the lock and control socket of the fix running on this device */
+static const char *run_path(const char *suffix)
 {
-	struct timeval ctime;
-	char shm_buf[512];
+	static char pathname[2][256];
+	static int i;
+	const char *dir = getenv("FIX_SECTOR_RUN");
 
-	gettimeofday(&ctime, NULL);
+	i ^= 1;
+	snprintf(pathname[i], sizeof(pathname[i]), "%s/fix_%s_%x_%x_%x_%x_%d.%s",
+		 dir ? dir : CTL_RUNDIR, dinfo.serialno, dinfo.raid_uuid[0], dinfo.raid_uuid[1],
+		 dinfo.raid_uuid[2], dinfo.raid_uuid[3], dinfo.role, suffix);
 
-	lseek(fd, 0, SEEK_SET);
-	memset(shm_buf, 0, sizeof(shm_buf));
-	sprintf(shm_buf, "%d-%lu-%lu-%"PRId64"-%"PRId64"-%u\n", status, ctime.tv_sec,
-				dinfo.stime.tv_sec, dinfo.start_offset, offset, cur_spd);
+	return pathname[i];
+}
 
-	write(fd, shm_buf, strlen(shm_buf) + 1);
+static int format_status(char *line, size_t len, off64_t offset, int status,
+			 int paused, unsigned int throttle)
+{
+	struct timeval ctime;
 
-	return 0;
+	gettimeofday(&ctime, NULL);
+
+	return snprintf(line, len, "%d-%lu-%lu-%"PRId64"-%"PRId64"-%u-%d-%u-%ld\n", status,
+			ctime.tv_sec, dinfo.stime.tv_sec, dinfo.start_offset, offset, cur_spd,
+			paused, throttle, cur_eta);
 }
 
-static int check()
+static int write_status(int fd, off64_t offset, int status)
 {
-	char cmd[64];
-	char buf[128];
-	int count = 0;
-	FILE *fp;
+	char shm_buf[512];
 
-	sprintf(cmd, "ps -ef|grep \"%s -f %s \"| grep -v grep | wc -l", PROC_NAME, dinfo.name);
-	fp = popen(cmd, "r");
-	if (fp != NULL) {
-		memset(buf, 0, sizeof(buf));
-		fgets(buf, sizeof(buf), fp);
-		count = atoi(buf);
-	}
+	lseek(fd, 0, SEEK_SET);
+	memset(shm_buf, 0, sizeof(shm_buf));
+	format_status(shm_buf, sizeof(shm_buf), offset, status, 0, 0);
 
-	fclose(fp);
+	write(fd, shm_buf, strlen(shm_buf) + 1);
 
-	return count;
+	return 0;
 }
 
+/*
+ * print_status:
+ *
+ * Ask the running fix first; the status file only tells how the last
+ * one ended once nobody answers.
+ */
 static int print_status()
 {
 	int shm_fd, ret;
-	char shm_buf[512];
+	char shm_buf[CTL_MAX_MSG];
 	time_t start_time, cur_time, finish_time = 3600 * 2;
 	off64_t start_offset, offset;
-	int status, percent = 0;
-	unsigned int avg_spd = 0;
+	int status, paused = 0, running, percent = 0;
+	unsigned int avg_spd = 0, throttle = 0;
+	long eta = -1;
 	double remained;
 
-	shm_fd = open_shm_file(0);
-	if (shm_fd < 0) {
-		if (shm_fd == -2) {
-			printf("%s is not fixing\n", dinfo.name);
-			return 0;
-		} else {
-			perror("open shm file error");
-			return -1;
+	memset(shm_buf, 0, sizeof(shm_buf));
+	running = !ctl_request(run_path("sock"), "status", shm_buf, sizeof(shm_buf));
+	if (!running) {
+		shm_fd = open_shm_file(0);
+		if (shm_fd < 0) {
+			if (shm_fd == -2) {
+				printf("%s is not fixing\n", dinfo.name);
+				return 0;
+			} else {
+				perror("open shm file error");
+				return -1;
+			}
 		}
+		read(shm_fd, shm_buf, sizeof(shm_buf) - 1);
+		close(shm_fd);
 	}
 
-	read(shm_fd, shm_buf, sizeof(shm_buf));
-	ret = sscanf(shm_buf, "%d-%lu-%lu-%"PRId64"-%"PRId64"-%u\n", &status,
-		&cur_time, &start_time, &start_offset, &offset, &avg_spd);
+	ret = sscanf(shm_buf, "%d-%lu-%lu-%"PRId64"-%"PRId64"-%u-%d-%u-%ld\n", &status,
+		&cur_time, &start_time, &start_offset, &offset, &avg_spd, &paused, &throttle,
+		&eta);
 
-	if (ret != 6) {
+	if (ret < 6) {
 		perror("invalid format");
 		return -1;
 	}
@@ -382,112 +626,567 @@ static int print_status()
 		return -1;
 	}
 
-	if (check() == 0) {
+	if (!running) {
 		printf("%s is not fixing\n", dinfo.name);
 		return 0;
 	}
 
 	if (offset >= start_offset && offset != 0 && avg_spd > 0) {
-		if (dinfo.data_size < offset) {
+		if (dinfo.data_offset + dinfo.data_size < offset) {
 			finish_time = 0;
 			percent = 100;
 		} else {
-			finish_time = (dinfo.data_size - offset) / avg_spd;
-			remained = (double)offset / dinfo.data_size;
+			finish_time = (dinfo.data_offset + dinfo.data_size - offset) / avg_spd;
+			remained = (double)(offset - dinfo.data_offset) / dinfo.data_size;
 			percent = remained * 100;
 		}
 	}
+	/* what is left to scan, which need not be all that lies past offset */
+	if (eta >= 0)
+		finish_time = eta;
 
-	printf("avg_spd %u, finish percent %d, remain %lu seconds\n", avg_spd, percent, finish_time);
-
-	close(shm_fd);
+	printf("avg_spd %u, finish percent %d, remain %lu seconds", avg_spd, percent, finish_time);
+	if (paused)
+		printf(", paused");
+	else if (throttle)
+		printf(", limited to %u MB/s", throttle);
+	printf("\n");
 
 	return 0;
 }
 
 /**********/
 
-static int fix_pending_sector(int fd, const __u64 rd_offset, const size_t size)
+static void report_sector(struct scan_ctx *ctx, off64_t offset, int fixed)
 {
-	off64_t offset, scaned_size = 0;
-	int i, ret, fixed = 0;
+	syslog(LOG_WARNING, "%s uuid: %x role %d: %s %"PRId64"-%d\n",
+			dinfo.name, dinfo.raid_uuid[0], dinfo.role, fixed ? "fixed" : "can't fix",
+			offset / SECTOR_SIZE, dinfo.phy_sector_size / SECTOR_SIZE);
+}
 
-	while (1) {
-		offset = rd_offset + scaned_size;
-		if (lseek64(fd, offset, SEEK_SET) < 0LL) {
-			if (EOVERFLOW != errno) {
-				perror("seek error");
-				return -1;
-			}
-		}
-		ret = read(fd, buf, dinfo.phy_sector_size);
+static const char *age_pathname(void)
+{
+	static char pathname[256];
+	const char *dir = getenv("FIX_SECTOR_AGE");
 
-		if (ret < 0) {
-			if (EIO != errno)
-				return -1;
+	snprintf(pathname, sizeof(pathname), "%s/%s", dir ? dir : AGE_PATHNAME,
+		 dinfo.serialno[0] ? dinfo.serialno : basename(dinfo.name));
 
-			fixed = 0;
-			for (i = 0; i < RETRY; i ++) {
-				if (lseek64(fd, offset, SEEK_SET) < 0LL) {
-					perror("seek error");
-					return -1;
-				}
-				memset(buf, 0, dinfo.phy_sector_size);
-				ret = write(fd, buf, dinfo.phy_sector_size);
-				if (ret != dinfo.phy_sector_size) {
-					perror("write badsector error");
-					continue;
-				}
-
-				if (lseek64(fd, offset, SEEK_SET) < 0LL) {
-					perror("seek error");
-					return -1;
-				}
-				ret = read(fd, buf, dinfo.phy_sector_size);
-				if (ret < 0) {
-					perror("reread error");
-					continue;
-				}
-
-				fixed = 1;
-				syslog(LOG_WARNING, "%s uuid: %x role %d: fixed %"PRId64"-%d\n",
-						dinfo.name, dinfo.raid_uuid[0], dinfo.role,
-						offset / SECTOR_SIZE, dinfo.phy_sector_size / SECTOR_SIZE);
-				break;
-			}
+	return pathname;
+}
 
-			if (!fixed) {
-				syslog(LOG_WARNING, "%s uuid: %x role %d: can't fix %"PRId64"-%d\n",
-						dinfo.name, dinfo.raid_uuid[0], dinfo.role,
-						offset / SECTOR_SIZE, dinfo.phy_sector_size / SECTOR_SIZE);
-				return -1;
-			}
-		}
+static const char *zone_pathname(void)
+{
+	static char pathname[256];
+	const char *dir = getenv("FIX_SECTOR_ZONES");
 
-		if (scaned_size > size)
-			break;
+	snprintf(pathname, sizeof(pathname), "%s/%s", dir ? dir : ZONE_PATHNAME,
+		 dinfo.serialno[0] ? dinfo.serialno : basename(dinfo.name));
+
+	return pathname;
+}
+
+static int load_ages(struct age_map *ages)
+{
+	if (age_init(ages, dinfo.data_offset, dinfo.data_size, AGE_REGION_SIZE))
+		return -1;
+	age_load(age_pathname(), ages);
+
+	return 0;
+}
+
+static void print_ages()
+{
+	struct age_map ages;
+	time_t stalest;
+	int never;
 
-		scaned_size += dinfo.phy_sector_size;
+	if (load_ages(&ages))
+		return;
+
+	stalest = age_stalest(&ages, &never);
+	printf("%d regions of %llu MB, %d never verified", ages.nr, ages.region_size >> 20, never);
+	if (stalest)
+		printf(", stalest verified %ld hours ago", (time(NULL) - stalest) / 3600);
+	printf("\n");
+
+	age_free(&ages);
+}
+
+/* zones under half the median, worn heads or a bad patch of surface */
+static int slow_zones(const struct zone_map *zones)
+{
+	unsigned int median = zone_median(zones), rate;
+	int i, nr = 0;
+
+	for (i = 0; i < zones->nr; i ++) {
+		rate = zone_rate(zones, i);
+		if (rate && rate < median / 2)
+			nr ++;
+	}
+
+	return nr;
+}
+
+/* what the running scan timed so far, or what the last one saved */
+static int print_zones()
+{
+	char line[CTL_MAX_MSG];
+	struct zone_map zones;
+	unsigned int median, rate;
+	int i;
+
+	memset(line, 0, sizeof(line));
+	if (ctl_request(run_path("sock"), "zones", line, sizeof(line)) == 0) {
+		if (zone_parse(&zones, line)) {
+			printf("invalid zones reply\n");
+			return -1;
+		}
+	} else if (zone_init(&zones, dinfo.data_offset, dinfo.data_size, ZONE_COUNT) ||
+		   zone_load(zone_pathname(), &zones)) {
+		printf("%s has no zone rates\n", dinfo.name);
+		zone_free(&zones);
+		return 0;
+	}
+
+	median = zone_median(&zones);
+	for (i = 0; i < zones.nr; i ++) {
+		rate = zone_rate(&zones, i);
+		if (0 == rate)
+			continue;
+		printf("zone %3d at %6llu MB: %4u MB/s%s\n", i,
+		       (unsigned long long)(zones.base + i * zones.zone_size) >> 20, rate,
+		       rate < median / 2 ? ", slow" : "");
 	}
+	printf("%d zones of %llu MB, median %u MB/s, %d under half that\n", zones.nr,
+	       zones.zone_size >> 20, median, slow_zones(&zones));
+	zone_free(&zones);
 
 	return 0;
 }
 
-static int fix_bad_sector(int fd, int start_percent)
+static void report_kernel_error(struct kmsg_follower *follower, off64_t offset)
 {
-	off64_t start_offset, offset, rec_offset;
-	__u64 scaned_size = 0;
-	ssize_t size;
-	int ret, shm_fd, last = 0;
-	struct timeval ctime;
+	syslog(LOG_WARNING, "%s %s uuid: %x role %d: kernel logged an error at %"PRId64", queued\n",
+			dinfo.name, dinfo.serialno, dinfo.raid_uuid[0], dinfo.role,
+			offset / SECTOR_SIZE);
+}
+
+/* what a -m run finds, in member bytes */
+struct surface_map {
+	pthread_mutex_t lock;
+	struct range_list bad;
+	struct range_list slow;
+};
+
+struct fix_progress {
+	int shm_fd;
+	off64_t rec_offset;
+	__u64 rec_scanned;
 	time_t last_sec;
+	__u64 total;		/* bytes to scan in all */
+	time_t deadline;	/* a scrub's, 0 for none */
+	int resumed;		/* the last INTERVAL had a pause in it */
+	struct zone_map *zones;
+	struct age_map *ages;
+	off64_t verified_from;	/* the sweep started here */
+	off64_t offset;		/* for status requests */
+	struct surface_map *surface;	/* -m only */
+};
+
+/*
+ * The speed is a moving average of the rate each INTERVAL, so one
+ * slow stretch or a retry does not swing the ETA. The rate is of the
+ * bytes scanned, not how far offset moved: hot windows and seeds are
+ * read out of order, and -F skips what no volume covers.
+ */
+static void update_speed(struct scan_ctx *ctx, struct fix_progress *progress, time_t now)
+{
+	__u64 scanned = ctx->scanned, rate;
+	long eta;
+
+	/* a pause says nothing of the disk */
+	if (ctx->paused || __atomic_exchange_n(&progress->resumed, 0, __ATOMIC_RELAXED))
+		return;
+
+	rate = (scanned - progress->rec_scanned) / (now - progress->last_sec);
+	if (0 == cur_spd)
+		cur_spd = rate;
+	else
+		cur_spd += ((double)rate - cur_spd) * SPEED_WEIGHT;
+
+	if (0 == cur_spd)
+		return;
+	eta = scanned < progress->total ? (progress->total - scanned) / cur_spd : 0;
+	if (progress->deadline && now + eta > progress->deadline)
+		eta = progress->deadline > now ? progress->deadline - now : 0;
+	cur_eta = eta;
+}
+
+/*
+ * Stamp the regions the sweep has read through, from verified_from up
+ * to end, and only within the ranges it reads: -F leaves out what no
+ * volume covers. A verify-only run fixes nothing and stamps nothing.
+ */
+static int mark_verified(struct scan_ctx *ctx, off64_t end, time_t when)
+{
+	struct fix_progress *progress = ctx->arg;
+	const struct range_list *ranges = ctx->ranges;
+	off64_t from;
+	int i, nr = 0;
+
+	if (ctx->verify_only || NULL == ranges)
+		return 0;
+
+	for (i = 0; i < ranges->nr && ranges->ranges[i].start < end; i ++) {
+		from = ranges->ranges[i].start;
+		if (from < progress->verified_from)
+			from = progress->verified_from;
+		nr += age_mark(progress->ages, from,
+			       ranges->ranges[i].end < end ? ranges->ranges[i].end : end, when);
+	}
+
+	return nr;
+}
+
+static void report_progress(struct scan_ctx *ctx, off64_t offset)
+{
+	struct fix_progress *progress = ctx->arg;
+	struct timeval ctime;
+
+	__atomic_store_n(&progress->offset, offset, __ATOMIC_RELAXED);
+
+	gettimeofday(&ctime, NULL);
+	if (ctime.tv_sec > progress->last_sec + INTERVAL) {
+		update_speed(ctx, progress, ctime.tv_sec);
+		progress->rec_offset = offset;
+		progress->rec_scanned = ctx->scanned;
+		progress->last_sec = ctime.tv_sec;
+		write_status(progress->shm_fd, offset, 0);
+
+		if (mark_verified(ctx, offset, ctime.tv_sec))
+			age_save(age_pathname(), progress->ages);
+	}
+}
+
+static const char *surface_pathname(void)
+{
+	const char *pathname = getenv("FIX_SECTOR_MAP");
+
+	return pathname ? pathname : SURFACE_PATHNAME;
+}
+
+/* sections are keyed by the disk and where it sits in the array */
+static void surface_name(char *name, size_t len)
+{
+	snprintf(name, len, "%s:%d", dinfo.serialno, dinfo.role);
+}
+
+/* a map made on another array, or before a reshape, is no use */
+static __u64 surface_generation(void)
+{
+	return bbmap_member_generation((const u8 *)dinfo.raid_uuid, dinfo.data_offset / SECTOR_SIZE);
+}
+
+static void map_sector(struct scan_ctx *ctx, off64_t offset, int fixed)
+{
+	struct fix_progress *progress = ctx->arg;
+	struct surface_map *surface = progress->surface;
+
+	report_sector(ctx, offset, fixed);
+	pthread_mutex_lock(&surface->lock);
+	add_range(&surface->bad, offset, offset + ctx->sector_size);
+	pthread_mutex_unlock(&surface->lock);
+}
+
+static void map_slow(struct scan_ctx *ctx, off64_t offset, size_t size, __u64 usecs)
+{
+	struct fix_progress *progress = ctx->arg;
+	struct surface_map *surface = progress->surface;
+
+	pthread_mutex_lock(&surface->lock);
+	add_range(&surface->slow, offset, offset + size);
+	pthread_mutex_unlock(&surface->lock);
+}
+
+static int add_surface_section(struct bbmap_writer *writer, u32 type, const char *name,
+			       const struct range_list *list)
+{
+	struct bbmap_range *ranges;
+	int i, ret;
+
+	ranges = malloc(sizeof(struct bbmap_range) * (list->nr + 1));
+	if (NULL == ranges)
+		return -1;
+
+	for (i = 0; i < list->nr; i ++) {
+		ranges[i].start = list->ranges[i].start / SECTOR_SIZE;
+		ranges[i].len = (list->ranges[i].end - list->ranges[i].start) / SECTOR_SIZE;
+	}
+	ret = bbmap_add_section(writer, type, name, surface_generation(), ranges, list->nr);
+	free(ranges);
+
+	return ret;
+}
+
+/*
+ * Replace this member's sections of the surface map, keeping those of
+ * every other member.
+ */
+static int save_surface(struct surface_map *surface)
+{
+	struct bbmap_writer *writer;
+	struct bbmap *old;
+	char name[BBMAP_NAME_LEN];
+	int ret = -1;
+
+	writer = bbmap_writer_new();
+	if (NULL == writer)
+		return -1;
+
+	surface_name(name, sizeof(name));
+	old = bbmap_open(surface_pathname());
+	if (!add_surface_section(writer, BBMAP_MEMBER, name, &surface->bad) &&
+	    !add_surface_section(writer, BBMAP_MEMBER_SLOW, name, &surface->slow) &&
+	    (NULL == old || !bbmap_merge(writer, old))) {
+		state_file_mkdir(surface_pathname());
+		ret = bbmap_write(writer, surface_pathname());
+	}
+
+	bbmap_close(old);
+	bbmap_writer_free(writer);
+
+	return ret;
+}
+
+/* the ranges of one of this member's sections, if the map is still its own */
+static int load_surface_section(struct bbmap *map, u32 type, struct range_list *list)
+{
+	const struct bbmap_section *sec;
+	struct bbmap_range *ranges;
+	char name[BBMAP_NAME_LEN];
+	int i, nr;
+
+	surface_name(name, sizeof(name));
+	sec = bbmap_find(map, type, name);
+	if (NULL == sec || sec->generation != surface_generation())
+		return 0;
+
+	ranges = malloc(sizeof(struct bbmap_range) * (sec->nr_ranges + 1));
+	if (NULL == ranges)
+		return -1;
+
+	nr = bbmap_decode(map, sec, ranges, sec->nr_ranges);
+	for (i = 0; i < nr; i ++) {
+		if (add_range(list, ranges[i].start * SECTOR_SIZE,
+			      (ranges[i].start + ranges[i].len) * SECTOR_SIZE))
+			break;
+	}
+	free(ranges);
+
+	return nr < 0 || i < nr ? -1 : 0;
+}
+
+/* what an earlier -m found unreadable or slow on this member */
+static int load_surface(struct range_list *bad, struct range_list *slow)
+{
+	struct bbmap *map;
+	int ret;
+
+	map = bbmap_open(surface_pathname());
+	if (NULL == map)
+		return -1;
+
+	ret = load_surface_section(map, BBMAP_MEMBER, bad);
+	if (!ret)
+		ret = load_surface_section(map, BBMAP_MEMBER_SLOW, slow);
+	bbmap_close(map);
+
+	return ret;
+}
+
+static void print_surface()
+{
+	struct range_list bad, slow;
+
+	memset(&bad, 0, sizeof(bad));
+	memset(&slow, 0, sizeof(slow));
+	if (load_surface(&bad, &slow) == 0 && (bad.nr || slow.nr))
+		printf("surface map: %llu KB unreadable in %d ranges, %llu MB slow in %d ranges\n",
+		       ranges_bytes(&bad) >> 10, bad.nr, ranges_bytes(&slow) >> 20, slow.nr);
+	free_ranges(&bad);
+	free_ranges(&slow);
+}
+
+struct fix_control {
+	struct scan_ctx *ctx;
+	struct fix_progress *progress;
+};
+
+/* one request from -s, -p, -c, -t or -x */
+static void handle_request(const char *request, char *reply, size_t len, void *arg)
+{
+	struct fix_control *control = arg;
+	struct scan_ctx *ctx = control->ctx;
+	unsigned int rate;
+
+	if (!strcmp(request, "status")) {
+		format_status(reply, len, __atomic_load_n(&control->progress->offset, __ATOMIC_RELAXED),
+			      0, ctx->paused, ctx->throttle >> 20);
+	} else if (!strcmp(request, "zones")) {
+		zone_format(control->progress->zones, reply, len);
+	} else if (!strcmp(request, "pause")) {
+		scan_pause(ctx, 1);
+		snprintf(reply, len, "%s paused\n", dinfo.name);
+	} else if (!strcmp(request, "resume")) {
+		__atomic_store_n(&control->progress->resumed, 1, __ATOMIC_RELAXED);
+		scan_pause(ctx, 0);
+		snprintf(reply, len, "%s resumed\n", dinfo.name);
+	} else if (sscanf(request, "throttle %u", &rate) == 1) {
+		scan_throttle(ctx, (__u64)rate << 20);
+		if (rate)
+			snprintf(reply, len, "%s limited to %u MB/s\n", dinfo.name, rate);
+		else
+			snprintf(reply, len, "%s not limited\n", dinfo.name);
+	} else if (!strcmp(request, "stop")) {
+		scan_stop(ctx);
+		snprintf(reply, len, "%s stopping\n", dinfo.name);
+	} else {
+		snprintf(reply, len, "unknown request\n");
+	}
+}
+
+static const char *tune_pathname(void)
+{
+	const char *pathname = getenv("FIX_SECTOR_TUNE");
+
+	return pathname ? pathname : TUNE_PATHNAME;
+}
+
+/* a scrub stops before whichever would run out, 0 for no limit */
+struct scrub_budget {
+	time_t secs;
+	__u64 bytes;
+};
+
+static int parse_budget(const char *arg, struct scrub_budget *budget)
+{
+	unsigned long long n;
+	char *end;
+
+	memset(budget, 0, sizeof(struct scrub_budget));
+	n = strtoull(arg, &end, 10);
+	if (end == arg || 0 == n)
+		return -1;
+
+	switch (*end) {
+	case 'd':
+		n *= 24;
+		/* fall through */
+	case 'h':
+		n *= 60;
+		/* fall through */
+	case 'm':
+		n *= 60;
+		/* fall through */
+	case 's':
+	case '\0':
+		budget->secs = n;
+		return end[0] && end[1] ? -1 : 0;
+	case 'T':
+		n <<= 10;
+		/* fall through */
+	case 'G':
+		n <<= 10;
+		/* fall through */
+	case 'M':
+		n <<= 10;
+		/* fall through */
+	case 'K':
+		n <<= 10;
+		budget->bytes = n;
+		return end[1] ? -1 : 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Scan one region at a time, the least recently verified first, and
+ * mark each as verified once it is read through. Stop before the next
+ * one would overrun the budget: by bytes, or by time when it would
+ * take as long as the last one did.
+ */
+static int scrub_regions(struct scan_ctx *ctx, struct age_map *ages,
+			 const struct scrub_budget *budget, struct fix_progress *progress)
+{
+	struct scan_range range;
+	struct range_list region = { &range, 1, 1 };
+	struct timeval start, rstart, rend;
+	time_t last = 0;
+	__u64 bytes = 0;
+	int *order, i, nr, ret = 0;
+
+	order = malloc(sizeof(int) * ages->nr);
+	if (NULL == order)
+		return -1;
+	nr = age_order(ages, order);
+
+	gettimeofday(&start, NULL);
+	ctx->ranges = &region;
+	for (i = 0; i < nr && !ret && !ctx->stopping; i ++) {
+		age_region(ages, order[i], &range);
+		gettimeofday(&rstart, NULL);
+		if (i && budget->secs && rstart.tv_sec - start.tv_sec + last > budget->secs)
+			break;
+		if (i && budget->bytes && bytes + (range.end - range.start) > budget->bytes)
+			break;
+
+		progress->rec_offset = range.start;
+		progress->verified_from = range.start;
+		ret = scan_sectors(ctx);
+
+		gettimeofday(&rend, NULL);
+		last = rend.tv_sec - rstart.tv_sec;
+		bytes += range.end - range.start;
+		if (mark_verified(ctx, ctx->offset, rend.tv_sec) &&
+		    age_save(age_pathname(), ages))
+			syslog(LOG_WARNING, "can't save region ages to %s\n", age_pathname());
+	}
+
+	syslog(LOG_INFO, "%s: scrubbed %d of %d regions, %llu MB\n", dinfo.name,
+		i, nr, bytes >> 20);
+	free(order);
+
+	return ret;
+}
+
+/*
+ * Fix the member's bad sectors, or with map_only just read it and map
+ * what is unreadable or slow.
+ */
+static int fix_bad_sector(struct blk_dev *dev, int start_percent, int alloc_only,
+			  const struct scrub_budget *budget, int map_only)
+{
+	struct scan_ctx ctx;
+	struct fix_progress progress;
+	struct surface_map surface;
+	struct age_map ages;
+	struct zone_map zones, old;
+	struct kmsg_follower follower;
+	struct fix_control control;
+	struct ctl_server server;
+	struct tune_params saved;
+	struct range_list ranges, seeds;
+	struct tuner tuner;
+	off64_t start_offset;
+	int shm_fd, ret, following, serving, i;
 
 	start_offset = (dinfo.data_size / 100 / dinfo.chunk_size) * dinfo.chunk_size * start_percent;
 	start_offset += dinfo.data_offset;
 	dinfo.start_offset = start_offset;
 
 	gettimeofday(&dinfo.stime, NULL);
-	last_sec = dinfo.stime.tv_sec;
 
 	openlog("fix_bad_sector", LOG_CONS | LOG_PID, LOG_USER);
 
@@ -501,62 +1200,160 @@ static int fix_bad_sector(int fd, int start_percent)
 		dinfo.name, dinfo.serialno, start_offset, dinfo.raid_uuid[0],
 		dinfo.raid_uuid[1], dinfo.raid_uuid[2], dinfo.raid_uuid[3], dinfo.role);
 
-	if (start_offset > dinfo.data_size) {
-		write_status(shm_fd, dinfo.data_size, 1);
+	if (start_offset > dinfo.data_offset + dinfo.data_size) {
+		write_status(shm_fd, dinfo.data_offset + dinfo.data_size, 1);
 		return 0;
 	}
 
-	rec_offset = start_offset;
-
-	while (1) {
-		offset = start_offset + scaned_size;
-		if (lseek64(fd, offset, SEEK_SET) < 0LL) {
-			if (EOVERFLOW != errno) {
-				perror("seek error");
-				write_status(shm_fd, offset, 2);
-				return 0;
-			}
-			break;
-		}
-		if (dinfo.data_size - offset > BUF_SIZE) {
-			size = BUF_SIZE;
-		} else {
-			size = dinfo.data_size - offset;
-			last = 1;
-		}
-
-		ret = read(fd, buf, size);
-		if (ret < 0) {
-			if (EIO == errno) {
-				ret = fix_pending_sector(fd, offset, size);
-				if (ret) {
-					perror("Can't fix pending sector");
-					write_status(shm_fd, offset, 2);
-					return 0;
-				}
-			} else {
-				perror("Other error happened");
-				write_status(shm_fd, offset, 2);
-				return 0;
-			}
-		}
+	memset(&ranges, 0, sizeof(ranges));
+	if (alloc_only && get_alloc_ranges(start_offset, &ranges)) {
+		syslog(LOG_WARNING, "%s: no logical volumes found, scanning all of it\n",
+			dinfo.name);
+		alloc_only = 0;
+	}
+	if (!alloc_only)
+		add_range(&ranges, start_offset, dinfo.data_offset + dinfo.data_size);
+	else
+		syslog(LOG_INFO, "%s: %llu MB allocated in %d ranges\n", dinfo.name,
+			ranges_bytes(&ranges) >> 20, ranges.nr);
+
+	memset(&seeds, 0, sizeof(seeds));
+	/* what the array lists when it is assembled, else the member's own log */
+	if ((get_md_bad_blocks(&seeds) == 0 || get_disk_bad_blocks(dev, &seeds) == 0) &&
+	    seeds.nr)
+		syslog(LOG_INFO, "%s: md lists %d bad ranges, looking there first\n",
+			dinfo.name, seeds.nr);
+	get_drive_bad_blocks(dev, &seeds);
+
+	memset(&surface, 0, sizeof(surface));
+	pthread_mutex_init(&surface.lock, NULL);
+	if (!map_only && load_surface(&surface.bad, &surface.slow) == 0 &&
+	    (surface.bad.nr || surface.slow.nr)) {
+		syslog(LOG_INFO, "%s: mapped %d unreadable and %d slow ranges, looking there first\n",
+			dinfo.name, surface.bad.nr, surface.slow.nr);
+		for (i = 0; i < surface.bad.nr; i ++)
+			add_range(&seeds, surface.bad.ranges[i].start, surface.bad.ranges[i].end);
+		for (i = 0; i < surface.slow.nr; i ++)
+			add_range(&seeds, surface.slow.ranges[i].start, surface.slow.ranges[i].end);
+	}
 
-		scaned_size += size;
+	if (load_ages(&ages)) {
+		write_status(shm_fd, start_offset, 2);
+		return 1;
+	}
 
-		if (last)
-			break;
+	if (zone_init(&zones, dinfo.data_offset, dinfo.data_size, ZONE_COUNT)) {
+		write_status(shm_fd, start_offset, 2);
+		return 1;
+	}
 
-		gettimeofday(&ctime, NULL);
-		if (ctime.tv_sec > last_sec + INTERVAL) {
-			cur_spd = (offset - rec_offset) / (ctime.tv_sec - last_sec);
-			rec_offset = offset;
-			last_sec = ctime.tv_sec;
-			write_status(shm_fd, offset, 0);
-		}
+	memset(&progress, 0, sizeof(progress));
+	progress.shm_fd = shm_fd;
+	progress.rec_offset = start_offset;
+	progress.last_sec = dinfo.stime.tv_sec;
+	progress.total = ranges_bytes(&ranges);
+	if (budget) {
+		if (budget->bytes && budget->bytes < progress.total)
+			progress.total = budget->bytes;
+		if (budget->secs)
+			progress.deadline = dinfo.stime.tv_sec + budget->secs;
+	}
+	progress.zones = &zones;
+	progress.ages = &ages;
+	progress.verified_from = start_offset;
+	progress.surface = &surface;
+
+	ret = tune_load(tune_pathname(), dinfo.model, dinfo.serialno, &saved);
+	tune_init(&tuner, BUF_SIZE, TUNE_MAX_DEPTH, ret ? NULL : &saved);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.dev = dev;
+	ctx.buf = buf;
+	ctx.buf_size = BUF_SIZE;
+	ctx.sector_size = dinfo.phy_sector_size;
+	ctx.tuner = &tuner;
+	ctx.zones = &zones;
+	ctx.sector_fn = report_sector;
+	ctx.progress_fn = report_progress;
+	ctx.arg = &progress;
+
+	ctx.seeds = &seeds;
+	ctx.hot_radius = SCAN_HOT_RADIUS;
+	ctx.repair_depth = SCAN_REPAIR_DEPTH;
+	if (map_only) {
+		ctx.verify_only = 1;
+		ctx.sector_fn = map_sector;
+		ctx.slow_us = SURFACE_SLOW_US;
+		ctx.slow_fn = map_slow;
 	}
 
-	offset = start_offset + scaned_size;
-	write_status(shm_fd, offset, 1);
+	/* errors the kernel logs from now on get repaired first */
+	memset(&follower, 0, sizeof(follower));
+	follower.pathname = getenv("FIX_SECTOR_KMSG");
+	follower.ctx = &ctx;
+	follower.error_fn = report_kernel_error;
+	following = !kmsg_set_member(&follower, dinfo.name) && !kmsg_start(&follower);
+
+	control.ctx = &ctx;
+	control.progress = &progress;
+	memset(&server, 0, sizeof(server));
+	snprintf(server.sock_path, sizeof(server.sock_path), "%s", run_path("sock"));
+	server.handler = handle_request;
+	server.arg = &control;
+	serving = !ctl_serve(&server);
+	if (!serving)
+		syslog(LOG_WARNING, "%s: can't listen on %s\n", dinfo.name, server.sock_path);
+
+	if (budget)
+		ret = scrub_regions(&ctx, &ages, budget, &progress);
+	else {
+		ctx.ranges = &ranges;
+		ret = scan_sectors(&ctx);
+		if (mark_verified(&ctx, ctx.offset, time(NULL)) &&
+		    age_save(age_pathname(), &ages))
+			syslog(LOG_WARNING, "can't save region ages to %s\n", age_pathname());
+	}
+	if (following) {
+		kmsg_stop(&follower);
+		syslog(LOG_INFO, "%s: %llu errors in the kernel log, %llu queued\n", dinfo.name,
+			follower.nr_errors, follower.nr_pushed);
+	}
+	if (map_only) {
+		coalesce_ranges(&surface.bad, dinfo.phy_sector_size);
+		coalesce_ranges(&surface.slow, dinfo.phy_sector_size);
+		syslog(LOG_INFO, "%s: %d unreadable and %d slow ranges mapped\n", dinfo.name,
+			surface.bad.nr, surface.slow.nr);
+		if (save_surface(&surface))
+			syslog(LOG_WARNING, "can't save the surface map to %s\n",
+				surface_pathname());
+	}
+	syslog(LOG_INFO, "%s %s: zones read at %u MB/s at the median, %d under half that\n",
+		dinfo.name, dinfo.serialno, zone_median(&zones), slow_zones(&zones));
+	if (zone_init(&old, zones.base, zones.size, zones.nr) == 0) {
+		if (zone_load(zone_pathname(), &old) == 0)
+			zone_merge(&zones, &old);
+		zone_free(&old);
+	}
+	if (zone_save(zone_pathname(), &zones))
+		syslog(LOG_WARNING, "can't save zone rates to %s\n", zone_pathname());
+	free_ranges(&surface.bad);
+	free_ranges(&surface.slow);
+	pthread_mutex_destroy(&surface.lock);
+	free_ranges(&ranges);
+	free_ranges(&seeds);
+	age_free(&ages);
+	zone_free(&zones);
+
+	syslog(LOG_INFO, "%s %s tuned to %u KB x %u, %.1f MB/s\n", dinfo.name,
+		dinfo.serialno, tuner.best.io_size / 1024, tuner.best.depth, tuner.rate);
+	if (tuner.trials && tune_save(tune_pathname(), dinfo.model, dinfo.serialno, &tuner.best))
+		syslog(LOG_WARNING, "can't save tuning to %s\n", tune_pathname());
+
+	/* a stopped fix is neither finished nor failed */
+	if (!ctx.stopping)
+		write_status(shm_fd, ctx.offset, ret ? 2 : 1);
+	if (serving)
+		ctl_close(&server);
 
 	close(shm_fd);
 	closelog();
@@ -592,27 +1389,32 @@ static int open_ro(const char *devname)
 
 /**************************************/
 
-static int stop_fixing()
+/* send a request to the fix running on the device and print the reply */
+static int control_fixing(const char *request)
 {
-	char cmd[64];
-	char buf[128];
-	int kpid = 0;
-	FILE *fp;
-
-	sprintf(cmd, "ps -ef|grep \"%s -f %s \"| grep -v grep | awk '{print $2}'", PROC_NAME, dinfo.name);
+	char reply[CTL_MAX_MSG];
 
-	fp = popen(cmd, "r");
-	if (fp != NULL) {
-		memset(buf, 0, sizeof(buf));
-		fgets(buf, sizeof(buf), fp);
-		kpid = atoi(buf);
-		if (0 == kpid)
-			return 0;
+	if (ctl_request(run_path("sock"), request, reply, sizeof(reply))) {
+		printf("%s is not fixing\n", dinfo.name);
+		return -1;
 	}
+	printf("%s", reply);
 
-	kill(kpid, SIGINT);
+	return 0;
+}
 
-	fclose(fp);
+static int stop_fixing()
+{
+	char reply[CTL_MAX_MSG];
+	pid_t pid;
+
+	if (ctl_request(run_path("sock"), "stop", reply, sizeof(reply)) == 0)
+		return 0;
+
+	/* still holding the lock, but not answering */
+	pid = ctl_owner(run_path("pid"));
+	if (pid > 0)
+		kill(pid, SIGINT);
 
 	return 0;
 }
@@ -676,12 +1478,15 @@ static int deamon_init()
 
 int main(int argc, char **argv)
 {
-	int fd, ret, vaild_opt = 0;
-	int start_percent = -1;
-	static const char *option_string = "x:f:s:";
+	struct blk_dev *dev;
+	int fd, ret, lock_fd, vaild_opt = 0;
+	int start_percent = -1, alloc_only = 0;
+	struct scrub_budget budget;
+	static const char *option_string = "x:f:F:r:m:s:z:p:c:t:";
 	int option = 0, tmp = 0;
 
 	memset(&dinfo, 0, sizeof(struct device_info));
+	arrays.sysfs = getenv("FIX_SECTOR_SYSFS");
 
 	buf = valloc(BUF_SIZE);
 	if (NULL == buf) {
@@ -691,6 +1496,9 @@ int main(int argc, char **argv)
 
 	while ((option = getopt(argc, argv, option_string)) != EOF) {
 		switch (option) {
+		case 'F':
+			alloc_only = 1;
+			/* fall through */
 		case 'f':
 			if (optind + 1 != argc)
 				usage();
@@ -704,9 +1512,47 @@ int main(int argc, char **argv)
 			tmp = 1;
 			vaild_opt = 1;
 
+			break;
+		case 'r':
+			if (optind + 1 != argc)
+				usage();
+			if (parse_budget(argv[optind], &budget)) {
+				printf("invalid budget %s\n", argv[optind]);
+				return 1;
+			}
+
+			close_stray_fds();
+			fd = open_excl(optarg);
+			start_percent = 0;
+			tmp = 1;
+			vaild_opt = 1;
+
+			break;
+		case 'm':
+			if (optind != argc)
+				usage();
+
+			close_stray_fds();
+			fd = open_ro(optarg);
+			start_percent = 0;
+			tmp = 1;
+			vaild_opt = 1;
+
+			break;
+		case 't':
+			if (optind + 1 != argc)
+				usage();
+
+			fd = open_ro(optarg);
+			tmp = 1;
+			vaild_opt = 1;
+
 			break;
 		case 'x':
 		case 's':
+		case 'z':
+		case 'p':
+		case 'c':
 			if (optind != argc)
 				usage();
 
@@ -737,12 +1583,20 @@ int main(int argc, char **argv)
 
 	switch (option) {
 	case 'f':
-		if (check(argv[0]) > 1) {
+	case 'F':
+	case 'r':
+	case 'm':
+		lock_fd = ctl_lock(run_path("pid"));
+		if (lock_fd == -2) {
 			printf("more than one is running\n");
 			return 0;
+		} else if (lock_fd < 0) {
+			perror("lock error");
+			return 1;
 		}
 
-		ret = check_array_status();
+		/* reading alone is safe on an active array */
+		ret = option == 'm' ? 0 : check_array_status();
 		if (ret) {
 			printf("raid is active\n");
 			return 0;
@@ -751,15 +1605,38 @@ int main(int argc, char **argv)
 		ret = deamon_init();
 		if (ret)
 			return 0;
-		fix_bad_sector(fd, start_percent);
+		ctl_set_owner(lock_fd);
+		dev = blk_open_fd(fd);
+		if (NULL == dev) {
+			perror("open device error");
+			return 1;
+		}
+		fix_bad_sector(dev, start_percent, alloc_only, option == 'r' ? &budget : NULL,
+			       option == 'm');
+		blk_close(dev);
 		break;
 	case 's':
 		print_status();
+		print_ages();
+		print_surface();
+		break;
+	case 'z':
+		print_zones();
 		break;
 	case 'x':
 		stop_fixing();
 		clear_status();
 		break;
+	case 'p':
+		control_fixing("pause");
+		break;
+	case 'c':
+		control_fixing("resume");
+		break;
+	case 't':
+		snprintf(buf, BUF_SIZE, "throttle %u", atoi(argv[optind]));
+		control_fixing(buf);
+		break;
 	}
 
 	close(fd);
@@ -24,6 +24,7 @@
 #include <signal.h>
 #include <linux/hdreg.h>
 
-int get_identify_data(int fd, __u16 *id);
+#define RETRY 3
+#define SECTOR_SIZE 512
 
 #endif
@@ -0,0 +1,245 @@
+#include "kmsg.h"
+#include <poll.h>
+#include <libgen.h>
+#include <limits.h>
+
+/*
+ * kmsg_parse:
+ *
+ * Pick the disk and sector out of the lines the block layer logs for
+ * a failed request, like
+ *   blk_update_request: I/O error, dev sdb, sector 123 op 0x0:(READ) ...
+ *   critical medium error, dev sdb, sector 123 op 0x0:(READ) ...
+ * /dev/kmsg records come with a "level,seq,time,flags;" prefix, which
+ * is skipped with everything else before the message.
+ */
+int kmsg_parse(const char *line, char *disk, size_t len, __u64 *sector)
+{
+	const char *p, *q;
+	char *end;
+
+	p = strstr(line, "error, dev ");
+	if (NULL == p)
+		return -1;
+	p += strlen("error, dev ");
+
+	q = strchr(p, ',');
+	if (NULL == q || q == p || q - p >= len)
+		return -1;
+	if (strncmp(q, ", sector ", strlen(", sector ")))
+		return -1;
+
+	*sector = strtoull(q + strlen(", sector "), &end, 10);
+	if (end == q + strlen(", sector "))
+		return -1;
+
+	memcpy(disk, p, q - p);
+	disk[q - p] = '\0';
+
+	return 0;
+}
+
+static int read_sysfs_u64(const char *pathname, __u64 *val)
+{
+	unsigned long long v;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+	ret = fscanf(fp, "%llu", &v) == 1 ? 0 : -1;
+	fclose(fp);
+	*val = v;
+
+	return ret;
+}
+
+/*
+ * The kernel logs errors against the whole disk, so a member that is a
+ * partition needs the disk's name and where the partition starts.
+ */
+int kmsg_set_member(struct kmsg_follower *follower, const char *devname)
+{
+	char member[PATH_MAX], pathname[PATH_MAX + 64], sysdev[PATH_MAX], *name;
+	__u64 start, sectors;
+
+	if (NULL == realpath(devname, member))
+		return -1;
+	name = basename(member);
+
+	snprintf(pathname, sizeof(pathname), "/sys/class/block/%s/size", name);
+	if (read_sysfs_u64(pathname, &sectors))
+		return -1;
+	follower->size = sectors * SECTOR_SIZE;
+
+	snprintf(pathname, sizeof(pathname), "/sys/class/block/%s/partition", name);
+	if (access(pathname, F_OK)) {
+		snprintf(follower->disk, sizeof(follower->disk), "%s", name);
+		follower->start = 0;
+		return 0;
+	}
+
+	/* .../block/sdb/sdb1 */
+	snprintf(pathname, sizeof(pathname), "/sys/class/block/%s", name);
+	if (NULL == realpath(pathname, sysdev))
+		return -1;
+	snprintf(follower->disk, sizeof(follower->disk), "%s", basename(dirname(sysdev)));
+
+	snprintf(pathname, sizeof(pathname), "/sys/class/block/%s/start", name);
+	if (read_sysfs_u64(pathname, &start))
+		return -1;
+	follower->start = start * SECTOR_SIZE;
+
+	return 0;
+}
+
+/* 1 if offset was logged within KMSG_DEDUP_SECS, otherwise remember it */
+static int seen(struct kmsg_follower *follower, off64_t offset, time_t now)
+{
+	struct kmsg_error *errors;
+	int i, j, max;
+
+	for (i = 0, j = 0; i < follower->nr_seen; i ++) {
+		if (follower->seen[i].when + KMSG_DEDUP_SECS < now)
+			continue;
+		if (follower->seen[i].offset == offset)
+			return 1;
+		follower->seen[j ++] = follower->seen[i];
+	}
+	follower->nr_seen = j;
+
+	if (follower->nr_seen == follower->max_seen) {
+		max = follower->max_seen ? follower->max_seen * 2 : 64;
+		errors = realloc(follower->seen, sizeof(struct kmsg_error) * max);
+		if (NULL == errors)
+			return 0;
+		follower->seen = errors;
+		follower->max_seen = max;
+	}
+
+	follower->seen[follower->nr_seen].offset = offset;
+	follower->seen[follower->nr_seen].when = now;
+	follower->nr_seen ++;
+
+	return 0;
+}
+
+/* hand what is pending to the scan, keep what it can't take yet */
+static void flush_pending(struct kmsg_follower *follower)
+{
+	struct range_list *pending = &follower->pending;
+	int i, j;
+
+	for (i = 0, j = 0; i < pending->nr; i ++) {
+		if (scan_push(follower->ctx, pending->ranges[i].start, pending->ranges[i].end)) {
+			pending->ranges[j ++] = pending->ranges[i];
+			continue;
+		}
+		follower->nr_pushed ++;
+	}
+	pending->nr = j;
+}
+
+static void handle_line(struct kmsg_follower *follower, const char *line)
+{
+	char disk[KMSG_DISK_LEN];
+	__u64 sector;
+	off64_t offset;
+
+	if (kmsg_parse(line, disk, sizeof(disk), &sector) || strcmp(disk, follower->disk))
+		return;
+
+	offset = sector * SECTOR_SIZE - follower->start;
+	if (sector * SECTOR_SIZE < follower->start || offset >= follower->size)
+		return;
+	if (seen(follower, offset, time(NULL)))
+		return;
+
+	follower->nr_errors ++;
+	if (follower->error_fn)
+		follower->error_fn(follower, offset);
+	add_range(&follower->pending, offset, offset + SECTOR_SIZE);
+}
+
+static void *follow(void *arg)
+{
+	struct kmsg_follower *follower = arg;
+	char buf[8192], *line, *nl;
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(follower->pathname, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "can't follow %s: %s\n", follower->pathname, strerror(errno));
+		return NULL;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&follower->stop, __ATOMIC_RELAXED)) {
+		flush_pending(follower);
+
+		/* /dev/kmsg gives a record per read, a file gives what it has */
+		ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (0 == ret) {
+			/* a file at its end, which always polls readable */
+			usleep(KMSG_POLL_MS * 1000);
+			continue;
+		}
+		if (ret < 0) {
+			/* EPIPE: records were overwritten before we got to them */
+			if (EPIPE != errno && EAGAIN != errno)
+				break;
+			if (EAGAIN == errno)
+				poll(&pfd, 1, KMSG_POLL_MS);
+			continue;
+		}
+
+		len += ret;
+		buf[len] = '\0';
+		for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+			*nl = '\0';
+			handle_line(follower, line);
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+		/* a line longer than the buffer is no error line we know */
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+/*
+ * kmsg_start:
+ *
+ * Follow follower->pathname, /dev/kmsg when it is NULL, from its
+ * start, in a thread of its own until kmsg_stop(). Every error logged
+ * on the member is reported once through error_fn and pushed to
+ * follower->ctx, as soon as a scan is running on it.
+ */
+int kmsg_start(struct kmsg_follower *follower)
+{
+	if (NULL == follower->pathname)
+		follower->pathname = KMSG_PATHNAME;
+	follower->stop = 0;
+
+	return pthread_create(&follower->tid, NULL, follow, follower) ? -1 : 0;
+}
+
+void kmsg_stop(struct kmsg_follower *follower)
+{
+	__atomic_store_n(&follower->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(follower->tid, NULL);
+
+	free(follower->seen);
+	follower->seen = NULL;
+	follower->nr_seen = follower->max_seen = 0;
+	free_ranges(&follower->pending);
+}
@@ -0,0 +1,55 @@
+#ifndef __KMSG_H_
+#define __KMSG_H_
+
+#include "scan.h"
+#include <pthread.h>
+#include <time.h>
+
+#define KMSG_PATHNAME "/dev/kmsg"
+#define KMSG_POLL_MS 250
+/* the same sector logged again within this long is the same error */
+#define KMSG_DEDUP_SECS 60
+#define KMSG_DISK_LEN 32
+
+struct kmsg_error {
+	off64_t offset;		/* on the member */
+	time_t when;
+};
+
+struct kmsg_follower;
+
+/* an error was logged on the member at offset, called from the follower */
+typedef void (*kmsg_error_fn)(struct kmsg_follower *follower, off64_t offset);
+
+/*
+ * Follows the kernel log, or a file recorded from it, for I/O errors
+ * on the disk the member is on, and pushes them to a running scan.
+ */
+struct kmsg_follower {
+	const char *pathname;
+	char disk[KMSG_DISK_LEN];	/* as the kernel names it */
+	off64_t start;			/* where the member starts on the disk */
+	off64_t size;
+
+	struct scan_ctx *ctx;
+	kmsg_error_fn error_fn;
+	void *arg;
+
+	/* private */
+	pthread_t tid;
+	int stop;
+	struct kmsg_error *seen;
+	int nr_seen, max_seen;
+	struct range_list pending;	/* no scan was running to take them */
+
+	/* results */
+	__u64 nr_errors;
+	__u64 nr_pushed;
+};
+
+int kmsg_parse(const char *line, char *disk, size_t len, __u64 *sector);
+int kmsg_set_member(struct kmsg_follower *follower, const char *devname);
+int kmsg_start(struct kmsg_follower *follower);
+void kmsg_stop(struct kmsg_follower *follower);
+
+#endif
@@ -0,0 +1,498 @@
+#include "md.h"
+#include <dirent.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/sysmacros.h>
+
+/*
+ * md_read_super0:
+ *
+ * Read the 0.90 superblock at the end of a member. The fd may be
+ * O_DIRECT. Return -2 if there is none.
+ */
+int md_read_super0(int fd, mdp_super_t *super)
+{
+	off64_t dsize, offset;
+	void *sb;
+
+	if (ioctl(fd, BLKGETSIZE64, &dsize) != 0)
+		return -1;
+	offset = MD_NEW_SIZE_SECTORS(dsize >> 9);
+	offset *= 512;
+	ioctl(fd, BLKFLSBUF, 0);
+
+	sb = valloc(MD_SB_BYTES);
+	if (NULL == sb)
+		return -1;
+
+	if (pread64(fd, sb, MD_SB_BYTES, offset) != MD_SB_BYTES) {
+		free(sb);
+		return -1;
+	}
+	memcpy(super, sb, sizeof(mdp_super_t));
+	free(sb);
+
+	return super->md_magic == MD_SB_MAGIC ? 0 : -2;
+}
+
+/* the sum the kernel keeps in sb_csum, of sb as if sb_csum were 0 */
+static __u32 super1_csum(const struct mdp_superblock_1 *sb)
+{
+	const __le32 *p = (const __le32 *)sb;
+	int size = 256 + le32toh(sb->max_dev) * 2;
+	__u64 sum = 0;
+
+	for (; size >= 4; size -= 4)
+		sum += le32toh(*p ++);
+	if (size == 2)
+		sum += le16toh(*(const __le16 *)p);
+	sum -= le32toh(sb->sb_csum);
+
+	return (sum & 0xffffffff) + (sum >> 32);
+}
+
+/* 1.2 4K from the start, 1.1 at the start, 1.0 8K or so from the end */
+static off64_t super1_offset(int minor, off64_t dsize)
+{
+	if (2 == minor)
+		return 8 * 512;
+	if (1 == minor)
+		return 0;
+	return (((dsize >> 9) - 8 * 2) & ~(off64_t)(4 * 2 - 1)) * 512;
+}
+
+/* a member image in a plain file works too, for checking the decoding */
+static int member_size(int fd, off64_t *dsize)
+{
+	struct stat st;
+
+	if (ioctl(fd, BLKGETSIZE64, dsize) == 0)
+		return 0;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return -1;
+	*dsize = st.st_size;
+
+	return 0;
+}
+
+/*
+ * md_read_super1:
+ *
+ * Find and read the 1.x superblock of a member into sb, MD_SB1_BYTES
+ * long, and where it is. The fd may be O_DIRECT. Return -2 if there is
+ * no valid one.
+ */
+int md_read_super1(int fd, struct mdp_superblock_1 *sb, off64_t *sb_offset)
+{
+	off64_t dsize, offset;
+	int minor, ret = -2;
+	void *raw;
+
+	if (member_size(fd, &dsize))
+		return -1;
+	ioctl(fd, BLKFLSBUF, 0);
+
+	raw = valloc(MD_SB1_BYTES);
+	if (NULL == raw)
+		return -1;
+
+	for (minor = 2; minor >= 0 && ret; minor --) {
+		offset = super1_offset(minor, dsize);
+		if (offset < 0 || pread64(fd, raw, MD_SB1_BYTES, offset) != MD_SB1_BYTES)
+			continue;
+		memcpy(sb, raw, MD_SB1_BYTES);
+
+		if (le32toh(sb->magic) != MD_SB_MAGIC || le32toh(sb->major_version) != 1 ||
+		    le64toh(sb->super_offset) != offset / 512 ||
+		    256 + le32toh(sb->max_dev) * 2 > MD_SB1_BYTES ||
+		    super1_csum(sb) != le32toh(sb->sb_csum))
+			continue;
+
+		*sb_offset = offset;
+		ret = 0;
+	}
+	free(raw);
+
+	return ret;
+}
+
+/* the member's slot in the array, -1 for a spare or a faulty one */
+int md_super1_role(const struct mdp_superblock_1 *sb)
+{
+	__u32 dev_number = le32toh(sb->dev_number);
+	int role;
+
+	if (dev_number >= le32toh(sb->max_dev))
+		return -1;
+	role = le16toh(sb->dev_roles[dev_number]);
+
+	return role < le32toh(sb->raid_disks) ? role : -1;
+}
+
+/*
+ * md_parse_bblog:
+ *
+ * Add the ranges in a 1.x bad block log to ranges, in member bytes.
+ * An entry is the block in its top 54 bits and the length in its low
+ * 10, both in blocks of 1 << shift sectors of the whole member, like
+ * sysfs bad_blocks. The log ends at an entry of all ones.
+ */
+int md_parse_bblog(const void *log, size_t len, int shift, struct range_list *ranges)
+{
+	const __le64 *bbp = log;
+	__u64 bb, sector, count;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(__le64); i ++) {
+		bb = le64toh(bbp[i]);
+		if (bb + 1 == 0)
+			break;
+
+		sector = (bb >> 10) << shift;
+		count = (bb & 0x3ff) << shift;
+		if (add_range(ranges, sector * SECTOR_SIZE, (sector + count) * SECTOR_SIZE))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int read_line(const char *pathname, char *line, size_t len)
+{
+	FILE *fp;
+	char *p;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+	p = fgets(line, len, fp);
+	fclose(fp);
+	if (NULL == p)
+		return -1;
+
+	line[strcspn(line, "\n")] = '\0';
+	return 0;
+}
+
+static int read_dev(const char *pathname, dev_t *dev)
+{
+	char line[32];
+	unsigned int maj, min;
+
+	if (read_line(pathname, line, sizeof(line)) ||
+	    sscanf(line, "%u:%u", &maj, &min) != 2)
+		return -1;
+
+	*dev = makedev(maj, min);
+	return 0;
+}
+
+/* md/uuid, the superblock's uuid bytes as the kernel keeps them */
+static int read_uuid(const char *pathname, int uuid[4])
+{
+	unsigned char bytes[16];
+	char line[64], *p;
+	int i;
+
+	if (read_line(pathname, line, sizeof(line)))
+		return -1;
+
+	for (i = 0, p = line; i < 16; i ++) {
+		if ('-' == *p)
+			p ++;
+		if (sscanf(p, "%2hhx", &bytes[i]) != 1)
+			return -1;
+		p += 2;
+	}
+	memcpy(uuid, bytes, sizeof(bytes));
+
+	return 0;
+}
+
+/* the uuid from a member's superblock, on kernels without md/uuid */
+static int member_uuid(const struct md_member *member, int uuid[4])
+{
+	struct mdp_superblock_1 *sb;
+	char devname[64];
+	mdp_super_t super;
+	off64_t offset;
+	int fd, ret;
+
+	snprintf(devname, sizeof(devname), "/dev/block/%u:%u",
+		 major(member->dev), minor(member->dev));
+	fd = open(devname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ret = md_read_super0(fd, &super);
+	if (0 == ret) {
+		uuid[0] = super.set_uuid0;
+		if (super.minor_version >= 90) {
+			uuid[1] = super.set_uuid1;
+			uuid[2] = super.set_uuid2;
+			uuid[3] = super.set_uuid3;
+		}
+	} else if ((sb = malloc(MD_SB1_BYTES)) != NULL) {
+		ret = md_read_super1(fd, sb, &offset);
+		if (0 == ret)
+			memcpy(uuid, sb->set_uuid, sizeof(sb->set_uuid));
+		free(sb);
+	}
+	close(fd);
+
+	return ret ? -1 : 0;
+}
+
+/*
+ * The serial of the disk under member dev-<name>, the same one fix_sector
+ * reads over HDIO and keys its surface map by. A partition's disk is
+ * the parent of its block directory.
+ */
+static void read_serial(const char *dir, const char *name, char *serial, size_t len)
+{
+	static const char *paths[] = {
+		"block/device/serial", "block/device/vpd_pg80",
+		"block/../device/serial", "block/../device/vpd_pg80",
+	};
+	char pathname[PATH_MAX + NAME_MAX + 32], buf[256], *p, *end;
+	size_t n;
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < 4; i ++) {
+		snprintf(pathname, sizeof(pathname), "%s/%s/%s", dir, name, paths[i]);
+		fp = fopen(pathname, "r");
+		if (NULL == fp)
+			continue;
+		n = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+
+		p = buf;
+		end = buf + n;
+		/* page 80h: 4 bytes of header, then the serial */
+		if (i % 2) {
+			if (n < 4 || 4 + (unsigned char)p[3] > n)
+				continue;
+			end = p + 4 + (unsigned char)p[3];
+			p += 4;
+		}
+		while (p < end && (' ' == *p || '\0' == *p))
+			p ++;
+		while (end > p && (' ' == end[-1] || '\n' == end[-1] || '\0' == end[-1]))
+			end --;
+		if (p == end || (size_t)(end - p) >= len)
+			continue;
+
+		memcpy(serial, p, end - p);
+		serial[end - p] = '\0';
+		return;
+	}
+}
+
+static int add_member(struct md_array *array, const char *dir, const char *name)
+{
+	char pathname[PATH_MAX + NAME_MAX + 16], line[32];
+	struct md_member *member, *members;
+
+	members = realloc(array->members, sizeof(struct md_member) * (array->nr_members + 1));
+	if (NULL == members)
+		return -1;
+	array->members = members;
+	member = &members[array->nr_members];
+
+	memset(member, 0, sizeof(struct md_member));
+	snprintf(member->name, sizeof(member->name), "%s", name + strlen("dev-"));
+	snprintf(pathname, sizeof(pathname), "%s/%s/block/dev", dir, name);
+	if (read_dev(pathname, &member->dev))
+		return 0;
+
+	snprintf(pathname, sizeof(pathname), "%s/%s/slot", dir, name);
+	if (read_line(pathname, line, sizeof(line)) || sscanf(line, "%d", &member->role) != 1)
+		member->role = -1;
+	read_serial(dir, name, member->serial, sizeof(member->serial));
+
+	array->nr_members ++;
+	return 0;
+}
+
+static int add_array(struct md_registry *reg, const char *sysfs, const char *name)
+{
+	char dir[PATH_MAX], pathname[PATH_MAX + 64];
+	struct md_array *array, *arrays;
+	struct dirent *de;
+	int i, ret = 0;
+	DIR *dp;
+
+	snprintf(dir, sizeof(dir), "%s/%s/md", sysfs, name);
+	dp = opendir(dir);
+	if (NULL == dp)
+		return 0;
+
+	arrays = realloc(reg->arrays, sizeof(struct md_array) * (reg->nr + 1));
+	if (NULL == arrays) {
+		closedir(dp);
+		return -1;
+	}
+	reg->arrays = arrays;
+	array = &arrays[reg->nr];
+
+	memset(array, 0, sizeof(struct md_array));
+	snprintf(array->name, sizeof(array->name), "%s", name);
+	snprintf(pathname, sizeof(pathname), "%s/%s/dev", sysfs, name);
+	read_dev(pathname, &array->dev);
+
+	while ((de = readdir(dp)) != NULL && !ret) {
+		if (!strncmp(de->d_name, "dev-", 4))
+			ret = add_member(array, dir, de->d_name);
+	}
+	closedir(dp);
+
+	snprintf(pathname, sizeof(pathname), "%s/uuid", dir);
+	if (read_uuid(pathname, array->uuid)) {
+		for (i = 0; i < array->nr_members; i ++) {
+			if (member_uuid(&array->members[i], array->uuid) == 0)
+				break;
+		}
+		/* not one we can tell apart */
+		if (i == array->nr_members) {
+			free(array->members);
+			return ret;
+		}
+	}
+
+	reg->nr ++;
+	return ret;
+}
+
+/*
+ * md_scan:
+ *
+ * Read the assembled arrays and their members from sysfs, replacing
+ * what reg had. An array is known by the uuid in md/uuid, or in the
+ * 0.90 or 1.x superblock of one of its members where the kernel has no
+ * md/uuid.
+ */
+int md_scan(struct md_registry *reg)
+{
+	const char *sysfs = reg->sysfs ? reg->sysfs : MD_SYSFS;
+	struct dirent *de;
+	int ret = 0;
+	DIR *dp;
+
+	md_free(reg);
+
+	dp = opendir(sysfs);
+	if (NULL == dp)
+		return -1;
+	while ((de = readdir(dp)) != NULL && !ret) {
+		if (!strncmp(de->d_name, "md", 2))
+			ret = add_array(reg, sysfs, de->d_name);
+	}
+	closedir(dp);
+
+	reg->scanned = 1;
+	return ret;
+}
+
+void md_free(struct md_registry *reg)
+{
+	int i;
+
+	for (i = 0; i < reg->nr; i ++)
+		free(reg->arrays[i].members);
+	free(reg->arrays);
+	reg->arrays = NULL;
+	reg->nr = 0;
+	reg->scanned = 0;
+}
+
+static const struct md_array *lookup_uuid(const struct md_registry *reg, const int uuid[4])
+{
+	int i;
+
+	for (i = 0; i < reg->nr; i ++) {
+		if (!memcmp(reg->arrays[i].uuid, uuid, sizeof(reg->arrays[i].uuid)))
+			return &reg->arrays[i];
+	}
+
+	return NULL;
+}
+
+/* md_find_uuid: the assembled array with this uuid, or NULL */
+const struct md_array *md_find_uuid(struct md_registry *reg, const int uuid[4])
+{
+	const struct md_array *array = NULL;
+
+	if (reg->scanned)
+		array = lookup_uuid(reg, uuid);
+	if (NULL == array && md_scan(reg) == 0)
+		array = lookup_uuid(reg, uuid);
+
+	return array;
+}
+
+static const struct md_array *lookup_member(const struct md_registry *reg, dev_t dev,
+					    const struct md_member **memberp)
+{
+	int i, j;
+
+	for (i = 0; i < reg->nr; i ++) {
+		for (j = 0; j < reg->arrays[i].nr_members; j ++) {
+			if (reg->arrays[i].members[j].dev != dev)
+				continue;
+			if (memberp)
+				*memberp = &reg->arrays[i].members[j];
+			return &reg->arrays[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* md_find_member: the assembled array the device is a member of, or NULL */
+const struct md_array *md_find_member(struct md_registry *reg, dev_t member,
+				      const struct md_member **memberp)
+{
+	const struct md_array *array = NULL;
+
+	if (reg->scanned)
+		array = lookup_member(reg, member, memberp);
+	if (NULL == array && md_scan(reg) == 0)
+		array = lookup_member(reg, member, memberp);
+
+	return array;
+}
+
+static const struct md_array *lookup_serial(const struct md_registry *reg, const char *serial,
+					    const struct md_member **memberp)
+{
+	int i, j;
+
+	for (i = 0; i < reg->nr; i ++) {
+		for (j = 0; j < reg->arrays[i].nr_members; j ++) {
+			if (strcmp(reg->arrays[i].members[j].serial, serial))
+				continue;
+			if (memberp)
+				*memberp = &reg->arrays[i].members[j];
+			return &reg->arrays[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* md_find_serial: the assembled array a member on the disk with this serial is in, or NULL */
+const struct md_array *md_find_serial(struct md_registry *reg, const char *serial,
+				      const struct md_member **memberp)
+{
+	const struct md_array *array = NULL;
+
+	if ('\0' == serial[0])
+		return NULL;
+	if (reg->scanned)
+		array = lookup_serial(reg, serial, memberp);
+	if (NULL == array && md_scan(reg) == 0)
+		array = lookup_serial(reg, serial, memberp);
+
+	return array;
+}
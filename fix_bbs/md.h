@@ -0,0 +1,53 @@
+#ifndef __MD_H_
+#define __MD_H_
+
+#include "fix_sector.h"
+#include "md_p.h"
+#include "alloc.h"
+
+#define MD_SYSFS "/sys/block"
+#define MD_NAME_LEN 32
+#define MD_SERIAL_LEN 64
+/* a 1.x superblock with the roles of up to 1920 members */
+#define MD_SB1_BYTES 4096
+
+struct md_member {
+	char name[MD_NAME_LEN];		/* sdb1 */
+	dev_t dev;
+	int role;			/* -1 for a spare or a faulty one */
+	char serial[MD_SERIAL_LEN];	/* of the disk under it, "" if unknown */
+};
+
+struct md_array {
+	char name[MD_NAME_LEN];		/* md0 */
+	dev_t dev;
+	int uuid[4];			/* as the superblock has it */
+	int nr_members;
+	struct md_member *members;
+};
+
+/*
+ * The assembled arrays, read from sysfs once and looked up from then
+ * on. A lookup that misses reads them again, for arrays assembled
+ * since.
+ */
+struct md_registry {
+	const char *sysfs;		/* MD_SYSFS when NULL */
+	int scanned;
+	int nr;
+	struct md_array *arrays;
+};
+
+int md_read_super0(int fd, mdp_super_t *super);
+int md_read_super1(int fd, struct mdp_superblock_1 *sb, off64_t *sb_offset);
+int md_super1_role(const struct mdp_superblock_1 *sb);
+int md_parse_bblog(const void *log, size_t len, int shift, struct range_list *ranges);
+int md_scan(struct md_registry *reg);
+void md_free(struct md_registry *reg);
+const struct md_array *md_find_uuid(struct md_registry *reg, const int uuid[4]);
+const struct md_array *md_find_member(struct md_registry *reg, dev_t member,
+				      const struct md_member **memberp);
+const struct md_array *md_find_serial(struct md_registry *reg, const char *serial,
+				      const struct md_member **memberp);
+
+#endif
@@ -0,0 +1,936 @@
+#include "scan.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+struct scan_worker {
+	struct scan_state *state;
+	pthread_t tid;
+	int index;
+	char *buf;
+	off64_t offset;		/* window in flight, -1 if none */
+};
+
+/* a window near a bad sector, read before the sweep goes on */
+struct hot_window {
+	off64_t offset;
+	__u32 len;
+	__u32 prio;		/* windows away from the bad sector */
+	__u64 seq;
+	int force;		/* read again even if claimed */
+};
+
+/*
+ * Failed windows on their way from the readers to the repair workers:
+ * a bounded queue any number of threads post to and take from without
+ * a lock. A slot's seq tells whose turn it is: pos when it is free to
+ * post at pos, pos + 1 once the window posted there can be taken.
+ */
+struct repair_slot {
+	__u64 seq;
+	off64_t offset;
+	size_t size;
+};
+
+struct repair_queue {
+	struct repair_slot slots[SCAN_REPAIR_QUEUE];
+	__u64 head;
+	__u64 tail;
+};
+
+struct repair_worker {
+	struct scan_state *state;
+	pthread_t tid;
+	char *buf;
+};
+
+/*
+ * The work shared by the workers, under lock. Every window handed out
+ * is claimed first, so the sweep and the hot windows never read the
+ * same place twice.
+ */
+struct scan_state {
+	struct scan_ctx *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	off64_t cursor;		/* the sweep, below it all is claimed */
+	off64_t limit;		/* end of the device once a read came back short */
+	size_t io_size;
+	__u32 depth;
+	__u32 in_flight;
+	int done;
+	int failed;
+	off64_t fail_offset;
+	__u64 next_io;		/* when a throttled read may start */
+	__u64 last_end;		/* when the latest read came back */
+
+	struct range_list claimed;
+	struct hot_window *hot;
+	int nr_hot, max_hot;
+	__u64 seq;
+
+	struct scan_worker workers[SCAN_MAX_DEPTH];
+
+	/* read and failed, the repair not done yet */
+	struct range_list repairing;
+	struct repair_queue queue;
+	sem_t queued;
+	__u32 nr_repair;
+	int stop_repair;
+	struct repair_worker repairers[SCAN_MAX_REPAIR];
+};
+
+/* keeps ctx->state alive for scan_push() */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* index of the first range that ends after offset */
+static int range_after(const struct range_list *list, off64_t offset)
+{
+	int lo = 0, hi = list->nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (list->ranges[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int claim(struct range_list *set, off64_t start, off64_t end)
+{
+	int i, j;
+
+	/* ranges that overlap or touch [start, end) merge into one */
+	i = range_after(set, start - 1);
+	for (j = i; j < set->nr && set->ranges[j].start <= end; j ++)
+		;
+
+	if (i == j) {
+		if (add_range(set, start, end))
+			return -1;
+		memmove(&set->ranges[i + 1], &set->ranges[i],
+			sizeof(struct scan_range) * (set->nr - 1 - i));
+		set->ranges[i].start = start;
+		set->ranges[i].end = end;
+		return 0;
+	}
+
+	if (set->ranges[i].start < start)
+		start = set->ranges[i].start;
+	if (set->ranges[j - 1].end > end)
+		end = set->ranges[j - 1].end;
+	set->ranges[i].start = start;
+	set->ranges[i].end = end;
+	memmove(&set->ranges[i + 1], &set->ranges[j],
+		sizeof(struct scan_range) * (set->nr - j));
+	set->nr -= j - i - 1;
+
+	return 0;
+}
+
+/*
+ * Trim [*start, *end) to the part of one scan range, then to its first
+ * piece nobody claimed. Return 0 if nothing is left.
+ */
+static int unclaimed(struct scan_state *state, off64_t *start, off64_t *end)
+{
+	const struct range_list *ranges = state->ctx->ranges;
+	struct range_list *set = &state->claimed;
+	int i;
+
+	if (*end > state->limit)
+		*end = state->limit;
+
+	i = range_after(ranges, *start);
+	if (i == ranges->nr)
+		return 0;
+	if (*start < ranges->ranges[i].start)
+		*start = ranges->ranges[i].start;
+	if (*end > ranges->ranges[i].end)
+		*end = ranges->ranges[i].end;
+
+	i = range_after(set, *start);
+	if (i < set->nr && set->ranges[i].start <= *start)
+		*start = set->ranges[i ++].end;
+	if (i < set->nr && set->ranges[i].start < *end)
+		*end = set->ranges[i].start;
+
+	return *start < *end;
+}
+
+static int hot_before(struct hot_window *a, struct hot_window *b)
+{
+	if (a->prio != b->prio)
+		return a->prio < b->prio;
+	return a->seq < b->seq;
+}
+
+static int push_hot(struct scan_state *state, off64_t offset, __u32 len, __u32 prio,
+		    int force)
+{
+	struct hot_window *hot, tmp;
+	int i, max;
+
+	if (offset < 0)
+		return 0;
+
+	if (state->nr_hot == state->max_hot) {
+		max = state->max_hot ? state->max_hot * 2 : 256;
+		hot = realloc(state->hot, sizeof(struct hot_window) * max);
+		if (NULL == hot)
+			return -1;
+		state->hot = hot;
+		state->max_hot = max;
+	}
+
+	i = state->nr_hot ++;
+	state->hot[i].offset = offset;
+	state->hot[i].len = len;
+	state->hot[i].prio = prio;
+	state->hot[i].seq = state->seq ++;
+	state->hot[i].force = force;
+
+	for (; i > 0 && hot_before(&state->hot[i], &state->hot[(i - 1) / 2]); i = (i - 1) / 2) {
+		tmp = state->hot[i];
+		state->hot[i] = state->hot[(i - 1) / 2];
+		state->hot[(i - 1) / 2] = tmp;
+	}
+
+	return 0;
+}
+
+static void pop_hot(struct scan_state *state, struct hot_window *win)
+{
+	struct hot_window tmp;
+	int i = 0, child;
+
+	*win = state->hot[0];
+	state->hot[0] = state->hot[-- state->nr_hot];
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= state->nr_hot)
+			break;
+		if (child + 1 < state->nr_hot && hot_before(&state->hot[child + 1], &state->hot[child]))
+			child ++;
+		if (!hot_before(&state->hot[child], &state->hot[i]))
+			break;
+		tmp = state->hot[i];
+		state->hot[i] = state->hot[child];
+		state->hot[child] = tmp;
+		i = child;
+	}
+}
+
+/*
+ * Queue the windows over [start, end) and rings of windows around it
+ * out to hot_radius, nearest first. With force, [start, end) itself is
+ * read again, in sectors, whether the scan went past it or not.
+ */
+static void heat(struct scan_state *state, off64_t start, off64_t end, int force)
+{
+	off64_t io = state->io_size, sector = state->ctx->sector_size, base, top, offset;
+	__u32 d;
+
+	base = start - start % io;
+	top = end + (io - end % io) % io;
+
+	if (force) {
+		start -= start % sector;
+		end += (sector - end % sector) % sector;
+		for (offset = start; offset < end; offset += io)
+			push_hot(state, offset, end - offset < io ? end - offset : io, 0, 1);
+	} else {
+		for (offset = base; offset < top; offset += io)
+			push_hot(state, offset, io, 0, 0);
+	}
+
+	for (d = 1; d * io <= state->ctx->hot_radius; d ++) {
+		push_hot(state, base - d * io, io, d, 0);
+		push_hot(state, top + (d - 1) * io, io, d, 0);
+	}
+
+	pthread_cond_broadcast(&state->cond);
+}
+
+/* a bad sector was found, look around it before going on */
+static void scan_found(struct scan_ctx *ctx, off64_t offset)
+{
+	struct scan_state *state = ctx->state;
+
+	if (NULL == state || 0 == ctx->hot_radius)
+		return;
+
+	pthread_mutex_lock(&state->lock);
+	heat(state, offset, offset + ctx->sector_size, 0);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/*
+ * scan_push:
+ *
+ * Read [start, end) again as soon as a worker is free, even where the
+ * scan has been, and look around it like around a bad sector found.
+ * Return -1 if no scan is running to take it.
+ */
+int scan_push(struct scan_ctx *ctx, off64_t start, off64_t end)
+{
+	struct scan_state *state;
+	int ret = -1;
+
+	pthread_mutex_lock(&state_lock);
+	state = ctx->state;
+	if (state) {
+		pthread_mutex_lock(&state->lock);
+		if (!state->done && !state->failed) {
+			heat(state, start, end, 1);
+			ret = 0;
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
+	pthread_mutex_unlock(&state_lock);
+
+	return ret;
+}
+
+/* the next window to read, hot ones first, 0 if there is none */
+static int next_window(struct scan_state *state, off64_t *offset, size_t *size)
+{
+	const struct range_list *ranges = state->ctx->ranges;
+	struct hot_window win;
+	off64_t start, end;
+	int i;
+
+	while (state->nr_hot) {
+		pop_hot(state, &win);
+		start = win.offset;
+		end = win.offset + win.len;
+		if (win.force) {
+			if (end > state->limit)
+				end = state->limit;
+			if (start < end)
+				goto found;
+		} else if (unclaimed(state, &start, &end))
+			goto found;
+	}
+
+	for (;;) {
+		i = range_after(ranges, state->cursor);
+		if (i == ranges->nr || state->cursor >= state->limit)
+			return 0;
+		if (state->cursor < ranges->ranges[i].start)
+			state->cursor = ranges->ranges[i].start;
+
+		start = state->cursor;
+		end = start + state->io_size;
+		if (unclaimed(state, &start, &end)) {
+			state->cursor = end;
+			goto found;
+		}
+		/* all claimed up to start, or up to the end of the range */
+		state->cursor = start > end ? start : end;
+	}
+
+found:
+	if (claim(&state->claimed, start, end))
+		return 0;
+	*offset = start;
+	*size = end - start;
+
+	return 1;
+}
+
+static ssize_t repair_read(struct scan_ctx *ctx, char *buf, off64_t offset)
+{
+	__atomic_add_fetch(&ctx->repair_reads, 1, __ATOMIC_RELAXED);
+	return blk_read(ctx->dev, buf, ctx->sector_size, offset);
+}
+
+static ssize_t repair_write(struct scan_ctx *ctx, char *buf, off64_t offset)
+{
+	__atomic_add_fetch(&ctx->repair_writes, 1, __ATOMIC_RELAXED);
+	memset(buf, 0, ctx->sector_size);
+	return blk_write(ctx->dev, buf, ctx->sector_size, offset);
+}
+
+/*
+ * Read the window sector by sector, rewrite every sector that fails
+ * and read it back. Return -1 if one can't be fixed. With
+ * ctx->verify_only the sectors that fail are only reported.
+ */
+int fix_pending_sector(struct scan_ctx *ctx, char *buf, off64_t rd_offset, size_t size)
+{
+	off64_t offset, scaned_size;
+	int i, ret, fixed;
+
+	for (scaned_size = 0; scaned_size < size; scaned_size += ctx->sector_size) {
+		offset = rd_offset + scaned_size;
+		ret = repair_read(ctx, buf, offset);
+		if (ret >= 0)
+			continue;
+		if (EIO != errno)
+			return -1;
+
+		__atomic_add_fetch(&ctx->bad_sectors, 1, __ATOMIC_RELAXED);
+		scan_found(ctx, offset);
+		if (ctx->verify_only) {
+			if (ctx->sector_fn)
+				ctx->sector_fn(ctx, offset, 0);
+			continue;
+		}
+
+		fixed = 0;
+		for (i = 0; i < RETRY; i ++) {
+			ret = repair_write(ctx, buf, offset);
+			if (ret != ctx->sector_size) {
+				perror("write badsector error");
+				continue;
+			}
+
+			ret = repair_read(ctx, buf, offset);
+			if (ret < 0) {
+				perror("reread error");
+				continue;
+			}
+
+			fixed = 1;
+			break;
+		}
+
+		if (ctx->sector_fn)
+			ctx->sector_fn(ctx, offset, fixed);
+		if (!fixed)
+			return -1;
+		__atomic_add_fetch(&ctx->fixed_sectors, 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+static void queue_init(struct repair_queue *queue)
+{
+	int i;
+
+	for (i = 0; i < SCAN_REPAIR_QUEUE; i ++)
+		queue->slots[i].seq = i;
+	queue->head = queue->tail = 0;
+}
+
+/* return -1 if the queue is full */
+static int queue_post(struct repair_queue *queue, off64_t offset, size_t size)
+{
+	struct repair_slot *slot;
+	__u64 pos, seq;
+
+	pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->slots[pos % SCAN_REPAIR_QUEUE];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((__s64)(seq - pos) < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	}
+
+	slot->offset = offset;
+	slot->size = size;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* return -1 if there is nothing to take yet */
+static int queue_take(struct repair_queue *queue, off64_t *offset, size_t *size)
+{
+	struct repair_slot *slot;
+	__u64 pos, seq;
+
+	pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->slots[pos % SCAN_REPAIR_QUEUE];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((__s64)(seq - (pos + 1)) < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	}
+
+	*offset = slot->offset;
+	*size = slot->size;
+	__atomic_store_n(&slot->seq, pos + SCAN_REPAIR_QUEUE, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* everything below this has been read, or repaired */
+static off64_t scan_done(struct scan_state *state)
+{
+	off64_t done = state->cursor;
+	int i;
+
+	for (i = 0; i < SCAN_MAX_DEPTH; i ++) {
+		if (state->workers[i].offset >= 0 && state->workers[i].offset < done)
+			done = state->workers[i].offset;
+	}
+	for (i = 0; i < state->repairing.nr; i ++) {
+		if (state->repairing.ranges[i].start < done)
+			done = state->repairing.ranges[i].start;
+	}
+
+	return done;
+}
+
+static void unlist_repair(struct scan_state *state, off64_t offset)
+{
+	struct range_list *list = &state->repairing;
+	int i;
+
+	for (i = 0; i < list->nr; i ++) {
+		if (list->ranges[i].start == offset) {
+			list->ranges[i] = list->ranges[-- list->nr];
+			break;
+		}
+	}
+}
+
+/*
+ * Hand a failed window to the repair workers. It is listed as being
+ * repaired before any of them can take it. Return 0 if it has to be
+ * repaired here: there are no repair workers, or they are behind.
+ */
+static int post_repair(struct scan_state *state, off64_t offset, size_t size)
+{
+	int ret;
+
+	if (0 == state->nr_repair)
+		return 0;
+
+	pthread_mutex_lock(&state->lock);
+	ret = add_range(&state->repairing, offset, offset + size);
+	pthread_mutex_unlock(&state->lock);
+	if (ret)
+		return 0;
+
+	if (queue_post(&state->queue, offset, size)) {
+		pthread_mutex_lock(&state->lock);
+		unlist_repair(state, offset);
+		pthread_mutex_unlock(&state->lock);
+		return 0;
+	}
+	sem_post(&state->queued);
+
+	return 1;
+}
+
+/* a window that failed, or could not be repaired, stops the scan */
+static void scan_fail(struct scan_state *state, off64_t offset)
+{
+	if (!state->failed || offset < state->fail_offset)
+		state->fail_offset = offset;
+	state->failed = 1;
+}
+
+static void *repair_worker_fn(void *arg)
+{
+	struct repair_worker *worker = arg;
+	struct scan_state *state = worker->state;
+	struct scan_ctx *ctx = state->ctx;
+	off64_t offset;
+	size_t size;
+	int ret;
+
+	for (;;) {
+		sem_wait(&state->queued);
+		/* a post shows up a moment after it is counted */
+		while (queue_take(&state->queue, &offset, &size)) {
+			if (__atomic_load_n(&state->stop_repair, __ATOMIC_ACQUIRE))
+				return NULL;
+			sched_yield();
+		}
+
+		ret = 0;
+		if (!__atomic_load_n(&state->failed, __ATOMIC_RELAXED)) {
+			ret = fix_pending_sector(ctx, worker->buf, offset, size);
+			if (ret)
+				perror("Can't fix pending sector");
+		}
+
+		pthread_mutex_lock(&state->lock);
+		unlist_repair(state, offset);
+		if (ret)
+			scan_fail(state, offset);
+		else if (!state->failed) {
+			ctx->scanned += size;
+			if (ctx->progress_fn)
+				ctx->progress_fn(ctx, scan_done(state));
+		}
+		/* readers may be waiting for the last repairs, or for what they found */
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+	}
+}
+
+static void apply_tuning(struct scan_state *state)
+{
+	struct tuner *tuner = state->ctx->tuner;
+
+	state->io_size = tuner->cur.io_size;
+	state->depth = tuner->cur.depth;
+	/* workers above the old depth may be parked */
+	pthread_cond_broadcast(&state->cond);
+}
+
+/* keep to ctx->throttle: the time to wait before reading size */
+static __u64 throttle(struct scan_state *state, size_t size)
+{
+	__u64 rate = state->ctx->throttle, now, wait;
+
+	if (0 == rate)
+		return 0;
+
+	now = now_us();
+	if (state->next_io < now)
+		state->next_io = now;
+	wait = state->next_io - now;
+	state->next_io += size * 1000000ULL / rate;
+
+	return wait;
+}
+
+/* in slices, so a stop does not wait for a slow throttle */
+static void throttle_wait(struct scan_ctx *ctx, __u64 wait)
+{
+	__u64 slice;
+
+	while (wait && !__atomic_load_n(&ctx->stopping, __ATOMIC_RELAXED)) {
+		slice = wait < 100000 ? wait : 100000;
+		usleep(slice);
+		wait -= slice;
+	}
+}
+
+static __u64 slow_limit(const struct scan_ctx *ctx, size_t size)
+{
+	if (size <= SCAN_SLOW_UNIT)
+		return ctx->slow_us;
+	return ctx->slow_us * size / SCAN_SLOW_UNIT;
+}
+
+/*
+ * How long the disk spent on a read that took elapsed from start. The
+ * reads in flight queue for one disk, so it is the time since the one
+ * before came back, or all of elapsed when nothing else was pending.
+ */
+static __u64 disk_time(struct scan_state *state, __u64 start, __u64 elapsed)
+{
+	__u64 end = start + elapsed, busy = elapsed;
+
+	if (end > state->last_end) {
+		if (end - state->last_end < elapsed)
+			busy = end - state->last_end;
+		state->last_end = end;
+	} else if (state->in_flight) {
+		/* came back before one already counted, a share of it */
+		busy = elapsed / (state->in_flight + 1);
+	}
+
+	return busy;
+}
+
+static void *scan_worker_fn(void *arg)
+{
+	struct scan_worker *worker = arg;
+	struct scan_state *state = worker->state;
+	struct scan_ctx *ctx = state->ctx;
+	off64_t offset;
+	size_t size;
+	__u64 start, elapsed, busy, wait;
+	__u32 gen = 0;
+	ssize_t ret;
+	int eio;
+
+	pthread_mutex_lock(&state->lock);
+	for (;;) {
+		if (state->failed || state->done)
+			break;
+		if (ctx->stopping) {
+			state->done = 1;
+			break;
+		}
+		if (ctx->paused || worker->index >= state->depth) {
+			pthread_cond_wait(&state->cond, &state->lock);
+			continue;
+		}
+		if (!next_window(state, &offset, &size)) {
+			/* windows still in flight or in repair may find more to do */
+			if (0 == state->in_flight && 0 == state->repairing.nr) {
+				state->done = 1;
+				break;
+			}
+			pthread_cond_wait(&state->cond, &state->lock);
+			continue;
+		}
+
+		worker->offset = offset;
+		state->in_flight ++;
+		if (ctx->tuner)
+			gen = ctx->tuner->gen;
+		wait = throttle(state, size);
+		pthread_mutex_unlock(&state->lock);
+
+		throttle_wait(ctx, wait);
+		start = now_us();
+		ret = blk_read(ctx->dev, worker->buf, size, offset);
+		elapsed = now_us() - start;
+		eio = ret < 0 && EIO == errno;
+		if (ret < 0 && !eio)
+			perror("Other error happened");
+		if (eio) {
+			__atomic_add_fetch(&ctx->bad_windows, 1, __ATOMIC_RELAXED);
+			if (post_repair(state, offset, size)) {
+				/* its repair worker finishes it */
+				pthread_mutex_lock(&state->lock);
+				worker->offset = -1;
+				state->in_flight --;
+				continue;
+			}
+			__atomic_add_fetch(&ctx->inline_repairs, 1, __ATOMIC_RELAXED);
+			ret = fix_pending_sector(ctx, worker->buf, offset, size);
+			if (ret)
+				perror("Can't fix pending sector");
+		}
+
+		pthread_mutex_lock(&state->lock);
+		worker->offset = -1;
+		state->in_flight --;
+		if (0 == state->in_flight)
+			pthread_cond_broadcast(&state->cond);
+		busy = disk_time(state, start, elapsed);
+
+		if (ret < 0) {
+			scan_fail(state, offset);
+			break;
+		}
+		if (ret == 0 && !eio) {
+			/* short device */
+			if (offset < state->limit)
+				state->limit = offset;
+			continue;
+		}
+		ctx->scanned += size;
+		/* zones are compared at one I/O size and depth, not the tuner's trials */
+		if (!eio && (!ctx->tuner || tune_steady(ctx->tuner))) {
+			zone_account(ctx->zones, offset, size, busy);
+			/* by the same measure: waiting behind other reads isn't the disk being slow */
+			if (ctx->slow_us && busy > slow_limit(ctx, size)) {
+				__atomic_add_fetch(&ctx->slow_windows, 1, __ATOMIC_RELAXED);
+				if (ctx->slow_fn)
+					ctx->slow_fn(ctx, offset, size, busy);
+			}
+		}
+
+		/* a throttled scan says nothing about what the disk can do */
+		if (ctx->tuner && !eio && !ctx->throttle) {
+			tune_account(ctx->tuner, gen, size, elapsed);
+			if (tune_step(ctx->tuner))
+				apply_tuning(state);
+		}
+
+		if (ctx->progress_fn)
+			ctx->progress_fn(ctx, scan_done(state));
+	}
+	pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/* wake the workers to look at the controls again */
+static void scan_kick(struct scan_ctx *ctx)
+{
+	pthread_mutex_lock(&state_lock);
+	if (ctx->state) {
+		pthread_mutex_lock(&ctx->state->lock);
+		pthread_cond_broadcast(&ctx->state->cond);
+		pthread_mutex_unlock(&ctx->state->lock);
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+/*
+ * The controls below may be used from any thread, while a scan runs
+ * or before. Reads in flight finish; a paused scan starts no more.
+ */
+void scan_pause(struct scan_ctx *ctx, int paused)
+{
+	__atomic_store_n(&ctx->paused, paused, __ATOMIC_RELAXED);
+	scan_kick(ctx);
+}
+
+/* bytes per second, 0 for no limit */
+void scan_throttle(struct scan_ctx *ctx, __u64 rate)
+{
+	__atomic_store_n(&ctx->throttle, rate, __ATOMIC_RELAXED);
+	scan_kick(ctx);
+}
+
+/* end this scan and any to come early, with ctx->offset at the sweep */
+void scan_stop(struct scan_ctx *ctx)
+{
+	__atomic_store_n(&ctx->stopping, 1, __ATOMIC_RELAXED);
+	scan_kick(ctx);
+}
+
+/*
+ * Read ctx->ranges in windows of io_size with up to depth reads in
+ * flight, from ctx->tuner when it is set. A window that fails to read
+ * is repaired sector by sector, by one of repair_depth workers while
+ * the readers go on, or by its reader when there are none or they are
+ * SCAN_REPAIR_QUEUE windows behind. A window counts as scanned once
+ * its repair is done. Every bad sector found, and every
+ * range in ctx->seeds or from scan_push(), queues the windows within
+ * hot_radius of it ahead of the sweep, nearest first; the sweep skips
+ * what they read.
+ * ctx->offset is left where the scan stopped: the first window that
+ * could not be repaired, where the sweep was for scan_stop(), or the
+ * end of the last range.
+ */
+int scan_sectors(struct scan_ctx *ctx)
+{
+	struct scan_state *state;
+	__u32 i, nr, nr_repair;
+	int ret = 0;
+
+	if (0 == ctx->ranges->nr) {
+		ctx->offset = 0;
+		return 0;
+	}
+
+	state = calloc(1, sizeof(struct scan_state));
+	if (NULL == state)
+		return -1;
+
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->cond, NULL);
+	state->ctx = ctx;
+	state->cursor = ctx->ranges->ranges[0].start;
+	state->limit = ctx->dev->size;
+	if (ctx->tuner) {
+		state->io_size = ctx->tuner->cur.io_size;
+		state->depth = ctx->tuner->cur.depth;
+		nr = ctx->tuner->max_depth;
+	} else {
+		state->io_size = ctx->buf_size;
+		state->depth = ctx->depth ? ctx->depth : 1;
+		nr = state->depth;
+	}
+	if (nr > SCAN_MAX_DEPTH)
+		nr = SCAN_MAX_DEPTH;
+	if (state->io_size > ctx->buf_size)
+		state->io_size = ctx->buf_size;
+
+	queue_init(&state->queue);
+	sem_init(&state->queued, 0, 0);
+	nr_repair = ctx->repair_depth > SCAN_MAX_REPAIR ? SCAN_MAX_REPAIR : ctx->repair_depth;
+	for (i = 0; i < nr_repair; i ++) {
+		state->repairers[i].state = state;
+		state->repairers[i].buf = valloc(ctx->sector_size);
+		if (NULL == state->repairers[i].buf ||
+		    pthread_create(&state->repairers[i].tid, NULL, repair_worker_fn,
+				   &state->repairers[i])) {
+			free(state->repairers[i].buf);
+			break;
+		}
+	}
+	/* with fewer repair workers, the readers repair what is left over */
+	nr_repair = state->nr_repair = i;
+
+	if (ctx->seeds && ctx->hot_radius) {
+		for (i = 0; i < ctx->seeds->nr; i ++)
+			heat(state, ctx->seeds->ranges[i].start, ctx->seeds->ranges[i].end, 0);
+	}
+
+	for (i = 0; i < SCAN_MAX_DEPTH; i ++) {
+		state->workers[i].state = state;
+		state->workers[i].index = i;
+		state->workers[i].offset = -1;
+		state->workers[i].buf = i ? valloc(ctx->buf_size) : ctx->buf;
+		if (i < nr && NULL == state->workers[i].buf) {
+			nr = i;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&state_lock);
+	ctx->state = state;
+	pthread_mutex_unlock(&state_lock);
+	for (i = 0; i < nr; i ++) {
+		if (pthread_create(&state->workers[i].tid, NULL, scan_worker_fn,
+				   &state->workers[i])) {
+			/* fewer workers only means less depth */
+			if (0 == i)
+				ret = -1;
+			nr = i;
+			break;
+		}
+	}
+	for (i = 0; i < nr; i ++)
+		pthread_join(state->workers[i].tid, NULL);
+
+	/* nothing is posted any more, what is left goes undone on a failure */
+	__atomic_store_n(&state->stop_repair, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < nr_repair; i ++)
+		sem_post(&state->queued);
+	for (i = 0; i < nr_repair; i ++) {
+		pthread_join(state->repairers[i].tid, NULL);
+		free(state->repairers[i].buf);
+	}
+	pthread_mutex_lock(&state_lock);
+	ctx->state = NULL;
+	pthread_mutex_unlock(&state_lock);
+
+	if (ret || state->failed) {
+		ctx->offset = state->failed ? state->fail_offset : ctx->ranges->ranges[0].start;
+		ret = -1;
+	} else if (ctx->stopping) {
+		/* only what the sweep got through, the scan is not done */
+		ctx->offset = scan_done(state);
+	} else {
+		ctx->offset = ctx->ranges->ranges[ctx->ranges->nr - 1].end;
+		if (ctx->offset > state->limit)
+			ctx->offset = state->limit;
+	}
+
+	for (i = 1; i < SCAN_MAX_DEPTH; i ++)
+		free(state->workers[i].buf);
+	free_ranges(&state->claimed);
+	free_ranges(&state->repairing);
+	sem_destroy(&state->queued);
+	free(state->hot);
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+
+	return ret;
+}
@@ -0,0 +1,77 @@
+#ifndef __SCAN_H_
+#define __SCAN_H_
+
+#include "blk_io.h"
+#include "tune.h"
+#include "alloc.h"
+#include "zone.h"
+
+#define SCAN_MAX_DEPTH TUNE_MAX_DEPTH
+/* how far around a bad sector to look before the sweep goes on */
+#define SCAN_HOT_RADIUS (16 * 1024 * 1024)
+/* failed windows the readers may get ahead of the repairs */
+#define SCAN_REPAIR_QUEUE 64
+#define SCAN_MAX_REPAIR 4
+#define SCAN_REPAIR_DEPTH 1
+/* slow_us is for reads up to this big, bigger ones get longer in proportion */
+#define SCAN_SLOW_UNIT (1024 * 1024)
+
+struct scan_state;
+
+struct scan_ctx;
+
+/* a bad sector was found at offset, fixed or not; may run in several threads */
+typedef void (*scan_sector_fn)(struct scan_ctx *ctx, off64_t offset, int fixed);
+/* called after every window with everything below offset done, one at a time */
+typedef void (*scan_progress_fn)(struct scan_ctx *ctx, off64_t offset);
+/* a window read fine, but slowly, see slow_us; may run in several threads */
+typedef void (*scan_slow_fn)(struct scan_ctx *ctx, off64_t offset, size_t size, __u64 usecs);
+
+struct scan_ctx {
+	struct blk_dev *dev;
+	char *buf;
+	size_t buf_size;	/* the largest I/O, each worker gets a buffer this big */
+	__u32 sector_size;	/* physical, the unit of repair */
+	__u32 depth;		/* reads in flight without a tuner */
+	__u32 repair_depth;	/* repair workers, 0 to repair in the readers */
+	int verify_only;	/* only find the bad sectors, write nothing */
+	__u64 slow_us;		/* disk time past which a read is slow, 0 to time nothing */
+	struct tuner *tuner;
+	struct zone_map *zones;	/* timed per zone when set */
+
+	const struct range_list *ranges;	/* what to scan, sorted */
+	const struct range_list *seeds;		/* known bad, looked at first */
+	off64_t hot_radius;			/* 0 for a plain sweep */
+
+	scan_sector_fn sector_fn;
+	scan_progress_fn progress_fn;
+	scan_slow_fn slow_fn;
+	void *arg;
+
+	struct scan_state *state;		/* while scan_sectors() runs */
+
+	/* controls, through scan_pause() and friends */
+	int paused;
+	int stopping;
+	__u64 throttle;				/* bytes per second, 0 for none */
+
+	/* results */
+	off64_t offset;
+	__u64 scanned;
+	__u64 bad_windows;
+	__u64 inline_repairs;	/* windows their reader had to repair */
+	__u64 bad_sectors;
+	__u64 fixed_sectors;
+	__u64 slow_windows;
+	__u64 repair_reads;
+	__u64 repair_writes;
+};
+
+int fix_pending_sector(struct scan_ctx *ctx, char *buf, off64_t rd_offset, size_t size);
+int scan_sectors(struct scan_ctx *ctx);
+int scan_push(struct scan_ctx *ctx, off64_t start, off64_t end);
+void scan_pause(struct scan_ctx *ctx, int paused);
+void scan_throttle(struct scan_ctx *ctx, __u64 rate);
+void scan_stop(struct scan_ctx *ctx);
+
+#endif
@@ -1,8 +1,10 @@
-#include "fix_sector.h"
+#include "sgio.h"
 #include <scsi/sg.h>
 #include <asm/byteorder.h>
 
-#define ATA_OP_IDENTIFY (0xec)
+/* PIO data-in, the protocol field of ATA PASS-THROUGH */
+#define SG_ATA_PROTO_PIO_IN (4 << 1)
+#define SG_ATA_LBA48 1
 
 #define SG_CHECK_CONDITION 0x02
 #define SG_DRIVER_SENSE 0x08
@@ -18,6 +20,7 @@ enum {
 	ATA_USING_LBA		= (1 << 6),
 	ATA_STAT_DRQ		= (1 << 3),
 	ATA_STAT_ERR		= (1 << 0),
+	ATA_ERR_ABRT		= (1 << 2),
 };
 
 struct scsi_sg_io_hdr {
@@ -45,24 +48,6 @@ struct scsi_sg_io_hdr {
 	unsigned int info;
 };
 
-struct ata_lba_regs {
-	__u8	feat;
-	__u8	nsect;
-	__u8	lbal;
-	__u8	lbam;
-	__u8	lbah;
-};
-
-struct ata_tf {
-	__u8 dev;
-	__u8 command;
-	__u8 error;
-	__u8 status;
-	__u8 is_lba48;
-	struct ata_lba_regs	lob;
-	struct ata_lba_regs	hob;
-};
-
 static __u64 tf_to_lba(struct ata_tf *tf)
 {
 	__u32 lba24, lbah;
@@ -89,42 +74,34 @@ static void tf_init(struct ata_tf *tf, __u8 ata_op, __u64 lba, unsigned int nsec
 	tf->dev |= (lba >> 24) & 0x0f;
 }
 
-static int do_drive_cmd(int fd, unsigned char *args, unsigned int timeout_secs)
+/* one command through SG_IO as ATA PASS-THROUGH (16) */
+static int sg_exec(struct ata_dev *dev, struct ata_tf *tf, void *data, unsigned int data_bytes)
 {
 	unsigned char cdb[SG_ATA_16_LEN];
 	unsigned char sb[32], *desc;
 	struct scsi_sg_io_hdr io_hdr;
 
-	struct ata_tf tf;
-	void *data = NULL;
-	unsigned int data_bytes = 0;
-
-	tf_init(&tf, args[0], 0, 0);
-	tf.lob.nsect = args[1];
-	tf.lob.feat = args[2];
-	if (args[3]) {
-		data_bytes = args[3] * 512;
-		data = args + 4;
-		if (!tf.lob.nsect)
-			tf.lob.nsect = args[3];
-	}
-
-	//rc = sg16(fd, SG_READ, 0, &tf, data, data_bytes, timeout_secs);
-	//int sg16 (int fd, int rw, int dma, struct ata_tf *tf,
-	//	void *data, unsigned int data_bytes, unsigned int timeout_secs)
 	memset(&cdb, 0, sizeof(cdb));
 	memset(&sb, 0, sizeof(sb));
 	memset(&io_hdr, 0, sizeof(struct scsi_sg_io_hdr));
-	cdb[1] = (4 << 1);
-	cdb[2] = 0xe;
 	cdb[0] = SG_ATA_16;
-	cdb[4] = tf.lob.feat;
-	cdb[6] = tf.lob.nsect;
-	cdb[8] = tf.lob.lbal;
-	cdb[10] = tf.lob.lbam;
-	cdb[12] = tf.lob.lbah;
-	cdb[13] = tf.dev;
-	cdb[14] = tf.command;
+	cdb[1] = SG_ATA_PROTO_PIO_IN;
+	cdb[2] = 0xe;
+	if (tf->is_lba48) {
+		cdb[1] |= SG_ATA_LBA48;
+		cdb[3] = tf->hob.feat;
+		cdb[5] = tf->hob.nsect;
+		cdb[7] = tf->hob.lbal;
+		cdb[9] = tf->hob.lbam;
+		cdb[11] = tf->hob.lbah;
+	}
+	cdb[4] = tf->lob.feat;
+	cdb[6] = tf->lob.nsect;
+	cdb[8] = tf->lob.lbal;
+	cdb[10] = tf->lob.lbam;
+	cdb[12] = tf->lob.lbah;
+	cdb[13] = tf->dev;
+	cdb[14] = tf->command;
 	io_hdr.cmd_len = SG_ATA_16_LEN;
 
 	io_hdr.interface_id = 'S';
@@ -134,10 +111,10 @@ static int do_drive_cmd(int fd, unsigned char *args, unsigned int timeout_secs)
 	io_hdr.dxferp = data;
 	io_hdr.cmdp = cdb;
 	io_hdr.sbp = sb;
-	io_hdr.pack_id = tf_to_lba(&tf);
-	io_hdr.timeout = (timeout_secs ? timeout_secs : 15) * 1000;
+	io_hdr.pack_id = tf_to_lba(tf);
+	io_hdr.timeout = 15 * 1000;
 
-	if (ioctl(fd, SG_IO, &io_hdr) == -1) {
+	if (ioctl(dev->fd, SG_IO, &io_hdr) == -1) {
 		perror("ioctl(fd,SG_IO)");
 		return -1;
 	}
@@ -151,39 +128,232 @@ static int do_drive_cmd(int fd, unsigned char *args, unsigned int timeout_secs)
 
 	desc = sb + 8;
 
-	tf.is_lba48 = desc[2] & 1;
-	tf.error = desc[3];
-	tf.lob.nsect = desc[5];
-	tf.lob.lbal = desc[7];
-	tf.lob.lbam = desc[9];
-	tf.lob.lbah = desc[11];
-	tf.dev = desc[12];
-	tf.status = desc[13];
-	tf.hob.feat = 0;
-	tf.hob.nsect = 0;
-	tf.hob.lbal = 0;
-	tf.hob.lbam = 0;
-	tf.hob.lbah = 0;
-
-	if (tf.status & (ATA_STAT_ERR | ATA_STAT_DRQ))
+	tf->is_lba48 = desc[2] & 1;
+	tf->error = desc[3];
+	tf->lob.nsect = desc[5];
+	tf->lob.lbal = desc[7];
+	tf->lob.lbam = desc[9];
+	tf->lob.lbah = desc[11];
+	tf->dev = desc[12];
+	tf->status = desc[13];
+	tf->hob.feat = 0;
+	tf->hob.nsect = desc[4];
+	tf->hob.lbal = desc[6];
+	tf->hob.lbam = desc[8];
+	tf->hob.lbah = desc[10];
+
+	if (tf->status & (ATA_STAT_ERR | ATA_STAT_DRQ))
 		return -1;
 
 	return 0;
 }
 
+static const struct ata_ops sg_ops = {
+	.exec = sg_exec,
+};
+
+struct ata_dev *ata_open_fd(int fd)
+{
+	struct ata_dev *dev;
+
+	dev = calloc(1, sizeof(struct ata_dev));
+	if (NULL == dev)
+		return NULL;
+	dev->ops = &sg_ops;
+	dev->fd = fd;
+
+	return dev;
+}
+
+/* canned log pages, for fix_bench and anything else without a drive */
+struct sim_log {
+	__u8 log;
+	int gpl;
+	int nr;
+	__u8 *pages;
+};
+
+struct sim_drive {
+	int nr;
+	struct sim_log *logs;
+};
+
+static struct sim_log *sim_find(struct sim_drive *drive, __u8 log, int gpl)
+{
+	int i;
+
+	for (i = 0; i < drive->nr; i ++) {
+		if (drive->logs[i].log == log && drive->logs[i].gpl == gpl)
+			return &drive->logs[i];
+	}
+
+	return NULL;
+}
+
+/* the GPL directory lists how many pages each log has */
+static void sim_directory(struct sim_drive *drive, __u8 *page)
+{
+	int i;
+
+	memset(page, 0, 512);
+	page[0] = 1;
+	for (i = 0; i < drive->nr; i ++) {
+		if (!drive->logs[i].gpl)
+			continue;
+		page[drive->logs[i].log * 2] = drive->logs[i].nr;
+		page[drive->logs[i].log * 2 + 1] = drive->logs[i].nr >> 8;
+	}
+}
+
+static int sim_exec(struct ata_dev *dev, struct ata_tf *tf, void *data, unsigned int data_bytes)
+{
+	struct sim_drive *drive = dev->priv;
+	struct sim_log *log;
+	int gpl, page, nr;
+
+	if (ATA_OP_READ_LOG_EXT == tf->command) {
+		gpl = 1;
+		page = tf->lob.lbam | (tf->hob.lbam << 8);
+		nr = tf->lob.nsect | (tf->hob.nsect << 8);
+	} else if (ATA_OP_SMART == tf->command && ATA_SMART_READ_LOG == tf->lob.feat) {
+		gpl = 0;
+		page = 0;
+		nr = tf->lob.nsect;
+	} else
+		goto abort;
+
+	if (data_bytes < nr * 512)
+		goto abort;
+	if (gpl && 0 == tf->lob.lbal && 0 == page && 1 == nr) {
+		sim_directory(drive, data);
+		return 0;
+	}
+	log = sim_find(drive, tf->lob.lbal, gpl);
+	if (NULL == log || page + nr > log->nr)
+		goto abort;
+	memcpy(data, log->pages + page * 512, nr * 512);
+
+	return 0;
+abort:
+	tf->status = ATA_STAT_ERR;
+	tf->error = ATA_ERR_ABRT;
+	return -1;
+}
+
+static void sim_close(struct ata_dev *dev)
+{
+	struct sim_drive *drive = dev->priv;
+	int i;
+
+	for (i = 0; i < drive->nr; i ++)
+		free(drive->logs[i].pages);
+	free(drive->logs);
+	free(drive);
+}
+
+static const struct ata_ops sim_ops = {
+	.exec = sim_exec,
+	.close = sim_close,
+};
+
+struct ata_dev *ata_open_sim(void)
+{
+	struct ata_dev *dev;
+
+	dev = calloc(1, sizeof(struct ata_dev));
+	if (NULL == dev)
+		return NULL;
+	dev->priv = calloc(1, sizeof(struct sim_drive));
+	if (NULL == dev->priv) {
+		free(dev);
+		return NULL;
+	}
+	dev->ops = &sim_ops;
+	dev->fd = -1;
+
+	return dev;
+}
+
+/* what a READ LOG EXT (gpl) or SMART READ LOG of log returns, nr pages */
+int ata_sim_log(struct ata_dev *dev, __u8 log, int gpl, const void *pages, int nr)
+{
+	struct sim_drive *drive = dev->priv;
+	struct sim_log *slot, *logs;
+
+	slot = sim_find(drive, log, gpl);
+	if (NULL == slot) {
+		logs = realloc(drive->logs, sizeof(struct sim_log) * (drive->nr + 1));
+		if (NULL == logs)
+			return -1;
+		drive->logs = logs;
+		slot = &logs[drive->nr ++];
+		memset(slot, 0, sizeof(struct sim_log));
+		slot->log = log;
+		slot->gpl = gpl;
+	}
+
+	free(slot->pages);
+	slot->pages = malloc(nr * 512);
+	slot->nr = slot->pages ? nr : 0;
+	if (NULL == slot->pages)
+		return -1;
+	memcpy(slot->pages, pages, nr * 512);
+
+	return 0;
+}
+
+void ata_close(struct ata_dev *dev)
+{
+	if (dev->ops->close)
+		dev->ops->close(dev);
+	free(dev);
+}
+
+/* ata_read_log_ext: nr pages of a General Purpose log, from page on */
+int ata_read_log_ext(struct ata_dev *dev, __u8 log, __u16 page, void *buf, int nr)
+{
+	struct ata_tf tf;
+
+	tf_init(&tf, ATA_OP_READ_LOG_EXT, 0, 0);
+	tf.is_lba48 = 1;
+	tf.lob.lbal = log;
+	tf.lob.lbam = page;
+	tf.hob.lbam = page >> 8;
+	tf.lob.nsect = nr;
+	tf.hob.nsect = nr >> 8;
+
+	return ata_exec(dev, &tf, buf, nr * 512);
+}
+
+/* ata_smart_read_log: the first nr pages of a SMART log, for drives without GPL */
+int ata_smart_read_log(struct ata_dev *dev, __u8 log, void *buf, int nr)
+{
+	struct ata_tf tf;
+
+	tf_init(&tf, ATA_OP_SMART, 0, 0);
+	tf.lob.feat = ATA_SMART_READ_LOG;
+	tf.lob.nsect = nr;
+	tf.lob.lbal = log;
+	tf.lob.lbam = 0x4f;
+	tf.lob.lbah = 0xc2;
+
+	return ata_exec(dev, &tf, buf, nr * 512);
+}
+
 int get_identify_data(int fd, __u16 *id)
 {
-	static __u8 args[4+512];
+	static __u8 data[512];
+	struct ata_dev dev = { &sg_ops, fd, NULL };
+	struct ata_tf tf;
 	int i;
 
-	memset(args, 0, sizeof(args));
-	args[0] = ATA_OP_IDENTIFY;
-	args[3] = 1;	/* sector count */
-	if (do_drive_cmd(fd, args, 0))
+	memset(data, 0, sizeof(data));
+	tf_init(&tf, ATA_OP_IDENTIFY, 0, 1);
+	if (ata_exec(&dev, &tf, data, sizeof(data)))
 		return -1;
 
 	/* byte-swap the little-endian IDENTIFY data to match byte-order on host CPU */
-	memcpy(id, (void *)(args + 4), 512);
+	memcpy(id, data, 512);
 	for (i = 0; i < 0x100; ++i)
 		__le16_to_cpus(id[i]);
 
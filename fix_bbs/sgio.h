@@ -0,0 +1,58 @@
+#ifndef __SGIO_H_
+#define __SGIO_H_
+
+#include "fix_sector.h"
+
+#define ATA_OP_IDENTIFY (0xec)
+#define ATA_OP_READ_LOG_EXT (0x2f)
+#define ATA_OP_SMART (0xb0)
+#define ATA_SMART_READ_LOG (0xd5)
+
+struct ata_lba_regs {
+	__u8	feat;
+	__u8	nsect;
+	__u8	lbal;
+	__u8	lbam;
+	__u8	lbah;
+};
+
+struct ata_tf {
+	__u8 dev;
+	__u8 command;
+	__u8 error;
+	__u8 status;
+	__u8 is_lba48;
+	struct ata_lba_regs	lob;
+	struct ata_lba_regs	hob;
+};
+
+struct ata_dev;
+
+/* run a PIO data-in command, the registers come back in tf */
+struct ata_ops {
+	int (*exec)(struct ata_dev *dev, struct ata_tf *tf, void *data, unsigned int data_bytes);
+	void (*close)(struct ata_dev *dev);
+};
+
+/* a drive taking ATA commands, through SG_IO or simulated */
+struct ata_dev {
+	const struct ata_ops *ops;
+	int fd;
+	void *priv;
+};
+
+static inline int ata_exec(struct ata_dev *dev, struct ata_tf *tf, void *data,
+			   unsigned int data_bytes)
+{
+	return dev->ops->exec(dev, tf, data, data_bytes);
+}
+
+struct ata_dev *ata_open_fd(int fd);
+struct ata_dev *ata_open_sim(void);
+int ata_sim_log(struct ata_dev *dev, __u8 log, int gpl, const void *pages, int nr);
+void ata_close(struct ata_dev *dev);
+int ata_read_log_ext(struct ata_dev *dev, __u8 log, __u16 page, void *buf, int nr);
+int ata_smart_read_log(struct ata_dev *dev, __u8 log, void *buf, int nr);
+int get_identify_data(int fd, __u16 *id);
+
+#endif
@@ -0,0 +1,183 @@
+#include "smart.h"
+
+#define EXT_ERROR_SIZE 124	/* 5 commands of 18 bytes, then the error */
+#define EXT_ERROR_PER_PAGE 4
+#define EXT_SELFTEST_SIZE 26
+#define EXT_SELFTEST_PER_PAGE 19
+#define ERROR_SIZE 90		/* 5 commands of 12 bytes, then the error */
+#define ERROR_PER_PAGE 5
+#define SELFTEST_SIZE 24
+#define SELFTEST_PER_PAGE 21
+/* the execution status of a self-test that failed reading */
+#define SELFTEST_READ_FAILED 7
+
+static int add_lba(struct smart_lbas *found, __u64 lba)
+{
+	return add_range(&found->lbas, lba, lba + 1);
+}
+
+/*
+ * smart_parse_ext_error:
+ *
+ * Add the LBAs of the uncorrectable errors in nr pages of the Extended
+ * Comprehensive SMART error log. The log is a ring of 4 errors a page;
+ * an entry never written is zero.
+ */
+int smart_parse_ext_error(const void *pages, int nr, struct smart_lbas *found)
+{
+	const __u8 *p, *err;
+	__u64 lba;
+	int i, j;
+
+	for (i = 0; i < nr; i ++) {
+		p = (const __u8 *)pages + i * 512;
+		for (j = 0; j < EXT_ERROR_PER_PAGE; j ++) {
+			err = p + 4 + j * EXT_ERROR_SIZE + 90;
+			if (!(err[1] & ATA_ERR_UNC))
+				continue;
+
+			/* low, low hi, mid, mid hi, high, high hi */
+			lba = (__u64)err[4] | (__u64)err[6] << 8 | (__u64)err[8] << 16 |
+			      (__u64)err[5] << 24 | (__u64)err[7] << 32 | (__u64)err[9] << 40;
+			if (add_lba(found, lba))
+				return -1;
+			found->nr_errors ++;
+		}
+	}
+
+	return 0;
+}
+
+/* smart_parse_ext_selftest: the failing LBAs of read failures in the Extended self-test log */
+int smart_parse_ext_selftest(const void *pages, int nr, struct smart_lbas *found)
+{
+	const __u8 *p, *desc;
+	__u64 lba;
+	int i, j, k;
+
+	for (i = 0; i < nr; i ++) {
+		p = (const __u8 *)pages + i * 512;
+		for (j = 0; j < EXT_SELFTEST_PER_PAGE; j ++) {
+			desc = p + 4 + j * EXT_SELFTEST_SIZE;
+			if (0 == desc[0] || desc[1] >> 4 != SELFTEST_READ_FAILED)
+				continue;
+
+			for (k = 5, lba = 0; k >= 0; k --)
+				lba = lba << 8 | desc[5 + k];
+			if (lba == 0xffffffffffffULL)
+				continue;
+			if (add_lba(found, lba))
+				return -1;
+			found->nr_selftests ++;
+		}
+	}
+
+	return 0;
+}
+
+/* smart_parse_error: the same from the Comprehensive SMART error log, 28-bit LBAs */
+int smart_parse_error(const void *page, struct smart_lbas *found)
+{
+	const __u8 *err;
+	__u64 lba;
+	int j;
+
+	for (j = 0; j < ERROR_PER_PAGE; j ++) {
+		err = (const __u8 *)page + 2 + j * ERROR_SIZE + 60;
+		if (!(err[1] & ATA_ERR_UNC))
+			continue;
+
+		lba = err[3] | err[4] << 8 | err[5] << 16 | (err[6] & 0x0f) << 24;
+		if (add_lba(found, lba))
+			return -1;
+		found->nr_errors ++;
+	}
+
+	return 0;
+}
+
+/* smart_parse_selftest: the same from the SMART self-test log */
+int smart_parse_selftest(const void *page, struct smart_lbas *found)
+{
+	const __u8 *desc;
+	__u64 lba;
+	int j;
+
+	for (j = 0; j < SELFTEST_PER_PAGE; j ++) {
+		desc = (const __u8 *)page + 2 + j * SELFTEST_SIZE;
+		if (0 == desc[0] || desc[1] >> 4 != SELFTEST_READ_FAILED)
+			continue;
+
+		lba = desc[5] | desc[6] << 8 | desc[7] << 16 | (__u64)desc[8] << 24;
+		if (lba == 0xffffffff)
+			continue;
+		if (add_lba(found, lba))
+			return -1;
+		found->nr_selftests ++;
+	}
+
+	return 0;
+}
+
+/* read nr pages of a GPL log and parse them, nr capped to max */
+static int read_ext(struct ata_dev *dev, __u8 log, int nr, int max,
+		    int (*parse)(const void *, int, struct smart_lbas *),
+		    struct smart_lbas *found)
+{
+	void *pages;
+	int ret;
+
+	if (nr > max)
+		nr = max;
+	if (0 == nr)
+		return -1;
+
+	pages = valloc(nr * 512);
+	if (NULL == pages)
+		return -1;
+	ret = ata_read_log_ext(dev, log, 0, pages, nr);
+	if (0 == ret)
+		ret = parse(pages, nr, found);
+	free(pages);
+
+	return ret;
+}
+
+/*
+ * smart_read_lbas:
+ *
+ * Collect the LBAs the drive logged as unreadable: from the extended
+ * error and self-test logs, or from the SMART ones where the drive has
+ * no General Purpose logs. Return -1 if there was no log to read.
+ */
+int smart_read_lbas(struct ata_dev *dev, struct smart_lbas *found)
+{
+	__u8 *page;
+	int nr_error = 0, nr_selftest = 0, read = 0;
+
+	page = valloc(512);
+	if (NULL == page)
+		return -1;
+
+	if (ata_read_log_ext(dev, ATA_LOG_DIRECTORY, 0, page, 1) == 0) {
+		nr_error = page[ATA_LOG_EXT_ERROR * 2] | page[ATA_LOG_EXT_ERROR * 2 + 1] << 8;
+		nr_selftest = page[ATA_LOG_EXT_SELFTEST * 2] |
+			      page[ATA_LOG_EXT_SELFTEST * 2 + 1] << 8;
+	}
+	if (read_ext(dev, ATA_LOG_EXT_ERROR, nr_error, SMART_MAX_ERROR_PAGES,
+		     smart_parse_ext_error, found) == 0)
+		read ++;
+	if (read_ext(dev, ATA_LOG_EXT_SELFTEST, nr_selftest, nr_selftest,
+		     smart_parse_ext_selftest, found) == 0)
+		read ++;
+
+	if (0 == nr_error && ata_smart_read_log(dev, ATA_LOG_ERROR, page, 1) == 0 &&
+	    smart_parse_error(page, found) == 0)
+		read ++;
+	if (0 == nr_selftest && ata_smart_read_log(dev, ATA_LOG_SELFTEST, page, 1) == 0 &&
+	    smart_parse_selftest(page, found) == 0)
+		read ++;
+	free(page);
+
+	return read ? 0 : -1;
+}
@@ -0,0 +1,33 @@
+#ifndef __SMART_H_
+#define __SMART_H_
+
+#include "sgio.h"
+#include "alloc.h"
+
+/* General Purpose logs, READ LOG EXT */
+#define ATA_LOG_DIRECTORY 0x00
+#define ATA_LOG_EXT_ERROR 0x03		/* Extended Comprehensive SMART error log */
+#define ATA_LOG_EXT_SELFTEST 0x07	/* Extended SMART self-test log */
+/* SMART logs, SMART READ LOG, 28-bit LBAs */
+#define ATA_LOG_ERROR 0x02		/* Comprehensive SMART error log */
+#define ATA_LOG_SELFTEST 0x06		/* SMART self-test log */
+
+/* the most error log pages read, 4 errors each */
+#define SMART_MAX_ERROR_PAGES 64
+
+#define ATA_ERR_UNC (1 << 6)
+
+/* what the drive's own logs say it could not read, in LBAs */
+struct smart_lbas {
+	int nr_errors;		/* uncorrectable reads in the error log */
+	int nr_selftests;	/* read failures in the self-test log */
+	struct range_list lbas;
+};
+
+int smart_parse_ext_error(const void *pages, int nr, struct smart_lbas *found);
+int smart_parse_ext_selftest(const void *pages, int nr, struct smart_lbas *found);
+int smart_parse_error(const void *page, struct smart_lbas *found);
+int smart_parse_selftest(const void *page, struct smart_lbas *found);
+int smart_read_lbas(struct ata_dev *dev, struct smart_lbas *found);
+
+#endif
@@ -0,0 +1,42 @@
+#include "state_file.h"
+#include <libgen.h>
+#include <limits.h>
+
+/*
+ * state_file_mkdir:
+ *
+ * Make the directory pathname goes in, and the one above it for the
+ * files kept one per member. Either may already be there.
+ */
+void state_file_mkdir(const char *pathname)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%s", pathname);
+	mkdir(dirname(dirname(dir)), 0755);
+	snprintf(dir, sizeof(dir), "%s", pathname);
+	mkdir(dirname(dir), 0755);
+}
+
+/* start a new pathname in tmpname, the first save makes its directory */
+FILE *state_file_open(const char *pathname, char *tmpname, size_t len)
+{
+	state_file_mkdir(pathname);
+
+	snprintf(tmpname, len, "%s.tmp", pathname);
+	return fopen(tmpname, "w");
+}
+
+/* write out and put in place what state_file_open() started, -1 leaves the old file */
+int state_file_commit(FILE *out, const char *tmpname, const char *pathname)
+{
+	int ret;
+
+	ret = fflush(out) || fsync(fileno(out));
+	if (fclose(out) || ret || rename(tmpname, pathname)) {
+		unlink(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef __STATE_FILE_H_
+#define __STATE_FILE_H_
+
+#include "fix_sector.h"
+
+/*
+ * What fix_sector keeps between runs is written to pathname.tmp and
+ * renamed over pathname, so a crash leaves the old file or the new
+ * one, never half of either.
+ */
+void state_file_mkdir(const char *pathname);
+FILE *state_file_open(const char *pathname, char *tmpname, size_t len);
+int state_file_commit(FILE *out, const char *tmpname, const char *pathname);
+
+#endif
@@ -0,0 +1,277 @@
+#include "tune.h"
+#include "state_file.h"
+#include <time.h>
+
+/*
+ * The scan calibrates while it reads: I/O size doubles at depth 1 as
+ * long as throughput improves, then depth doubles at the best size.
+ * After that it probes one neighbour every adapt_trials trials and
+ * keeps it if it is faster, and backs off when the latency ceiling is
+ * broken. Every trial counts only I/Os issued under its parameters.
+ */
+enum {
+	TUNE_SIZE,
+	TUNE_DEPTH,
+	TUNE_STEADY,
+	TUNE_PROBE,
+};
+
+#define TUNE_GAIN 1.05
+
+static __u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void start_trial(struct tuner *tuner)
+{
+	tuner->gen ++;
+	tuner->trial_start = now_us();
+	tuner->bytes = 0;
+	tuner->ios = 0;
+}
+
+void tune_init(struct tuner *tuner, __u32 max_io, __u32 max_depth,
+	       const struct tune_params *saved)
+{
+	memset(tuner, 0, sizeof(struct tuner));
+	tuner->max_io = max_io;
+	tuner->max_depth = max_depth > TUNE_MAX_DEPTH ? TUNE_MAX_DEPTH : max_depth;
+	tuner->lat_ceiling_us = TUNE_LAT_CEILING_MS * 1000;
+	tuner->adapt_trials = TUNE_ADAPT_TRIALS;
+
+	if (saved && saved->io_size >= TUNE_MIN_IO && saved->io_size <= max_io &&
+	    saved->depth >= 1 && saved->depth <= tuner->max_depth) {
+		tuner->cur = *saved;
+		tuner->phase = TUNE_STEADY;
+	} else {
+		tuner->cur.io_size = TUNE_MIN_IO < max_io ? TUNE_MIN_IO : max_io;
+		tuner->cur.depth = 1;
+		tuner->phase = TUNE_SIZE;
+	}
+	tuner->best = tuner->cur;
+
+	start_trial(tuner);
+}
+
+/* one read of len bytes issued under trial gen completed in lat_us */
+void tune_account(struct tuner *tuner, __u32 gen, size_t len, __u64 lat_us)
+{
+	if (gen != tuner->gen)
+		return;
+
+	tuner->bytes += len;
+	tuner->lats[tuner->ios % TUNE_MAX_LATS] = lat_us;
+	tuner->ios ++;
+}
+
+/* the next neighbour of cur to probe, 0 if there is none */
+static int next_probe(struct tuner *tuner, struct tune_params *next)
+{
+	int i;
+
+	for (i = 0; i < 4; i ++) {
+		*next = tuner->cur;
+		switch (tuner->probe ++ % 4) {
+		case 0:
+			next->io_size *= 2;
+			break;
+		case 1:
+			next->depth *= 2;
+			break;
+		case 2:
+			next->io_size /= 2;
+			break;
+		case 3:
+			next->depth /= 2;
+			break;
+		}
+		if (next->io_size >= TUNE_MIN_IO && next->io_size <= tuner->max_io &&
+		    next->depth >= 1 && next->depth <= tuner->max_depth)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * tune_step:
+ *
+ * Call after accounting a completion. When the trial has run long
+ * enough, judge it and start the next one.
+ *
+ * Return 1 if tuner->cur changed.
+ */
+int tune_step(struct tuner *tuner)
+{
+	struct tune_params old = tuner->cur, next;
+	__u64 lats[TUNE_MAX_LATS], elapsed;
+	__u32 nr;
+	int ok, better;
+
+	elapsed = now_us() - tuner->trial_start;
+	if (elapsed < TUNE_TRIAL_MS * 1000 || tuner->ios < 4 * tuner->cur.depth)
+		return 0;
+
+	nr = tuner->ios < TUNE_MAX_LATS ? tuner->ios : TUNE_MAX_LATS;
+	memcpy(lats, tuner->lats, sizeof(__u64) * nr);
+	qsort(lats, nr, sizeof(__u64), cmp_u64);
+	tuner->p99_us = lats[nr * 99 / 100];
+	tuner->rate = (double)tuner->bytes / elapsed;
+	tuner->trials ++;
+
+	ok = tuner->p99_us <= tuner->lat_ceiling_us;
+	better = ok && tuner->rate > tuner->best_rate * TUNE_GAIN;
+
+	switch (tuner->phase) {
+	case TUNE_SIZE:
+	case TUNE_DEPTH:
+		if (better || 0 == tuner->best_rate) {
+			tuner->best = tuner->cur;
+			tuner->best_rate = tuner->rate;
+		}
+		tuner->cur = tuner->best;
+		if (better && tuner->phase == TUNE_SIZE && tuner->best.io_size * 2 <= tuner->max_io) {
+			tuner->cur.io_size *= 2;
+			break;
+		}
+		if (better || tuner->phase == TUNE_SIZE) {
+			tuner->phase = TUNE_DEPTH;
+			if (tuner->best.depth * 2 <= tuner->max_depth) {
+				tuner->cur.depth *= 2;
+				break;
+			}
+		}
+		tuner->phase = TUNE_STEADY;
+		break;
+	case TUNE_STEADY:
+		tuner->best_rate = tuner->rate;
+		if (!ok) {
+			/* the drive got slower, give some concurrency back */
+			if (tuner->cur.depth > 1)
+				tuner->cur.depth /= 2;
+			else if (tuner->cur.io_size / 2 >= TUNE_MIN_IO)
+				tuner->cur.io_size /= 2;
+			tuner->best = tuner->cur;
+			tuner->steady = 0;
+			break;
+		}
+		if (++ tuner->steady < tuner->adapt_trials || !next_probe(tuner, &next))
+			break;
+		tuner->best = tuner->cur;
+		tuner->cur = next;
+		tuner->phase = TUNE_PROBE;
+		break;
+	case TUNE_PROBE:
+		if (better) {
+			tuner->best = tuner->cur;
+			tuner->best_rate = tuner->rate;
+		} else
+			tuner->cur = tuner->best;
+		tuner->steady = 0;
+		tuner->phase = TUNE_STEADY;
+		break;
+	}
+
+	start_trial(tuner);
+
+	return old.io_size != tuner->cur.io_size || old.depth != tuner->cur.depth;
+}
+
+/*
+ * The tune file keeps one line per drive:
+ *	model<TAB>serial<TAB>io_kb<TAB>depth
+ * A drive without a line of its own starts from one of its model.
+ */
+static int parse_line(char *line, char **model, char **serial, struct tune_params *params)
+{
+	char *io_kb, *depth, *save;
+
+	*model = strtok_r(line, "\t\n", &save);
+	*serial = strtok_r(NULL, "\t\n", &save);
+	io_kb = strtok_r(NULL, "\t\n", &save);
+	depth = strtok_r(NULL, "\t\n", &save);
+	if (NULL == depth)
+		return -1;
+
+	params->io_size = atoi(io_kb) * 1024;
+	params->depth = atoi(depth);
+
+	return 0;
+}
+
+/* the parameters stay put but for a probe now and then */
+int tune_steady(const struct tuner *tuner)
+{
+	return TUNE_STEADY == tuner->phase;
+}
+
+/* Return 0 if saved parameters were found, -1 otherwise. */
+int tune_load(const char *pathname, const char *model, const char *serial,
+	      struct tune_params *params)
+{
+	struct tune_params p;
+	char line[256], *m, *s;
+	int found = 0;
+	FILE *fp;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (parse_line(line, &m, &s, &p))
+			continue;
+		if (serial[0] && !strcmp(s, serial)) {
+			*params = p;
+			found = 1;
+			break;
+		}
+		if (!found && model[0] && !strcmp(m, model)) {
+			*params = p;
+			found = 1;
+		}
+	}
+
+	fclose(fp);
+
+	return found ? 0 : -1;
+}
+
+int tune_save(const char *pathname, const char *model, const char *serial,
+	      const struct tune_params *params)
+{
+	char tmpname[256], line[256], copy[256], *m, *s;
+	struct tune_params p;
+	FILE *in, *out;
+
+	out = state_file_open(pathname, tmpname, sizeof(tmpname));
+	if (NULL == out)
+		return -1;
+
+	in = fopen(pathname, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			strcpy(copy, line);
+			if (!parse_line(copy, &m, &s, &p) && serial[0] && !strcmp(s, serial))
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s\t%s\t%u\t%u\n", model[0] ? model : "-", serial[0] ? serial : "-",
+		params->io_size / 1024, params->depth);
+
+	return state_file_commit(out, tmpname, pathname);
+}
@@ -0,0 +1,54 @@
+#ifndef __TUNE_H_
+#define __TUNE_H_
+
+#include "fix_sector.h"
+
+#define TUNE_PATHNAME "/var/lib/fix_sector/tune"
+#define TUNE_MIN_IO (64 * 1024)
+#define TUNE_MAX_DEPTH 16
+#define TUNE_TRIAL_MS 250
+#define TUNE_MAX_LATS 1024
+#define TUNE_LAT_CEILING_MS 100
+#define TUNE_ADAPT_TRIALS 40
+
+struct tune_params {
+	__u32 io_size;
+	__u32 depth;
+};
+
+struct tuner {
+	__u32 max_io;
+	__u32 max_depth;
+	__u64 lat_ceiling_us;
+	__u32 adapt_trials;	/* steady trials between two probes */
+
+	int phase;
+	__u32 gen;
+	struct tune_params cur;
+	struct tune_params best;
+	double best_rate;
+	int probe;
+	__u32 steady;
+	__u32 trials;
+
+	/* the trial running now */
+	__u64 trial_start;
+	__u64 bytes;
+	__u32 ios;
+	__u64 lats[TUNE_MAX_LATS];
+
+	double rate;
+	__u64 p99_us;
+};
+
+void tune_init(struct tuner *tuner, __u32 max_io, __u32 max_depth,
+	       const struct tune_params *saved);
+void tune_account(struct tuner *tuner, __u32 gen, size_t len, __u64 lat_us);
+int tune_step(struct tuner *tuner);
+int tune_steady(const struct tuner *tuner);
+int tune_load(const char *pathname, const char *model, const char *serial,
+	      struct tune_params *params);
+int tune_save(const char *pathname, const char *model, const char *serial,
+	      const struct tune_params *params);
+
+#endif
@@ -0,0 +1,200 @@
+#include "zone.h"
+#include "state_file.h"
+
+int zone_init(struct zone_map *map, off64_t base, off64_t size, int nr)
+{
+	memset(map, 0, sizeof(struct zone_map));
+	if (size <= 0 || nr <= 0)
+		return -1;
+
+	map->base = base;
+	map->size = size;
+	map->zone_size = (size + nr - 1) / nr;
+	map->nr = (size + map->zone_size - 1) / map->zone_size;
+	map->bytes = calloc(map->nr, sizeof(__u64));
+	map->usecs = calloc(map->nr, sizeof(__u64));
+	if (NULL == map->bytes || NULL == map->usecs) {
+		zone_free(map);
+		return -1;
+	}
+
+	return 0;
+}
+
+void zone_free(struct zone_map *map)
+{
+	free(map->bytes);
+	free(map->usecs);
+	memset(map, 0, sizeof(struct zone_map));
+}
+
+/* a read of size at offset took usecs; may run in several threads */
+void zone_account(struct zone_map *map, off64_t offset, size_t size, __u64 usecs)
+{
+	int i;
+
+	if (NULL == map || offset < map->base || offset >= map->base + map->size)
+		return;
+
+	i = (offset - map->base) / map->zone_size;
+	__atomic_add_fetch(&map->bytes[i], size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&map->usecs[i], usecs, __ATOMIC_RELAXED);
+}
+
+/* in MB/s, 0 if nothing was timed there */
+unsigned int zone_rate(const struct zone_map *map, int i)
+{
+	__u64 bytes = __atomic_load_n(&map->bytes[i], __ATOMIC_RELAXED);
+	__u64 usecs = __atomic_load_n(&map->usecs[i], __ATOMIC_RELAXED);
+
+	if (0 == usecs)
+		return 0;
+
+	return bytes * 1000000 / usecs >> 20;
+}
+
+static int cmp_rate(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the median rate of the zones timed, 0 if none was */
+unsigned int zone_median(const struct zone_map *map)
+{
+	unsigned int *rates, median = 0;
+	int i, nr = 0;
+
+	rates = malloc(sizeof(unsigned int) * map->nr);
+	if (NULL == rates)
+		return 0;
+
+	for (i = 0; i < map->nr; i ++) {
+		if (map->usecs[i])
+			rates[nr ++] = zone_rate(map, i);
+	}
+	if (nr) {
+		qsort(rates, nr, sizeof(unsigned int), cmp_rate);
+		median = rates[nr / 2];
+	}
+	free(rates);
+
+	return median;
+}
+
+/*
+ * "base size nr" then each zone's rate, on one line for a status
+ * reply. Return what snprintf() would, so a short line can be told.
+ */
+int zone_format(const struct zone_map *map, char *line, size_t len)
+{
+	size_t done;
+	int i;
+
+	done = snprintf(line, len, "%llu %llu %d", (unsigned long long)map->base,
+			(unsigned long long)map->size, map->nr);
+	for (i = 0; i < map->nr; i ++)
+		done += snprintf(line + (done < len ? done : len), done < len ? len - done : 0,
+				 " %u", zone_rate(map, i));
+	if (done + 1 < len)
+		strcat(line, "\n");
+
+	return done + 1;
+}
+
+/* a zone_format() line into a map, rates read back as a second's worth */
+int zone_parse(struct zone_map *map, const char *line)
+{
+	unsigned long long base, size;
+	unsigned int rate;
+	int nr, n, i;
+
+	if (sscanf(line, "%llu %llu %d%n", &base, &size, &nr, &n) != 3 ||
+	    zone_init(map, base, size, nr) || map->nr != nr)
+		return -1;
+
+	for (i = 0; i < nr; i ++) {
+		line += n;
+		if (sscanf(line, " %u%n", &rate, &n) != 1) {
+			zone_free(map);
+			return -1;
+		}
+		if (rate) {
+			map->bytes[i] = (__u64)rate << 20;
+			map->usecs[i] = 1000000;
+		}
+	}
+
+	return 0;
+}
+
+/* keep what an older scan timed where this one timed nothing */
+void zone_merge(struct zone_map *map, const struct zone_map *old)
+{
+	int i;
+
+	if (old->base != map->base || old->size != map->size || old->nr != map->nr)
+		return;
+
+	for (i = 0; i < map->nr; i ++) {
+		if (0 == map->usecs[i]) {
+			map->bytes[i] = old->bytes[i];
+			map->usecs[i] = old->usecs[i];
+		}
+	}
+}
+
+/*
+ * "base size nr", then what each zone read in bytes and usecs. Rates
+ * from zones cut differently can't be merged, so that is an error.
+ */
+int zone_load(const char *pathname, struct zone_map *map)
+{
+	unsigned long long base, size, bytes, usecs;
+	int nr, i, ret = -1;
+	FILE *fp;
+
+	fp = fopen(pathname, "r");
+	if (NULL == fp)
+		return -1;
+
+	if (fscanf(fp, "%llu %llu %d", &base, &size, &nr) != 3)
+		goto out;
+	if (base != map->base || size != map->size || nr != map->nr)
+		goto out;
+
+	for (i = 0; i < nr; i ++) {
+		if (fscanf(fp, "%llu %llu", &bytes, &usecs) != 2)
+			goto out;
+		map->bytes[i] = bytes;
+		map->usecs[i] = usecs;
+	}
+	ret = 0;
+out:
+	fclose(fp);
+	if (ret) {
+		memset(map->bytes, 0, sizeof(__u64) * map->nr);
+		memset(map->usecs, 0, sizeof(__u64) * map->nr);
+	}
+
+	return ret;
+}
+
+int zone_save(const char *pathname, const struct zone_map *map)
+{
+	char tmpname[256];
+	FILE *out;
+	int i;
+
+	out = state_file_open(pathname, tmpname, sizeof(tmpname));
+	if (NULL == out)
+		return -1;
+
+	fprintf(out, "%llu %llu %d\n", (unsigned long long)map->base,
+		(unsigned long long)map->size, map->nr);
+	for (i = 0; i < map->nr; i ++)
+		fprintf(out, "%llu %llu\n", map->bytes[i], map->usecs[i]);
+
+	return state_file_commit(out, tmpname, pathname);
+}
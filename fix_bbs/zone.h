@@ -0,0 +1,35 @@
+#ifndef __ZONE_H_
+#define __ZONE_H_
+
+#include "alloc.h"
+
+/* one file per member, named after its serial */
+#define ZONE_PATHNAME "/var/lib/fix_sector/zones"
+/* enough to tell the outer tracks from the inner ones, and one head's worth */
+#define ZONE_COUNT 256
+
+/*
+ * How fast each zone of a member reads, from what the scans timed
+ * there. A zone's rate is bytes / usecs, in MB/s.
+ */
+struct zone_map {
+	off64_t base;		/* where the first zone starts */
+	off64_t size;		/* bytes from base the zones cover */
+	__u64 zone_size;
+	int nr;
+	__u64 *bytes;
+	__u64 *usecs;
+};
+
+int zone_init(struct zone_map *map, off64_t base, off64_t size, int nr);
+void zone_free(struct zone_map *map);
+void zone_account(struct zone_map *map, off64_t offset, size_t size, __u64 usecs);
+unsigned int zone_rate(const struct zone_map *map, int i);
+unsigned int zone_median(const struct zone_map *map);
+int zone_format(const struct zone_map *map, char *line, size_t len);
+int zone_parse(struct zone_map *map, const char *line);
+void zone_merge(struct zone_map *map, const struct zone_map *old);
+int zone_load(const char *pathname, struct zone_map *map);
+int zone_save(const char *pathname, const struct zone_map *map);
+
+#endif